@@ -0,0 +1,281 @@
+/** \file bench.c
+ \brief common helpers for the microbenchmarks
+
+ Every benchmark program accepts the same command line:
+
+ bench_xyz [-i iterations] [-s seed] [name ...]
+
+ If names are given only the benchmarks with these names are run. All input
+ data is generated from the seed, so the same seed always gives the same
+ input. The results are written to stdout, one JSON object per line.
+ */
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+unsigned long bench_iterations;
+static uint64_t bench_seed = 0x51536d747000ULL;
+static char **bench_names;		/**< the benchmarks selected on the command line */
+
+/**
+ * @brief parse the common command line arguments
+ * @param argc argument count as passed to main()
+ * @param argv arguments as passed to main()
+ * @param iterations default number of iterations
+ * @return if the arguments were valid
+ * @retval 0 arguments were valid
+ * @retval 1 invalid arguments, a usage message was printed
+ */
+int
+bench_init(int argc, char **argv, const unsigned long iterations)
+{
+	int opt;
+
+	bench_iterations = iterations;
+
+	while ((opt = getopt(argc, argv, "i:s:")) != -1) {
+		char *end;
+
+		switch (opt) {
+		case 'i':
+			bench_iterations = strtoul(optarg, &end, 10);
+			if ((*end != '\0') || (bench_iterations == 0)) {
+				fprintf(stderr, "invalid number of iterations: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 's':
+			bench_seed = strtoull(optarg, &end, 0);
+			if (*end != '\0') {
+				fprintf(stderr, "invalid seed: %s\n", optarg);
+				return 1;
+			}
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-i iterations] [-s seed] [name ...]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind < argc)
+		bench_names = argv + optind;
+
+	return 0;
+}
+
+/**
+ * @brief check if a benchmark was selected on the command line
+ * @param name the name of the benchmark
+ */
+int
+bench_selected(const char *name)
+{
+	if (bench_names == NULL)
+		return 1;
+
+	for (char **n = bench_names; *n != NULL; n++)
+		if (strcmp(*n, name) == 0)
+			return 1;
+
+	return 0;
+}
+
+/**
+ * @brief current time of the monotonic clock in nanoseconds
+ */
+uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief create the state for a random number sequence
+ * @param salt value to distinguish different sequences from the same seed
+ */
+uint64_t
+bench_state(const uint64_t salt)
+{
+	uint64_t s = bench_seed ^ (salt * 0x9e3779b97f4a7c15ULL);
+
+	return (s == 0) ? 1 : s;
+}
+
+/**
+ * @brief get the next pseudo random number (xorshift64*)
+ * @param state state of the sequence, see bench_state()
+ */
+uint32_t
+bench_random(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+
+	return (x * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+static const char *words[] = {
+	"the", "mail", "server", "queue", "message", "delivery", "recipient", "sender",
+	"domain", "filter", "header", "body", "transfer", "connection", "status", "report",
+	"a", "of", "to", "and", "in", "is", "for", "with", "on", "at", "by", "from"
+};
+
+/**
+ * @brief append one body line
+ */
+static char *
+add_line(char *p, uint64_t *st, const unsigned int flags)
+{
+	unsigned int llen;
+	const char *start = p;
+
+	if ((flags & BENCH_MSG_LONGLINES) && (bench_random(st) % 64 == 0))
+		llen = 1000 + bench_random(st) % 1000;
+	else
+		llen = 20 + bench_random(st) % 57;
+
+	if ((flags & BENCH_MSG_DOTS) && (bench_random(st) % 50 == 0))
+		*p++ = '.';
+
+	while ((size_t)(p - start) < llen) {
+		if ((flags & BENCH_MSG_8BIT) && (bench_random(st) % 16 == 0)) {
+			/* U+00E4, LATIN SMALL LETTER A WITH DIAERESIS */
+			*p++ = (char)0xc3;
+			*p++ = (char)0xa4;
+		} else {
+			const char *w = words[bench_random(st) % (sizeof(words) / sizeof(words[0]))];
+			const size_t wl = strlen(w);
+
+			memcpy(p, w, wl);
+			p += wl;
+		}
+		*p++ = ' ';
+	}
+	p--;
+
+	if (!(flags & BENCH_MSG_BARELF))
+		*p++ = '\r';
+	*p++ = '\n';
+
+	return p;
+}
+
+static char *
+add_str(char *p, const char *s, const unsigned int flags)
+{
+	const size_t l = strlen(s);
+
+	memcpy(p, s, l);
+	p += l;
+	if (!(flags & BENCH_MSG_BARELF))
+		*p++ = '\r';
+	*p++ = '\n';
+
+	return p;
+}
+
+/**
+ * @brief create a synthetic mail message
+ * @param size the approximate size of the message
+ * @param flags properties of the message, see enum bench_msg_flags
+ * @param len the exact length of the message is stored here
+ * @return the message, must be freed by the caller
+ *
+ * The message is always the same for the same seed, size, and flags.
+ * The program is terminated if no memory is available.
+ */
+char *
+bench_message(const size_t size, const unsigned int flags, size_t *len)
+{
+	static const char boundary[] = "bench-boundary-42";
+	uint64_t st = bench_state(size * 64 + flags);
+	/* the longest line is 2000 characters, each of them could be 2 bytes */
+	char *msg = malloc(size + 8192);
+	char *p = msg;
+
+	if (msg == NULL) {
+		fputs("out of memory\n", stderr);
+		exit(1);
+	}
+
+	p = add_str(p, "Received: from client.example.net (client.example.net [192.0.2.25])", flags);
+	p = add_str(p, "\tby mx.example.com with ESMTPS; Mon, 12 Oct 2026 10:11:12 +0200", flags);
+	p = add_str(p, "From: Sender <sender@example.net>", flags);
+	p = add_str(p, "To: Recipient <rcpt@example.com>", flags);
+	p = add_str(p, "Date: Mon, 12 Oct 2026 10:11:10 +0200", flags);
+	p = add_str(p, "Message-Id: <bench.12345@client.example.net>", flags);
+	p = add_str(p, "Subject: synthetic benchmark message", flags);
+	p = add_str(p, "MIME-Version: 1.0", flags);
+	if (flags & BENCH_MSG_MULTIPART) {
+		p = add_str(p, "Content-Type: multipart/mixed; boundary=\"bench-boundary-42\"", flags);
+	} else {
+		p = add_str(p, (flags & BENCH_MSG_8BIT) ? "Content-Type: text/plain; charset=utf-8" :
+				"Content-Type: text/plain; charset=us-ascii", flags);
+		p = add_str(p, (flags & BENCH_MSG_8BIT) ? "Content-Transfer-Encoding: 8bit" :
+				"Content-Transfer-Encoding: 7bit", flags);
+	}
+	p = add_str(p, "", flags);
+
+	for (unsigned int part = 0; part < ((flags & BENCH_MSG_MULTIPART) ? 2 : 1); part++) {
+		const size_t end = (flags & BENCH_MSG_MULTIPART) ? (size / 2) * (part + 1) : size;
+
+		if (flags & BENCH_MSG_MULTIPART) {
+			p = add_str(p, "", flags);
+			*p++ = '-';
+			*p++ = '-';
+			p = add_str(p, boundary, flags);
+			p = add_str(p, (flags & BENCH_MSG_8BIT) ? "Content-Type: text/plain; charset=utf-8" :
+					"Content-Type: text/plain; charset=us-ascii", flags);
+			p = add_str(p, "", flags);
+		}
+
+		while ((size_t)(p - msg) < end)
+			p = add_line(p, &st, flags);
+	}
+
+	if (flags & BENCH_MSG_MULTIPART) {
+		*p++ = '-';
+		*p++ = '-';
+		memcpy(p, boundary, strlen(boundary));
+		p += strlen(boundary);
+		p = add_str(p, "--", flags);
+	}
+
+	*len = p - msg;
+
+	return msg;
+}
+
+/**
+ * @brief print the result of a benchmark
+ * @param name name of the benchmark
+ * @param variant the input variant used
+ * @param ops number of operations done
+ * @param bytes number of bytes processed, 0 if not applicable
+ * @param ns time used for all operations in nanoseconds
+ */
+void
+bench_report(const char *name, const char *variant, const unsigned long ops,
+		const unsigned long long bytes, const uint64_t ns)
+{
+	const double secs = (ns > 0) ? ns / 1e9 : 1e-9;
+
+	printf("{\"bench\":\"%s\",\"variant\":\"%s\",\"ops\":%lu,\"bytes\":%llu,\"ns\":%llu,"
+			"\"ns_per_op\":%.1f,\"ops_per_s\":%.1f,\"mib_per_s\":%.2f}\n",
+			name, variant, ops, bytes, (unsigned long long)ns,
+			(double)ns / ops, ops / secs, bytes / secs / (1024.0 * 1024.0));
+	fflush(stdout);
+}
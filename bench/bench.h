@@ -0,0 +1,32 @@
+/** \file bench.h
+ \brief common helpers for the microbenchmarks
+ */
+#ifndef QSMTP_BENCH_H
+#define QSMTP_BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** @enum bench_msg_flags
+ @brief properties of the messages created by bench_message()
+ */
+enum bench_msg_flags {
+	BENCH_MSG_8BIT = 0x1,		/**< body contains UTF-8 characters */
+	BENCH_MSG_LONGLINES = 0x2,	/**< body contains lines longer than 998 characters */
+	BENCH_MSG_BARELF = 0x4,		/**< lines are terminated by LF instead of CRLF */
+	BENCH_MSG_DOTS = 0x8,		/**< some lines begin with a dot */
+	BENCH_MSG_MULTIPART = 0x10	/**< message is multipart/mixed with two parts */
+};
+
+extern unsigned long bench_iterations;	/**< number of iterations for every benchmark */
+
+extern int bench_init(int argc, char **argv, const unsigned long iterations);
+extern int bench_selected(const char *name);
+extern uint64_t bench_now(void);
+extern uint32_t bench_random(uint64_t *state);
+extern uint64_t bench_state(const uint64_t salt);
+extern char *bench_message(const size_t size, const unsigned int flags, size_t *len);
+extern void bench_report(const char *name, const char *variant, const unsigned long ops,
+		const unsigned long long bytes, const uint64_t ns);
+
+#endif /* QSMTP_BENCH_H */
@@ -0,0 +1,318 @@
+/** \file bench_lookup.c
+ \brief benchmarks for the local lookups done for every recipient
+
+ The database files are generated in the current directory and removed
+ afterwards. Every cdb_seekmm() and lookupipbl() call includes mapping the
+ file, just like in Qsmtpd.
+ */
+
+#include "bench.h"
+
+#include <cdb.h>
+#include <control.h>
+#include <qsmtpd/antispam.h>
+#include <qsmtpd/qsmtpd.h>
+#include "test_io/testcase_io.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct xmitstat xmitstat;
+
+static const char cdbname[] = "bench_lookup.cdb";
+static const char ipblname[] = "bench_lookup.ipbl";
+
+void
+dieerror(int a)
+{
+	fprintf(stderr, "unexpected error %i\n", a);
+	exit(1);
+}
+
+int
+dnstxt(char **out __attribute__ ((unused)), const char *host __attribute__ ((unused)))
+{
+	abort();
+}
+
+static void
+put32(unsigned char *buf, const uint32_t v)
+{
+	buf[0] = v & 0xff;
+	buf[1] = (v >> 8) & 0xff;
+	buf[2] = (v >> 16) & 0xff;
+	buf[3] = v >> 24;
+}
+
+static uint32_t
+cdb_hash(const char *buf, unsigned int len)
+{
+	uint32_t h = 5381;
+
+	while (len--) {
+		h += (h << 5);
+		h ^= (uint32_t)*buf++;
+	}
+
+	return h;
+}
+
+/**
+ * @brief write a cdb file
+ * @param keys the keys to store, every key gets a 64 byte value
+ * @param count number of keys
+ */
+static void
+write_cdb(char **keys, const unsigned int count)
+{
+	const size_t vlen = 64;
+	size_t datalen = 0;
+	uint32_t *hashes = calloc(count, sizeof(*hashes));
+	uint32_t *positions = calloc(count, sizeof(*positions));
+	unsigned int tablecount[256] = { 0 };
+
+	for (unsigned int i = 0; i < count; i++) {
+		hashes[i] = cdb_hash(keys[i], strlen(keys[i]));
+		positions[i] = 2048 + datalen;
+		datalen += 8 + strlen(keys[i]) + vlen;
+		tablecount[hashes[i] & 0xff]++;
+	}
+
+	const size_t total = 2048 + datalen + (size_t)count * 2 * 8;
+	unsigned char *buf = calloc(1, total);
+	if ((buf == NULL) || (hashes == NULL) || (positions == NULL)) {
+		fputs("out of memory\n", stderr);
+		exit(1);
+	}
+
+	for (unsigned int i = 0; i < count; i++) {
+		unsigned char *r = buf + positions[i];
+		const size_t klen = strlen(keys[i]);
+
+		put32(r, klen);
+		put32(r + 4, vlen);
+		memcpy(r + 8, keys[i], klen);
+		memset(r + 8 + klen, 'v', vlen);
+	}
+
+	size_t tpos = 2048 + datalen;
+	for (unsigned int t = 0; t < 256; t++) {
+		const uint32_t slots = tablecount[t] * 2;
+
+		put32(buf + 8 * t, tpos);
+		put32(buf + 8 * t + 4, slots);
+
+		for (unsigned int i = 0; i < count; i++) {
+			if ((hashes[i] & 0xff) != t)
+				continue;
+
+			uint32_t s = (hashes[i] >> 8) % slots;
+			while (buf[tpos + 8 * s + 4] | buf[tpos + 8 * s + 5] | buf[tpos + 8 * s + 6] | buf[tpos + 8 * s + 7])
+				s = (s + 1) % slots;
+			put32(buf + tpos + 8 * s, hashes[i]);
+			put32(buf + tpos + 8 * s + 4, positions[i]);
+		}
+		tpos += 8 * slots;
+	}
+
+	int fd = open(cdbname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if ((fd < 0) || (write(fd, buf, total) != (ssize_t)total) || (close(fd) != 0)) {
+		perror(cdbname);
+		exit(1);
+	}
+
+	free(buf);
+	free(hashes);
+	free(positions);
+}
+
+static void
+run_cdb(const unsigned int count)
+{
+	char **keys = calloc(count, sizeof(*keys));
+	uint64_t st = bench_state(count);
+	char variant[32];
+	unsigned long found = 0;
+
+	if (keys == NULL)
+		exit(1);
+
+	/* keys look like the ones in users/cdb of qmail */
+	for (unsigned int i = 0; i < count; i++) {
+		keys[i] = malloc(48);
+		if (keys[i] == NULL)
+			exit(1);
+		snprintf(keys[i], 48, "!domain%u.example-%u.com-", i, bench_random(&st) % 1000);
+	}
+	write_cdb(keys, count);
+
+	int fd = open(cdbname, O_RDONLY | O_CLOEXEC);
+	struct stat sb;
+	if ((fd < 0) || (fstat(fd, &sb) != 0)) {
+		perror(cdbname);
+		exit(1);
+	}
+
+	const unsigned long n = bench_iterations * 1000;
+	const uint64_t start = bench_now();
+	for (unsigned long i = 0; i < n; i++) {
+		char *mm;
+		/* every second lookup is a miss */
+		const char *key = (i & 1) ? "!nonexistent.example.org-" : keys[bench_random(&st) % count];
+		const char *r = cdb_seekmm(dup(fd), key, strlen(key), &mm, &sb);
+
+		if (r != NULL) {
+			found++;
+			munmap(mm, sb.st_size);
+		}
+	}
+	const uint64_t ns = bench_now() - start;
+
+	if (found != n / 2) {
+		fprintf(stderr, "cdb_seekmm() found %lu of %lu keys\n", found, n / 2);
+		exit(1);
+	}
+
+	close(fd);
+	unlink(cdbname);
+	for (unsigned int i = 0; i < count; i++)
+		free(keys[i]);
+	free(keys);
+
+	snprintf(variant, sizeof(variant), "keys-%u", count);
+	bench_report("cdb_seekmm", variant, n, 0, ns);
+}
+
+static void
+run_finddomain(const unsigned int count)
+{
+	char *buf = malloc((size_t)count * 64);
+	char *p = buf;
+	uint64_t st = bench_state(count + 1);
+	char variant[32];
+	unsigned long found = 0;
+
+	if (buf == NULL)
+		exit(1);
+
+	/* like rcpthosts: mostly exact names, some subdomain wildcards, some comments */
+	for (unsigned int i = 0; i < count; i++) {
+		if (i % 50 == 0)
+			p += sprintf(p, "# customer block %u\n", i / 50);
+		p += sprintf(p, "%sdomain%u.example.com\n", (i % 10 == 0) ? "." : "", i);
+	}
+
+	const size_t len = p - buf;
+	const unsigned long n = bench_iterations * 100;
+	const uint64_t start = bench_now();
+	for (unsigned long i = 0; i < n; i++) {
+		char domain[64];
+		unsigned int d = bench_random(&st) % count;
+
+		if (i & 1)
+			snprintf(domain, sizeof(domain), "domain%u.example.org", d);
+		else if (d % 10 == 0)
+			snprintf(domain, sizeof(domain), "mail.domain%u.example.com", d);
+		else
+			snprintf(domain, sizeof(domain), "domain%u.example.com", d);
+
+		found += finddomain(buf, len, domain);
+	}
+	const uint64_t ns = bench_now() - start;
+
+	if (found != n / 2) {
+		fprintf(stderr, "finddomain() found %lu of %lu domains\n", found, n / 2);
+		exit(1);
+	}
+
+	free(buf);
+
+	snprintf(variant, sizeof(variant), "domains-%u", count);
+	bench_report("finddomain", variant, n, (unsigned long long)len * n, ns);
+}
+
+static void
+run_lookupipbl(const unsigned int count, const int hit)
+{
+	unsigned char *buf = malloc((size_t)count * 5);
+	uint64_t st = bench_state(count + 2);
+	char variant[32];
+
+	if (buf == NULL)
+		exit(1);
+
+	/* IPv4 networks from 10.0.0.0/8, network byte order, followed by the netmask */
+	for (unsigned int i = 0; i < count; i++) {
+		const uint32_t net = htonl(0x0a000000 | ((bench_random(&st) % 0xffff) << 8));
+
+		memcpy(buf + 5 * i, &net, 4);
+		buf[5 * i + 4] = 24;
+	}
+
+	memset(&xmitstat, 0, sizeof(xmitstat));
+	xmitstat.ipv4conn = 1;
+	if (hit) {
+		/* the last entry matches, so the whole file is scanned */
+		char ip[INET_ADDRSTRLEN];
+		char mapped[INET6_ADDRSTRLEN];
+
+		inet_ntop(AF_INET, buf + 5 * (count - 1), ip, sizeof(ip));
+		snprintf(mapped, sizeof(mapped), "::ffff:%s", ip);
+		inet_pton(AF_INET6, mapped, &xmitstat.sremoteip);
+	} else {
+		inet_pton(AF_INET6, "::ffff:192.0.2.25", &xmitstat.sremoteip);
+	}
+
+	int fd = open(ipblname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if ((fd < 0) || (write(fd, buf, (size_t)count * 5) != (ssize_t)count * 5) || (close(fd) != 0)) {
+		perror(ipblname);
+		exit(1);
+	}
+	free(buf);
+
+	const unsigned long n = bench_iterations * 100;
+	const uint64_t start = bench_now();
+	for (unsigned long i = 0; i < n; i++) {
+		if (lookupipbl(open(ipblname, O_RDONLY | O_CLOEXEC)) != hit) {
+			fputs("lookupipbl() returned unexpected result\n", stderr);
+			exit(1);
+		}
+	}
+	const uint64_t ns = bench_now() - start;
+
+	unlink(ipblname);
+
+	snprintf(variant, sizeof(variant), "ipv4-%u-%s", count, hit ? "hit" : "miss");
+	bench_report("lookupipbl", variant, n, (unsigned long long)count * 5 * n, ns);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (bench_init(argc, argv, 100))
+		return 1;
+
+	if (bench_selected("cdb_seekmm")) {
+		run_cdb(1000);
+		run_cdb(100000);
+	}
+
+	if (bench_selected("finddomain")) {
+		run_finddomain(100);
+		run_finddomain(10000);
+	}
+
+	if (bench_selected("lookupipbl")) {
+		run_lookupipbl(100, 0);
+		run_lookupipbl(10000, 0);
+		run_lookupipbl(10000, 1);
+	}
+
+	return 0;
+}
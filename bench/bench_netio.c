@@ -0,0 +1,152 @@
+/** \file bench_netio.c
+ \brief benchmark for splitting network input into lines
+
+ net_read() is fed from a socketpair by a child process, so the real
+ buffering and line splitting code is measured, only the network is missing.
+ */
+
+#include "bench.h"
+
+#include <log.h>
+#include <netio.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int socketd;
+
+void
+dieerror(int error)
+{
+	fprintf(stderr, "net_read() failed with error %i\n", error);
+	exit(error);
+}
+
+/**
+ * @brief count the lines in the input data
+ */
+static unsigned long
+count_lines(const char *buf, const size_t len)
+{
+	unsigned long lines = 0;
+
+	for (const char *p = buf; (p = memchr(p, '\n', len - (p - buf))) != NULL; p++)
+		lines++;
+
+	return lines;
+}
+
+/**
+ * @brief send the input data to the socket
+ * @param fd the socket to write to
+ * @param buf the data to send
+ * @param len length of buf
+ * @param wsize size of the single writes
+ */
+static void __attribute__ ((noreturn))
+feeder(const int fd, const char *buf, const size_t len, const size_t wsize)
+{
+	for (unsigned long i = 0; i < bench_iterations; i++) {
+		size_t off = 0;
+
+		while (off < len) {
+			size_t l = (len - off < wsize) ? len - off : wsize;
+			ssize_t w = write(fd, buf + off, l);
+
+			if (w < 0) {
+				if (errno == EINTR)
+					continue;
+				_exit(1);
+			}
+			off += w;
+		}
+	}
+
+	_exit(0);
+}
+
+static void
+run_net_read(const char *variant, const char *buf, const size_t len, const size_t wsize)
+{
+	int sv[2];
+	const unsigned long lines = count_lines(buf, len) * bench_iterations;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		perror("socketpair");
+		exit(1);
+	}
+
+	pid_t child = fork();
+	if (child < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (child == 0) {
+		close(sv[0]);
+		feeder(sv[1], buf, len, wsize);
+	}
+
+	close(sv[1]);
+	/* net_read() always reads from stdin */
+	if (dup2(sv[0], 0) != 0) {
+		perror("dup2");
+		exit(1);
+	}
+	if (sv[0] != 0)
+		close(sv[0]);
+	socketd = 0;
+	timeout = 30;
+
+	const uint64_t start = bench_now();
+	for (unsigned long i = 0; i < lines; i++) {
+		if (net_read(1) != 0) {
+			fprintf(stderr, "%s: net_read() failed in line %lu: %i\n", variant, i, errno);
+			exit(1);
+		}
+	}
+	const uint64_t ns = bench_now() - start;
+
+	waitpid(child, NULL, 0);
+
+	bench_report("net_read", variant, lines, (unsigned long long)len * bench_iterations, ns);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t len;
+
+	if (bench_init(argc, argv, 20))
+		return 1;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (!bench_selected("net_read"))
+		return 0;
+
+	/* a message body as sent during DATA */
+	char *msg = bench_message(1024 * 1024, BENCH_MSG_DOTS, &len);
+	run_net_read("body-1m-64k-writes", msg, len, 65536);
+	run_net_read("body-1m-1k-writes", msg, len, 1024);
+	free(msg);
+
+	/* a pipelined envelope with many recipients */
+	char *cmds = malloc(256 * 64);
+	char *p = cmds;
+	if (cmds == NULL)
+		return 1;
+	p += sprintf(p, "MAIL FROM:<sender@example.net> SIZE=12345 BODY=8BITMIME\r\n");
+	for (unsigned int i = 0; i < 250; i++)
+		p += sprintf(p, "RCPT TO:<user%u@example.com>\r\n", i);
+	p += sprintf(p, "DATA\r\n");
+	run_net_read("envelope-250-rcpts", cmds, p - cmds, p - cmds);
+	free(cmds);
+
+	return 0;
+}
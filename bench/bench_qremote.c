@@ -0,0 +1,246 @@
+/** \file bench_qremote.c
+ \brief benchmarks for the message body handling of Qremote
+
+ The output of send_data() and send_bdat() is only counted, all replies of
+ the remote server are positive.
+ */
+
+#include "bench.h"
+
+#include <netio.h>
+#include <qremote/client.h>
+#include <qremote/greeting.h>
+#include <qremote/qrdata.h>
+#include <qremote/qremote.h>
+#include "test_io/testcase_io.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+string heloname;
+unsigned int smtpext;
+
+#ifdef DEBUG_IO
+int in_data;
+#endif /* DEBUG_IO */
+
+static unsigned long long written;	/**< bytes passed to netnwrite() */
+
+void
+quit(void)
+{
+	exit(1);
+}
+
+void
+write_status(const char *str)
+{
+	fprintf(stderr, "unexpected status: %s\n", str);
+	exit(1);
+}
+
+void
+write_status_m(const char **strs, const unsigned int count)
+{
+	for (unsigned int i = 0; i < count; i++)
+		fputs(strs[i], stderr);
+	fputc('\n', stderr);
+	exit(1);
+}
+
+int
+netget(const unsigned int terminate __attribute__ ((unused)))
+{
+	return 354;
+}
+
+int
+checkreply(const char *status __attribute__ ((unused)), const char **pre __attribute__ ((unused)),
+		const int mask __attribute__ ((unused)))
+{
+	return 250;
+}
+
+int
+envelope_flush(const char *tail, const size_t taillen)
+{
+	return (tail != NULL) ? netnwrite(tail, taillen) : 0;
+}
+
+int
+envelope_replies(void)
+{
+	return 0;
+}
+
+static int
+count_netnwrite(const char *s __attribute__ ((unused)), const size_t l)
+{
+	written += l;
+	return 0;
+}
+
+static void
+ignore_log_write(int priority __attribute__ ((unused)), const char *s __attribute__ ((unused)))
+{
+}
+
+static void
+bench_shutdown(const enum conn_shutdown_type sdtype __attribute__ ((unused)))
+{
+	fputs("unexpected connection shutdown\n", stderr);
+	exit(1);
+}
+
+/** @struct corpus
+ @brief input messages used for the benchmarks
+ */
+static struct corpus {
+	const char *variant;	/**< name of the variant */
+	size_t size;		/**< approximate size */
+	unsigned int flags;	/**< flags for bench_message() */
+	char *msg;		/**< the generated message */
+	size_t len;		/**< length of msg */
+} corpora[] = {
+	{ .variant = "ascii-4k", .size = 4096, .flags = 0 },
+	{ .variant = "ascii-1m", .size = 1024 * 1024, .flags = BENCH_MSG_DOTS },
+	{ .variant = "8bit-1m", .size = 1024 * 1024, .flags = BENCH_MSG_8BIT | BENCH_MSG_DOTS },
+	{ .variant = "longlines-1m", .size = 1024 * 1024, .flags = BENCH_MSG_LONGLINES },
+	{ .variant = "barelf-1m", .size = 1024 * 1024, .flags = BENCH_MSG_BARELF | BENCH_MSG_DOTS },
+	{ .variant = "multipart-8bit-1m", .size = 1024 * 1024, .flags = BENCH_MSG_MULTIPART | BENCH_MSG_8BIT },
+	{ .variant = NULL }
+};
+
+/**
+ * @brief scale the iterations to the message size
+ *
+ * The default number of iterations is meant for 1 MiB, small messages are
+ * processed more often to get measurable times.
+ */
+static unsigned long
+iterations(const struct corpus *c)
+{
+	return (c->size < 1024 * 1024) ? bench_iterations * (1024 * 1024 / c->size) : bench_iterations;
+}
+
+static void
+run_need_recode(const struct corpus *c)
+{
+	const unsigned long n = iterations(c);
+	unsigned int res = 0;
+
+	const uint64_t start = bench_now();
+	for (unsigned long i = 0; i < n; i++)
+		res |= need_recode(c->msg, c->len);
+	const uint64_t ns = bench_now() - start;
+
+	/* make sure the result is used */
+	if (res == 0xffff)
+		puts("");
+
+	bench_report("need_recode", c->variant, n, (unsigned long long)c->len * n, ns);
+}
+
+/**
+ * @brief run send_data()
+ * @param name name of the benchmark
+ * @param c the input data
+ * @param ext the SMTP extensions the remote server announces
+ *
+ * Without 8BITMIME support 8bit messages are recoded to quoted-printable,
+ * otherwise they are passed unmodified.
+ */
+static void
+run_send_data(const char *name, const struct corpus *c, const unsigned int ext)
+{
+	const unsigned long n = iterations(c);
+	const unsigned int recodeflag = need_recode(c->msg, c->len);
+
+	smtpext = ext;
+	msgdata = c->msg;
+	msgsize = c->len;
+	written = 0;
+
+	const uint64_t start = bench_now();
+	for (unsigned long i = 0; i < n; i++)
+		send_data(recodeflag);
+	const uint64_t ns = bench_now() - start;
+
+	msgdata = NULL;
+
+	bench_report(name, c->variant, n, written, ns);
+}
+
+#ifdef CHUNKING
+static void
+run_send_bdat(const struct corpus *c, const size_t csize, const char *variant)
+{
+	const unsigned long n = iterations(c);
+	const unsigned int recodeflag = need_recode(c->msg, c->len);
+
+	smtpext = esmtp_chunking | esmtp_8bitmime | esmtp_pipelining;
+	chunksize = csize;
+	chunkwindow = 4;
+	msgdata = c->msg;
+	msgsize = c->len;
+	written = 0;
+
+	const uint64_t start = bench_now();
+	for (unsigned long i = 0; i < n; i++)
+		send_bdat(recodeflag);
+	const uint64_t ns = bench_now() - start;
+
+	msgdata = NULL;
+
+	bench_report("send_bdat", variant, n, written, ns);
+}
+#endif /* CHUNKING */
+
+int
+main(int argc, char **argv)
+{
+	if (bench_init(argc, argv, 50))
+		return 1;
+
+	testcase_setup_netnwrite(count_netnwrite);
+	testcase_setup_log_write(ignore_log_write);
+	testcase_setup_net_conn_shutdown(bench_shutdown);
+
+	heloname.s = "mx.example.com";
+	heloname.len = strlen(heloname.s);
+
+	for (struct corpus *c = corpora; c->variant != NULL; c++)
+		c->msg = bench_message(c->size, c->flags, &c->len);
+
+	for (struct corpus *c = corpora; c->variant != NULL; c++) {
+		if (bench_selected("need_recode"))
+			run_need_recode(c);
+		/* send_plain() is used for everything that needs no recoding */
+		if (bench_selected("send_plain"))
+			run_send_data("send_plain", c, esmtp_8bitmime);
+		/* send_qp() and recode_qp() for 8bit data if the server does not support 8BITMIME */
+		if (bench_selected("send_qp") && (c->flags & (BENCH_MSG_8BIT | BENCH_MSG_LONGLINES)))
+			run_send_data("send_qp", c, 0);
+	}
+
+#ifdef CHUNKING
+	if (bench_selected("send_bdat")) {
+		static const size_t sizes[] = { 4096, 32768, 1024 * 1024 };
+
+		for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			char variant[64];
+
+			snprintf(variant, sizeof(variant), "%s-chunk-%zu", corpora[1].variant, sizes[i]);
+			run_send_bdat(corpora + 1, sizes[i], variant);
+			snprintf(variant, sizeof(variant), "%s-chunk-%zu", corpora[4].variant, sizes[i]);
+			run_send_bdat(corpora + 4, sizes[i], variant);
+		}
+	}
+#endif /* CHUNKING */
+
+	for (struct corpus *c = corpora; c->variant != NULL; c++)
+		free(c->msg);
+
+	return 0;
+}
@@ -0,0 +1,321 @@
+/** \file bench_qsdata.c
+ \brief benchmarks for receiving the message body in Qsmtpd
+
+ smtp_data() and smtp_bdat() get their input from memory and write the
+ message to /dev/null instead of qmail-queue, so only the processing of the
+ message body is measured.
+ */
+
+#include "bench.h"
+
+#include <netio.h>
+#include <qsmtpd/antispam.h>
+#include <qsmtpd/commands.h>
+#include <qsmtpd/qsdata.h>
+#include <qsmtpd/qsmtpd.h>
+#include <qsmtpd/queue.h>
+#include <qsmtpd/rcptset.h>
+#include "test_io/testcase_io.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int relayclient;
+unsigned long sslauth;
+unsigned long databytes;
+unsigned int goodrcpt;
+struct xmitstat xmitstat;
+const char **globalconf;
+string heloname;
+string msgidhost;
+string liphost;
+unsigned long comstate = 0x001;
+int authhide;
+int submission_mode;
+int queuefd_data = -1;
+int queuefd_hdr = -1;
+
+struct recip *thisrecip;
+struct rcpt_list head;
+
+static struct smtpcomm command;
+struct smtpcomm *current_command = &command;
+
+static int devnull = -1;
+
+/** @struct line
+ @brief one line of input for net_read()
+ */
+struct line {
+	const char *s;		/**< start of the line */
+	size_t len;		/**< length without CRLF */
+};
+
+static struct line *lines;	/**< the input for net_read() */
+static size_t linecount;	/**< number of entries in lines */
+static size_t linepos;		/**< next line to return */
+
+static const char *bindata;	/**< the input for net_readbin() */
+static size_t binlen;		/**< length of bindata */
+static size_t binpos;		/**< next position to return */
+
+void
+freedata(void)
+{
+}
+
+void
+tarpit(void)
+{
+}
+
+void
+sync_pipelining(void)
+{
+}
+
+int
+spfreceived(int fd __attribute__ ((unused)), const int spf __attribute__ ((unused)))
+{
+	return 0;
+}
+
+int
+queue_init(void)
+{
+	queuefd_data = devnull;
+	queuefd_hdr = devnull;
+	return 0;
+}
+
+void
+queue_reset(void)
+{
+	fputs("unexpected call to queue_reset()\n", stderr);
+	exit(1);
+}
+
+int
+queue_envelope(const unsigned long msgsize __attribute__ ((unused)), const int chunked __attribute__ ((unused)))
+{
+	return 0;
+}
+
+int
+queue_result(void)
+{
+	queuefd_data = -1;
+	queuefd_hdr = -1;
+	return 0;
+}
+
+static int
+bench_net_read(const int fatal __attribute__ ((unused)))
+{
+	const struct line *l = lines + linepos++;
+
+	memcpy(linein.s, l->s, l->len);
+	linein.s[l->len] = '\0';
+	linein.len = l->len;
+
+	return 0;
+}
+
+static size_t
+bench_net_readbin(size_t num, char *buf)
+{
+	if (num > binlen - binpos)
+		num = binlen - binpos;
+
+	memcpy(buf, bindata + binpos, num);
+	binpos += num;
+
+	return num;
+}
+
+static int
+ignore_netnwrite(const char *s __attribute__ ((unused)), const size_t l __attribute__ ((unused)))
+{
+	return 0;
+}
+
+static int
+ignore_net_writen(const char *const *s __attribute__ ((unused)))
+{
+	return 0;
+}
+
+static void
+ignore_log_writen(int priority __attribute__ ((unused)), const char **s __attribute__ ((unused)))
+{
+}
+
+/**
+ * @brief split the message into lines like a client would send them in DATA
+ *
+ * The lines point into the message, so the added dots for lines beginning
+ * with a dot are simulated by starting the line one character earlier if
+ * possible. The final line is the single dot.
+ */
+static void
+split_lines(const char *msg, const size_t len)
+{
+	static const char dot[] = ".";
+	size_t cnt = 1;
+
+	for (size_t i = 0; i < len; i++)
+		if (msg[i] == '\n')
+			cnt++;
+
+	lines = calloc(cnt, sizeof(*lines));
+	if (lines == NULL)
+		exit(1);
+
+	linecount = 0;
+	for (const char *p = msg; p < msg + len; ) {
+		const char *e = memchr(p, '\n', len - (p - msg));
+		const size_t l = e - p - 1;	/* the messages always use CRLF */
+
+		if ((*p == '.') && (p > msg)) {
+			/* the preceding LF is not part of the content, it just needs to be a '.' */
+			lines[linecount].s = p - 1;
+			lines[linecount].len = l + 1;
+		} else {
+			lines[linecount].s = p;
+			lines[linecount].len = l;
+		}
+		linecount++;
+		p = e + 1;
+	}
+	lines[linecount].s = dot;
+	lines[linecount].len = 1;
+	linecount++;
+}
+
+static void
+run_smtp_data(const char *variant, const size_t size, const unsigned int flags)
+{
+	size_t len;
+	char *msg = bench_message(size, flags, &len);
+	const unsigned long n = (size < 1024 * 1024) ? bench_iterations * (1024 * 1024 / size) : bench_iterations;
+
+	split_lines(msg, len);
+
+	/* the lines starting with a dot use the LF before them, make that a dot */
+	for (size_t i = 0; i < linecount - 1; i++)
+		if (lines[i].s[0] == '\n')
+			*(char *)lines[i].s = '.';
+
+	const uint64_t start = bench_now();
+	for (unsigned long i = 0; i < n; i++) {
+		linepos = 0;
+		if (smtp_data() != 0) {
+			fprintf(stderr, "%s: smtp_data() failed\n", variant);
+			exit(1);
+		}
+		if (linepos != linecount) {
+			fprintf(stderr, "%s: smtp_data() read %zu of %zu lines\n", variant, linepos, linecount);
+			exit(1);
+		}
+	}
+	const uint64_t ns = bench_now() - start;
+
+	free(lines);
+	free(msg);
+
+	bench_report("smtp_data", variant, n, (unsigned long long)len * n, ns);
+}
+
+#ifdef CHUNKING
+static void
+run_smtp_bdat(const char *variant, const size_t size, const unsigned int flags, const size_t chunk)
+{
+	const unsigned long n = (size < 1024 * 1024) ? bench_iterations * (1024 * 1024 / size) : bench_iterations;
+	size_t len;
+	char *msg = bench_message(size, flags, &len);
+
+	bindata = msg;
+	binlen = len;
+
+	const uint64_t start = bench_now();
+	for (unsigned long i = 0; i < n; i++) {
+		binpos = 0;
+		comstate = 0x001;
+
+		while (binpos < binlen) {
+			const size_t c = (binlen - binpos > chunk) ? chunk : binlen - binpos;
+
+			linein.len = sprintf(linein.s, "BDAT %zu%s", c, (c == binlen - binpos) ? " LAST" : "");
+			if (smtp_bdat() != 0) {
+				fprintf(stderr, "%s: smtp_bdat() failed\n", variant);
+				exit(1);
+			}
+		}
+	}
+	const uint64_t ns = bench_now() - start;
+
+	free(msg);
+
+	bench_report("smtp_bdat", variant, n, (unsigned long long)len * n, ns);
+}
+#endif /* CHUNKING */
+
+int
+main(int argc, char **argv)
+{
+	struct recip rcpt = {
+		.to = { .s = "rcpt@example.com", .len = strlen("rcpt@example.com") },
+		.ok = 1
+	};
+
+	if (bench_init(argc, argv, 50))
+		return 1;
+
+	devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if (devnull < 0) {
+		perror("/dev/null");
+		return 1;
+	}
+
+	testcase_setup_net_read(bench_net_read);
+	testcase_setup_net_readbin(bench_net_readbin);
+	testcase_setup_netnwrite(ignore_netnwrite);
+	testcase_setup_net_writen(ignore_net_writen);
+	testcase_setup_log_writen(ignore_log_writen);
+
+	heloname.s = "mx.example.com";
+	heloname.len = strlen(heloname.s);
+	xmitstat.esmtp = 1;
+	xmitstat.mailfrom.s = "sender@example.net";
+	xmitstat.mailfrom.len = strlen(xmitstat.mailfrom.s);
+	xmitstat.helostr.s = "client.example.net";
+	xmitstat.helostr.len = strlen(xmitstat.helostr.s);
+	strcpy(xmitstat.remoteip, "::ffff:192.0.2.25");
+	relayclient = 1;
+	maxbytes = (size_t)-1 - 1000;
+	goodrcpt = 1;
+	TAILQ_INIT(&head);
+	TAILQ_INSERT_TAIL(&head, &rcpt, entries);
+	if (rcptset_add(&rcpt) != 0)
+		return 1;
+
+	if (bench_selected("smtp_data")) {
+		run_smtp_data("ascii-4k", 4096, 0);
+		run_smtp_data("ascii-1m", 1024 * 1024, BENCH_MSG_DOTS);
+		run_smtp_data("8bit-1m", 1024 * 1024, BENCH_MSG_8BIT | BENCH_MSG_DOTS);
+	}
+
+#ifdef CHUNKING
+	if (bench_selected("smtp_bdat")) {
+		run_smtp_bdat("ascii-4k-single", 4096, 0, 4096 * 2);
+		run_smtp_bdat("ascii-1m-single", 1024 * 1024, 0, 2 * 1024 * 1024);
+		run_smtp_bdat("ascii-1m-chunk-32k", 1024 * 1024, 0, 32768);
+		run_smtp_bdat("8bit-1m-chunk-32k", 1024 * 1024, BENCH_MSG_8BIT, 32768);
+	}
+#endif /* CHUNKING */
+
+	return 0;
+}
@@ -0,0 +1,270 @@
+/** \file bench_spf.c
+ \brief benchmark for SPF evaluation
+
+ check_host() is run against a static set of DNS records, so only the
+ parsing and evaluation of the SPF policies is measured, not the DNS latency.
+ */
+
+#include "bench.h"
+
+#include <libowfatconn.h>
+#include <qdns.h>
+#include <qremote/qremote.h>
+#include <qsmtpd/antispam.h>
+#include <qsmtpd/qsmtpd.h>
+#include <sstring.h>
+#include "test_io/testcase_io.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+struct xmitstat xmitstat;
+string heloname;
+
+void
+write_status(const char *str)
+{
+	fprintf(stderr, "unexpected status: %s\n", str);
+	exit(1);
+}
+
+void
+dieerror(int a)
+{
+	fprintf(stderr, "unexpected error %i\n", a);
+	exit(1);
+}
+
+/** @struct dnsrecord
+ @brief a static DNS record
+ */
+static const struct dnsrecord {
+	const char *name;	/**< the name the record belongs to */
+	const char *txt;	/**< TXT record, records are separated by '#' */
+	const char *a;		/**< IPv4 addresses, separated by ';' */
+	const char *mx;		/**< MX names, separated by ';' */
+} dnsrecords[] = {
+	{
+		.name = "simple.example.com",
+		.txt = "v=spf1 ip4:192.0.2.0/24 -all"
+	},
+	{
+		.name = "big.example.com",
+		.txt = "google-site-verification=0123456789abcdef#"
+			"v=spf1 ip4:198.51.100.0/26 ip4:198.51.100.64/26 ip6:2001:db8:1::/48 "
+			"a mx a:relay.example.com/28 include:_spf.example.net include:_spf.example.org ~all",
+		.a = "198.51.100.200",
+		.mx = "mx1.example.com;mx2.example.com"
+	},
+	{
+		.name = "_spf.example.net",
+		.txt = "v=spf1 ip4:203.0.113.0/25 ip6:2001:db8:2::/48 ?all"
+	},
+	{
+		.name = "_spf.example.org",
+		.txt = "v=spf1 ip4:203.0.113.128/26 exists:%{i}._spf.example.org -all"
+	},
+	{
+		.name = "mx1.example.com",
+		.a = "198.51.100.201"
+	},
+	{
+		.name = "mx2.example.com",
+		.a = "198.51.100.202"
+	},
+	{
+		.name = "relay.example.com",
+		.a = "198.51.100.208"
+	},
+	{
+		.name = NULL
+	}
+};
+
+static const struct dnsrecord *
+find_record(const char *name)
+{
+	for (const struct dnsrecord *r = dnsrecords; r->name != NULL; r++)
+		if (strcasecmp(r->name, name) == 0)
+			return r;
+
+	return NULL;
+}
+
+int
+dnstxt_records(char **out, const char *host)
+{
+	const struct dnsrecord *r = find_record(host);
+
+	if ((r == NULL) || (r->txt == NULL)) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	*out = strdup(r->txt);
+	if (*out == NULL)
+		return -1;
+
+	int records = 1;
+	for (char *hash = *out; (hash = strchr(hash, '#')) != NULL; records++)
+		*hash++ = '\0';
+
+	return records;
+}
+
+int
+dnstxt(char **out __attribute__ ((unused)), const char *host __attribute__ ((unused)))
+{
+	abort();
+}
+
+void
+dnsprefetch(const char *host __attribute__ ((unused)), const enum dns_prefetch_type type __attribute__ ((unused)))
+{
+	/* all answers are local, there is nothing to fetch in advance */
+}
+
+static int
+bench_ask_dnsa(const char *domain, struct in6_addr **ips)
+{
+	const struct dnsrecord *r = find_record(domain);
+	int cnt = 0;
+
+	if ((r == NULL) || (r->a == NULL))
+		return 0;
+
+	struct in6_addr *res = calloc(4, sizeof(*res));
+	if (res == NULL)
+		return DNS_ERROR_LOCAL;
+
+	for (const char *p = r->a; (p != NULL) && (cnt < 4); cnt++) {
+		char buf[INET_ADDRSTRLEN + 7] = "::ffff:";
+		const char *e = strchr(p, ';');
+		const size_t l = (e != NULL) ? (size_t)(e - p) : strlen(p);
+
+		memcpy(buf + 7, p, l);
+		buf[7 + l] = '\0';
+		inet_pton(AF_INET6, buf, res + cnt);
+		p = (e != NULL) ? e + 1 : NULL;
+	}
+
+	if (ips != NULL)
+		*ips = res;
+	else
+		free(res);
+
+	return cnt;
+}
+
+static int
+bench_ask_dnsaaaa(const char *domain, struct in6_addr **ips)
+{
+	return bench_ask_dnsa(domain, ips);
+}
+
+static int
+bench_ask_dnsmx(const char *domain, struct ips **ips)
+{
+	const struct dnsrecord *r = find_record(domain);
+
+	*ips = NULL;
+	if ((r == NULL) || (r->mx == NULL))
+		return 0;
+
+	for (const char *p = r->mx; p != NULL; ) {
+		char name[64];
+		const char *e = strchr(p, ';');
+		const size_t l = (e != NULL) ? (size_t)(e - p) : strlen(p);
+		struct in6_addr *a;
+
+		memcpy(name, p, l);
+		name[l] = '\0';
+		int cnt = bench_ask_dnsa(name, &a);
+		if (cnt > 0) {
+			struct ips *n = in6_to_ips(a, cnt, 10);
+
+			if (n == NULL) {
+				freeips(*ips);
+				*ips = NULL;
+				return DNS_ERROR_LOCAL;
+			}
+			n->next = *ips;
+			*ips = n;
+		}
+		p = (e != NULL) ? e + 1 : NULL;
+	}
+
+	return 0;
+}
+
+static int
+bench_ask_dnsname(const struct in6_addr *addr __attribute__ ((unused)), char **name __attribute__ ((unused)))
+{
+	return 0;
+}
+
+static void
+run_check_host(const char *variant, const char *domain, const char *remoteip, const int expect)
+{
+	char from[128];
+	const unsigned long n = bench_iterations * 1000;
+
+	memset(&xmitstat, 0, sizeof(xmitstat));
+	snprintf(from, sizeof(from), "sender@%s", domain);
+	xmitstat.mailfrom.s = from;
+	xmitstat.mailfrom.len = strlen(from);
+	xmitstat.helostr.s = "client.example.net";
+	xmitstat.helostr.len = strlen(xmitstat.helostr.s);
+	inet_pton(AF_INET6, remoteip, &xmitstat.sremoteip);
+	xmitstat.ipv4conn = IN6_IS_ADDR_V4MAPPED(&xmitstat.sremoteip) ? 1 : 0;
+
+	const uint64_t start = bench_now();
+	for (unsigned long i = 0; i < n; i++) {
+		int r = check_host(domain);
+
+		if (r != expect) {
+			fprintf(stderr, "%s: check_host() returned %i instead of %i\n", variant, r, expect);
+			exit(1);
+		}
+		free(xmitstat.spfexp);
+		xmitstat.spfexp = NULL;
+	}
+	const uint64_t ns = bench_now() - start;
+
+	bench_report("check_host", variant, n, 0, ns);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (bench_init(argc, argv, 10))
+		return 1;
+
+	testcase_setup_ask_dnsa(bench_ask_dnsa);
+	testcase_setup_ask_dnsaaaa(bench_ask_dnsaaaa);
+	testcase_setup_ask_dnsmx(bench_ask_dnsmx);
+	testcase_setup_ask_dnsname(bench_ask_dnsname);
+
+	heloname.s = "mx.example.com";
+	heloname.len = strlen(heloname.s);
+
+	if (!bench_selected("check_host"))
+		return 0;
+
+	run_check_host("simple-pass", "simple.example.com", "::ffff:192.0.2.25", SPF_PASS);
+	run_check_host("simple-fail", "simple.example.com", "::ffff:203.0.113.5", SPF_FAIL);
+	/* matches the first mechanism */
+	run_check_host("big-pass-first", "big.example.com", "::ffff:198.51.100.10", SPF_PASS);
+	/* matches the mx mechanism, after 2 A lookups */
+	run_check_host("big-pass-mx", "big.example.com", "::ffff:198.51.100.202", SPF_PASS);
+	/* matches in the first include */
+	run_check_host("big-pass-include", "big.example.com", "::ffff:203.0.113.10", SPF_PASS);
+	/* nothing matches, all mechanisms and includes are evaluated */
+	run_check_host("big-softfail", "big.example.com", "::ffff:192.0.2.99", SPF_SOFTFAIL);
+
+	return 0;
+}
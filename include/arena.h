@@ -0,0 +1,30 @@
+/** \file arena.h
+ \brief bump allocator for memory that is released all at once
+ */
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+struct arena_block;
+
+/** \struct arena
+ \brief a set of memory blocks that are handed out piece by piece
+
+ Single allocations can not be freed, all memory of an arena is released
+ at once with arena_reset() or arena_free(). An arena initialized to all
+ zeroes is valid and empty.
+ */
+struct arena {
+	struct arena_block *blocks;	/**< the allocated blocks, the one currently used first */
+	size_t used;			/**< bytes used in the first block */
+};
+
+#define ARENA_BLOCKSIZE 4096		/**< default size of a block including its header */
+
+extern void *arena_alloc(struct arena *a, const size_t size) __attribute__ ((nonnull (1))) __attribute__ ((malloc));
+extern char *arena_strndup(struct arena *a, const char *s, const size_t len) __attribute__ ((nonnull (1, 2))) __attribute__ ((malloc));
+extern void arena_reset(struct arena *a) __attribute__ ((nonnull (1)));
+extern void arena_free(struct arena *a) __attribute__ ((nonnull (1)));
+
+#endif
@@ -7,7 +7,19 @@
 #include "compiler.h"
 
 #include <sys/stat.h>
+#include <sys/types.h>
+
+/** @brief one entry of a CDB database to create */
+struct cdb_record {
+	const char *key;		/**< the key */
+	unsigned int keylen;		/**< length of key */
+	const char *data;		/**< the value */
+	unsigned int datalen;		/**< length of data */
+};
 
 extern const char *cdb_seekmm(int, const char *, unsigned int, char **, const struct stat *) ATTR_ACCESS(read_only, 2, 3);
+extern const char *cdb_find(const char *mm, const size_t size, const char *key, const unsigned int len,
+		unsigned int *datalen) __attribute__ ((nonnull (1, 3, 5))) ATTR_ACCESS(read_only, 3, 4);
+extern int cdb_make(int fd, const struct cdb_record *records, const unsigned int count);
 
 #endif
@@ -8,11 +8,24 @@
 
 struct in6_addr;
 
+/** @enum dns_prefetch_type
+ * @brief the record types that can be passed to dnsprefetch()
+ */
+enum dns_prefetch_type {
+	DNS_PREFETCH_A,		/**< A records, as looked up by dnsip4() */
+	DNS_PREFETCH_IP6,	/**< AAAA and A records, as looked up by dnsip6() */
+	DNS_PREFETCH_MX,	/**< MX records */
+	DNS_PREFETCH_TXT	/**< TXT records */
+};
+
 extern int dnsip4(char **out, size_t *len, const char *host) __attribute__ ((nonnull (1,2,3)));
 extern int dnsip6(char **out, size_t *len, const char *host) __attribute__ ((nonnull (1,2,3)));
 extern int dnstxt(char **, const char *) __attribute__ ((nonnull (1,2)));
 extern int dnstxt_records(char **, const char *) __attribute__ ((nonnull (1,2)));
 extern int dnsmx(char **out, size_t *len, const char *host) __attribute__ ((nonnull (1,2,3)));
 extern int dnsname(char **, const struct in6_addr *) __attribute__ ((nonnull (1,2)));
+extern void dnsprefetch(const char *host, const enum dns_prefetch_type type) __attribute__ ((nonnull (1)));
+
+extern unsigned long long dns_wait_ns;
 
 #endif
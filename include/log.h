@@ -6,6 +6,8 @@
 
 extern void log_writen(int priority, const char **s) __attribute__ ((nonnull (2)));
 extern void log_write(int priority, const char *s) __attribute__ ((nonnull (2)));
+extern void log_buffer_enable(const char *ident, int facility) __attribute__ ((nonnull (1)));
+extern void log_flush(void);
 /* this function has to be implemented by every program */
 extern void dieerror(int error) __attribute__ ((noreturn));
 
@@ -0,0 +1,100 @@
+/** \file metrics.h
+ \brief runtime metrics shared between all Qsmtpd and Qremote processes
+
+ The metrics live in a file that is mapped into every process. It is split
+ into slots, every process increments the counters in the slot of the CPU
+ it currently runs on using atomic operations, so no locking is needed. The
+ values of all slots are summed up when the metrics are read.
+
+ If the file does not exist or can't be mapped all functions that update
+ metrics do nothing.
+ */
+#ifndef QSMTP_METRICS_H
+#define QSMTP_METRICS_H
+
+#include <stdint.h>
+
+/** @brief the SMTP commands counted by Qsmtpd */
+enum metrics_command {
+	METRICS_CMD_NOOP = 0,
+	METRICS_CMD_QUIT,
+	METRICS_CMD_RSET,
+	METRICS_CMD_HELO,
+	METRICS_CMD_EHLO,
+	METRICS_CMD_MAIL,
+	METRICS_CMD_RCPT,
+	METRICS_CMD_DATA,
+	METRICS_CMD_STARTTLS,
+	METRICS_CMD_AUTH,
+	METRICS_CMD_VRFY,
+	METRICS_CMD_BDAT,
+	METRICS_CMD_POST,
+	METRICS_COMMANDS		/**< number of commands, must be last */
+};
+
+/** @brief the DNS query types that are counted */
+enum metrics_dns_type {
+	METRICS_DNS_A = 0,
+	METRICS_DNS_AAAA,
+	METRICS_DNS_MX,
+	METRICS_DNS_TXT,
+	METRICS_DNS_PTR,
+	METRICS_DNS_TYPES		/**< number of query types, must be last */
+};
+
+#define METRICS_FILTERS 32		/**< number of entries of rcpt_cbs that are counted */
+#define METRICS_VERDICTS 7		/**< number of filter results, FILTER_ERROR to FILTER_WHITELISTED */
+#define METRICS_QREMOTE_STATUS "rhsKZD"	/**< the status codes of Qremote that are counted */
+
+/** @brief the counters */
+enum metrics_counter {
+	METRIC_SMTPD_SESSIONS = 0,	/**< sessions accepted by Qsmtpd */
+	METRIC_SMTPD_COMMANDS,		/**< first of METRICS_COMMANDS command counters */
+	METRIC_SMTPD_FILTERS = METRIC_SMTPD_COMMANDS + METRICS_COMMANDS,	/**< first of the filter verdicts, METRICS_VERDICTS per filter */
+	METRIC_SMTPD_FILTER_TIME = METRIC_SMTPD_FILTERS + METRICS_FILTERS * METRICS_VERDICTS,	/**< first of METRICS_FILTERS counters of the time spent in a filter in nanoseconds */
+	METRIC_DNS_QUERIES = METRIC_SMTPD_FILTER_TIME + METRICS_FILTERS,	/**< first of METRICS_DNS_TYPES query counters */
+	METRIC_DNS_ERRORS = METRIC_DNS_QUERIES + METRICS_DNS_TYPES,	/**< first of METRICS_DNS_TYPES error counters */
+	METRIC_NET_BYTES_IN = METRIC_DNS_ERRORS + METRICS_DNS_TYPES,	/**< bytes read from the network */
+	METRIC_NET_BYTES_OUT,		/**< bytes written to the network */
+	METRIC_TLS_ACCEPT,		/**< successful TLS handshakes as server */
+	METRIC_TLS_ACCEPT_FAILED,	/**< failed TLS handshakes as server */
+	METRIC_TLS_CONNECT,		/**< successful TLS handshakes as client */
+	METRIC_TLS_CONNECT_FAILED,	/**< failed TLS handshakes as client */
+	METRIC_SMTPD_QUEUED,		/**< messages accepted by qmail-queue */
+	METRIC_SMTPD_QUEUE_ERRORS,	/**< messages rejected by qmail-queue or failures to run it */
+	METRIC_QREMOTE_STATUS,		/**< first of the Qremote status counters, order as in METRICS_QREMOTE_STATUS */
+	METRIC_COUNTERS = METRIC_QREMOTE_STATUS + sizeof(METRICS_QREMOTE_STATUS) - 1	/**< number of counters, must be last */
+};
+
+/** @brief the histograms */
+enum metrics_histogram {
+	METRIC_H_DNS = 0,		/**< first of METRICS_DNS_TYPES DNS latency histograms */
+	METRIC_H_SMTPD_SESSION = METRIC_H_DNS + METRICS_DNS_TYPES,	/**< duration of Qsmtpd sessions */
+	METRIC_H_QREMOTE_DELIVERY,	/**< duration of Qremote deliveries */
+	METRIC_HISTOGRAMS		/**< number of histograms, must be last */
+};
+
+#define METRICS_BUCKETS 10		/**< number of histogram buckets, without +Inf */
+
+extern const uint64_t metrics_bucket_bounds[METRICS_BUCKETS];
+
+extern int metrics_attach(void);
+extern void metrics_add(const enum metrics_counter counter, const uint64_t value);
+extern void metrics_observe(const enum metrics_histogram hist, const uint64_t ns);
+extern uint64_t metrics_get(const enum metrics_counter counter);
+
+extern int metrics_create(const char *path) __attribute__ ((nonnull (1)));
+extern int metrics_read(const char *path, uint64_t counters[METRIC_COUNTERS],
+		uint64_t hists[METRIC_HISTOGRAMS][METRICS_BUCKETS + 2]) __attribute__ ((nonnull (1, 2, 3)));
+
+/**
+ * @brief increment a counter by one
+ * @param counter the counter to increment
+ */
+static inline void
+metrics_inc(const enum metrics_counter counter)
+{
+	metrics_add(counter, 1);
+}
+
+#endif
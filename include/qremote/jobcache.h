@@ -0,0 +1,31 @@
+/** \file jobcache.h
+ \brief results shared between the deliveries of the Qremote scheduler
+ */
+#ifndef QREMOTE_JOBCACHE_H
+#define QREMOTE_JOBCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define JOBCACHE_SLOTS 512		/**< number of entries in the cache */
+#define JOBCACHE_PROBE 8		/**< number of slots searched for a given key */
+#define JOBCACHE_KEYLEN 320		/**< maximum length of a key including the trailing 0 byte */
+#define JOBCACHE_DATA 4096		/**< maximum length of the data of an entry */
+
+/** @struct jobcache_slot
+ @brief a single cached result
+ */
+struct jobcache_slot {
+	int32_t owner;			/**< process currently using the slot, 0 if the slot is not in use */
+	uint32_t len;			/**< length of data */
+	int64_t expires;		/**< the entry is invalid after this time, 0 if the slot is free */
+	char key[JOBCACHE_KEYLEN];	/**< the key of the entry */
+	unsigned char data[JOBCACHE_DATA];	/**< the cached data */
+} __attribute__ ((aligned (64)));
+
+extern int jobcache_init(void);
+extern ssize_t jobcache_get(const char *key, void *buf, const size_t len, const int remove) __attribute__ ((nonnull (1, 2)));
+extern void jobcache_put(const char *key, const void *data, const size_t len, const unsigned int ttl) __attribute__ ((nonnull (1, 2)));
+
+#endif
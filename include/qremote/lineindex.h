@@ -0,0 +1,37 @@
+/** \file lineindex.h
+ \brief index of the lines of a message for recoding decisions
+ */
+#ifndef QREMOTE_LINEINDEX_H
+#define QREMOTE_LINEINDEX_H
+
+#include <sys/types.h>
+
+/** @struct line_entry
+ * @brief information about one line of the indexed buffer
+ */
+struct line_entry {
+	off_t start;		/**< offset of the first character of the line */
+	off_t len;		/**< length of the line without the line ending */
+	off_t first8bit;	/**< offset of the first 8 bit character in the line, -1 if none */
+	unsigned int cnt8bit;	/**< number of lines with 8 bit characters before this one */
+	unsigned int cntlong;	/**< number of lines longer than 998 characters before this one */
+	unsigned int nextempty;	/**< index of the next empty line, starting with this one */
+};
+
+/** @struct line_index
+ * @brief the lines of a buffer
+ *
+ * The entry behind the last line has the start set to the length of the
+ * buffer and holds the total counts.
+ */
+struct line_index {
+	const char *buf;		/**< the indexed buffer */
+	unsigned int lines;		/**< number of lines */
+	struct line_entry *entries;	/**< lines + 1 entries */
+};
+
+extern int line_index_build(struct line_index *idx, const char *buf, const off_t len) __attribute__ ((nonnull (1,2)));
+extern void line_index_free(struct line_index *idx) __attribute__ ((nonnull (1)));
+extern int line_index_recode(const struct line_index *idx, const char *buf, const off_t len) __attribute__ ((nonnull (1,2)));
+
+#endif
@@ -0,0 +1,46 @@
+/** \file mxhealth.h
+ \brief shared cache of the connection health of remote mail exchangers
+ */
+#ifndef QREMOTE_MXHEALTH_H
+#define QREMOTE_MXHEALTH_H
+
+#include <qdns.h>
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#define MXHEALTH_MAGIC 0x51486331	/**< "QHc1", identifies a valid cache file */
+#define MXHEALTH_SLOTS 4096		/**< number of addresses tracked in the cache file */
+#define MXHEALTH_PROBE 8		/**< number of slots searched for a given address */
+#define MXHEALTH_BACKOFF_BASE 60	/**< seconds an address is skipped after the first failure */
+#define MXHEALTH_BACKOFF_MAX 3600	/**< upper limit for the backoff time in seconds */
+
+/** @struct mxhealth_slot
+ @brief health information of a single remote address
+ */
+struct mxhealth_slot {
+	struct in6_addr addr;		/**< the remote address, unspecified if the slot is free */
+	int64_t last_failure;		/**< time of the last failed attempt */
+	int64_t retry_after;		/**< address is considered dead until this time */
+	uint32_t failures;		/**< number of consecutive failures */
+	uint32_t reserved;		/**< padding, keep 0 */
+};
+
+/** @struct mxhealth_table
+ @brief layout of the shared cache file
+ */
+struct mxhealth_table {
+	uint32_t magic;			/**< MXHEALTH_MAGIC */
+	uint32_t slots;			/**< MXHEALTH_SLOTS */
+	struct mxhealth_slot slot[MXHEALTH_SLOTS];	/**< the entries */
+};
+
+extern int mxhealth_open(const char *fname) __attribute__ ((nonnull (1)));
+extern int mxhealth_reopen(void);
+extern void mxhealth_close(void);
+extern int mxhealth_dead(const struct in6_addr *addr, const int64_t now) __attribute__ ((nonnull (1)));
+extern void mxhealth_sort(struct ips **mx) __attribute__ ((nonnull (1)));
+extern void mxhealth_attempt(const struct in6_addr *addr) __attribute__ ((nonnull (1)));
+extern void mxhealth_result(const int failed);
+
+#endif
@@ -18,6 +18,8 @@ enum recode_reasons {
 };
 
 extern unsigned int need_recode(const char *, off_t);
+extern unsigned int prescan_msgdata(void);
+extern void free_msgindex(void);
 extern void send_data(unsigned int recodeflag);
 extern void send_bdat(unsigned int recodeflag);
 
@@ -30,6 +30,12 @@ extern void remote_common_setup(void);
  */
 extern int netget(const unsigned int terminate);
 
+/**
+ * @brief count a status code sent to qmail-rspawn in the runtime metrics
+ * @param code the status code, codes not in METRICS_QREMOTE_STATUS are ignored
+ */
+extern void count_status(const char code);
+
 /**
  * @brief write raw status message to qmail-rspawn
  * @param str the data to write
@@ -72,8 +78,14 @@ extern void write_status_raw_m(const char **strs, const unsigned int count) __at
  * @return if all recipients were rejected
  * @retval 1 all recipients were rejected, mail must not be sent
  * @retval 0 at least one recipient was accepted, send mail
+ *
+ * If the server supports PIPELINING the commands are only queued and 0 is
+ * returned. They are sent by envelope_flush() together with the DATA command
+ * or the first BDAT chunk, the replies are checked by envelope_replies().
  */
 extern int send_envelope(const unsigned int recodeflag, const char *sender, int rcptcount, char **rcpts);
+extern int envelope_flush(const char *tail, const size_t taillen);
+extern int envelope_replies(void);
 
 extern char *rhost;
 extern size_t rhostlen;
@@ -82,6 +94,7 @@ extern unsigned int smtpext;
 extern string heloname;
 #ifdef CHUNKING
 extern size_t chunksize;
+extern unsigned int chunkwindow;
 #endif
 extern char *clientcertbuf;
 extern struct in6_addr outgoingip;
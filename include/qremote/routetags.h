@@ -0,0 +1,27 @@
+/** \file routetags.h
+ \brief the settings of an entry in control/smtproutes.d
+ */
+#ifndef QREMOTE_ROUTETAGS_H
+#define QREMOTE_ROUTETAGS_H
+
+/** @brief the settings possible in a smtproutes.d file */
+enum route_tag {
+	ROUTE_RELAY,		/**< host to relay to */
+	ROUTE_PORT,		/**< port on the relay host */
+	ROUTE_CLIENTCERT,	/**< client certificate to use */
+	ROUTE_OUTGOINGIP,	/**< local IPv4 address to use */
+	ROUTE_OUTGOINGIP6,	/**< local IPv6 address to use */
+	ROUTE_TAGS		/**< number of settings */
+};
+
+extern const char *route_tags[ROUTE_TAGS];
+
+/**
+ * @brief find the setting of a line in a smtproutes.d file
+ * @param line the line in the form key=value
+ * @return the setting of the line
+ * @retval -1 the line is no valid setting
+ */
+extern int route_tag(const char *line) __attribute__ ((nonnull (1)));
+
+#endif
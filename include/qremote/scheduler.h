@@ -0,0 +1,40 @@
+/** \file scheduler.h
+ \brief long running delivery scheduler of Qremote
+ */
+#ifndef QREMOTE_SCHEDULER_H
+#define QREMOTE_SCHEDULER_H
+
+#include <sys/types.h>
+
+/**
+ * @brief parse the arguments of a delivery job
+ * @param buf the arguments, each terminated by a 0 byte
+ * @param len length of buf
+ * @param argv the arguments will be stored here, argv[0] is set to "Qremote"
+ * @return number of entries in argv
+ * @retval -EINVAL the request is not a valid job
+ * @retval -ENOMEM out of memory
+ *
+ * A job needs at least a host, a sender, and one recipient. The entries of
+ * argv point into buf, only the array itself has to be freed.
+ */
+extern int scheduler_job_args(char *buf, const size_t len, char ***argv) __attribute__ ((nonnull (1,3)));
+
+/**
+ * @brief run the delivery scheduler
+ * @param argc number of arguments in argv
+ * @param argv the command line options of the scheduler, starting with "-d"
+ * @param jobargc the number of arguments of the job will be stored here
+ * @param jobargv the arguments of the job will be stored here
+ * @retval 0 this is a child process that has to run the job
+ * @retval -1 the scheduler could not be started
+ *
+ * This only returns in the parent process if an error happens during
+ * startup. For every job a child process is forked that returns from this
+ * function with the message on file descriptor 0 and the connection to the
+ * client on file descriptor 1, so it can do the delivery just like a Qremote
+ * process that was started by qmail-rspawn.
+ */
+extern int scheduler_run(int argc, char **argv, int *jobargc, char ***jobargv) __attribute__ ((nonnull (2,3,4)));
+
+#endif
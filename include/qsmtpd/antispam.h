@@ -6,8 +6,42 @@
 
 #include <sys/types.h>
 
+/** @enum lookup_memo_kind
+ * @brief the kind of lookup a memo entry stores
+ */
+enum lookup_memo_kind {
+	MEMO_DNSBL,	/**< A lookup of an IP based DNSBL, txt is the TXT record */
+	MEMO_SPF,	/**< result of check_host(), txt is the SPF explanation */
+	MEMO_NAMEBL	/**< A lookup of a name based blocklist, txt is the TXT record */
+};
+
+/** @struct lookup_memo
+ * @brief the remembered result of a lookup done by the filters
+ *
+ * The DNS lookups are valid for the whole SMTP session: the remote host does
+ * not change, and the result of a DNS lookup does not depend on the
+ * recipient that triggered it. SPF results are only valid for the current
+ * transaction. Temporary errors are never remembered.
+ */
+struct lookup_memo {
+	enum lookup_memo_kind kind;	/**< what kind of lookup this was */
+	int result;		/**< result of the lookup */
+	char *name;		/**< the name that was looked up */
+	char *txt;		/**< additional text, may be NULL */
+	unsigned int has_txt:1;	/**< if txt has been set */
+};
+
 /* qsmtpd/antispam.c */
 
+extern void lookup_memo_enable(void);
+extern void lookup_memo_free(void);
+extern void lookup_memo_forget(const enum lookup_memo_kind kind);
+extern struct lookup_memo *lookup_memo_find(const enum lookup_memo_kind kind, const char *name) __attribute__ ((nonnull (2)));
+extern struct lookup_memo *lookup_memo_add(const enum lookup_memo_kind kind, const char *name, const int result) __attribute__ ((nonnull (2)));
+extern int lookup_memo_set_txt(struct lookup_memo *memo, const char *txt) __attribute__ ((nonnull (1)));
+extern int lookup_memo_dnsa(const enum lookup_memo_kind kind, const char *name, struct lookup_memo **memo) __attribute__ ((nonnull (2,3)));
+extern void lookup_memo_dnstxt(char **txt, const char *name, struct lookup_memo *memo) __attribute__ ((nonnull (1,2)));
+
 extern void dotip6(char *);
 extern int check_rbl(char *const *, char **) __attribute__ ((nonnull (1)));
 extern void tarpit(void);
@@ -0,0 +1,56 @@
+/** \file headerscan.h
+ \brief incremental analysis of the message header
+ */
+#ifndef HEADERSCAN_H
+#define HEADERSCAN_H
+
+#include <sys/types.h>
+
+#define MAXHOPS		100		/**< maximum number of "Received:" lines allowed in a mail (loop prevention) */
+
+/** @brief flags for the headers required by RfC 5322 */
+enum header_flags {
+	HEADER_HAS_DATE = 0x1,		/**< "Date:" header found */
+	HEADER_HAS_FROM = 0x2,		/**< "From:" header found */
+	HEADER_HAS_MSGID = 0x4		/**< "Message-Id:" header found */
+};
+
+/** @brief the results of the header analysis */
+enum header_result {
+	HDRSCAN_OK = 0,			/**< nothing special found */
+	HDRSCAN_HOPS,			/**< more than MAXHOPS "Received:" lines */
+	HDRSCAN_LOOP,			/**< "Delivered-To:" line with one of the recipients */
+	HDRSCAN_DUPLICATE,		/**< a header that may only be given once was found again */
+	HDRSCAN_8BIT			/**< unencoded 8 bit data in the header */
+};
+
+#define HDRSCAN_NAMELEN 16		/**< bytes of a header name that are kept for classification */
+#define HDRSCAN_VALUELEN 512		/**< bytes of a "Delivered-To:" value that are kept */
+
+/** \struct header_scan
+ \brief state of the header analysis of one message
+
+ The message data is passed in with hdrscan_feed() in spans of any size,
+ lines may end in LF or CRLF. Once the empty line ending the header was
+ seen or a result other than HDRSCAN_OK was found all further data is
+ ignored.
+ */
+struct header_scan {
+	unsigned int state;		/**< the position in the current line */
+	unsigned int hops;		/**< number of "Received:" lines */
+	unsigned int flags;		/**< the headers found, a combination of enum header_flags */
+	unsigned int check2822:1;	/**< if duplicate headers and 8 bit data should be detected */
+	unsigned int kind;		/**< classification of the current header line */
+	enum header_result result;	/**< the result of the analysis */
+	const char *hdrname;		/**< name of the duplicate header for HDRSCAN_DUPLICATE */
+	size_t namelen;			/**< length of the current header name */
+	size_t valuelen;		/**< length of the current "Delivered-To:" value */
+	char name[HDRSCAN_NAMELEN];	/**< the lowercased start of the current header name */
+	char value[HDRSCAN_VALUELEN];	/**< the start of the current "Delivered-To:" value */
+};
+
+extern void hdrscan_init(struct header_scan *hs, const int check2822) __attribute__ ((nonnull (1)));
+extern enum header_result hdrscan_feed(struct header_scan *hs, const char *buf, const size_t len) __attribute__ ((nonnull (1, 2)));
+extern int hdrscan_done(const struct header_scan *hs) __attribute__ ((nonnull (1)));
+
+#endif
@@ -4,6 +4,8 @@
 #ifndef QSMTPD_H
 #define QSMTPD_H
 
+#include <arena.h>
+#include <metrics.h>
 #include <qdns.h>
 #include <sstring.h>
 
@@ -23,6 +25,7 @@ struct smtpcomm {
 	unsigned int	flags;		/**< bit 1: this command takes arguments
 					     bit 2: this command allows lines > 512 chars (and will check this itself)
 					     bit 3: a space is required between commands and arguments */
+	enum metrics_command metric;	/**< the counter of this command in the runtime metrics */
 };
 
 /*! \struct xmitstat
@@ -75,12 +78,14 @@ extern int err_control2(const char *, const char *);
 extern void freedata(void);
 extern pid_t fork_clean();
 extern int pipe_move(int p[2], int target);
+extern pid_t spawn_piped(const char *prog, char *const argv[], int pipes[][2], const int *targets, const unsigned int count);
 void __attribute__ ((noreturn)) conn_cleanup(const int rc);
 
 #define EBOGUS 1002
 #define EDONE 1003
 
 extern TAILQ_HEAD(rcpt_list, recip) head;
+extern struct arena txarena;		/**< memory of the current mail transaction, released by freedata(), only used for data kept until then */
 
 /** \struct recip
  \brief list of recipients given for this transaction
@@ -90,6 +95,8 @@ extern TAILQ_HEAD(rcpt_list, recip) head;
  then permitted by MAXRCPT they will be _not_ stored here, every following one will be
  rejected with a temporary error anyway. Receipients that rejected the mail basing on
  their spam filter rules are stored here so cb_badcc() can take them into account.
+ All entries are also referenced from rcptset to look them up by address. The
+ entries and their addresses are allocated from txarena.
  */
 struct recip {
 	TAILQ_ENTRY(recip) entries;	/**< List. */
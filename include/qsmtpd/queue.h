@@ -7,9 +7,12 @@
 
 extern int queuefd_data; /**< fd to send message data to qmail-queue */
 extern int queuefd_hdr;  /**< fd to send header data to qmail-queue */
+extern unsigned long queueprespawn; /**< start qmail-queue once the first recipient is accepted */
 
 extern void queue_reset(void);
 extern int queue_init(void);
+extern void queue_prespawn(void);
+extern void queue_discard(void);
 extern int queue_envelope(const unsigned long msgsize, const int chunked);
 extern int queue_result(void);
 
@@ -0,0 +1,71 @@
+/** \file ratelimit.h
+ \brief shared per client connection limits
+ */
+#ifndef QSMTPD_RATELIMIT_H
+#define QSMTPD_RATELIMIT_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#define RATELIMIT_MAGIC 0x51524c32	/**< "QRL2", identifies a valid table file */
+#define RATELIMIT_SLOTS 16384		/**< number of clients tracked in the table file */
+#define RATELIMIT_TRACKED 4096		/**< number of running sessions whose process is known */
+#define RATELIMIT_PROBE 8		/**< number of slots searched for a given client */
+#define RATELIMIT_WINDOW 60		/**< length of the rate window in seconds */
+#define RATELIMIT_STALE 3600		/**< seconds without connection after which the session count is reset, for sessions not in the session list */
+
+/** @struct ratelimit_slot
+ @brief counters of a single client address or IPv6 network
+ */
+struct ratelimit_slot {
+	uint64_t key;			/**< the client as returned by ratelimit_key(), 0 if the slot is free */
+	uint64_t cur;			/**< window number in the upper, connections in the lower 32 bit */
+	uint64_t prev;			/**< the same for the previous window */
+	int64_t last;			/**< time of the last connection */
+	uint32_t sessions;		/**< number of currently running sessions */
+} __attribute__ ((aligned (64)));
+
+/** @struct ratelimit_session
+ @brief a running session, used to find sessions of processes that were killed
+ */
+struct ratelimit_session {
+	uint64_t key;			/**< the client as returned by ratelimit_key(), 0 if the entry is free */
+	int32_t pid;			/**< the process running the session, 0 if the entry is free */
+};
+
+/** @struct ratelimit_table
+ @brief layout of the shared table file
+ */
+struct ratelimit_table {
+	uint32_t magic;			/**< RATELIMIT_MAGIC */
+	uint32_t slots;			/**< RATELIMIT_SLOTS */
+	struct ratelimit_slot slot[RATELIMIT_SLOTS] __attribute__ ((aligned (64)));	/**< the entries */
+	struct ratelimit_session session[RATELIMIT_TRACKED];	/**< the running sessions */
+};
+
+/** @struct ratelimit_config
+ @brief the settings from control/ratelimit
+ */
+struct ratelimit_config {
+	const char *table;		/**< path of the table file */
+	unsigned long sessions;		/**< maximum concurrent sessions per client, 0 for unlimited */
+	unsigned long rate;		/**< maximum connections per client and minute, 0 for unlimited */
+};
+
+/** @enum ratelimit_result
+ @brief result of ratelimit_enter()
+ */
+enum ratelimit_result {
+	RATELIMIT_OK = 0,		/**< the connection is allowed */
+	RATELIMIT_SESSIONS,		/**< the client has too many concurrent sessions */
+	RATELIMIT_RATE			/**< the client connected too often recently */
+};
+
+extern int ratelimit_checkline(const char *line) __attribute__ ((nonnull (1)));
+extern int ratelimit_config(char **lines, struct ratelimit_config *cfg) __attribute__ ((nonnull (2)));
+extern int ratelimit_open(const struct ratelimit_config *cfg) __attribute__ ((nonnull (1)));
+extern void ratelimit_close(void);
+extern enum ratelimit_result ratelimit_enter(const struct in6_addr *addr, const int64_t now) __attribute__ ((nonnull (1)));
+extern void ratelimit_leave(void);
+
+#endif
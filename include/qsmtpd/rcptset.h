@@ -0,0 +1,30 @@
+/** \file rcptset.h
+ \brief hash set of the recipients of the current mail transaction
+ */
+#ifndef RCPTSET_H
+#define RCPTSET_H
+
+#include "qsmtpd.h"
+
+#include <sys/types.h>
+
+/** \struct rcpt_set
+ \brief open addressing hash set of the entries in the recipient list
+
+ The set is keyed on the normalized mail address: the local part is compared
+ exactly, the domain part is compared case insensitive. It only references
+ the entries of the recipient list, it never owns them.
+ */
+struct rcpt_set {
+	struct recip **slots;	/**< the entries, NULL for unused slots */
+	unsigned int size;	/**< number of slots, always a power of 2 */
+	unsigned int count;	/**< number of used slots */
+};
+
+extern struct rcpt_set rcptset;
+
+extern int rcptset_add(struct recip *r) __attribute__ ((nonnull (1)));
+extern struct recip *rcptset_find(const char *addr, const size_t len) __attribute__ ((nonnull (1)));
+extern void rcptset_clear(void);
+
+#endif
@@ -0,0 +1,71 @@
+/** \file timing.h
+ \brief per-session phase timing of Qsmtpd
+
+ Every phase of an SMTP session accumulates the time spent in it and how
+ often it was entered. The values are written as a single log line when the
+ connection is closed, see log_timing().
+ */
+
+#ifndef QSMTPD_TIMING_H
+#define QSMTPD_TIMING_H 1
+
+#include <stdint.h>
+#include <time.h>
+
+/** @brief the phases of a session that are timed */
+enum session_phase {
+	TIMING_CONNECT = 0,	/**< connsetup(): reverse lookup and connection checks */
+	TIMING_BANNER,		/**< greeting pause and writing the banner */
+	TIMING_HELO,		/**< HELO and EHLO */
+	TIMING_STARTTLS,	/**< STARTTLS including the TLS handshake */
+	TIMING_MAIL,		/**< MAIL FROM including MX and SPF lookups */
+	TIMING_SPF,		/**< the SPF check in MAIL FROM */
+	TIMING_RCPT,		/**< RCPT TO including user lookup and filters */
+	TIMING_RCPT_USER,	/**< user lookup in RCPT TO */
+	TIMING_DATA,		/**< DATA and BDAT, including TIMING_QUEUE */
+	TIMING_QUEUE,		/**< waiting for qmail-queue to finish */
+	TIMING_PHASES		/**< number of phases, must be last */
+};
+
+#define TIMING_FILTERS 32	/**< number of entries of rcpt_cbs that are timed separately */
+
+/** @brief accumulated timing values of one session, all times in nanoseconds */
+struct session_timing {
+	uint64_t start;				/**< when the session started */
+	uint64_t ns[TIMING_PHASES];		/**< time spent in the phases */
+	uint64_t dns_ns[TIMING_PHASES];		/**< time spent waiting for DNS replies in the phases */
+	unsigned int count[TIMING_PHASES];	/**< how often the phases were entered */
+	uint64_t filter_ns[TIMING_FILTERS];	/**< time spent in the recipient filters */
+	unsigned int filter_count[TIMING_FILTERS];	/**< how often the recipient filters were run */
+};
+
+extern struct session_timing sesstiming;
+
+/**
+ * @brief get a monotonic timestamp
+ * @return current time in nanoseconds
+ */
+static inline uint64_t
+timing_now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief account the time since start to the given phase
+ * @param phase the phase to account
+ * @param start the timestamp when the phase was entered
+ */
+static inline void
+timing_add(const enum session_phase phase, const uint64_t start)
+{
+	sesstiming.ns[phase] += timing_now() - start;
+	sesstiming.count[phase]++;
+}
+
+#endif
@@ -60,6 +60,12 @@ int userconf_load_configs(struct userconf *ds) __attribute__ ((nonnull (1)));
  * @param flags search flags
  * @return the type of the configuration entry returned
  * @retval <0 negative error code
+ *
+ * The file is read again on every call, i.e. for every filter and recipient
+ * that asks for it. The result is a single allocation that the caller must
+ * release with free() as soon as it is done with it. It is not taken from
+ * txarena on purpose: that would keep every buffer until the end of the
+ * transaction.
  */
 int userconf_get_buffer(const struct userconf *ds, const char *key, char ***values, checkfunc cf, const unsigned int flags) __attribute__ ((nonnull (1,2,3)));
 
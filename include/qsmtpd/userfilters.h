@@ -77,6 +77,32 @@ typedef enum filter_result (*rcpt_cb)(const struct userconf *ds, const char **lo
 extern rcpt_cb rcpt_cbs[];
 extern rcpt_cb late_rcpt_cbs[];
 
+/** @enum filter_cost
+ * @brief the expected cost of running a user filter
+ */
+enum filter_cost {
+	FILTER_COST_LOCAL = 0,		/**< only checks data already known and local configuration */
+	FILTER_COST_DNS = 1		/**< may need DNS lookups */
+};
+
+/* the inputs a filter looks at besides the user configuration */
+#define FILTER_DEP_CONNECTION 0x1	/**< remote IP, remote host name, TLS and authentication state */
+#define FILTER_DEP_HELO 0x2		/**< the HELO/EHLO argument */
+#define FILTER_DEP_SENDER 0x4		/**< the envelope sender and the MAIL FROM parameters */
+#define FILTER_DEP_RECIPIENT 0x8	/**< the current recipient and the previous ones */
+
+/** @struct rcpt_filter_info
+ * @brief properties of the filter at the same position in rcpt_cbs
+ */
+struct rcpt_filter_info {
+	const char *name;		/**< name of the filter for log messages */
+	unsigned int deps;		/**< FILTER_DEP_* flags */
+	enum filter_cost cost;		/**< expected cost */
+	unsigned int fixed:1;		/**< the filter must not be moved to another position */
+};
+
+extern const struct rcpt_filter_info rcpt_filter_info[];
+
 extern const char *blocktype[];
 
 extern void logwhitelisted(const char *, const int, const int);
@@ -0,0 +1,42 @@
+/** \file verdict.h
+ \brief shared cache of recent rejections per client address
+ */
+#ifndef QSMTPD_VERDICT_H
+#define QSMTPD_VERDICT_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#define VERDICT_MAGIC 0x51566331	/**< "QVc1", identifies a valid cache file */
+#define VERDICT_SLOTS 16384		/**< number of clients tracked in the cache file */
+#define VERDICT_PROBE 8			/**< number of slots searched for a given client */
+#define VERDICT_TTL 900			/**< seconds a rejection is remembered */
+#define VERDICT_THRESHOLD 3		/**< rejections after which connections are refused */
+
+/** @struct verdict_slot
+ @brief rejections of a single client address or IPv6 network
+ */
+struct verdict_slot {
+	struct in6_addr addr;		/**< the client address, unspecified if the slot is free */
+	int64_t expires;		/**< the entry is ignored after this time */
+	uint32_t rejects;		/**< number of rejections since the entry was created */
+	uint32_t filter;		/**< index of the filter that caused the last rejection */
+};
+
+/** @struct verdict_table
+ @brief layout of the shared cache file
+ */
+struct verdict_table {
+	uint32_t magic;			/**< VERDICT_MAGIC */
+	uint32_t slots;			/**< VERDICT_SLOTS */
+	struct verdict_slot slot[VERDICT_SLOTS];	/**< the entries */
+};
+
+extern int verdict_open(const char *fname) __attribute__ ((nonnull (1)));
+extern void verdict_close(void);
+extern int verdict_active(void);
+extern unsigned int verdict_check(const struct in6_addr *addr, const int64_t now, unsigned int *filter) __attribute__ ((nonnull (1, 3)));
+extern void verdict_reject(const struct in6_addr *addr, const unsigned int filter, const int64_t now) __attribute__ ((nonnull (1)));
+extern void verdict_accept(const struct in6_addr *addr) __attribute__ ((nonnull (1)));
+
+#endif
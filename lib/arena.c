@@ -0,0 +1,164 @@
+/** \file arena.c
+ \brief bump allocator for memory that is released all at once
+ */
+
+#include <arena.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** @brief the types with the strictest alignment requirements */
+union arena_align {
+	long double ld;
+	long long ll;
+	void *p;
+	void (*f)(void);
+};
+
+/** @brief header of a memory block of an arena */
+struct arena_block {
+	struct arena_block *next;	/**< the next older block */
+	size_t size;			/**< usable bytes in data */
+	union arena_align data[];	/**< the memory handed out */
+};
+
+#define ARENA_ALIGN (sizeof(union arena_align))	/**< alignment of all returned pointers */
+#define ARENA_DATASIZE (ARENA_BLOCKSIZE - sizeof(struct arena_block))	/**< usable bytes in a default block */
+
+/**
+ * @brief allocate a new block
+ * @param size usable bytes in the block
+ * @return the new block
+ * @retval NULL out of memory
+ */
+static struct arena_block *
+arena_block_new(const size_t size)
+{
+	struct arena_block *b = malloc(sizeof(*b) + size);
+
+	if (b != NULL)
+		b->size = size;
+
+	return b;
+}
+
+/**
+ * @brief get memory from an arena
+ * @param a the arena
+ * @param size number of bytes needed
+ * @return pointer to the memory, aligned for any type
+ * @retval NULL out of memory (errno is set)
+ *
+ * The memory stays valid until the next call to arena_reset() or arena_free().
+ * Requests larger than a quarter of a block get a block of their own, so they
+ * do not waste the space left in the current block.
+ */
+void *
+arena_alloc(struct arena *a, const size_t size)
+{
+	const size_t asize = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+
+	if (asize < size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if ((a->blocks != NULL) && (a->blocks->size - a->used >= asize)) {
+		void *r = (char *)a->blocks->data + a->used;
+
+		a->used += asize;
+		return r;
+	}
+
+	if (asize > ARENA_DATASIZE / 4) {
+		struct arena_block *b = arena_block_new(asize);
+
+		if (b == NULL)
+			return NULL;
+
+		/* put it behind the current block, it is full anyway */
+		if (a->blocks == NULL) {
+			b->next = NULL;
+			a->blocks = b;
+			a->used = asize;
+		} else {
+			b->next = a->blocks->next;
+			a->blocks->next = b;
+		}
+		return b->data;
+	}
+
+	struct arena_block *b = arena_block_new(ARENA_DATASIZE);
+
+	if (b == NULL)
+		return NULL;
+
+	b->next = a->blocks;
+	a->blocks = b;
+	a->used = asize;
+
+	return b->data;
+}
+
+/**
+ * @brief copy a string into an arena
+ * @param a the arena
+ * @param s the string to copy
+ * @param len length of s
+ * @return the 0-terminated copy
+ * @retval NULL out of memory (errno is set)
+ */
+char *
+arena_strndup(struct arena *a, const char *s, const size_t len)
+{
+	char *r = arena_alloc(a, len + 1);
+
+	if (r != NULL) {
+		memcpy(r, s, len);
+		r[len] = '\0';
+	}
+
+	return r;
+}
+
+/**
+ * @brief release all memory handed out by an arena
+ * @param a the arena
+ *
+ * One default sized block is kept to serve the next allocations, so an
+ * arena that is reset regularly does not need to call malloc() again
+ * unless it grows beyond a single block.
+ */
+void
+arena_reset(struct arena *a)
+{
+	struct arena_block *keep = NULL;
+
+	while (a->blocks != NULL) {
+		struct arena_block *b = a->blocks;
+
+		a->blocks = b->next;
+		if ((keep == NULL) && (b->size == ARENA_DATASIZE))
+			keep = b;
+		else
+			free(b);
+	}
+
+	if (keep != NULL)
+		keep->next = NULL;
+	a->blocks = keep;
+	a->used = 0;
+}
+
+/**
+ * @brief release all memory of an arena
+ * @param a the arena
+ */
+void
+arena_free(struct arena *a)
+{
+	arena_reset(a);
+	free(a->blocks);
+	a->blocks = NULL;
+}
@@ -7,6 +7,7 @@
 
 #include <errno.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -39,6 +40,86 @@ cdb_unpack(const char *buf)
 #endif
 }
 
+static inline void
+cdb_pack(char *buf, const uint32_t v)
+{
+	buf[0] = v & 0xff;
+	buf[1] = (v >> 8) & 0xff;
+	buf[2] = (v >> 16) & 0xff;
+	buf[3] = (v >> 24) & 0xff;
+}
+
+/**
+ * @brief search a key in a CDB database already mapped into memory
+ * @param mm the contents of the database
+ * @param size size of mm
+ * @param key key to search for
+ * @param len length of key
+ * @param datalen the length of the value will be stored here
+ * @returns cdb value belonging to that key
+ * @retval NULL no key found in database or error
+ *
+ * If the function returns NULL and errno is 0 there is no entry for key in
+ * the database. If the database is truncated or corrupt errno is set to
+ * EINVAL.
+ */
+const char *
+cdb_find(const char *mm, const size_t size, const char *key, const unsigned int len, unsigned int *datalen)
+{
+	if (size < 2048) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	errno = 0;
+	const uint32_t h = cdb_hash(key, len);
+	const uint32_t lenhash = cdb_unpack(mm + 8 * (h & 255) + 4);
+
+	if (lenhash == 0)
+		return NULL;
+
+	const uint32_t pos = cdb_unpack(mm + 8 * (h & 255));
+	uint32_t h2 = (h >> 8) % lenhash;
+
+	if ((pos > size) || (lenhash > (size - pos) / 8)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	for (uint32_t loop = 0; loop < lenhash; ++loop) {
+		const char *cur = mm + pos + 8 * h2;
+		const uint32_t poskd = cdb_unpack(cur + 4);
+
+		if (!poskd)
+			break;
+
+		if (cdb_unpack(cur) == h) {
+			if (poskd > size - 8) {
+				errno = EINVAL;
+				return NULL;
+			}
+
+			cur = mm + poskd;
+			const uint32_t klen = cdb_unpack(cur);
+			const uint32_t dlen = cdb_unpack(cur + 4);
+
+			if ((klen > size - poskd - 8) || (dlen > size - poskd - 8 - klen)) {
+				errno = EINVAL;
+				return NULL;
+			}
+
+			if ((klen == len) && (memcmp(cur + 8, key, len) == 0)) {
+				*datalen = dlen;
+				return cur + 8 + len;
+			}
+		}
+		if (++h2 == lenhash)
+			h2 = 0;
+	}
+
+	return NULL;
+}
+
 /**
  * perform cdb search on the given file
  *
@@ -71,38 +152,108 @@ cdb_seekmm(int fd, const char *key, unsigned int len, char **mm, const struct st
 		return NULL;
 	}
 
-	errno = 0;
-	uint32_t h = cdb_hash(key, len);
+	unsigned int datalen;
+	const char *res = cdb_find(*mm, st->st_size, key, len, &datalen);
 
-	uint32_t pos = 8 * (h & 255);
-	uint32_t lenhash = cdb_unpack(*mm + pos + 4);
+	if (res != NULL)
+		return res;
 
-	if (lenhash != 0) {
-		uint32_t h2 = (h >> 8) % lenhash;
+	err = errno;
+	munmap(*mm, st->st_size);
+	errno = err;
+	return NULL;
+}
 
-		pos = cdb_unpack(*mm + pos);
+/**
+ * @brief write a CDB database
+ * @param fd the file to write to
+ * @param records the entries of the database
+ * @param count number of entries in records
+ * @retval 0 the database was written
+ * @retval -EFBIG the database would exceed the 4 GiB limit of the format
+ * @retval -ENOMEM out of memory
+ * @retval <0 negative error code from write()
+ *
+ * The database is built in memory and written in one go, the caller is
+ * responsible for writing to a temporary file and renaming it to make the
+ * update atomic.
+ */
+int
+cdb_make(int fd, const struct cdb_record *records, const unsigned int count)
+{
+	unsigned int buckets[256] = { 0 };
+	uint64_t size = 2048;
 
-		for (uint32_t loop = 0; loop < lenhash; ++loop) {
-			char *cur = *mm + pos + 8 * h2;
-			uint32_t poskd = cdb_unpack(cur + 4);
+	for (unsigned int i = 0; i < count; i++) {
+		size += 8 + (uint64_t)records[i].keylen + records[i].datalen;
+		buckets[cdb_hash(records[i].key, records[i].keylen) & 255]++;
+	}
 
-			if (!poskd)
-				break;
+	/* every bucket gets a hash table with twice as many slots as entries */
+	const uint64_t tables = size;
+	size += 16 * (uint64_t)count;
+	if (size > UINT32_MAX)
+		return -EFBIG;
 
-			if (cdb_unpack(cur) == h) {
-				cur = *mm + poskd;
+	char *buf = calloc(1, size);
+	uint32_t *recpos = malloc((count + 1) * sizeof(*recpos));
+	if ((buf == NULL) || (recpos == NULL)) {
+		free(buf);
+		free(recpos);
+		return -ENOMEM;
+	}
 
-				if (cdb_unpack(cur) == len)
-					if (!strncmp(cur + 8, key, len))
-						return cur + 8 + len;
-			}
-			if (++h2 == lenhash)
-				h2 = 0;
+	uint32_t pos = 2048;
+	for (unsigned int i = 0; i < count; i++) {
+		recpos[i] = pos;
+		cdb_pack(buf + pos, records[i].keylen);
+		cdb_pack(buf + pos + 4, records[i].datalen);
+		memcpy(buf + pos + 8, records[i].key, records[i].keylen);
+		memcpy(buf + pos + 8 + records[i].keylen, records[i].data, records[i].datalen);
+		pos += 8 + records[i].keylen + records[i].datalen;
+	}
+
+	pos = tables;
+	for (unsigned int b = 0; b < 256; b++) {
+		const uint32_t slots = 2 * buckets[b];
+
+		cdb_pack(buf + 8 * b, pos);
+		cdb_pack(buf + 8 * b + 4, slots);
+
+		for (unsigned int i = 0; (i < count) && (buckets[b] > 0); i++) {
+			const uint32_t h = cdb_hash(records[i].key, records[i].keylen);
+
+			if ((h & 255) != b)
+				continue;
+
+			uint32_t h2 = (h >> 8) % slots;
+			while (cdb_unpack(buf + pos + 8 * h2 + 4) != 0)
+				if (++h2 == slots)
+					h2 = 0;
+
+			cdb_pack(buf + pos + 8 * h2, h);
+			cdb_pack(buf + pos + 8 * h2 + 4, recpos[i]);
 		}
+
+		pos += 8 * slots;
 	}
 
-	err = errno;
-	munmap(*mm, st->st_size);
-	errno = err;
-	return NULL;
+	free(recpos);
+
+	int ret = 0;
+	for (uint64_t off = 0; off < size; ) {
+		ssize_t r = write(fd, buf + off, size - off);
+
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			break;
+		}
+		off += r;
+	}
+
+	free(buf);
+
+	return ret;
 }
@@ -4,6 +4,8 @@
 
 #include <libowfatconn.h>
 
+#include <metrics.h>
+
 #include <byte.h>
 #include <dns.h>
 #include <errno.h>
@@ -12,8 +14,44 @@
 #include <stdlib.h>
 #include <stralloc.h>
 #include <string.h>
+#include <time.h>
 #include <uint16.h>
 
+unsigned long long dns_wait_ns;	/**< accumulated time spent waiting for DNS replies */
+
+/**
+ * @brief get a monotonic timestamp for dns_wait_ns
+ * @return current time in nanoseconds
+ */
+static unsigned long long
+dns_clock(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		return 0;
+
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief account a finished DNS query
+ * @param type the query type
+ * @param start when the query was started
+ * @param r the return code of the libowfat function
+ */
+static void
+dns_account(const enum metrics_dns_type type, const unsigned long long start, const int r)
+{
+	const unsigned long long ns = dns_clock() - start;
+
+	dns_wait_ns += ns;
+	metrics_inc(METRIC_DNS_QUERIES + type);
+	if (r < 0)
+		metrics_inc(METRIC_DNS_ERRORS + type);
+	metrics_observe(METRIC_H_DNS + type, ns);
+}
+
 /**
  * @brief handle the libowfat return codes
  *
@@ -74,7 +112,10 @@ dnsip6(char **out, size_t *len, const char *host)
 	if (!stralloc_copys(&fqdn, host))
 		return -1;
 
+	const unsigned long long start = dns_clock();
 	int r = dns_ip6(&sa, &fqdn);
+	dns_account(METRICS_DNS_AAAA, start, r);
+
 	free(fqdn.s);
 	return mangle_ip_ret(&sa, out, len, r);
 }
@@ -93,7 +134,10 @@ dnsip4(char **out, size_t *len, const char *host)
 {
 	const stralloc fqdn = const_stralloc_from_string(host);
 	stralloc sa = {.a = 0, .len = 0, .s = NULL};
+	const unsigned long long start = dns_clock();
 	int r = dns_ip4(&sa, &fqdn);
+	dns_account(METRICS_DNS_A, start, r);
+
 	return mangle_ip_ret(&sa, out, len, r);
 }
 
@@ -111,7 +155,10 @@ dnsmx(char **out, size_t *len, const char *host)
 {
 	const stralloc fqdn = const_stralloc_from_string(host);
 	stralloc sa = {.a = 0, .len = 0, .s = NULL};
+	const unsigned long long start = dns_clock();
 	int r = dns_mx(&sa, &fqdn);
+	dns_account(METRICS_DNS_MX, start, r);
+
 	return mangle_ip_ret(&sa, out, len, r);
 }
 
@@ -202,7 +249,9 @@ dnstxt_records(char **out, const char *host)
 {
 	stralloc sa = {.a = 0, .len = 0, .s = NULL};
 	const stralloc fqdn = const_stralloc_from_string(host);
+	const unsigned long long start = dns_clock();
 	int r = dns_txt2(&sa, &fqdn);
+	dns_account(METRICS_DNS_TXT, start, r);
 
 	if (r <= 0) {
 		free(sa.s);
@@ -228,7 +277,9 @@ dnstxt(char **out, const char *host)
 {
 	stralloc sa = {.a = 0, .len = 0, .s = NULL};
 	const stralloc fqdn = const_stralloc_from_string(host);
+	const unsigned long long start = dns_clock();
 	int r = dns_txt(&sa, &fqdn);
+	dns_account(METRICS_DNS_TXT, start, r);
 
 	if ((r != 0) || (sa.len == 0)) {
 		free(sa.s);
@@ -259,7 +310,9 @@ int
 dnsname(char **out, const struct in6_addr *ip)
 {
 	stralloc sa = {.a = 0, .len = 0, .s = NULL};
+	const unsigned long long start = dns_clock();
 	int r = dns_name6(&sa, (const char *)ip->s6_addr);
+	dns_account(METRICS_DNS_PTR, start, r);
 
 	if ((r != 0) || (sa.len == 0)) {
 		free(sa.s);
@@ -273,3 +326,65 @@ dnsname(char **out, const struct in6_addr *ip)
 	*out = sa.s;
 	return 0;
 }
+
+/**
+ * @brief send a single query to the resolver and forget about it
+ *
+ * @param servers the resolvers to query
+ * @param q the name to query in DNS packet format
+ * @param qtype the record type
+ */
+static void
+dns_prefetch_send(const char servers[256], const char *q, const char qtype[2])
+{
+	static const char localip[16];
+	struct dns_transmit tx;
+
+	memset(&tx, 0, sizeof(tx));
+	/* this sends the first UDP packet, the answer is never read */
+	(void) dns_transmit_start(&tx, servers, 1, q, qtype, localip);
+	dns_transmit_free(&tx);
+}
+
+/**
+ * @brief ask the resolver for a record that will be looked up soon
+ *
+ * @param host name to look up
+ * @param type the records to ask for
+ *
+ * This only sends the queries and returns immediately, it never waits for
+ * the answers. The caching resolver will then already have the answers (or
+ * at least is already fetching them) when the record is looked up with one
+ * of the other functions, so several queries can be resolved concurrently
+ * while the caller still does its lookups in the order it needs them.
+ * Errors are silently ignored, the real lookup will report them.
+ */
+void
+dnsprefetch(const char *host, const enum dns_prefetch_type type)
+{
+	char servers[256];
+	char *q = NULL;
+
+	if (dns_resolvconfip(servers) != 0)
+		return;
+	if (!dns_domain_fromdot(&q, host, strlen(host)))
+		return;
+
+	switch (type) {
+	case DNS_PREFETCH_A:
+		dns_prefetch_send(servers, q, DNS_T_A);
+		break;
+	case DNS_PREFETCH_IP6:
+		dns_prefetch_send(servers, q, DNS_T_AAAA);
+		dns_prefetch_send(servers, q, DNS_T_A);
+		break;
+	case DNS_PREFETCH_MX:
+		dns_prefetch_send(servers, q, DNS_T_MX);
+		break;
+	case DNS_PREFETCH_TXT:
+		dns_prefetch_send(servers, q, DNS_T_TXT);
+		break;
+	}
+
+	dns_domain_free(&q);
+}
@@ -1,15 +1,250 @@
 /** \file log.c
  \brief syslog interface
+
+ By default every message is written out immediately. After
+ log_buffer_enable() was called the messages are collected in a buffer of
+ the process and written in batches: when the buffer is full, when a
+ message of priority LOG_ERR or more severe is logged, when the oldest
+ message is older than LOG_MAXDELAY seconds, when log_flush() is called
+ (e.g. before waiting for network input), and on exit. Messages for syslog
+ are then sent to a non-blocking socket, if that can't keep up they are
+ dropped instead of stalling the process and the number of dropped
+ messages is logged later.
  */
 
 #include <log.h>
 
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifndef _PATH_LOG
+#define _PATH_LOG "/dev/log"
+#endif
+
+#define LOG_BUFSIZE 16384	/**< size of the buffer for pending messages */
+#define LOG_ENTRIES 128		/**< maximum number of pending messages */
+#define LOG_MAXDELAY 2		/**< maximum time in seconds a message is kept in the buffer */
+
+/** @brief the pending log messages */
+static struct {
+	unsigned int enabled:1;		/**< if messages are buffered at all */
+	unsigned int entries;		/**< number of pending messages */
+	size_t used;			/**< bytes used in text */
+	unsigned long dropped;		/**< messages that could not be sent to syslog */
+	int prio[LOG_ENTRIES];		/**< the priorities of the messages */
+	time_t stamp[LOG_ENTRIES];	/**< the times the messages were logged */
+	size_t end[LOG_ENTRIES];	/**< offset in text behind the newline of every message */
+	char text[LOG_BUFSIZE];		/**< the messages, each terminated by a newline */
+} logbuf;
+
+#ifdef USESYSLOG
+static int logsock = -1;		/**< datagram socket connected to syslogd */
+static const char *logident;		/**< program name for the messages */
+static int logfacility;			/**< syslog facility of the messages */
+#endif
+
+/**
+ * @brief write a single message immediately
+ * @param priority syslog priority
+ * @param s message to write
+ */
+static void
+log_direct(int priority, const char *s)
+{
+#ifdef USESYSLOG
+	syslog(priority, "%s", s);
+#else
+	(void)priority;
+#endif
+#ifndef NOSTDERR
+	write(2, s, strlen(s));
+#elif !defined(USESYSLOG) && defined(REALLY_NO_LOGGING)
+	(void) s;
+#endif
+}
+
+#ifdef USESYSLOG
+/**
+ * @brief send one message to syslog
+ * @param priority syslog priority
+ * @param stamp time the message was logged
+ * @param msg the message
+ * @param len length of msg
+ * @retval 0 the message was sent
+ * @retval -1 the socket would block, the message was not sent
+ */
+static int
+log_send(int priority, const time_t stamp, const char *msg, const size_t len)
+{
+	if (logsock >= 0) {
+		char hdr[128];
+		struct tm tm;
+		int hlen = snprintf(hdr, sizeof(hdr), "<%i>", priority | logfacility);
+
+		localtime_r(&stamp, &tm);
+		hlen += strftime(hdr + hlen, sizeof(hdr) - hlen, "%b %e %H:%M:%S ", &tm);
+		hlen += snprintf(hdr + hlen, sizeof(hdr) - hlen, "%s[%li]: ", logident, (long)getpid());
+		if ((size_t)hlen >= sizeof(hdr))
+			hlen = sizeof(hdr) - 1;
+
+		struct iovec iov[2] = {
+			{ .iov_base = hdr, .iov_len = hlen },
+			{ .iov_base = (char *)msg, .iov_len = len }
+		};
+		struct msghdr mh = {
+			.msg_iov = iov,
+			.msg_iovlen = 2
+		};
+
+		if (sendmsg(logsock, &mh, MSG_NOSIGNAL) >= 0)
+			return 0;
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ENOBUFS))
+			return -1;
+
+		/* syslogd is gone or was restarted, use the blocking interface from now on */
+		close(logsock);
+		logsock = -1;
+	}
+
+	syslog(priority, "%.*s", (int)len, msg);
+	return 0;
+}
+#endif
+
+/**
+ * @brief write all pending messages
+ *
+ * This does nothing if messages are not buffered.
+ */
+void
+log_flush(void)
+{
+	if (logbuf.entries == 0)
+		return;
+
+#ifdef USESYSLOG
+	if (logbuf.dropped != 0) {
+		char msg[64];
+		int len = snprintf(msg, sizeof(msg), "%lu log messages dropped", logbuf.dropped);
+
+		if (log_send(LOG_WARNING, logbuf.stamp[0], msg, len) == 0)
+			logbuf.dropped = 0;
+	}
+
+	for (unsigned int i = 0; i < logbuf.entries; i++) {
+		const size_t start = (i == 0) ? 0 : logbuf.end[i - 1];
+
+		/* the trailing newline is not sent to syslog */
+		if (log_send(logbuf.prio[i], logbuf.stamp[i], logbuf.text + start, logbuf.end[i] - start - 1) != 0) {
+			logbuf.dropped += logbuf.entries - i;
+			break;
+		}
+	}
+#endif
+#ifndef NOSTDERR
+	for (size_t off = 0; off < logbuf.used; ) {
+		ssize_t r = write(2, logbuf.text + off, logbuf.used - off);
+
+		if (r <= 0)
+			break;
+		off += r;
+	}
+#endif
+
+	logbuf.entries = 0;
+	logbuf.used = 0;
+}
+
+/**
+ * @brief add a message to the buffer
+ * @param priority syslog priority
+ * @param s array of message parts
+ * @retval 0 the message was added
+ * @retval -1 the message is too long for the buffer
+ */
+static int
+log_queue(int priority, const char **s)
+{
+	size_t len = 1;		/* the newline */
+	const time_t now = time(NULL);
+
+	for (unsigned int j = 0; s[j]; j++)
+		len += strlen(s[j]);
+	if (len > sizeof(logbuf.text))
+		return -1;
+
+	if ((logbuf.entries == LOG_ENTRIES) || (logbuf.used + len > sizeof(logbuf.text)))
+		log_flush();
+
+	char *p = logbuf.text + logbuf.used;
+
+	for (unsigned int j = 0; s[j]; j++) {
+		const size_t l = strlen(s[j]);
+
+		memcpy(p, s[j], l);
+		p += l;
+	}
+	/* log_write() callers may or may not add the newline themselves */
+	if ((p == logbuf.text + logbuf.used) || (*(p - 1) != '\n'))
+		*p++ = '\n';
+
+	logbuf.prio[logbuf.entries] = priority;
+	logbuf.stamp[logbuf.entries] = now;
+	logbuf.used = p - logbuf.text;
+	logbuf.end[logbuf.entries++] = logbuf.used;
+
+	/* errors are usually followed by termination of the process */
+	if ((priority <= LOG_ERR) || (now - logbuf.stamp[0] >= LOG_MAXDELAY))
+		log_flush();
+
+	return 0;
+}
+
+/**
+ * @brief buffer the log messages of this process
+ * @param ident the program name used for syslog
+ * @param facility the syslog facility
+ *
+ * The pending messages are written on exit(), a process that forks must
+ * call log_flush() before so the messages are not written twice.
+ */
+void
+log_buffer_enable(const char *ident, int facility)
+{
+#ifdef USESYSLOG
+	struct sockaddr_un sa = {
+		.sun_family = AF_UNIX,
+		.sun_path = _PATH_LOG
+	};
+
+	logident = ident;
+	logfacility = facility;
+
+	if (logsock < 0) {
+		logsock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if ((logsock >= 0) && (connect(logsock, (struct sockaddr *)&sa, sizeof(sa)) != 0)) {
+			close(logsock);
+			logsock = -1;
+		}
+	}
+#else
+	(void)ident;
+	(void)facility;
+#endif
+
+	if (!logbuf.enabled && (atexit(log_flush) != 0))
+		return;
+	logbuf.enabled = 1;
+}
+
 /**
  * combine line and write it to syslog
  *
@@ -19,6 +254,13 @@
 void
 log_writen(int priority, const char **s)
 {
+	if (logbuf.enabled) {
+		if (log_queue(priority, s) == 0)
+			return;
+		/* keep the order of the messages */
+		log_flush();
+	}
+
 	size_t i = 0;
 
 	for (unsigned int j = 0; s[j]; j++)
@@ -41,7 +283,7 @@ log_writen(int priority, const char **s)
 		buf[i++] = '\n';
 		buf[i] = '\0';
 	}
-	log_write(priority, buf);
+	log_direct(priority, buf);
 	free(buf);
 }
 
@@ -55,14 +297,13 @@ log_writen(int priority, const char **s)
 void
 log_write(int priority, const char *s)
 {
-#ifdef USESYSLOG
-	syslog(priority, "%s", s);
-#else
-	(void)priority;
-#endif
-#ifndef NOSTDERR
-	write(2, s, strlen(s));
-#elif !defined(USESYSLOG) && defined(REALLY_NO_LOGGING)
-	(void) s;
-#endif
+	const char *msg[] = { s, NULL };
+
+	if (logbuf.enabled) {
+		if (log_queue(priority, msg) == 0)
+			return;
+		log_flush();
+	}
+
+	log_direct(priority, s);
 }
@@ -0,0 +1,300 @@
+/** \file metrics.c
+ \brief runtime metrics shared between all Qsmtpd and Qremote processes
+ */
+
+#include <metrics.h>
+
+#include <qmaildir.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define METRICS_SLOTS 64		/**< number of slots, should be at least the number of CPUs */
+#define METRICS_VERSION 1		/**< version of the file layout */
+
+static const char metrics_magic[] = "QSMETRIC";
+
+/** @brief the counters of one CPU */
+struct metrics_slot {
+	uint64_t counters[METRIC_COUNTERS];
+	uint64_t hists[METRIC_HISTOGRAMS][METRICS_BUCKETS + 2];	/**< the buckets, +Inf, and the sum in microseconds */
+} __attribute__ ((aligned (64)));
+
+/** @brief layout of the metrics file */
+struct metrics_file {
+	char magic[8];
+	uint32_t version;
+	uint32_t slots;
+	uint32_t counters;
+	uint32_t histograms;
+	uint32_t buckets;
+	struct metrics_slot slot[METRICS_SLOTS] __attribute__ ((aligned (64)));
+};
+
+/** @brief upper bounds of the histogram buckets in microseconds */
+const uint64_t metrics_bucket_bounds[METRICS_BUCKETS] = {
+	1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000, 10000000, 60000000
+};
+
+static struct metrics_file *metrics;
+
+/**
+ * @brief check if the header of a metrics file matches this program
+ * @param m the mapped file
+ * @return if the header matches
+ */
+static int
+metrics_valid(const struct metrics_file *m)
+{
+	return (memcmp(m->magic, metrics_magic, sizeof(m->magic)) == 0) &&
+			(m->version == METRICS_VERSION) && (m->slots == METRICS_SLOTS) &&
+			(m->counters == METRIC_COUNTERS) && (m->histograms == METRIC_HISTOGRAMS) &&
+			(m->buckets == METRICS_BUCKETS);
+}
+
+/**
+ * @brief map a metrics file
+ * @param path name of the file
+ * @param flags flags for open()
+ * @return the mapped file
+ * @retval NULL the file could not be mapped or has the wrong format (errno is set)
+ */
+static struct metrics_file *
+metrics_map(const char *path, const int flags)
+{
+	int fd = open(path, flags | O_CLOEXEC);
+	struct stat st;
+
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) != 0) {
+		int e = errno;
+		close(fd);
+		errno = e;
+		return NULL;
+	}
+
+	if (st.st_size != sizeof(struct metrics_file)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	const int prot = ((flags & O_ACCMODE) == O_RDONLY) ? PROT_READ : (PROT_READ | PROT_WRITE);
+	struct metrics_file *m = mmap(NULL, sizeof(*m), prot, MAP_SHARED, fd, 0);
+
+	close(fd);
+	if (m == MAP_FAILED)
+		return NULL;
+
+	if (!metrics_valid(m)) {
+		munmap(m, sizeof(*m));
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return m;
+}
+
+/**
+ * @brief map the metrics file for updating
+ * @retval 0 the metrics file was mapped
+ * @retval <0 error code
+ *
+ * The name of the file is taken from the environment variable QSMTP_METRICS
+ * if it is set, otherwise the compiled in default is used. If this fails
+ * the metrics are not updated by this process.
+ */
+int
+metrics_attach(void)
+{
+	const char *path = getenv("QSMTP_METRICS");
+
+	if (metrics != NULL)
+		return 0;
+
+	metrics = metrics_map((path != NULL) ? path : METRICS_FILE, O_RDWR);
+
+	return (metrics == NULL) ? -errno : 0;
+}
+
+/**
+ * @brief get the slot to update for the current process
+ */
+static struct metrics_slot *
+metrics_slot(void)
+{
+#ifdef HAVE_SCHED_GETCPU
+	const int cpu = sched_getcpu();
+
+	if (cpu >= 0)
+		return metrics->slot + (cpu % METRICS_SLOTS);
+#endif
+	return metrics->slot + (getpid() % METRICS_SLOTS);
+}
+
+/**
+ * @brief increase a counter
+ * @param counter the counter to update
+ * @param value the value to add
+ */
+void
+metrics_add(const enum metrics_counter counter, const uint64_t value)
+{
+	if (metrics == NULL)
+		return;
+
+	__atomic_fetch_add(&metrics_slot()->counters[counter], value, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief record a value in a histogram
+ * @param hist the histogram to update
+ * @param ns the value to record in nanoseconds
+ */
+void
+metrics_observe(const enum metrics_histogram hist, const uint64_t ns)
+{
+	const uint64_t us = ns / 1000;
+	unsigned int b = 0;
+
+	if (metrics == NULL)
+		return;
+
+	while ((b < METRICS_BUCKETS) && (us > metrics_bucket_bounds[b]))
+		b++;
+
+	uint64_t *h = metrics_slot()->hists[hist];
+
+	__atomic_fetch_add(h + b, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(h + METRICS_BUCKETS + 1, us, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief get the current value of a counter
+ * @param counter the counter to read
+ * @return the sum of the counter over all processes
+ * @retval 0 the metrics file is not mapped
+ */
+uint64_t
+metrics_get(const enum metrics_counter counter)
+{
+	uint64_t r = 0;
+
+	if (metrics == NULL)
+		return 0;
+
+	for (unsigned int s = 0; s < METRICS_SLOTS; s++)
+		r += __atomic_load_n(&metrics->slot[s].counters[counter], __ATOMIC_RELAXED);
+
+	return r;
+}
+
+/**
+ * @brief create an empty metrics file
+ * @param path name of the file
+ * @retval 0 the file was created
+ * @retval <0 error code
+ *
+ * An existing file with a different layout is replaced, a file with a
+ * matching layout is kept so the values are not reset.
+ */
+int
+metrics_create(const char *path)
+{
+	struct metrics_file *m = metrics_map(path, O_RDONLY);
+
+	if (m != NULL) {
+		munmap(m, sizeof(*m));
+		return 0;
+	}
+
+	size_t plen = strlen(path);
+	char *tmpname = malloc(plen + 8);
+
+	if (tmpname == NULL)
+		return -ENOMEM;
+
+	memcpy(tmpname, path, plen);
+	memcpy(tmpname + plen, ".XXXXXX", 8);
+
+	int fd = mkstemp(tmpname);
+	if (fd < 0) {
+		int e = errno;
+		free(tmpname);
+		return -e;
+	}
+
+	struct metrics_file *hdr = calloc(1, sizeof(*hdr));
+	int r = 0;
+
+	if (hdr == NULL) {
+		r = -ENOMEM;
+	} else {
+		memcpy(hdr->magic, metrics_magic, sizeof(hdr->magic));
+		hdr->version = METRICS_VERSION;
+		hdr->slots = METRICS_SLOTS;
+		hdr->counters = METRIC_COUNTERS;
+		hdr->histograms = METRIC_HISTOGRAMS;
+		hdr->buckets = METRICS_BUCKETS;
+
+		if (write(fd, hdr, sizeof(*hdr)) != sizeof(*hdr))
+			r = -errno;
+		else if (fchmod(fd, 0664) != 0)
+			r = -errno;
+		free(hdr);
+	}
+
+	if ((close(fd) != 0) && (r == 0))
+		r = -errno;
+	if ((r == 0) && (rename(tmpname, path) != 0))
+		r = -errno;
+	if (r != 0)
+		unlink(tmpname);
+	free(tmpname);
+
+	return r;
+}
+
+/**
+ * @brief read the current values from a metrics file
+ * @param path name of the file
+ * @param counters the summed up counters are stored here
+ * @param hists the summed up histograms are stored here, the buckets are not cumulative
+ * @retval 0 the values were read
+ * @retval <0 error code
+ */
+int
+metrics_read(const char *path, uint64_t counters[METRIC_COUNTERS],
+		uint64_t hists[METRIC_HISTOGRAMS][METRICS_BUCKETS + 2])
+{
+	struct metrics_file *m = metrics_map(path, O_RDONLY);
+
+	if (m == NULL)
+		return -errno;
+
+	memset(counters, 0, sizeof(counters[0]) * METRIC_COUNTERS);
+	memset(hists, 0, sizeof(hists[0]) * METRIC_HISTOGRAMS);
+
+	for (unsigned int s = 0; s < METRICS_SLOTS; s++) {
+		const struct metrics_slot *slot = m->slot + s;
+
+		for (unsigned int i = 0; i < METRIC_COUNTERS; i++)
+			counters[i] += __atomic_load_n(&slot->counters[i], __ATOMIC_RELAXED);
+		for (unsigned int i = 0; i < METRIC_HISTOGRAMS; i++)
+			for (unsigned int b = 0; b < METRICS_BUCKETS + 2; b++)
+				hists[i][b] += __atomic_load_n(&slot->hists[i][b], __ATOMIC_RELAXED);
+	}
+
+	munmap(m, sizeof(*m));
+
+	return 0;
+}
@@ -5,6 +5,7 @@
 #include <netio.h>
 
 #include <log.h>
+#include <metrics.h>
 #include <ssl_timeoutio.h>
 #include <tls.h>
 
@@ -125,6 +126,10 @@ readinput(char *buffer, const size_t len, const int fatal)
 {
 	size_t retval;
 
+	/* the process will wait for the peer now, so this is a good time to
+	 * write out the pending log messages */
+	log_flush();
+
 	if (ssl) {
 		int r = ssl_timeoutread(timeout, buffer, len - 1);
 
@@ -180,6 +185,7 @@ readinput(char *buffer, const size_t len, const int fatal)
 		}
 	} else if (retval != (size_t) -1) {
 		buffer[retval] = '\0';
+		metrics_add(METRIC_NET_BYTES_IN, retval);
 	}
 	return retval;
 }
@@ -417,6 +423,7 @@ netnwrite(const char *s, const size_t l)
 				errno = -r;
 				return -1;
 			} else {
+				metrics_add(METRIC_NET_BYTES_OUT, l);
 				return 0;
 			}
 		}
@@ -445,6 +452,7 @@ netnwrite(const char *s, const size_t l)
 			}
 			p += r;
 		}
+		metrics_add(METRIC_NET_BYTES_OUT, l);
 		return 0;
 	}
 }
@@ -783,6 +791,7 @@ data_pending(void)
 			return -errno;
 		if (i > 0) {
 			linenlen = i;
+			metrics_add(METRIC_NET_BYTES_IN, i);
 			return 1;
 		}
 		return -ECONNRESET;
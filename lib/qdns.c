@@ -85,7 +85,15 @@ ask_dnsmx(const char *name, struct ips **result)
 		return 2;
 	}
 
-	char *s = r;
+	/* The addresses are looked up one after another below, let the resolver
+	 * work on all but the first one in the meantime. */
+	char *s = r + 3 + strlen(r + 2);
+	while (r + l > s) {
+		dnsprefetch(s + 2, DNS_PREFETCH_IP6);
+		s += 3 + strlen(s + 2);
+	}
+
+	s = r;
 	while (r + l > s) {
 		struct in6_addr *a;
 		int rc;
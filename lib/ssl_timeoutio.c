@@ -4,6 +4,7 @@
 
 #include <ssl_timeoutio.h>
 
+#include <metrics.h>
 #include <tls.h>
 
 #include <assert.h>
@@ -115,6 +116,7 @@ ssl_timeoutaccept(time_t t)
 		return -errno;
 	int r = ssl_timeoutio(SSL_accept, t, NULL, 0);
 
+	metrics_inc((r < 0) ? METRIC_TLS_ACCEPT_FAILED : METRIC_TLS_ACCEPT);
 	if (r < 0) {
 		ndelay_off(ssl_rfd);
 		ndelay_off(ssl_wfd);
@@ -142,6 +144,7 @@ ssl_timeoutconn(time_t t)
 		return -errno;
 	int r = ssl_timeoutio(SSL_connect, t, NULL, 0);
 
+	metrics_inc((r < 0) ? METRIC_TLS_CONNECT_FAILED : METRIC_TLS_CONNECT);
 	if (r < 0) {
 		/* keep nonblocking, the socket is closed anyway */
 		return r;
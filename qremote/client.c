@@ -92,6 +92,7 @@ checkreply(const char *status, const char **pre, const int mask)
 		}
 		if (!ignore) {
 			write_status_raw(status + m, 1);
+			count_status(status[m]);
 
 			if (pre && ((1 << m) & mask)) {
 				unsigned int pcount = 0;
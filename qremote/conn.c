@@ -9,6 +9,8 @@
 #include <netio.h>
 #include <qdns.h>
 #include <qremote/client.h>
+#include <qremote/jobcache.h>
+#include <qremote/mxhealth.h>
 #include <qremote/qremote.h>
 
 #include <arpa/inet.h>
@@ -16,6 +18,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <syslog.h>
@@ -23,6 +27,8 @@
 
 unsigned int targetport = 25;
 
+#define MXCACHE_TTL 60		/**< seconds a MX lookup is shared with other deliveries */
+
 #ifndef SOCK_CLOEXEC
 #define SOCK_CLOEXEC 0
 #endif /* SOCK_CLOEXEC */
@@ -138,12 +144,150 @@ tryconn(struct ips *mx, const struct in6_addr *outip4, const struct in6_addr *ou
 #endif
 			outip = outip4;
 
+		mxhealth_attempt(thisip->addr + cur_s);
 		sd = conn(thisip->addr[cur_s], outip);
 		if (sd >= 0) {
 			getrhost(thisip, cur_s);
 			return sd;
 		}
+
+		switch (-sd) {
+		case ECONNREFUSED:
+		case ETIMEDOUT:
+		case EHOSTUNREACH:
+		case ENETUNREACH:
+			mxhealth_result(1);
+			break;
+		default:
+			/* local errors say nothing about the remote host */
+			break;
+		}
+	}
+}
+
+/**
+ * @brief build the key for the MX list of a host in the job cache
+ * @param key the key is stored here
+ * @param remhost the target host
+ * @return if the key could be built
+ */
+static int
+mxcache_key(char key[JOBCACHE_KEYLEN], const char *remhost)
+{
+	const size_t len = strlen(remhost);
+
+	if (len + 4 > JOBCACHE_KEYLEN)
+		return 0;
+
+	memcpy(key, "mx:", 3);
+	memcpy(key + 3, remhost, len + 1);
+
+	return 1;
+}
+
+/**
+ * @brief share a MX list with the other deliveries
+ * @param remhost the target host
+ * @param mx the list as returned by ask_dnsmx()
+ *
+ * Every entry is stored as its priority, the number of addresses, the length
+ * of the name, the name and the addresses. Lists that do not fit into a cache
+ * entry are not shared.
+ */
+static void
+mxcache_put(const char *remhost, const struct ips *mx)
+{
+	unsigned char buf[JOBCACHE_DATA];
+	char key[JOBCACHE_KEYLEN];
+	size_t pos = 0;
+
+	if (!mxcache_key(key, remhost))
+		return;
+
+	for (; mx != NULL; mx = mx->next) {
+		const uint32_t prio = mx->priority;
+		const uint16_t cnt = mx->count;
+		const uint16_t nlen = (mx->name == NULL) ? 0 : strlen(mx->name);
+		const size_t alen = cnt * sizeof(*mx->addr);
+
+		if (pos + sizeof(prio) + sizeof(cnt) + sizeof(nlen) + nlen + alen > sizeof(buf))
+			return;
+
+		memcpy(buf + pos, &prio, sizeof(prio));
+		pos += sizeof(prio);
+		memcpy(buf + pos, &cnt, sizeof(cnt));
+		pos += sizeof(cnt);
+		memcpy(buf + pos, &nlen, sizeof(nlen));
+		pos += sizeof(nlen);
+		memcpy(buf + pos, mx->name, nlen);
+		pos += nlen;
+		memcpy(buf + pos, mx->addr, alen);
+		pos += alen;
+	}
+
+	jobcache_put(key, buf, pos, MXCACHE_TTL);
+}
+
+/**
+ * @brief get a MX list another delivery has looked up
+ * @param remhost the target host
+ * @return the MX list
+ * @retval NULL the list is not cached
+ */
+static struct ips *
+mxcache_get(const char *remhost)
+{
+	unsigned char buf[JOBCACHE_DATA];
+	char key[JOBCACHE_KEYLEN];
+	struct ips *res = NULL;
+	struct ips **tail = &res;
+	size_t pos = 0;
+
+	if (!mxcache_key(key, remhost))
+		return NULL;
+
+	const size_t len = jobcache_get(key, buf, sizeof(buf), 0);
+
+	while (pos < len) {
+		uint32_t prio;
+		uint16_t cnt;
+		uint16_t nlen;
+
+		memcpy(&prio, buf + pos, sizeof(prio));
+		pos += sizeof(prio);
+		memcpy(&cnt, buf + pos, sizeof(cnt));
+		pos += sizeof(cnt);
+		memcpy(&nlen, buf + pos, sizeof(nlen));
+		pos += sizeof(nlen);
+
+		struct ips *m = calloc(1, sizeof(*m));
+		if (m == NULL) {
+			freeips(res);
+			err_mem(0);
+		}
+		*tail = m;
+		tail = &m->next;
+
+		m->priority = prio;
+		m->count = cnt;
+		m->addr = malloc(cnt * sizeof(*m->addr));
+		if (nlen > 0)
+			m->name = malloc(nlen + 1);
+		if ((m->addr == NULL) || ((nlen > 0) && (m->name == NULL))) {
+			freeips(res);
+			err_mem(0);
+		}
+
+		if (nlen > 0) {
+			memcpy(m->name, buf + pos, nlen);
+			m->name[nlen] = '\0';
+			pos += nlen;
+		}
+		memcpy(m->addr, buf + pos, cnt * sizeof(*m->addr));
+		pos += cnt * sizeof(*m->addr);
 	}
+
+	return res;
 }
 
 /**
@@ -197,9 +341,13 @@ getmxlist(char *remhost, struct ips **mx)
 		err_mem(0);
 	}
 
+	if (!*mx)
+		*mx = mxcache_get(remhost);
+
 	if (!*mx) {
 		switch (ask_dnsmx(remhost, mx)) {
 		case 0:
+			mxcache_put(remhost, *mx);
 			break;
 		case 2: {
 			const char *msg[] = { "D5.1.10 only null MX exists for ",
@@ -9,14 +9,94 @@
 #include <qdns.h>
 #include <qremote/client.h>
 #include <qremote/greeting.h>
+#include <qremote/mxhealth.h>
 #include <qremote/qremote.h>
 #include <qremote/starttlsr.h>
 #include <qdns_dane.h>
 
 #include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
 #include <unistd.h>
 
+/** @brief the TLSA lookup for the current MX, running in a separate thread */
+static struct {
+	pthread_t thread;
+	char *name;			/**< the host the lookup is done for */
+	struct daneinfo *d;		/**< the TLSA records found */
+	int cnt;			/**< the return value of dnstlsa() */
+	unsigned int running:1;		/**< if the thread still needs to be joined */
+} tlsa;
+
+static void *
+tlsa_thread(void *arg __attribute__ ((unused)))
+{
+	tlsa.cnt = dnstlsa(tlsa.name, targetport, &tlsa.d);
+
+	return NULL;
+}
+
+/**
+ * @brief wait for the TLSA lookup to finish
+ * @return the result of dnstlsa()
+ */
+static int
+tlsa_wait(void)
+{
+	if (tlsa.running) {
+		pthread_join(tlsa.thread, NULL);
+		tlsa.running = 0;
+	}
+
+	return tlsa.cnt;
+}
+
+/**
+ * @brief free the result of the TLSA lookup
+ */
+static void
+tlsa_free(void)
+{
+	tlsa_wait();
+	daneinfo_free(tlsa.d, tlsa.cnt);
+	tlsa.d = NULL;
+	tlsa.cnt = 0;
+	free(tlsa.name);
+	tlsa.name = NULL;
+}
+
+/**
+ * @brief start the TLSA lookup for a host
+ * @param name the host name, may be NULL
+ *
+ * The lookup is run in the background so it overlaps with connecting to the
+ * host and the greeting, the result is only needed before STARTTLS. If the
+ * lookup for this host was already done before its result is kept.
+ */
+static void
+tlsa_start(const char *name)
+{
+	if ((name != NULL) && (tlsa.name != NULL) && (strcmp(name, tlsa.name) == 0))
+		return;
+
+	tlsa_free();
+	if (name == NULL)
+		return;
+
+	tlsa.name = strdup(name);
+	if (tlsa.name == NULL) {
+		tlsa.cnt = DNS_ERROR_LOCAL;
+		return;
+	}
+
+	if (pthread_create(&tlsa.thread, NULL, tlsa_thread, NULL) == 0)
+		tlsa.running = 1;
+	else
+		tlsa_thread(NULL);
+}
+
 /**
  * @brief send QUIT to the remote server if there still is a connection
  * @param error the negative error code of the last message
@@ -45,33 +125,26 @@ connection_died(void)
 	close(socketd);
 	socketd = -1;
 	log_writen(LOG_WARNING, logmsg);
+	mxhealth_result(1);
 }
 
 int
 connect_mx(struct ips *mx, const struct in6_addr *outip4, const struct in6_addr *outip6)
 {
-	struct daneinfo *d = NULL;
-	int tlsa = 0;
 	/* for all MX entries we got: try to enable connection, check if the SMTP server wants us
 	 * (sends 220 response) and EHLO/HELO succeeds. If not, try next. If none left, exit. */
 	do {
 		int flagerr = 0;
-		if (tlsa > 0) {
-			daneinfo_free(d, tlsa);
-			d = NULL;
-		}
 
-		/* query DNS before opening the socket, otherwise a long DNS timeout could lead to SMTP
-		 * socket timeout */
-		tlsa = (mx->name == NULL) ? 0 : dnstlsa(mx->name, targetport, &d);
+		tlsa_start(mx->name);
 
 		socketd = tryconn(mx, outip4, outip6);
 		if (socketd < 0) {
-			daneinfo_free(d, tlsa);
+			tlsa_free();
 			return socketd;
 		}
 		if (dup2(socketd, 0) < 0) {
-			daneinfo_free(d, tlsa);
+			tlsa_free();
 			net_conn_shutdown(shutdown_abort);
 		}
 
@@ -87,13 +160,14 @@ connect_mx(struct ips *mx, const struct in6_addr *outip4, const struct in6_addr
 				const char *dropmsg[] = { "invalid greeting from ", rhost, NULL };
 
 				log_writen(LOG_WARNING, dropmsg);
+				mxhealth_result(1);
 				quitmsg();
 				continue;
 				}
 			default:
 				/* something unexpected went wrong, assume that this is a local
 				 * problem that will eventually go away. */
-				daneinfo_free(d, tlsa);
+				tlsa_free();
 				net_conn_shutdown(shutdown_abort);
 			}
 		}
@@ -130,11 +204,15 @@ connect_mx(struct ips *mx, const struct in6_addr *outip4, const struct in6_addr
 				log_writen(LOG_WARNING, dropmsg);
 			}
 
+			mxhealth_result(1);
 			quitmsg_if_net(s);
 
 			continue;
 		}
 
+		/* the host is alive, problems from here on are not connection related */
+		mxhealth_result(0);
+
 		flagerr = greeting();
 		if (flagerr < 0) {
 			quitmsg_if_net(flagerr);
@@ -144,11 +222,13 @@ connect_mx(struct ips *mx, const struct in6_addr *outip4, const struct in6_addr
 		smtpext = flagerr;
 
 		if (smtpext & esmtp_starttls) {
-			flagerr = tls_init(d, tlsa);
+			const int cnt = tlsa_wait();
+
+			flagerr = tls_init(tlsa.d, cnt);
 			/* Local error, this would likely happen on the next host again.
 			 * Since it's a local fault stop trying and hope it gets fixed. */
 			if (flagerr < 0) {
-				daneinfo_free(d, tlsa);
+				tlsa_free();
 				net_conn_shutdown(shutdown_clean);
 			}
 
@@ -172,7 +252,7 @@ connect_mx(struct ips *mx, const struct in6_addr *outip4, const struct in6_addr
 
 			quitmsg();
 			continue;
-		} else if (tlsa > 0) {
+		} else if (tlsa_wait() > 0) {
 			const char *dropmsg[] = { "no STARTTLS offered by ", rhost, ", but TLSA record exists", NULL };
 
 			log_writen(LOG_WARNING, dropmsg);
@@ -182,7 +262,7 @@ connect_mx(struct ips *mx, const struct in6_addr *outip4, const struct in6_addr
 		}
 	} while (socketd < 0);
 
-	daneinfo_free(d, tlsa);
+	tlsa_free();
 
 	return 0;
 }
@@ -7,6 +7,73 @@
 #include <qremote/greeting.h>
 #include <qremote/qrdata.h>
 
+#include <stdlib.h>
+#include <string.h>
+
+static char *pending_cmds;		/**< pipelined envelope commands not yet sent */
+static size_t pending_len;		/**< length of pending_cmds */
+static int pending_replies = -1;	/**< number of RCPT replies still to read, -1 if nothing is pending */
+
+/**
+ * @brief queue the pipelined envelope commands
+ * @param netmsg the MAIL FROM command, NULL terminated
+ * @param rcptcount the number of recipients in rcpts
+ * @param rcpts the recipients
+ *
+ * The commands are not sent here, but together with the data that follows
+ * them in envelope_flush(), so the whole envelope and the DATA command or the
+ * first BDAT chunk go out in a single write.
+ */
+static void
+queue_envelope(const char **netmsg, const int rcptcount, char **rcpts)
+{
+	static const char rcpthead[] = "RCPT TO:<";
+	static const char rcpttail[] = ">\r\n";
+	size_t len = 2;	/* CRLF after MAIL FROM */
+
+	for (unsigned int i = 0; netmsg[i] != NULL; i++)
+		len += strlen(netmsg[i]);
+	for (int i = 0; i < rcptcount; i++)
+		len += strlen(rcpts[i]) + strlen(rcpthead) + strlen(rcpttail);
+
+	pending_replies = rcptcount;
+	pending_cmds = malloc(len);
+	if (pending_cmds == NULL) {
+		/* Combining into one buffer failed, send everything right now.
+		 * This needs more writes, but the replies are still only read
+		 * once all commands have been sent. */
+		net_writen(netmsg);
+		netmsg[0] = rcpthead;
+		netmsg[2] = ">";
+		netmsg[3] = NULL;
+		for (int i = 0; i < rcptcount; i++) {
+			netmsg[1] = rcpts[i];
+			net_writen(netmsg);
+		}
+		return;
+	}
+
+	char *p = pending_cmds;
+	for (unsigned int i = 0; netmsg[i] != NULL; i++) {
+		const size_t l = strlen(netmsg[i]);
+		memcpy(p, netmsg[i], l);
+		p += l;
+	}
+	*p++ = '\r';
+	*p++ = '\n';
+	for (int i = 0; i < rcptcount; i++) {
+		const size_t l = strlen(rcpts[i]);
+
+		memcpy(p, rcpthead, strlen(rcpthead));
+		p += strlen(rcpthead);
+		memcpy(p, rcpts[i], l);
+		p += l;
+		memcpy(p, rcpttail, strlen(rcpttail));
+		p += strlen(rcpttail);
+	}
+	pending_len = len;
+}
+
 int
 send_envelope(const unsigned int recodeflag, const char *sender, int rcptcount, char **rcpts)
 {
@@ -28,59 +95,105 @@ send_envelope(const unsigned int recodeflag, const char *sender, int rcptcount,
 	if (smtpext & esmtp_8bitmime) {
 		netmsg[lastmsg++] = (recodeflag & 1) ? " BODY=8BITMIME" : " BODY=7BIT";
 	}
+	netmsg[lastmsg] = NULL;
+
 	if (smtpext & esmtp_pipelining) {
-/* server allows PIPELINING: first send all the messages, then check the replies.
- * This allows to hide network latency. */
-		/* batch the first recipient with the from */
-		netmsg[lastmsg++] = "\r\nRCPT TO:<";
-		netmsg[lastmsg++] = rcpts[0];
-		netmsg[lastmsg++] = ">\r\n";
-		netmsg[lastmsg] = NULL;
-		net_write_multiline(netmsg);
-
-		lastmsg = 1;
-		netmsg[0] = "RCPT TO:<";
-		for (int i = 1; i < rcptcount; i++) {
-			netmsg[lastmsg++] = rcpts[i];
-			if ((i == rcptcount - 1) || ((i % 4) == 3)) {
-				netmsg[lastmsg++] = ">\r\n";
-				netmsg[lastmsg] = NULL;
-				net_write_multiline(netmsg);
-				lastmsg = 1;
-			} else {
-				netmsg[lastmsg++] = ">\r\nRCPT TO:<";
-			}
-		}
-/* MAIL FROM: reply */
-		if (checkreply(" ZD", mailerrmsg, 6) >= 300) {
-			for (int i = rcptcount; i > 0; i--)
-				checkreply(NULL, NULL, 0);
-			return 1;
-		}
-/* RCPT TO: replies */
-		for (int i = rcptcount; i > 0; i--) {
-			if (checkreply("rsh", NULL, 8) < 300)
-				rcptstat = 0;
-		}
-	} else {
+/* server allows PIPELINING: send all commands including DATA or the first
+ * BDAT chunk at once, then check the replies. This allows to hide network
+ * latency. The replies are read by envelope_replies(). */
+		queue_envelope(netmsg, rcptcount, rcpts);
+		return 0;
+	}
+
 /* server does not allow pipelining: we must do this one by one */
-		netmsg[lastmsg] = NULL;
+	net_writen(netmsg);
+
+	if (checkreply(" ZD", mailerrmsg, 6) >= 300)
+		return 1;
+
+	netmsg[0] = "RCPT TO:<";
+	netmsg[2] = ">";
+	netmsg[3] = NULL;
+
+	for (int i = 0; i < rcptcount; i++) {
+		netmsg[1] = rcpts[i];
 		net_writen(netmsg);
+		if (checkreply("rsh", NULL, 8) < 300)
+			rcptstat = 0;
+	}
 
-		if (checkreply(" ZD", mailerrmsg, 6) >= 300)
-			return 1;
+	return rcptstat;
+}
 
-		netmsg[0] = "RCPT TO:<";
-		netmsg[2] = ">";
-		netmsg[3] = NULL;
+/**
+ * @brief send the queued envelope together with the following data
+ * @param tail data to send directly behind the envelope, may be NULL
+ * @param taillen length of tail
+ * @return the result of netnwrite()
+ *
+ * If no envelope commands are queued only tail is sent.
+ */
+int
+envelope_flush(const char *tail, const size_t taillen)
+{
+	int ret = 0;
 
-		for (int i = 0; i < rcptcount; i++) {
-			netmsg[1] = rcpts[i];
-			net_writen(netmsg);
-			if (checkreply("rsh", NULL, 8) < 300)
-				rcptstat = 0;
+	if (pending_cmds == NULL)
+		return (tail != NULL) ? netnwrite(tail, taillen) : 0;
+
+	if (tail != NULL) {
+		char *buf = realloc(pending_cmds, pending_len + taillen);
+
+		if (buf != NULL) {
+			memcpy(buf + pending_len, tail, taillen);
+			pending_cmds = buf;
+			pending_len += taillen;
+			tail = NULL;
 		}
 	}
 
+	ret = netnwrite(pending_cmds, pending_len);
+	free(pending_cmds);
+	pending_cmds = NULL;
+	pending_len = 0;
+
+	if ((ret == 0) && (tail != NULL))
+		ret = netnwrite(tail, taillen);
+
+	return ret;
+}
+
+/**
+ * @brief read the replies to the pipelined envelope
+ * @return if all recipients were rejected
+ * @retval 1 the sender or all recipients were rejected, mail must not be sent
+ * @retval 0 at least one recipient was accepted or there was no pipelined envelope
+ *
+ * This must be called after envelope_flush(). The reply to any command sent
+ * as tail is not read.
+ */
+int
+envelope_replies(void)
+{
+	const char *mailerrmsg[] = { "Connected to ", rhost, " but sender was rejected\n", NULL };
+	int rcptstat = 1;	/* this means: all recipients have been rejected */
+	const int rcptcount = pending_replies;
+
+	if (rcptcount < 0)
+		return 0;
+	pending_replies = -1;
+
+/* MAIL FROM: reply */
+	if (checkreply(" ZD", mailerrmsg, 6) >= 300) {
+		for (int i = rcptcount; i > 0; i--)
+			checkreply(NULL, NULL, 0);
+		return 1;
+	}
+/* RCPT TO: replies */
+	for (int i = rcptcount; i > 0; i--) {
+		if (checkreply("rsh", NULL, 8) < 300)
+			rcptstat = 0;
+	}
+
 	return rcptstat;
 }
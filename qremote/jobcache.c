@@ -0,0 +1,190 @@
+/** \file jobcache.c
+ \brief results shared between the deliveries of the Qremote scheduler
+
+ The deliveries started by the scheduler run in forked processes, so a
+ result one of them has obtained is lost once it exits. This cache is
+ mapped into memory by the scheduler before any delivery is forked and is
+ inherited by all of them, so MX lookups and TLS sessions are shared between
+ the deliveries to the same destination.
+
+ Every slot is locked by the process using it. A process never waits for a
+ lock, a slot locked by someone else is treated like a cache miss. A lock
+ held by a process that was killed is taken over. If the scheduler is not
+ used the cache is never set up and all lookups miss.
+ */
+
+#include <qremote/jobcache.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static struct jobcache_slot *table;	/**< the shared slots */
+
+/**
+ * @brief set up the shared cache
+ * @retval 0 the cache is active
+ * @retval <0 negative error code, the cache remains inactive
+ *
+ * This must be called before the deliveries are forked.
+ */
+int
+jobcache_init(void)
+{
+	if (table != NULL)
+		return 0;
+
+	void *t = mmap(NULL, JOBCACHE_SLOTS * sizeof(*table), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (t == MAP_FAILED)
+		return -errno;
+
+	table = t;
+
+	return 0;
+}
+
+/**
+ * @brief calculate the first slot to look at for a key
+ */
+static unsigned int
+jobcache_hash(const char *key)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *key != '\0'; key++) {
+		h ^= (unsigned char)*key;
+		h *= 16777619u;
+	}
+
+	return h % JOBCACHE_SLOTS;
+}
+
+/**
+ * @brief try to lock a slot
+ * @param s the slot
+ * @param me the process id of this process
+ * @return if the slot is now locked by this process
+ */
+static int
+jobcache_lock(struct jobcache_slot *s, const int32_t me)
+{
+	int32_t owner = 0;
+
+	if (__atomic_compare_exchange_n(&s->owner, &owner, me, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return 1;
+
+	/* the owner was killed while holding the lock */
+	if ((kill(owner, 0) != 0) && (errno == ESRCH))
+		return __atomic_compare_exchange_n(&s->owner, &owner, me, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+static void
+jobcache_unlock(struct jobcache_slot *s)
+{
+	__atomic_store_n(&s->owner, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief look up a cached result
+ * @param key the key of the entry
+ * @param buf the data will be copied here
+ * @param len size of buf
+ * @param remove if the entry should be removed from the cache
+ * @return length of the data
+ * @retval 0 the key was not found
+ */
+ssize_t
+jobcache_get(const char *key, void *buf, const size_t len, const int remove)
+{
+	if ((table == NULL) || (strlen(key) >= JOBCACHE_KEYLEN))
+		return 0;
+
+	const unsigned int start = jobcache_hash(key);
+	const int32_t me = getpid();
+	const int64_t now = time(NULL);
+
+	for (unsigned int i = 0; i < JOBCACHE_PROBE; i++) {
+		struct jobcache_slot *s = table + (start + i) % JOBCACHE_SLOTS;
+
+		if (!jobcache_lock(s, me))
+			continue;
+
+		if ((s->expires < now) || (strcmp(s->key, key) != 0) || (s->len > len)) {
+			jobcache_unlock(s);
+			continue;
+		}
+
+		const ssize_t ret = s->len;
+
+		memcpy(buf, s->data, s->len);
+		if (remove)
+			s->expires = 0;
+		jobcache_unlock(s);
+
+		return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief store a result in the cache
+ * @param key the key of the entry
+ * @param data the data to store
+ * @param len length of data
+ * @param ttl number of seconds the entry remains valid
+ *
+ * An existing entry with the same key is replaced. Otherwise a free slot is
+ * preferred, then the one that expires first. Data that does not fit into a
+ * slot is not cached.
+ */
+void
+jobcache_put(const char *key, const void *data, const size_t len, const unsigned int ttl)
+{
+	const size_t keylen = strlen(key);
+
+	if ((table == NULL) || (keylen >= JOBCACHE_KEYLEN) || (len > JOBCACHE_DATA))
+		return;
+
+	const unsigned int start = jobcache_hash(key);
+	const int32_t me = getpid();
+	const int64_t now = time(NULL);
+	struct jobcache_slot *victim = NULL;
+
+	for (unsigned int i = 0; i < JOBCACHE_PROBE; i++) {
+		struct jobcache_slot *s = table + (start + i) % JOBCACHE_SLOTS;
+
+		if (!jobcache_lock(s, me))
+			continue;
+
+		if (strcmp(s->key, key) == 0) {
+			if (victim != NULL)
+				jobcache_unlock(victim);
+			victim = s;
+			break;
+		}
+
+		if ((victim == NULL) || (s->expires < victim->expires)) {
+			if (victim != NULL)
+				jobcache_unlock(victim);
+			victim = s;
+		} else {
+			jobcache_unlock(s);
+		}
+	}
+
+	if (victim == NULL)
+		return;
+
+	memcpy(victim->key, key, keylen + 1);
+	memcpy(victim->data, data, len);
+	victim->len = len;
+	victim->expires = now + ttl;
+	jobcache_unlock(victim);
+}
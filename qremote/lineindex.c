@@ -0,0 +1,195 @@
+/** \file lineindex.c
+ \brief index of the lines of a message for recoding decisions
+
+ need_recode() has to scan the whole buffer it is given. When a multipart
+ message is recoded this is done for the message, every part, and again
+ for every nested part. The index is built in one pass over the message
+ and then answers the same question for every line aligned range of the
+ message without looking at the data again.
+ */
+
+#include <qremote/lineindex.h>
+
+#include <qremote/qrdata.h>
+
+#include <errno.h>
+#include <stdlib.h>
+
+#define MAXLINELEN 998		/**< longest line permitted by RfC 5322 */
+
+/**
+ * @brief build the line index of a buffer
+ * @param idx the index to fill
+ * @param buf the buffer to index
+ * @param len length of buf
+ * @retval 0 the index was built
+ * @retval -ENOMEM out of memory
+ *
+ * The line endings are detected like need_recode() does: CR, LF, and CRLF
+ * each end a line.
+ */
+int
+line_index_build(struct line_index *idx, const char *buf, const off_t len)
+{
+	unsigned int size = 64;
+	unsigned int cnt8bit = 0;
+	unsigned int cntlong = 0;
+	off_t pos = 0;
+
+	idx->buf = buf;
+	idx->lines = 0;
+	idx->entries = malloc(size * sizeof(*idx->entries));
+	if (idx->entries == NULL)
+		return -ENOMEM;
+
+	while (pos < len) {
+		if (idx->lines + 1 == size) {
+			struct line_entry *n = realloc(idx->entries, 2 * size * sizeof(*n));
+
+			if (n == NULL) {
+				line_index_free(idx);
+				return -ENOMEM;
+			}
+			idx->entries = n;
+			size *= 2;
+		}
+
+		struct line_entry *e = idx->entries + idx->lines++;
+		off_t end = pos;
+
+		e->start = pos;
+		e->first8bit = -1;
+		e->cnt8bit = cnt8bit;
+		e->cntlong = cntlong;
+
+		while ((end < len) && (buf[end] != '\r') && (buf[end] != '\n')) {
+			if ((((signed char)buf[end]) <= 0) && (e->first8bit < 0))
+				e->first8bit = end - pos;
+			end++;
+		}
+
+		e->len = end - pos;
+		if (e->first8bit >= 0)
+			cnt8bit++;
+		if (e->len > MAXLINELEN)
+			cntlong++;
+
+		if (end < len) {
+			if ((buf[end] == '\r') && (end < len - 1) && (buf[end + 1] == '\n'))
+				end++;
+			end++;
+		}
+		pos = end;
+	}
+
+	struct line_entry *last = idx->entries + idx->lines;
+
+	last->start = len;
+	last->len = 0;
+	last->first8bit = -1;
+	last->cnt8bit = cnt8bit;
+	last->cntlong = cntlong;
+	last->nextempty = idx->lines;
+
+	/* an empty line always has a line ending, otherwise it would not exist */
+	for (unsigned int i = idx->lines; i > 0; i--) {
+		struct line_entry *e = idx->entries + i - 1;
+
+		e->nextempty = (e->len == 0) ? i - 1 : e[1].nextempty;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief free the memory of a line index
+ * @param idx the index to free
+ */
+void
+line_index_free(struct line_index *idx)
+{
+	free(idx->entries);
+	idx->entries = NULL;
+	idx->lines = 0;
+}
+
+/**
+ * @brief find the last line starting before a given offset
+ * @param idx the line index
+ * @param off the offset
+ * @return index of the line
+ */
+static unsigned int
+line_index_find(const struct line_index *idx, const off_t off)
+{
+	unsigned int lo = 0;
+	unsigned int hi = idx->lines;
+
+	/* entries[lo].start < off <= entries[hi].start */
+	while (hi - lo > 1) {
+		const unsigned int mid = lo + (hi - lo) / 2;
+
+		if (idx->entries[mid].start < off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/**
+ * @brief check if a part of the indexed buffer has to be recoded
+ * @param idx the line index
+ * @param buf start of the part to check
+ * @param len length of the part
+ * @return logical or of recode_reason flags, the same value need_recode() returns
+ * @retval -1 the part does not start at the beginning of an indexed line
+ */
+int
+line_index_recode(const struct line_index *idx, const char *buf, const off_t len)
+{
+	if ((idx->entries == NULL) || (buf < idx->buf))
+		return -1;
+
+	const off_t start = buf - idx->buf;
+	const off_t end = start + len;
+
+	if (len <= 0)
+		return 0;
+	if (end > idx->entries[idx->lines].start)
+		return -1;
+
+	const unsigned int i = line_index_find(idx, start + 1);
+	const unsigned int j = line_index_find(idx, end);
+	const struct line_entry *first = idx->entries + i;
+	const struct line_entry *last = idx->entries + j;
+
+	if (first->start != start)
+		return -1;
+
+	/* bytes of the last line inside the part, including the line ending */
+	const off_t lastbytes = end - last->start;
+	/* need_recode() notices a long line on the character after the 998th one */
+	const int lastlong = (last->len > MAXLINELEN) && (lastbytes > MAXLINELEN + 1);
+	const unsigned int e = first->nextempty;
+	int res = 0;
+
+	if ((last->cnt8bit != first->cnt8bit) ||
+			((last->first8bit >= 0) && (last->first8bit < lastbytes)))
+		res |= recode_8bit;
+
+	if (e < j) {
+		/* the header ends with line e inside the part */
+		if (idx->entries[e].cntlong != first->cntlong)
+			res |= recode_long_header;
+		if ((last->cntlong != idx->entries[e + 1].cntlong) || lastlong)
+			res |= recode_long_line;
+	} else {
+		/* if e is j the last line is empty and can't be long */
+		if ((last->cntlong != first->cntlong) || lastlong)
+			res |= recode_long_header;
+	}
+
+	return res;
+}
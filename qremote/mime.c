@@ -320,29 +320,42 @@ getfieldlen(const char *msg, const size_t len)
  * @param boundary boundary limit string
  * @return offset of first character behind next boundary
  * @retval 0 no boundary found
+ *
+ * This searches for "--boundary" using the Boyer-Moore-Horspool algorithm,
+ * so usually only a fraction of the bytes of a part have to be looked at.
  */
 off_t
 find_boundary(const char *buf, const off_t len, const cstring *boundary)
 {
-	off_t pos = 0;
+	const off_t m = boundary->len + 2;	/* length of "--" and the boundary */
+	off_t skip[256];
+	off_t q = 1;	/* start of the "--" that is checked, there must be a line break before */
 
 	if (len < (off_t) (boundary->len + 3))
 		return 0;
-	while (pos <= len - 3 - (off_t) boundary->len) {
-		if (((buf[pos] == '\r') || (buf[pos] == '\n')) && (buf[pos + 1] == '-') && (buf[pos + 2] == '-')) {
-			if (!strncmp(buf + pos + 3, boundary->s, boundary->len)) {
-				pos += 3 + boundary->len;
-				if ((pos == len) || WSPACE(buf[pos]))
-					return pos;
-				if (pos + 1 < len) {
-					if ((buf[pos] == '-') && (buf[pos + 1] == '-') &&
-							((pos + 2 == len) || (WSPACE(buf[pos + 2])))) {
-						return pos;
-					}
-				}
-			}
+
+	for (unsigned int i = 0; i < 256; i++)
+		skip[i] = m;
+	for (off_t i = 0; i < m - 1; i++)
+		skip[(unsigned char)((i < 2) ? '-' : boundary->s[i - 2])] = m - 1 - i;
+
+	const unsigned char lastc = (boundary->len > 0) ? boundary->s[boundary->len - 1] : '-';
+
+	while (q <= len - m) {
+		const unsigned char c = buf[q + m - 1];
+
+		if ((c == lastc) && (buf[q] == '-') && (buf[q + 1] == '-') &&
+				((buf[q - 1] == '\r') || (buf[q - 1] == '\n')) &&
+				(memcmp(buf + q + 2, boundary->s, boundary->len) == 0)) {
+			const off_t pos = q + m;
+
+			if ((pos == len) || WSPACE(buf[pos]))
+				return pos;
+			if ((pos + 1 < len) && (buf[pos] == '-') && (buf[pos + 1] == '-') &&
+					((pos + 2 == len) || (WSPACE(buf[pos + 2]))))
+				return pos;
 		}
-		pos++;
+		q += skip[c];
 	}
 	return 0;
 }
@@ -0,0 +1,347 @@
+/** \file mxhealth.c
+ \brief shared cache of the connection health of remote mail exchangers
+
+ Every Qremote instance is a short living process, so information about
+ remote hosts that refuse connections or do not send a proper greeting is
+ lost once the delivery has finished. This cache keeps that information in
+ a file mapped into memory by all running Qremote instances so a delivery
+ can try hosts known to work first and only fall back to the dead ones if
+ nothing else is left.
+ */
+
+#include <qremote/mxhealth.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static struct mxhealth_table *table;	/**< the mapped cache file */
+static int tablefd = -1;		/**< descriptor of the cache file, used for locking */
+static char *tablename;			/**< path of the cache file */
+static struct in6_addr current;		/**< address of the last connection attempt */
+static int current_valid;		/**< if current contains an address without a recorded result */
+
+/**
+ * @brief open the shared cache file
+ * @param fname path of the cache file
+ * @return if the cache could be opened
+ * @retval 0 the cache is active
+ * @retval <0 negative error code, the cache remains inactive
+ *
+ * The file is created if it does not exist yet. If the contents of the file
+ * are not recognized it is reinitialized.
+ */
+int
+mxhealth_open(const char *fname)
+{
+	struct stat st;
+	int err;
+
+	mxhealth_close();
+
+	tablename = strdup(fname);
+	if (tablename == NULL)
+		return -ENOMEM;
+
+	tablefd = open(fname, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (tablefd < 0) {
+		err = errno;
+		goto err_name;
+	}
+
+	if (flock(tablefd, LOCK_EX) != 0)
+		goto err;
+
+	if (fstat(tablefd, &st) != 0)
+		goto err;
+
+	if ((st.st_size != sizeof(*table)) && (ftruncate(tablefd, sizeof(*table)) != 0))
+		goto err;
+
+	table = mmap(NULL, sizeof(*table), PROT_READ | PROT_WRITE, MAP_SHARED, tablefd, 0);
+	if (table == MAP_FAILED) {
+		table = NULL;
+		goto err;
+	}
+
+	if ((table->magic != MXHEALTH_MAGIC) || (table->slots != MXHEALTH_SLOTS)) {
+		memset(table, 0, sizeof(*table));
+		table->magic = MXHEALTH_MAGIC;
+		table->slots = MXHEALTH_SLOTS;
+	}
+
+	flock(tablefd, LOCK_UN);
+
+	return 0;
+err:
+	err = errno;
+	close(tablefd);
+	tablefd = -1;
+err_name:
+	free(tablename);
+	tablename = NULL;
+	return -err;
+}
+
+/**
+ * @brief get an own lock on the cache after fork()
+ * @retval 0 the cache is inactive or has a new descriptor
+ * @retval <0 negative error code, the cache was closed
+ *
+ * The lock belongs to the open file, which a forked child shares with its
+ * parent and all its siblings, so it would not exclude them. The file is
+ * opened again, the mapping is kept.
+ */
+int
+mxhealth_reopen(void)
+{
+	struct stat oldst;
+	struct stat st;
+	int err;
+
+	if (table == NULL)
+		return 0;
+
+	const int fd = open(tablename, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		err = errno;
+		mxhealth_close();
+		return -err;
+	}
+
+	if ((fstat(tablefd, &oldst) != 0) || (fstat(fd, &st) != 0)) {
+		err = errno;
+		close(fd);
+		mxhealth_close();
+		return -err;
+	}
+
+	/* the file was replaced in between */
+	if ((st.st_dev != oldst.st_dev) || (st.st_ino != oldst.st_ino)) {
+		close(fd);
+		mxhealth_close();
+		return -ESTALE;
+	}
+
+	close(tablefd);
+	tablefd = fd;
+
+	return 0;
+}
+
+/**
+ * @brief release the shared cache
+ */
+void
+mxhealth_close(void)
+{
+	if (table != NULL) {
+		munmap(table, sizeof(*table));
+		table = NULL;
+	}
+	if (tablefd >= 0) {
+		close(tablefd);
+		tablefd = -1;
+	}
+	free(tablename);
+	tablename = NULL;
+	current_valid = 0;
+}
+
+/**
+ * @brief calculate the first slot to look at for an address
+ */
+static unsigned int
+mxhealth_hash(const struct in6_addr *addr)
+{
+	uint32_t h = 2166136261u;
+
+	for (unsigned int i = 0; i < sizeof(addr->s6_addr); i++) {
+		h ^= addr->s6_addr[i];
+		h *= 16777619u;
+	}
+
+	return h % MXHEALTH_SLOTS;
+}
+
+/**
+ * @brief find the slot of an address
+ * @param addr the address to search for
+ * @param create if a slot should be allocated when the address is not found
+ * @return the slot of the address
+ * @retval NULL the address is not in the cache
+ *
+ * When a new slot is allocated a free one is preferred, otherwise the one
+ * with the oldest retry time is reused.
+ */
+static struct mxhealth_slot *
+mxhealth_find(const struct in6_addr *addr, const int create)
+{
+	const unsigned int start = mxhealth_hash(addr);
+	struct mxhealth_slot *victim = NULL;
+
+	for (unsigned int i = 0; i < MXHEALTH_PROBE; i++) {
+		struct mxhealth_slot *s = table->slot + (start + i) % MXHEALTH_SLOTS;
+
+		if (IN6_ARE_ADDR_EQUAL(&s->addr, addr))
+			return s;
+
+		if (!create)
+			continue;
+
+		if (IN6_IS_ADDR_UNSPECIFIED(&s->addr)) {
+			if ((victim == NULL) || !IN6_IS_ADDR_UNSPECIFIED(&victim->addr))
+				victim = s;
+		} else if ((victim == NULL) || (!IN6_IS_ADDR_UNSPECIFIED(&victim->addr) &&
+				(s->retry_after < victim->retry_after))) {
+			victim = s;
+		}
+	}
+
+	if (victim != NULL) {
+		memset(victim, 0, sizeof(*victim));
+		victim->addr = *addr;
+	}
+
+	return victim;
+}
+
+/**
+ * @brief check if an address is currently considered dead
+ * @param addr the address to check
+ * @param now the current time
+ * @return if connections to this address should be avoided
+ */
+int
+mxhealth_dead(const struct in6_addr *addr, const int64_t now)
+{
+	if (table == NULL)
+		return 0;
+
+	const struct mxhealth_slot *s = mxhealth_find(addr, 0);
+
+	return (s != NULL) && (s->retry_after > now);
+}
+
+/**
+ * @brief move dead hosts to the end of the MX list
+ * @param mx the MX list as sorted by sortmx()
+ *
+ * Inside every entry the addresses that are considered dead are moved behind
+ * the working ones. Entries that have no working address left are moved to the
+ * end of the list. The relative order of the entries is kept otherwise, so the
+ * dead hosts are still tried if nothing else works.
+ */
+void
+mxhealth_sort(struct ips **mx)
+{
+	if (table == NULL)
+		return;
+
+	const int64_t now = time(NULL);
+	struct ips *good = NULL;
+	struct ips **goodtail = &good;
+	struct ips *dead = NULL;
+	struct ips **deadtail = &dead;
+
+	flock(tablefd, LOCK_SH);
+
+	struct ips *next = *mx;
+	while (next != NULL) {
+		struct ips *this = next;
+		unsigned short alive = 0;
+
+		next = this->next;
+		this->next = NULL;
+
+		for (unsigned short s = 0; s < this->count; s++) {
+			if (mxhealth_dead(this->addr + s, now))
+				continue;
+
+			if (s != alive) {
+				struct in6_addr tmp = this->addr[s];
+
+				memmove(this->addr + alive + 1, this->addr + alive,
+						(s - alive) * sizeof(*this->addr));
+				this->addr[alive] = tmp;
+			}
+			alive++;
+		}
+
+		if (alive > 0) {
+			*goodtail = this;
+			goodtail = &this->next;
+		} else {
+			*deadtail = this;
+			deadtail = &this->next;
+		}
+	}
+
+	flock(tablefd, LOCK_UN);
+
+	*goodtail = dead;
+	*mx = good;
+}
+
+/**
+ * @brief record the address a connection is attempted to
+ * @param addr the remote address
+ *
+ * The result of the attempt is later reported with mxhealth_result().
+ */
+void
+mxhealth_attempt(const struct in6_addr *addr)
+{
+	current = *addr;
+	current_valid = 1;
+}
+
+/**
+ * @brief record the result of the current connection attempt
+ * @param failed if the connection attempt failed
+ *
+ * A failure increases the backoff time of the remote address, a success
+ * removes it from the cache. If no attempt is pending this does nothing.
+ */
+void
+mxhealth_result(const int failed)
+{
+	if (!current_valid)
+		return;
+	current_valid = 0;
+
+	if (table == NULL)
+		return;
+
+	flock(tablefd, LOCK_EX);
+
+	struct mxhealth_slot *s = mxhealth_find(&current, failed);
+
+	if (s == NULL) {
+		/* success for an address not in the cache, nothing to do */
+	} else if (failed) {
+		const int64_t now = time(NULL);
+		unsigned int shift = s->failures;
+		int64_t backoff;
+
+		if (shift > 6)
+			shift = 6;
+		backoff = (int64_t)MXHEALTH_BACKOFF_BASE << shift;
+		if (backoff > MXHEALTH_BACKOFF_MAX)
+			backoff = MXHEALTH_BACKOFF_MAX;
+
+		s->failures++;
+		s->last_failure = now;
+		s->retry_after = now + backoff;
+	} else {
+		memset(s, 0, sizeof(*s));
+	}
+
+	flock(tablefd, LOCK_UN);
+}
@@ -4,6 +4,7 @@
 #include <log.h>
 #include <netio.h>
 #include <qremote/client.h>
+#include <qremote/greeting.h>
 #include <qremote/qremote.h>
 
 #include <stdlib.h>
@@ -11,6 +12,25 @@
 #include <syslog.h>
 
 size_t chunksize;	/**< the maximum allowed size for an outgoing send buffer in BDAT mode */
+unsigned int chunkwindow;	/**< the maximum number of BDAT chunks sent without waiting for a reply */
+
+/**
+ * @brief stop sending chunks after an error
+ * @param chunkbuf the chunk buffer to free
+ * @param outstanding the number of chunks that were sent without reading the reply
+ *
+ * The replies of the chunks still in flight are read and ignored, the error
+ * has already been reported. Afterwards the connection is closed.
+ */
+static void __attribute__ ((noreturn))
+bdat_abort(char *chunkbuf, unsigned int outstanding)
+{
+	while (outstanding-- > 0)
+		checkreply(NULL, NULL, 0);
+
+	free(chunkbuf);
+	net_conn_shutdown(shutdown_clean);
+}
 
 /**
  * send the message data as binary chunk
@@ -21,6 +41,9 @@ void
 send_bdat(unsigned int recodeflag)
 {
 	int bare_cr_warning = 0;
+	unsigned int outstanding = 0;	/* chunks sent without reading the reply */
+	/* chunks may only be pipelined if the server supports it */
+	const unsigned int window = ((smtpext & esmtp_pipelining) && (chunkwindow > 1)) ? chunkwindow : 1;
 
 	char *chunkbuf = malloc(chunksize);
 
@@ -29,6 +52,8 @@ send_bdat(unsigned int recodeflag)
 		send_data(recodeflag);
 		return;
 	}
+	/* the message is sent as is, the line index is only used for recoding */
+	free_msgindex();
 
 	successmsg[2] = "chunked ";
 	/* calculate length needed to send out the "BDAT <len>" stuff */
@@ -123,19 +148,33 @@ send_bdat(unsigned int recodeflag)
 			chunkbuf[lenlen - 2] = '\r';
 			chunkbuf[lenlen - 1] = '\n';
 		}
-		netnwrite(chunkbuf + hl, len - hl);
-		if (off != msgsize) {
+		/* the first chunk is sent together with a pipelined envelope */
+		envelope_flush(chunkbuf + hl, len - hl);
+		outstanding++;
+
+		/* If the server supports PIPELINING keep up to window chunks in
+		 * flight before waiting for a reply. The reply to the last chunk
+		 * is checked separately below. */
+		const unsigned int keep = (off == msgsize) ? 1 : window - 1;
+		if ((off != msgsize) && (outstanding <= keep))
+			continue;
+
 #ifdef DEBUG_IO
-			in_data = 0;
+		in_data = 0;
 #endif
-			if (checkreply(" ZD", NULL, 0) != 250) {
-				free(chunkbuf);
-				net_conn_shutdown(shutdown_clean);
-			}
+		if (envelope_replies() != 0) {
+			/* all recipients were rejected, discard the BDAT replies */
+			bdat_abort(chunkbuf, outstanding);
+		}
+
+		while (outstanding > keep) {
+			outstanding--;
+			if (checkreply(" ZD", NULL, 0) != 250)
+				bdat_abort(chunkbuf, outstanding);
+		}
 #ifdef DEBUG_IO
-			in_data = 1;
+		in_data = 1;
 #endif
-		}
 	}
 #ifdef DEBUG_IO
 	in_data = 0;
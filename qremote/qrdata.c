@@ -13,12 +13,14 @@
 #include <netio.h>
 #include <qremote/client.h>
 #include <qremote/greeting.h>
+#include <qremote/lineindex.h>
 #include <qremote/mime.h>
 #include <qremote/qremote.h>
 #include <version.h>
 
 #include <assert.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
@@ -31,6 +33,7 @@ const char *successmsg[] = {NULL, " accepted ", NULL, "message", "", "", "./Remo
 const char *msgdata = MAP_FAILED;		/* message will be mmaped here */
 off_t msgsize;		/* size of the mmaped area */
 static int lastlf = 1;		/* set if last byte sent was a LF */
+static struct line_index msgindex;	/* line index of msgdata while it is recoded */
 
 /**
  * check if buffer has to be recoded for SMTP transfer
@@ -75,6 +78,57 @@ need_recode(const char *buf, off_t len)
 	return res;
 }
 
+/**
+ * @brief scan the message before it is sent
+ * @return logical or of recode_reason flags for the whole message
+ *
+ * If the message has long lines it must be recoded when sent with DATA, so
+ * the line index is built, too. Whether 8 bit data needs recoding depends on
+ * the extensions of the remote host, send_data() builds the index itself
+ * once it knows. This only reads msgdata and does not send anything, so it
+ * can run in a helper thread while the connection is set up.
+ */
+unsigned int
+prescan_msgdata(void)
+{
+	const unsigned int recodeflag = need_recode(msgdata, msgsize);
+
+	/* if this fails send_data() will try again if it needs the index */
+	if (recodeflag & recode_long)
+		(void) line_index_build(&msgindex, msgdata, msgsize);
+
+	return recodeflag;
+}
+
+/**
+ * @brief free the line index built by prescan_msgdata()
+ *
+ * This is needed if the message is not sent with send_data().
+ */
+void
+free_msgindex(void)
+{
+	line_index_free(&msgindex);
+}
+
+/**
+ * @brief check if a part of the message has to be recoded
+ *
+ * @param buf start of the part
+ * @param len length of the part
+ * @return logical or of recode_reason flags
+ *
+ * This gives the same result as need_recode(), but uses the line index of
+ * the message if the part starts at the beginning of a line.
+ */
+static unsigned int
+part_recode(const char *buf, const off_t len)
+{
+	const int r = line_index_recode(&msgindex, buf, len);
+
+	return (r >= 0) ? (unsigned int)r : need_recode(buf, len);
+}
+
 /**
  * send message body, only fix broken line endings if present
  *
@@ -274,7 +328,7 @@ wrap_header(const char *buf, const off_t len)
 	off_t off = 0;	/* start of current line relative to pos */
 	off_t ll = 0;	/* length of current line */
 
-	if (!(need_recode(buf, len) & recode_long_header)) {
+	if (!(part_recode(buf, len) & recode_long_header)) {
 		send_plain(buf, len);
 		return;
 	}
@@ -388,7 +442,7 @@ qp_header(const char *buf, const off_t len, cstring *boundary, int *multipart, c
 		header = len;
 	}
 
-	if (need_recode(buf, header) & recode_8bit) {
+	if (part_recode(buf, header) & recode_8bit) {
 		/* no empty line found: treat whole message as header. But this means we have
 		 * 8bit characters in header which is a bug in the client that we can't handle */
 		write_status("D5.6.3 message contains unencoded 8bit data in message header");
@@ -422,6 +476,101 @@ qp_header(const char *buf, const off_t len, cstring *boundary, int *multipart, c
 	return header;
 }
 
+/** @enum qp_class
+ * @brief how a character is handled by recode_qp()
+ */
+enum qp_class {
+	QP_PLAIN = 0,	/**< printable character that can be copied */
+	QP_SPACE,	/**< space or tab, needs recoding at the end of a line */
+	QP_ESCAPE,	/**< character that always needs recoding */
+	QP_CR,		/**< carriage return */
+	QP_LF		/**< line feed */
+};
+
+#define P QP_PLAIN
+#define S QP_SPACE
+#define E QP_ESCAPE
+static const unsigned char qp_class[256] = {
+	E, E, E, E, E, E, E, E, E, S, QP_LF, E, E, QP_CR, E, E,
+	E, E, E, E, E, E, E, E, E, E, E, E, E, E, E, E,
+	S, P, P, P, P, P, P, P, P, P, P, P, P, P, P, P,
+	P, P, P, P, P, P, P, P, P, P, P, P, P, E, P, P,	/* '=' */
+	P, P, P, P, P, P, P, P, P, P, P, P, P, P, P, P,
+	P, P, P, P, P, P, P, P, P, P, P, P, P, P, P, P,
+	P, P, P, P, P, P, P, P, P, P, P, P, P, P, P, P,
+	P, P, P, P, P, P, P, P, P, P, P, P, P, P, P, E,	/* DEL */
+	E, E, E, E, E, E, E, E, E, E, E, E, E, E, E, E,
+	E, E, E, E, E, E, E, E, E, E, E, E, E, E, E, E,
+	E, E, E, E, E, E, E, E, E, E, E, E, E, E, E, E,
+	E, E, E, E, E, E, E, E, E, E, E, E, E, E, E, E,
+	E, E, E, E, E, E, E, E, E, E, E, E, E, E, E, E,
+	E, E, E, E, E, E, E, E, E, E, E, E, E, E, E, E,
+	E, E, E, E, E, E, E, E, E, E, E, E, E, E, E, E,
+	E, E, E, E, E, E, E, E, E, E, E, E, E, E, E, E
+};
+#undef P
+#undef S
+#undef E
+
+static char qpbuf[65536];	/* output buffer of recode_qp() */
+static unsigned int qpidx;	/* bytes used in qpbuf */
+/* the most bytes recode_qp() adds to qpbuf for one step: soft line break and a full line */
+#define QP_MAXSTEP 80
+
+/**
+ * @brief get the length of a run of characters that need no recoding
+ * @param buf the data to check
+ * @param max the maximum length of the run
+ * @return number of characters from the start of buf that are of class QP_PLAIN or QP_SPACE
+ *
+ * 8 bytes are checked at once: a word can be copied if no byte is a control
+ * character, has the high bit set, or is '=' or DEL. The caller has to check
+ * if whitespace at the end of the run is followed by a line break.
+ */
+static size_t
+qp_plain_run(const char *buf, const size_t max)
+{
+	const uint64_t ones = 0x0101010101010101ULL;
+	const uint64_t highs = 0x8080808080808080ULL;
+	size_t n = 0;
+
+	while (n + sizeof(uint64_t) <= max) {
+		uint64_t w;
+
+		memcpy(&w, buf + n, sizeof(w));
+
+		/* nonzero if any byte is below 32 or has the high bit set */
+		uint64_t bad = ((w - ones * 32) & ~w) | w;
+		const uint64_t eq = w ^ (ones * '=');
+		const uint64_t del = w ^ (ones * 127);
+
+		/* nonzero if any byte of eq or del is 0 */
+		bad |= ((eq - ones) & ~eq) | ((del - ones) & ~del);
+		if (bad & highs)
+			break;
+		n += sizeof(w);
+	}
+
+	while ((n < max) && (qp_class[(unsigned char)buf[n]] <= QP_SPACE))
+		n++;
+
+	return n;
+}
+
+/**
+ * @brief write out the contents of qpbuf except the last byte
+ *
+ * The last byte is kept as recode_qp() may need to replace it if it is
+ * whitespace in front of a soft line break.
+ */
+static void
+qp_flush(void)
+{
+	netnwrite(qpbuf, qpidx - 1);
+	qpbuf[0] = qpbuf[qpidx - 1];
+	qpidx = 1;
+}
+
 /**
  * recode buffer to quoted-printable and send it to remote host
  *
@@ -431,147 +580,133 @@ qp_header(const char *buf, const off_t len, cstring *boundary, int *multipart, c
 static void
 recode_qp(const char *buf, const off_t len)
 {
-	unsigned int idx = 0;
-	char sendbuf[1280];
-	int llen = 0;		/* length of this line, needed for qp line break */
+	static const char hexchars[] = "0123456789ABCDEF";
+	unsigned int llen = 0;	/* length of this line, needed for qp line break */
+	off_t off = 0;
 
 	assert(len >= 0);
 
 	if (len <= 0)
 		return;
 
-	for (off_t off = 0; off < len; ) {
-		size_t chunk = 0;	/* size of the chunk to copy into sendbuf */
-		if (idx > 0) {
-			/* flush out everything already in the buffer */
-			netnwrite(sendbuf, idx);
-			lastlf = (sendbuf[idx - 1] == '\n');
-			idx = 0;
+	qpidx = 0;
+	while (off < len) {
+		unsigned char c = buf[off];
+
+		if (qpidx > sizeof(qpbuf) - QP_MAXSTEP)
+			qp_flush();
+
+		if (qp_class[c] == QP_CR) {
+			/* CRLF, or CR without following LF that gets an LF inserted */
+			off++;
+			if ((off < len) && (buf[off] == '\n'))
+				off++;
+			qpbuf[qpidx++] = '\r';
+			qpbuf[qpidx++] = '\n';
+			llen = 0;
+			continue;
+		} else if (qp_class[c] == QP_LF) {
+			/* LF without preceding CR, insert CR */
+			off++;
+			qpbuf[qpidx++] = '\r';
+			qpbuf[qpidx++] = '\n';
+			llen = 0;
+			continue;
 		}
 
-		while ((idx + chunk < sizeof(sendbuf) - 11) && (off + (off_t) chunk < len)) {
-			if (buf[off + chunk] == '\r') {
-				chunk++;
-				llen = 0;
-				if (buf[off + chunk] == '\n') {
-					/* valid CRLF pair, chunk can accumulate further */
-					chunk++;
+		/* add soft line break to make sure encoded line length < 80 */
+		if (llen > 72) {
+			const char last = (qpidx > 0) ? qpbuf[qpidx - 1] : '\0';
+
+			/* recode last character if it was whitespace */
+			if ((last == '\t') || (last == ' ')) {
+				/* if the next character does not need recoding add
+				 * it to this line if this line would end in a whitespace
+				 * otherwise. " x" is shorter than "=20". */
+				if (qp_class[c] == QP_PLAIN) {
+					qpbuf[qpidx++] = c;
+					off++;
 				} else {
-					/* CR without following LF, copy chunk, insert LF,
-					 * start next chunk */
-					memcpy(sendbuf + idx, buf + off, chunk);
-					off += chunk;
-					idx += chunk;
-					sendbuf[idx++] = '\n';
-					chunk = 0;
+					qpbuf[qpidx - 1] = '=';
+					qpbuf[qpidx++] = (last == '\t') ? '0' : '2';
+					qpbuf[qpidx++] = (last == '\t') ? '9' : '0';
 				}
-				continue;
-			} else if (buf[off + chunk] == '\n') {
-				/* LF without preceding CR, copy chunk without LF, insert
-				 * CRLF, skip LF in input, start next chunk */
-				memcpy(sendbuf + idx, buf + off, chunk);
-				off += chunk + 1;
-				idx += chunk;
-				chunk = 0;
-				sendbuf[idx++] = '\r';
-				sendbuf[idx++] = '\n';
-				llen = 0;
-				continue;
 			}
+			qpbuf[qpidx++] = '=';
+			qpbuf[qpidx++] = '\r';
+			qpbuf[qpidx++] = '\n';
+			llen = 0;
 
-			/* add soft line break to make sure encoded line length < 80 */
-			if (llen > 72) {
-				memcpy(sendbuf + idx, buf + off, chunk);
-				off += chunk;
-				idx += chunk;
-				chunk = 0;
-				/* recode last character if it was whitespace */
-				if ((idx > 0) && ((sendbuf[idx - 1] == '\t') || (sendbuf[idx - 1] == ' '))) {
-					/* if the next character does not need recoding add
-					 * it to this line if this line would end in a whitespace
-					 * otherwise. " x" is shorter than "=20". */
-					if ((off < len) &&
-							((buf[off] > 32) && (buf[off] < 127) &&
-							(buf[off] != '='))) {
-						sendbuf[idx++] = buf[off++];
-					} else if (sendbuf[idx - 1] == '\t') {
-						sendbuf[idx - 1] = '=';
-						sendbuf[idx++] = '0';
-						sendbuf[idx++] = '9';
-					} else {
-						assert(sendbuf[idx - 1] == ' ');
-						sendbuf[idx - 1] = '=';
-						sendbuf[idx++] = '2';
-						sendbuf[idx++] = '0';
-					}
-				}
-				sendbuf[idx++] = '=';
-				sendbuf[idx++] = '\r';
-				sendbuf[idx++] = '\n';
+			if (off == len)
+				break;
+			c = buf[off];
+		}
+
+		switch (qp_class[c]) {
+		case QP_SPACE:
+			/* recode whitespace if a linebreak follows */
+			if ((off + 1 < len) && ((buf[off + 1] == '\r') || (buf[off + 1] == '\n'))) {
+				qpbuf[qpidx++] = '=';
+				qpbuf[qpidx++] = (c == '\t') ? '0' : '2';
+				qpbuf[qpidx++] = (c == '\t') ? '9' : '0';
+				qpbuf[qpidx++] = '\r';
+				qpbuf[qpidx++] = '\n';
+				if (buf[++off] == '\r')
+					off++;
+				if ((off < len) && (buf[off] == '\n'))
+					off++;
 				llen = 0;
+				break;
 			}
-
-			if (!llen && (buf[off + chunk] == '.')) {
-				chunk++;
-				memcpy(sendbuf + idx, buf + off, chunk);
-				off += chunk;
-				idx += chunk;
-				sendbuf[idx++] = '.';
-				chunk = 0;
-			} else if ((buf[off + chunk] == '\t') || (buf[off + chunk] == ' ')) {
-				/* recode whitespace if a linebreak follows */
-				if ((off + (off_t) chunk < len) &&
-						((buf[off + chunk + 1] == '\r') || (buf[off + chunk + 1] == '\n'))) {
-					memcpy(sendbuf + idx, buf + off, chunk);
-					off += chunk;
-					idx += chunk;
-					sendbuf[idx++] = '=';
-					if (buf[off] == '\t') {
-						sendbuf[idx++] = '0';
-						sendbuf[idx++] = '9';
-					} else {
-						sendbuf[idx++] = '2';
-						sendbuf[idx++] = '0';
-					}
-					sendbuf[idx++] = '\r';
-					sendbuf[idx++] = '\n';
-					if (buf[++off] == '\r')
-						off++;
-					if ((off < len) && (buf[off] == '\n'))
-						off++;
-					llen = 0;
-					chunk = 0;
-				} else {
-					chunk++;
-					llen++;
-				}
-			} else if ((buf[off + chunk] < 32) || (buf[off + chunk] == '=') ||
-							 (buf[off + chunk] > 126)) {
-				const char hexchars[] = "0123456789ABCDEF";
-
-				/* recode non-printable and non-ascii characters */
-				memcpy(sendbuf + idx, buf + off, chunk);
-				off += chunk;
-				idx += chunk;
-				chunk = 0;
-				sendbuf[idx++] = '=';
-				sendbuf[idx++] = hexchars[(buf[off] >> 4) & 0x0f];
-				sendbuf[idx++] = hexchars[buf[off] & 0xf];
-				llen +=3;
+			/* recode whitespace at the end of the data, the caller
+			 * adds a linebreak after it */
+			if (off + 1 == len) {
+				qpbuf[qpidx++] = '=';
+				qpbuf[qpidx++] = (c == '\t') ? '0' : '2';
+				qpbuf[qpidx++] = (c == '\t') ? '9' : '0';
+				llen += 3;
 				off++;
+				break;
+			}
+			/* fallthrough */
+		case QP_PLAIN:
+			if ((llen == 0) && (c == '.')) {
+				qpbuf[qpidx++] = '.';
+				qpbuf[qpidx++] = '.';
+				off++;
+				llen = 1;
 			} else {
-				llen++;
-				chunk++;
+				/* copy as much as fits into this line */
+				size_t run = 73 - llen;
+
+				if ((off_t)run > len - off)
+					run = len - off;
+				run = qp_plain_run(buf + off, run);
+				/* whitespace in front of a linebreak or at the end of
+				 * the data is handled above */
+				if (((off + (off_t)run == len) ||
+						(buf[off + run] == '\r') || (buf[off + run] == '\n')) &&
+						((buf[off + run - 1] == ' ') || (buf[off + run - 1] == '\t')))
+					run--;
+				memcpy(qpbuf + qpidx, buf + off, run);
+				qpidx += run;
+				off += run;
+				llen += run;
 			}
-		}
-		if (chunk) {
-			memcpy(sendbuf + idx, buf + off, chunk);
-			off += chunk;
-			idx += chunk;
+			break;
+		default:
+			/* recode non-printable and non-ascii characters, this
+			 * includes CR and LF directly after a soft line break */
+			qpbuf[qpidx++] = '=';
+			qpbuf[qpidx++] = hexchars[c >> 4];
+			qpbuf[qpidx++] = hexchars[c & 0xf];
+			llen += 3;
+			off++;
 		}
 	}
-	lastlf = (sendbuf[idx - 1] == '\n');
-	netnwrite(sendbuf, idx);
+
+	lastlf = (qpbuf[qpidx - 1] == '\n');
+	netnwrite(qpbuf, qpidx);
 }
 
 /**
@@ -607,7 +742,7 @@ send_qp(const char *buf, const off_t len)
 	cstring boundary;
 	int multipart;		/* set to one if this is a multipart message */
 
-	unsigned int recodeflag = need_recode(buf, len);
+	unsigned int recodeflag = part_recode(buf, len);
 
 	off_t off = qp_header(buf, len, &boundary, &multipart, (recodeflag & recode_qp_body));
 
@@ -641,7 +776,7 @@ send_qp(const char *buf, const off_t len)
 		}
 
 		/* check and send or discard MIME preamble */
-		if (need_recode(buf + off, nextoff)) {
+		if (part_recode(buf + off, nextoff)) {
 			log_write(LOG_ERR, "discarding invalid MIME preamble");
 			netwrite("\r\ninvalid MIME preamble was dicarded.\r\n\r\n--");
 			netnwrite(boundary.s, boundary.len);
@@ -667,7 +802,7 @@ send_qp(const char *buf, const off_t len)
 
 		while ((off < len) && !islast && (nextoff = find_boundary(buf + off, len - off, &boundary))) {
 			off_t partlen = nextoff - boundary.len - 2;
-			int nr = need_recode(buf + off, partlen);
+			int nr = part_recode(buf + off, partlen);
 
 			if (nr & nr_match)
 				send_qp(buf + off, partlen);
@@ -701,7 +836,7 @@ send_qp(const char *buf, const off_t len)
 			netwrite("\r\n--");
 			netnwrite(boundary.s, boundary.len);
 			netwrite("--\r\n");
-		} else if (need_recode(buf + off, len - off)) {
+		} else if (part_recode(buf + off, len - off)) {
 			/* All normal MIME parts are processed now, what follow is the epilogue.
 			 * Check if it needs recode. If it does, it is broken and can simply be
 			 * discarded */
@@ -723,7 +858,17 @@ void
 send_data(unsigned int recodeflag)
 {
 	successmsg[2] = "";
-	netwrite("DATA\r\n");
+	envelope_flush("DATA\r\n", strlen("DATA\r\n"));
+	if (envelope_replies() != 0) {
+		/* All recipients were rejected, so the server should also reject
+		 * DATA. If it does not, send an empty message to keep the
+		 * protocol in sync, it will not be delivered to anyone. */
+		if (checkreply(NULL, NULL, 0) == 354) {
+			netwrite(".\r\n");
+			checkreply(NULL, NULL, 0);
+		}
+		net_conn_shutdown(shutdown_clean);
+	}
 	int num = netget(1);
 	if (num != 354) {
 		const char *msg[] = { num >= 500 ? "D5" : "Z4", ".3.0 remote host rejected DATA command: ",
@@ -738,10 +883,14 @@ send_data(unsigned int recodeflag)
 	if ((!(smtpext & esmtp_8bitmime) && (recodeflag & recode_8bit)) ||
 			(recodeflag & recode_long)) {
 		successmsg[2] = "(qp recoded) ";
+		/* if this fails every part is just scanned on it's own */
+		if (msgindex.entries == NULL)
+			(void) line_index_build(&msgindex, msgdata, msgsize);
 		send_qp(msgdata, msgsize);
 	} else {
 		send_plain(msgdata, msgsize);
 	}
+	line_index_free(&msgindex);
 	if (lastlf) {
 		netwrite(".\r\n");
 	} else {
@@ -10,12 +10,15 @@
 #include <control.h>
 #include <ipme.h>
 #include <log.h>
+#include <metrics.h>
 #include <netio.h>
 #include <qdns.h>
 #include <qmaildir.h>
 #include <qremote/conn.h>
 #include <qremote/greeting.h>
+#include <qremote/mxhealth.h>
 #include <qremote/qrdata.h>
+#include <qremote/scheduler.h>
 #include <qremote/starttlsr.h>
 #include <sstring.h>
 #include <tls.h>
@@ -23,6 +26,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
@@ -30,6 +34,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 int socketd = -1;
@@ -37,6 +42,7 @@ unsigned int smtpext;	/**< the SMTP extensions supported by the remote server */
 char *rhost;		/**< the DNS name (if present) and IP address of the remote server to be used in log messages */
 size_t rhostlen;	/**< valid length of rhost */
 char *partner_fqdn;	/**< the DNS name of the remote server (forward-lookup), or NULL if the connection was done by IP */
+static struct timespec starttime;	/**< when this delivery was started */
 
 /**
  * @brief send QUIT to the remote server and close the connection
@@ -71,6 +77,51 @@ quitmsg(void)
 	clientcertname = "control/clientcert.pem";
 }
 
+/** @brief the scan of the message, running in a separate thread */
+static struct {
+	pthread_t thread;
+	unsigned int recodeflag;	/**< the return value of prescan_msgdata() */
+	unsigned int running:1;		/**< if the thread still needs to be joined */
+} prescan;
+
+static void *
+prescan_thread(void *arg __attribute__ ((unused)))
+{
+	prescan.recodeflag = prescan_msgdata();
+
+	return NULL;
+}
+
+/**
+ * @brief start scanning the message
+ *
+ * The scan runs in the background so it overlaps with the MX lookup and
+ * connecting to the remote host, the result is only needed for the envelope.
+ */
+static void
+prescan_start(void)
+{
+	if (pthread_create(&prescan.thread, NULL, prescan_thread, NULL) == 0)
+		prescan.running = 1;
+	else
+		prescan_thread(NULL);
+}
+
+/**
+ * @brief wait for the scan of the message to finish
+ * @return the result of prescan_msgdata()
+ */
+static unsigned int
+prescan_wait(void)
+{
+	if (prescan.running) {
+		pthread_join(prescan.thread, NULL);
+		prescan.running = 0;
+	}
+
+	return prescan.recodeflag;
+}
+
 void
 net_conn_shutdown(const enum conn_shutdown_type sd_type)
 {
@@ -90,11 +141,19 @@ net_conn_shutdown(const enum conn_shutdown_type sd_type)
 		free(clientcertbuf);
 	}
 
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) == 0)
+		metrics_observe(METRIC_H_QREMOTE_DELIVERY, (now.tv_sec - starttime.tv_sec) * 1000000000ULL +
+				now.tv_nsec - starttime.tv_nsec);
+
 #ifdef USESYSLOG
 	closelog();
 #endif
 
 	free(heloname.s);
+	/* the scan must not access the message after it is unmapped */
+	(void) prescan_wait();
 	if (msgdata != MAP_FAILED)
 		munmap((void*)msgdata, msgsize);
 
@@ -155,6 +214,16 @@ setup(void)
 
 	remote_common_setup();
 
+	char *healthfile;
+	if (((ssize_t)loadoneliner(controldir_fd, "mxhealthcache", &healthfile, 1)) >= 0) {
+		if (mxhealth_open(healthfile) != 0) {
+			const char *logmsg[] = { "can not open MX health cache ", healthfile, NULL };
+
+			log_writen(LOG_WARNING, logmsg);
+		}
+		free(healthfile);
+	}
+
 #ifdef CHUNKING
 	unsigned long chunk;
 	if (loadintfd(openat(controldir_fd, "chunksizeremote", O_RDONLY | O_CLOEXEC), &chunk, 32768) < 0) {
@@ -165,6 +234,12 @@ setup(void)
 		}
 		chunksize = chunk & 0xffffffff;
 	}
+
+	if (loadintfd(openat(controldir_fd, "chunkwindowremote", O_RDONLY | O_CLOEXEC), &chunk, 4) < 0)
+		err_conf("parse error in control/chunkwindowremote");
+	else if ((chunk == 0) || (chunk > 64))
+		err_conf("control/chunkwindowremote must be between 1 and 64");
+	chunkwindow = chunk;
 #endif
 
 #ifdef DEBUG_IO
@@ -176,13 +251,26 @@ int
 main(int argc, char *argv[])
 {
 	struct ips *mx = NULL;
-	int rcptcount = argc - 3;
 	struct stat st;
+	int i;
+
+	if ((argc > 1) && (strcmp(argv[1], "-d") == 0)) {
+		(void) metrics_attach();
+		setup();
+		/* this only returns in a child that has to deliver a job */
+		if (scheduler_run(argc - 1, argv + 1, &argc, &argv) != 0)
+			return 1;
+		i = fstat(0, &st);
+	} else {
+		/* do this check before opening any files to catch the case that fd 0 is closed at this point */
+		i = fstat(0, &st);
+		(void) metrics_attach();
+		setup();
+	}
 
-	/* do this check before opening any files to catch the case that fd 0 is closed at this point */
-	int i = fstat(0, &st);
+	const int rcptcount = argc - 3;
 
-	setup();
+	(void) clock_gettime(CLOCK_MONOTONIC, &starttime);
 
 	if (rcptcount <= 0) {
 		log_write(LOG_CRIT, "too few arguments");
@@ -207,6 +295,8 @@ main(int argc, char *argv[])
 		net_conn_shutdown(shutdown_abort);
 	}
 
+	prescan_start();
+
 	getmxlist(argv[1], &mx);
 	if (targetport == 25) {
 		mx = filter_my_ips(mx);
@@ -218,6 +308,7 @@ main(int argc, char *argv[])
 		}
 	}
 	sortmx(&mx);
+	mxhealth_sort(&mx);
 
 	i = connect_mx(mx, &outgoingip, &outgoingip6);
 	freeips(mx);
@@ -239,7 +330,7 @@ main(int argc, char *argv[])
 	}
 
 /* check if message is plain ASCII or not */
-	const unsigned int recodeflag = need_recode(msgdata, msgsize);
+	const unsigned int recodeflag = prescan_wait();
 
 	if (send_envelope(recodeflag, argv[2], argc - 3, argv + 3) != 0)
 		net_conn_shutdown(shutdown_clean);
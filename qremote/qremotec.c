@@ -0,0 +1,177 @@
+/** \file qremotec.c
+ \brief pass a delivery to the Qremote scheduler
+
+ qremotec is called by qmail-rspawn instead of qmail-remote. It passes the
+ message and its arguments to the delivery scheduler started with
+ "Qremote -d" and copies the status of the delivery back to qmail-rspawn.
+ The socket of the scheduler can be changed with the QREMOTE_SOCKET
+ environment variable.
+
+ Usage: qremotec host sender recip [recip ...]
+ */
+
+#include <qmaildir.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifndef SOCK_CLOEXEC
+#define SOCK_CLOEXEC 0
+#endif /* SOCK_CLOEXEC */
+
+static void
+status(const char *msg)
+{
+	/* the same format Qremote uses */
+	ssize_t r = write(1, msg, strlen(msg) + 1);
+
+	(void) r;
+}
+
+/**
+ * @brief send the job to the scheduler
+ * @param fd the connection to the scheduler
+ * @param argc number of arguments
+ * @param argv the arguments of the job
+ * @return 0 on success, negative error code otherwise
+ *
+ * The message file descriptor is sent together with the first argument.
+ */
+static int
+send_job(const int fd, int argc, char **argv)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cbuf;
+	struct iovec iov = {
+		.iov_base = argv[0],
+		.iov_len = strlen(argv[0]) + 1
+	};
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf.buf,
+		.msg_controllen = sizeof(cbuf.buf)
+	};
+	struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+	const int msgfd = 0;
+
+	memset(&cbuf, 0, sizeof(cbuf));
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(sizeof(msgfd));
+	memcpy(CMSG_DATA(c), &msgfd, sizeof(msgfd));
+
+	/* an argument is much smaller than the socket buffer, so this sends all of it */
+	if (sendmsg(fd, &mh, 0) != (ssize_t)iov.iov_len)
+		return -errno;
+
+	for (int i = 1; i < argc; i++) {
+		const size_t len = strlen(argv[i]) + 1;
+		size_t off = 0;
+
+		while (off < len) {
+			ssize_t r = write(fd, argv[i] + off, len - off);
+
+			if (r < 0) {
+				if (errno == EINTR)
+					continue;
+				return -errno;
+			}
+			off += r;
+		}
+	}
+
+	if (shutdown(fd, SHUT_WR) != 0)
+		return -errno;
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct sockaddr_un sa = {
+		.sun_family = AF_UNIX
+	};
+	const char *path = getenv("QREMOTE_SOCKET");
+
+	if (argc < 4) {
+		status("Z4.3.0 internal error: qremotec called with invalid arguments\n");
+		return 0;
+	}
+
+	if (path == NULL)
+		path = QREMOTE_SOCKET;
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		status("Z4.3.0 path of Qremote scheduler socket is too long\n");
+		return 0;
+	}
+	strcpy(sa.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		status("Z4.3.0 can't create socket to Qremote scheduler\n");
+		return 0;
+	}
+
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+		status("Z4.3.0 can't connect to Qremote scheduler\n");
+		return 0;
+	}
+
+	if (send_job(fd, argc - 1, argv + 1) != 0) {
+		status("Z4.3.0 can't pass delivery to Qremote scheduler\n");
+		return 0;
+	}
+
+	/* The delivery writes the status directly to the socket: one record for
+	 * every recipient, then the final K, Z, or D record. Every record is
+	 * terminated by a 0 byte. */
+	char buf[4096];
+	char rectype = '\0';	/* first byte of the record being received, 0 at the start of a record */
+	int final = 0;		/* if the last complete record is the final one */
+
+	while (1) {
+		ssize_t r = read(fd, buf, sizeof(buf));
+
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (r == 0)
+			break;
+
+		for (ssize_t off = 0; off < r; ) {
+			ssize_t w = write(1, buf + off, r - off);
+
+			if (w < 0) {
+				if (errno == EINTR)
+					continue;
+				return 111;
+			}
+			off += w;
+		}
+
+		for (ssize_t i = 0; i < r; i++) {
+			if (rectype == '\0') {
+				rectype = buf[i];
+				final = 0;
+			}
+			if (buf[i] == '\0') {
+				final = (rectype == 'K') || (rectype == 'Z') || (rectype == 'D');
+				rectype = '\0';
+			}
+		}
+	}
+
+	/* the final status is missing: the delivery crashed, let qmail-rspawn notice that */
+	return final ? 0 : 111;
+}
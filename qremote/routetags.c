@@ -0,0 +1,35 @@
+/** \file routetags.c
+ \brief the settings of an entry in control/smtproutes.d
+ */
+
+#include <qremote/routetags.h>
+
+#include <string.h>
+
+const char *route_tags[ROUTE_TAGS] = {
+	[ROUTE_RELAY] = "relay",
+	[ROUTE_PORT] = "port",
+	[ROUTE_CLIENTCERT] = "clientcert",
+	[ROUTE_OUTGOINGIP] = "outgoingip",
+	[ROUTE_OUTGOINGIP6] = "outgoingip6"
+};
+
+int
+route_tag(const char *line)
+{
+	const char *last = strchr(line, '=');
+
+	/* must be key=value, catch empty keys */
+	if ((last == NULL) || (last == line))
+		return -1;
+
+	const size_t len = last - line;
+
+	for (int i = 0; i < ROUTE_TAGS; i++) {
+		/* catch if tag is longer than the key found here */
+		if ((strlen(route_tags[i]) == len) && (strncmp(route_tags[i], line, len) == 0))
+			return i;
+	}
+
+	return -1;
+}
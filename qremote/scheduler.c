@@ -0,0 +1,639 @@
+/** \file scheduler.c
+ \brief long running delivery scheduler of Qremote
+
+ Started as "Qremote -d", the configuration is loaded once and then jobs are
+ accepted on a UNIX domain socket. A job is what qmail-rspawn passes to
+ qmail-remote: the message as file descriptor and the host, sender, and
+ recipients as arguments, see qremotec. For every job a child is forked
+ from the already set up process, so the per message cost of starting and
+ configuring Qremote is gone. The number of concurrent deliveries, both in
+ total and per destination host, is limited. Jobs exceeding the limits are
+ kept until a running delivery finishes. MX lookups and TLS sessions are
+ shared between the deliveries through the job cache.
+
+ The socket is only accessible by its owner, which can be set with the -u
+ option to the user qmail-rspawn runs as. Jobs are read from all clients in
+ parallel, a client that does not send its job in time is dropped.
+ */
+
+#include <qremote/scheduler.h>
+
+#include <log.h>
+#include <qmaildir.h>
+#include <qremote/jobcache.h>
+#include <qremote/mxhealth.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_REQUEST 65536	/**< maximum size of the arguments of a job */
+#define MAX_QUEUED 256		/**< maximum number of jobs waiting for a free slot */
+#define MAX_READING 64		/**< maximum number of clients sending their job at the same time */
+#define REQUEST_TIMEOUT 5	/**< seconds a client may take to send the job */
+
+/** @struct job
+ @brief a delivery job
+ */
+struct job {
+	pid_t pid;		/**< process id of the delivery, 0 if not yet started */
+	int clientfd;		/**< connection to the client */
+	int msgfd;		/**< the message */
+	char *args;		/**< the arguments, each terminated by a 0 byte */
+	size_t len;		/**< length of args */
+	time_t deadline;	/**< while the job is received: it is dropped if not complete by then */
+};
+
+static struct job *running;	/**< the running deliveries */
+static unsigned int nrunning;
+static unsigned int maxrunning = 120;
+static unsigned int maxperhost = 10;
+static struct job queued[MAX_QUEUED];
+static unsigned int nqueued;
+static struct job reading[MAX_READING];	/**< the jobs that are still received */
+static unsigned int nreading;
+static int listenfd = -1;
+static int sigpipe[2];
+
+static void
+sigchld(int sig __attribute__ ((unused)))
+{
+	const int e = errno;
+	/* the pipe is non-blocking, a full pipe already wakes up the main loop */
+	ssize_t r = write(sigpipe[1], "", 1);
+
+	(void) r;
+	errno = e;
+}
+
+int
+scheduler_job_args(char *buf, const size_t len, char ***argv)
+{
+	unsigned int cnt = 0;
+
+	if ((len == 0) || (buf[len - 1] != '\0'))
+		return -EINVAL;
+
+	for (size_t i = 0; i < len; i++) {
+		if (buf[i] != '\0')
+			continue;
+		/* the host must not be empty, the sender may be */
+		if ((cnt == 0) && (i == 0))
+			return -EINVAL;
+		cnt++;
+	}
+
+	if (cnt < 3)
+		return -EINVAL;
+
+	*argv = malloc((cnt + 2) * sizeof(**argv));
+	if (*argv == NULL)
+		return -ENOMEM;
+
+	(*argv)[0] = "Qremote";
+	for (unsigned int i = 1; i <= cnt; i++) {
+		(*argv)[i] = buf;
+		buf += strlen(buf) + 1;
+	}
+	(*argv)[cnt + 1] = NULL;
+
+	return cnt + 1;
+}
+
+/**
+ * @brief reply to a client that its job can not be run
+ * @param fd the connection to the client
+ * @param msg the status message
+ */
+static void
+reject_job(const int fd, const char *msg)
+{
+	/* the same format write_status() uses */
+	ssize_t r = write(fd, msg, strlen(msg) + 1);
+
+	(void) r;
+	close(fd);
+}
+
+static void
+free_job(struct job *j)
+{
+	if (j->clientfd >= 0)
+		close(j->clientfd);
+	if (j->msgfd >= 0)
+		close(j->msgfd);
+	free(j->args);
+}
+
+/**
+ * @brief count the running deliveries to a host
+ */
+static unsigned int
+host_running(const char *host)
+{
+	unsigned int cnt = 0;
+
+	for (unsigned int i = 0; i < nrunning; i++)
+		if (strcmp(running[i].args, host) == 0)
+			cnt++;
+
+	return cnt;
+}
+
+/**
+ * @brief start a delivery
+ * @param j the job to start
+ * @param jobargc the number of arguments of the job will be stored here in the child
+ * @param jobargv the arguments of the job will be stored here in the child
+ * @retval 1 this is the child process
+ * @retval 0 the delivery was started
+ * @retval <0 negative error code
+ */
+static int
+start_job(struct job *j, int *jobargc, char ***jobargv)
+{
+	char **argv;
+	const int argc = scheduler_job_args(j->args, j->len, &argv);
+
+	if (argc < 0)
+		return argc;
+
+	const pid_t child = fork();
+	if (child < 0) {
+		const int e = errno;
+
+		free(argv);
+		return -e;
+	}
+
+	if (child == 0) {
+		close(listenfd);
+		close(sigpipe[0]);
+		close(sigpipe[1]);
+		/* the connections of the other jobs must not be kept open by this child */
+		for (unsigned int i = 0; i < nqueued; i++)
+			if (queued + i != j)
+				free_job(queued + i);
+		for (unsigned int i = 0; i < nreading; i++)
+			free_job(reading + i);
+
+		if ((dup2(j->msgfd, 0) != 0) || (dup2(j->clientfd, 1) != 1))
+			_exit(1);
+		close(j->msgfd);
+		close(j->clientfd);
+		signal(SIGCHLD, SIG_DFL);
+		/* the deliveries must not share the lock of the cache */
+		if (mxhealth_reopen() != 0)
+			log_write(LOG_WARNING, "can not reopen MX health cache");
+
+		*jobargc = argc;
+		*jobargv = argv;
+		return 1;
+	}
+
+	free(argv);
+	close(j->msgfd);
+	close(j->clientfd);
+	j->msgfd = -1;
+	j->clientfd = -1;
+	j->pid = child;
+	running[nrunning++] = *j;
+
+	return 0;
+}
+
+/**
+ * @brief start all waiting jobs for which a slot is free
+ * @param jobargc the number of arguments of the job will be stored here in the child
+ * @param jobargv the arguments of the job will be stored here in the child
+ * @return if this is a child process that has to run a job
+ */
+static int
+start_jobs(int *jobargc, char ***jobargv)
+{
+	unsigned int i = 0;
+
+	while ((i < nqueued) && (nrunning < maxrunning)) {
+		struct job *j = queued + i;
+
+		if (host_running(j->args) >= maxperhost) {
+			i++;
+			continue;
+		}
+
+		int r = start_job(j, jobargc, jobargv);
+		if (r > 0)
+			return 1;
+
+		if (r < 0) {
+			log_write(LOG_ERR, "cannot fork delivery");
+			reject_job(j->clientfd, "Z4.3.0 internal error: cannot start delivery\n");
+			j->clientfd = -1;
+			free_job(j);
+		}
+
+		/* keep the order of the jobs so no job waits forever */
+		memmove(queued + i, queued + i + 1, (nqueued - i - 1) * sizeof(*queued));
+		nqueued--;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief collect all finished deliveries
+ */
+static void
+reap_children(void)
+{
+	pid_t pid;
+	int wstat;
+
+	while ((pid = waitpid(-1, &wstat, WNOHANG)) > 0) {
+		unsigned int i;
+
+		for (i = 0; i < nrunning; i++)
+			if (running[i].pid == pid)
+				break;
+
+		if (i == nrunning)
+			continue;
+
+		if (!WIFEXITED(wstat)) {
+			const char *logmsg[] = { "delivery to ", running[i].args, " crashed", NULL };
+
+			log_writen(LOG_ERR, logmsg);
+		}
+
+		free(running[i].args);
+		running[i] = running[--nrunning];
+	}
+}
+
+static time_t
+now_monotonic(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+/**
+ * @brief remove a job from the list of jobs that are received
+ * @param idx index of the job in reading
+ *
+ * Nothing is closed or freed.
+ */
+static void
+reading_remove(const unsigned int idx)
+{
+	reading[idx] = reading[--nreading];
+}
+
+/**
+ * @brief drop a job that is received
+ * @param idx index of the job in reading
+ * @param msg the status message for the client, NULL to just close the connection
+ */
+static void
+reading_drop(const unsigned int idx, const char *msg)
+{
+	struct job *j = reading + idx;
+
+	if (msg != NULL) {
+		reject_job(j->clientfd, msg);
+		j->clientfd = -1;
+	}
+	free_job(j);
+	reading_remove(idx);
+}
+
+/**
+ * @brief accept a new client connection
+ */
+static void
+accept_client(void)
+{
+	int fd = accept(listenfd, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	if ((fcntl(fd, F_SETFD, FD_CLOEXEC) != 0) || (fcntl(fd, F_SETFL, O_NONBLOCK) != 0)) {
+		close(fd);
+		return;
+	}
+
+	struct job *j = reading + nreading;
+
+	memset(j, 0, sizeof(*j));
+	j->clientfd = fd;
+	j->msgfd = -1;
+	j->deadline = now_monotonic() + REQUEST_TIMEOUT;
+	j->args = malloc(MAX_REQUEST);
+	if (j->args == NULL) {
+		reject_job(fd, "Z4.3.0 Out of memory.\n");
+		return;
+	}
+
+	nreading++;
+}
+
+/**
+ * @brief read the data a client has sent
+ * @param idx index of the job in reading
+ *
+ * The client sends the message file descriptor together with the first part
+ * of the arguments and shuts down its sending side after the arguments. Once
+ * the end of input is reached the job is queued.
+ */
+static void
+read_job(const unsigned int idx)
+{
+	struct job *j = reading + idx;
+
+	while (j->len < MAX_REQUEST) {
+		union {
+			struct cmsghdr hdr;
+			char buf[CMSG_SPACE(sizeof(int))];
+		} cbuf;
+		struct iovec iov = {
+			.iov_base = j->args + j->len,
+			.iov_len = MAX_REQUEST - j->len
+		};
+		struct msghdr mh = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = cbuf.buf,
+			.msg_controllen = sizeof(cbuf.buf)
+		};
+
+		ssize_t r = recvmsg(j->clientfd, &mh, 0);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				return;
+			reading_drop(idx, NULL);
+			return;
+		}
+
+		for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c != NULL; c = CMSG_NXTHDR(&mh, c)) {
+			if ((c->cmsg_level != SOL_SOCKET) || (c->cmsg_type != SCM_RIGHTS))
+				continue;
+
+			int mfd;
+
+			memcpy(&mfd, CMSG_DATA(c), sizeof(mfd));
+			if (j->msgfd < 0)
+				j->msgfd = mfd;
+			else
+				close(mfd);
+		}
+
+		if (r == 0)
+			break;
+		j->len += r;
+	}
+
+	char **argv;
+	const int argc = ((j->len < MAX_REQUEST) && (j->msgfd >= 0)) ?
+			scheduler_job_args(j->args, j->len, &argv) : -EINVAL;
+
+	if (argc < 0) {
+		log_write(LOG_WARNING, "invalid job received");
+		reading_drop(idx, "Z4.3.0 internal error: invalid job passed to Qremote scheduler\n");
+		return;
+	}
+	free(argv);
+
+	/* the delivery writes its status with blocking I/O */
+	if (fcntl(j->clientfd, F_SETFL, 0) != 0) {
+		reading_drop(idx, NULL);
+		return;
+	}
+
+	queued[nqueued++] = *j;
+	reading_remove(idx);
+}
+
+/**
+ * @brief drop all clients that did not send their job in time
+ * @param now the current time
+ */
+static void
+expire_jobs(const time_t now)
+{
+	for (unsigned int i = 0; i < nreading; ) {
+		if (reading[i].deadline <= now) {
+			log_write(LOG_WARNING, "timeout while reading job");
+			reading_drop(i, "Z4.3.0 internal error: timeout while passing job to Qremote scheduler\n");
+		} else {
+			i++;
+		}
+	}
+}
+
+/**
+ * @brief create the listening socket
+ * @param path path of the socket
+ * @param owner the user the socket is given to, NULL to keep the current user
+ * @return the socket
+ * @retval -1 the socket could not be created
+ *
+ * The socket is only accessible by its owner, otherwise every local user
+ * could pass deliveries to the scheduler.
+ */
+static int
+setup_socket(const char *path, const struct passwd *owner)
+{
+	struct sockaddr_un sa = {
+		.sun_family = AF_UNIX
+	};
+	struct stat st;
+
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		fprintf(stderr, "socket path %s is too long\n", path);
+		return -1;
+	}
+	strcpy(sa.sun_path, path);
+
+	/* remove a stale socket of a previous instance */
+	if ((lstat(path, &st) == 0) && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	/* never let the socket be accessible by others, not even for a moment */
+	const mode_t oldmask = umask(077);
+	const int b = bind(fd, (struct sockaddr *)&sa, sizeof(sa));
+	umask(oldmask);
+
+	if ((fcntl(fd, F_SETFD, FD_CLOEXEC) != 0) || (b != 0) ||
+			(chmod(path, 0600) != 0) ||
+			((owner != NULL) && (chown(path, owner->pw_uid, owner->pw_gid) != 0)) ||
+			(listen(fd, SOMAXCONN) != 0)) {
+		perror(path);
+		close(fd);
+		if (b == 0)
+			unlink(path);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int
+parse_limit(const char *arg, unsigned int *limit)
+{
+	char *end;
+	const unsigned long v = strtoul(arg, &end, 10);
+
+	if ((*end != '\0') || (*arg == '\0') || (v == 0) || (v > 65535)) {
+		fprintf(stderr, "invalid limit: %s\n", arg);
+		return -1;
+	}
+
+	*limit = v;
+	return 0;
+}
+
+int
+scheduler_run(int argc, char **argv, int *jobargc, char ***jobargv)
+{
+	int opt;
+	const struct passwd *owner = NULL;
+
+	while ((opt = getopt(argc, argv, "c:m:u:")) != -1) {
+		switch (opt) {
+		case 'c':
+			if (parse_limit(optarg, &maxrunning) != 0)
+				return -1;
+			break;
+		case 'm':
+			if (parse_limit(optarg, &maxperhost) != 0)
+				return -1;
+			break;
+		case 'u':
+			owner = getpwnam(optarg);
+			if (owner == NULL) {
+				fprintf(stderr, "unknown user: %s\n", optarg);
+				return -1;
+			}
+			break;
+		default:
+			fprintf(stderr, "Usage: Qremote -d [-c concurrency] [-m concurrency per host] [-u user] [socket]\n");
+			return -1;
+		}
+	}
+
+	if (argc > optind + 1) {
+		fprintf(stderr, "Usage: Qremote -d [-c concurrency] [-m concurrency per host] [-u user] [socket]\n");
+		return -1;
+	}
+
+	running = calloc(maxrunning, sizeof(*running));
+	if (running == NULL) {
+		fputs("out of memory\n", stderr);
+		return -1;
+	}
+
+	if (pipe(sigpipe) != 0) {
+		perror("pipe");
+		return -1;
+	}
+	for (unsigned int i = 0; i < 2; i++) {
+		fcntl(sigpipe[i], F_SETFD, FD_CLOEXEC);
+		fcntl(sigpipe[i], F_SETFL, O_NONBLOCK);
+	}
+
+	struct sigaction sa = {
+		.sa_handler = sigchld,
+		.sa_flags = SA_RESTART | SA_NOCLDSTOP
+	};
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGCHLD, &sa, NULL) != 0) {
+		perror("sigaction");
+		return -1;
+	}
+
+	/* inherited by all deliveries, so it must exist before the first fork */
+	if (jobcache_init() != 0)
+		log_write(LOG_WARNING, "can not set up job cache, deliveries will not share results");
+
+	listenfd = setup_socket((argc > optind) ? argv[optind] : QREMOTE_SOCKET, owner);
+	if (listenfd < 0)
+		return -1;
+
+	while (1) {
+		struct pollfd pfd[2 + MAX_READING] = {
+			{
+				.fd = sigpipe[0],
+				.events = POLLIN
+			},
+			{
+				.fd = listenfd,
+				/* do not accept new jobs while the queue is full */
+				.events = ((nqueued + nreading < MAX_QUEUED) && (nreading < MAX_READING)) ? POLLIN : 0
+			}
+		};
+		int timeout = -1;
+		const time_t now = now_monotonic();
+
+		for (unsigned int i = 0; i < nreading; i++) {
+			const int left = (reading[i].deadline - now) * 1000;
+
+			pfd[2 + i].fd = reading[i].clientfd;
+			pfd[2 + i].events = POLLIN;
+			if ((timeout < 0) || (left < timeout))
+				timeout = (left > 0) ? left : 0;
+		}
+		const unsigned int nfds = 2 + nreading;
+
+		if (poll(pfd, nfds, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			log_write(LOG_ERR, "poll() failed");
+			return -1;
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			char buf[32];
+
+			while (read(sigpipe[0], buf, sizeof(buf)) > 0)
+				;
+			reap_children();
+		}
+
+		/* walk backwards, reading_remove() moves the last entry into the freed slot */
+		for (unsigned int i = nfds - 2; i > 0; i--) {
+			if (pfd[1 + i].revents != 0)
+				read_job(i - 1);
+		}
+
+		expire_jobs(now_monotonic());
+
+		if (pfd[1].revents & POLLIN)
+			accept_client();
+
+		if (start_jobs(jobargc, jobargv))
+			return 0;
+	}
+}
@@ -4,12 +4,14 @@
 
 #include <qremote/qremote.h>
 
+#include <cdb.h>
 #include <control.h>
 #include <diropen.h>
 #include <log.h>
 #include <match.h>
 #include <mmap.h>
 #include <qdns.h>
+#include <qremote/routetags.h>
 #include <qremote/starttlsr.h>
 
 #include <arpa/inet.h>
@@ -18,21 +20,14 @@
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <syslog.h>
 #include <unistd.h>
 
 char *clientcertbuf;	/* buffer for a user-defined client certificate location */
 
-static const char *tags[] = {
-	"relay",
-	"port",
-	"clientcert",
-	"outgoingip",
-	"outgoingip6",
-	NULL
-};
-
 /**
  * @brief check smtproutes entries for basic syntax errors
  * @return 0 if the line is valid, i.e. it contains exactly 1 or 2 colons
@@ -72,36 +67,19 @@ static unsigned int tagmask;
 static int
 validroute(const char *s)
 {
-	const char *last = strchr(s, '=');
-
-	/* must be key=value */
-	if (last == NULL)
-		return 1;
+	const int i = route_tag(s);
 
-	/* catch empty keys */
-	if (last == s)
+	if (i < 0)
 		return 1;
 
-	size_t len = last - s;
-
-	for (unsigned int i = 0; tags[i] != NULL; i++) {
-		/* catch if tag is longer than the key found here */
-		if (strlen(tags[i]) != len)
-			continue;
+	const unsigned int tag = 1 << i;
 
-		if (strncmp(tags[i], s, len) == 0) {
-			const unsigned int tag = 1 << i;
-
-			/* duplicate tag is error */
-			if (tagmask & tag)
-				return 1;
-
-			tagmask |= tag;
-			return 0;
-		}
-	}
+	/* duplicate tag is error */
+	if (tagmask & tag)
+		return 1;
 
-	return 1;
+	tagmask |= tag;
+	return 0;
 }
 
 static const char *
@@ -109,10 +87,10 @@ tagvalue(char **lines, const unsigned int idx)
 {
 	unsigned int i = 0;
 
-	while (strncmp(lines[i], tags[idx], strlen(tags[idx])) != 0)
+	while (strncmp(lines[i], route_tags[idx], strlen(route_tags[idx])) != 0)
 		i++;
 	
-	return lines[i] + strlen(tags[idx]) + 1;
+	return lines[i] + strlen(route_tags[idx]) + 1;
 }
 
 /**
@@ -120,7 +98,7 @@ tagvalue(char **lines, const unsigned int idx)
  * @param mx MX result list is stored here
  * @param remhost original remote host
  * @param targetport targetport will be stored here
- * @param buf additional buffer, will be freed in case of fatal error
+ * @param buf additional buffer, will be freed in case of fatal error, may be NULL
  * @param host host name of smtproute or NULL
  * @param port port string of smtproute of NULL
  * @retval 0 values were successfully parsed
@@ -128,7 +106,7 @@ tagvalue(char **lines, const unsigned int idx)
  *
  * The function will abort the program if a parse error occurs.
  */
-static int __attribute__ ((nonnull(1, 2, 3, 4)))
+static int __attribute__ ((nonnull(1, 2, 3)))
 parse_route_params(struct ips **mx, const char *remhost, unsigned int *targetport, void *buf, const char *host, const char *port)
 {
 	if (host != NULL) {
@@ -188,6 +166,244 @@ parse_route_params(struct ips **mx, const char *remhost, unsigned int *targetpor
 	return 0;
 }
 
+/**
+ * @brief use the settings of a static route
+ * @param values the values of the settings, NULL for settings not given
+ * @param remhost original remote host
+ * @param targetport port on the remote host to connect to
+ * @param buf additional buffer, will be freed in case of fatal error, may be NULL
+ * @returns MX list if a relay is given in the route
+ * @retval NULL no relay given (errno is 0) or out of memory (errno is set)
+ *
+ * The function will abort the program if one of the settings is invalid.
+ */
+static struct ips *
+use_route(const char **values, const char *remhost, unsigned int *targetport, void *buf)
+{
+	const char *v = values[ROUTE_CLIENTCERT];
+
+	if (v != NULL) {
+		if (access(v, R_OK) != 0) {
+			const char *logmsg[] = { "invalid certificate '", v,
+						"' given for \"", remhost, "\"", NULL };
+
+			err_confn(logmsg, buf);
+		} else {
+			clientcertbuf = strdup(v);
+			if (clientcertbuf == NULL) {
+				free(buf);
+				err_mem(0);
+			} else
+				clientcertname = clientcertbuf;
+		}
+	}
+
+	v = values[ROUTE_OUTGOINGIP];
+	if ((v != NULL) && (inet_pton_v4mapped(v, &outgoingip) <= 0)) {
+		const char *logmsg[] = { "invalid outgoingip '", v, "' given for \"",
+				remhost, "\"", NULL };
+		err_confn(logmsg, buf);
+	}
+
+	v = values[ROUTE_OUTGOINGIP6];
+	if (v != NULL) {
+		if (inet_pton(AF_INET6, v, &outgoingip6) <= 0) {
+			const char *logmsg[] = { "invalid outgoingip6 '", v, "' given for \"",
+					remhost, "\"", NULL };
+			err_confn(logmsg, buf);
+		}
+
+		if (IN6_IS_ADDR_V4MAPPED(&outgoingip6)) {
+			const char *logmsg[] = { "IPv4 mapped address '", v,
+					"' in outgoingip6 for \"", remhost, "\"", NULL };
+
+			err_confn(logmsg, buf);
+		}
+	}
+
+	struct ips *mx = NULL;
+	if (parse_route_params(&mx, remhost, targetport, buf, values[ROUTE_RELAY], values[ROUTE_PORT]) != 0) {
+		free(clientcertbuf);
+		clientcertbuf = NULL;
+		return NULL;
+	}
+
+	errno = 0;
+	return mx;
+}
+
+/**
+ * @brief get static route for domain from control/smtproutes.d
+ * @param dirfd file descriptor of control/smtproutes.d, will be closed
+ * @param remhost target to look up
+ * @param targetport port on the remote host to connect to
+ * @param found will be set to 1 if an entry for remhost exists
+ * @returns MX list if route present
+ * @retval NULL no relay given or out of memory, errno is set in that case
+ */
+static struct ips *
+smtproute_dir(const int dirfd, const char *remhost, unsigned int *targetport, int *found)
+{
+	char fnbuf[DOMAINNAME_MAX + 2];
+	const char *fn = remhost;
+	const char *curpart = remhost;
+	int fd;
+
+	while ((fd = openat(dirfd, fn, O_RDONLY | O_CLOEXEC)) < 0) {
+		if (errno != ENOENT) {
+			const char *errmsg[] = {
+					"error opening smtproute.d file for domain ",
+					remhost, NULL};
+			err_confn(errmsg, NULL);
+		}
+		if (curpart == NULL) {
+			close(dirfd);
+			*found = 0;
+			return NULL;
+		}
+
+		const char *dot = strchr(curpart, '.');
+
+		if (dot == NULL) {
+			fn = "default";
+			curpart = NULL;
+		} else {
+			assert(strlen(dot) < sizeof(fnbuf) - 2);
+			fnbuf[0] = '*';
+			strcpy(fnbuf + 1, dot);
+			fn = fnbuf;
+
+			curpart = dot + 1;
+		}
+	}
+
+	char **array;
+	const char *values[ROUTE_TAGS] = { NULL };
+
+	tagmask = 0;
+
+	close(dirfd);
+
+	/* no error */
+	if (loadlistfd(fd, &array, validroute) != 0) {
+		const char *errmsg[] = {
+				"error loading smtproute.d file for domain ",
+				remhost, NULL};
+		err_confn(errmsg, NULL);
+	}
+
+	for (unsigned int i = 0; i < ROUTE_TAGS; i++) {
+		if (tagmask & (1 << i))
+			values[i] = tagvalue(array, i);
+	}
+
+	*found = 1;
+	struct ips *mx = use_route(values, remhost, targetport, array);
+	free(array);
+
+	return mx;
+}
+
+/**
+ * @brief get static route for domain from the compiled smtproutes.d
+ * @param fd file descriptor of control/smtproutes.cdb, will be closed
+ * @param remhost target to look up
+ * @param targetport port on the remote host to connect to
+ * @param found will be set to 1 if an entry for remhost exists
+ * @returns MX list if route present
+ * @retval NULL no relay given or out of memory, errno is set in that case
+ *
+ * The database is created by qsroutes from the files in control/smtproutes.d,
+ * every file is stored with its name as key. The same names are probed as
+ * the files would be, but all of them in one mapping of the database.
+ */
+static struct ips *
+smtproute_cdb(int fd, const char *remhost, unsigned int *targetport, int *found)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) != 0) {
+		const char *errmsg[] = { "error reading smtproutes.cdb for domain ",
+				remhost, NULL };
+		close(fd);
+		err_confn(errmsg, NULL);
+	}
+
+	char *mm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mm == MAP_FAILED) {
+		const char *errmsg[] = { "error reading smtproutes.cdb for domain ",
+				remhost, NULL };
+		err_confn(errmsg, NULL);
+	}
+
+	char keybuf[DOMAINNAME_MAX + 2];
+	const char *key = remhost;
+	const char *curpart = remhost;
+	const char *data;
+	unsigned int datalen;
+
+	while ((data = cdb_find(mm, st.st_size, key, strlen(key), &datalen)) == NULL) {
+		if (errno != 0) {
+			const char *errmsg[] = { "smtproutes.cdb is corrupt, looking up domain ",
+					remhost, NULL };
+			err_confn(errmsg, NULL);
+		}
+
+		if (curpart == NULL)
+			break;
+
+		const char *dot = strchr(curpart, '.');
+
+		if (dot == NULL) {
+			key = "default";
+			curpart = NULL;
+		} else {
+			assert(strlen(dot) < sizeof(keybuf) - 2);
+			keybuf[0] = '*';
+			strcpy(keybuf + 1, dot);
+			key = keybuf;
+
+			curpart = dot + 1;
+		}
+	}
+
+	if (data == NULL) {
+		munmap(mm, st.st_size);
+		*found = 0;
+		return NULL;
+	}
+
+	/* the value holds the valid lines of the file, each terminated by a 0 byte */
+	const char *values[ROUTE_TAGS] = { NULL };
+	const char *end = data + datalen;
+	const char *errmsg[] = { "smtproutes.cdb contains invalid entry for domain ",
+			remhost, NULL };
+
+	if ((datalen > 0) && (data[datalen - 1] != '\0'))
+		err_confn(errmsg, NULL);
+
+	while (data < end) {
+		const int i = route_tag(data);
+
+		if ((i < 0) || (values[i] != NULL))
+			err_confn(errmsg, NULL);
+
+		values[i] = data + strlen(route_tags[i]) + 1;
+		data += strlen(data) + 1;
+	}
+
+	*found = 1;
+	struct ips *mx = use_route(values, remhost, targetport, NULL);
+	const int err = errno;
+
+	/* everything needed later has been copied by use_route() */
+	munmap(mm, st.st_size);
+	errno = err;
+
+	return mx;
+}
+
 /**
  * @brief get static route for domain
  *
@@ -197,137 +413,38 @@ parse_route_params(struct ips **mx, const char *remhost, unsigned int *targetpor
  * @returns MX list if route present
  * @retval NULL a runtime error occurred while reading the control file, errno is set
  *
+ * If control/smtproutes.cdb exists it is used instead of control/smtproutes.d.
  * If control/smtproutes contains a syntax error the program is terminated.
  * On runtime error (out of memory) NULL is returned and errno is set.
  */
 struct ips *
 smtproute(const char *remhost, const size_t reml, unsigned int *targetport)
 {
-	/* check if the dir exists at all to avoid probing for every
-	 * subdomain if the dir does not exist. */
-	const int dirfd = get_dirfd(controldir_fd, "smtproutes.d");
+	const int cdbfd = openat(controldir_fd, "smtproutes.cdb", O_RDONLY | O_CLOEXEC);
 
 	*targetport = 25;
 
-	if (dirfd >= 0) {
-		char fnbuf[DOMAINNAME_MAX + 2];
-		const char *fn = remhost;
-		const char *curpart = remhost;
-
-		while (1) {
-			char **array;
-			int fd = openat(dirfd, fn, O_RDONLY | O_CLOEXEC);
-			const char *hv = NULL;
-			const char *pv = NULL;
-			unsigned int i;
-
-			if (fd < 0) {
-				if (errno != ENOENT) {
-					const char *errmsg[] = {
-							"error opening smtproute.d file for domain ",
-							remhost, NULL};
-					err_confn(errmsg, NULL);
-				}
-				if (curpart == NULL) {
-					close(dirfd);
-					break;
-				} else {
-					const char *dot = strchr(curpart, '.');
-
-					if (dot == NULL) {
-						fn = "default";
-						curpart = NULL;
-					} else {
-						assert(strlen(dot) < sizeof(fnbuf) - 2);
-						fnbuf[0] = '*';
-						strcpy(fnbuf + 1, dot);
-						fn = fnbuf;
-
-						curpart = dot + 1;
-					}
-					continue;
-				}
-			}
-
-			tagmask = 0;
-
-			close(dirfd);
+	if (cdbfd >= 0) {
+		int found;
+		struct ips *mx = smtproute_cdb(cdbfd, remhost, targetport, &found);
 
-			/* no error */
-			if (loadlistfd(fd, &array, validroute) != 0) {
-				const char *errmsg[] = {
-						"error loading smtproute.d file for domain ",
-						remhost, NULL};
-				err_confn(errmsg, NULL);
-			}
+		if (found)
+			return mx;
+	} else if (errno != ENOENT) {
+		const char *errmsg[] = { "error opening smtproutes.cdb for domain ",
+				remhost, NULL };
+		err_confn(errmsg, NULL);
+	} else {
+		/* check if the dir exists at all to avoid probing for every
+		 * subdomain if the dir does not exist. */
+		const int dirfd = get_dirfd(controldir_fd, "smtproutes.d");
 
-			for (i = 0; tags[i] != NULL; i++) {
-				const char *v;
-				if (!(tagmask & (1 << i)))
-					continue;
-
-				v = tagvalue(array, i);
-
-				switch (i) {
-				case 0:
-					/* find host */
-					hv = v;
-					break;
-				case 1:
-					/* find port */
-					pv = v;
-					break;
-				case 2:
-					if (access(v, R_OK) != 0) {
-						const char *logmsg[] = { "invalid certificate '", v,
-									"' given for \"", remhost, "\"", NULL };
-
-						err_confn(logmsg, array);
-					} else {
-						clientcertbuf = strdup(v);
-						if (clientcertbuf == NULL) {
-							free(array);
-							err_mem(0);
-						} else
-							clientcertname = clientcertbuf;
-					}
-					break;
-				case 3:
-					if (inet_pton_v4mapped(v, &outgoingip) <= 0) {
-						const char *logmsg[] = { "invalid outgoingip '", v, "' given for \"",
-								remhost, "\"", NULL };
-						err_confn(logmsg, array);
-					}
-					break;
-				case 4:
-					if (inet_pton(AF_INET6, v, &outgoingip6) <= 0) {
-						const char *logmsg[] = { "invalid outgoingip6 '", v, "' given for \"",
-								remhost, "\"", NULL };
-						err_confn(logmsg, array);
-					}
-
-					if (IN6_IS_ADDR_V4MAPPED(&outgoingip6)) {
-						const char *logmsg[] = { "IPv4 mapped address '", v,
-								"' in outgoingip6 for \"", remhost, "\"", NULL };
-
-						err_confn(logmsg, array);
-					}
-
-					break;
-				default:
-					assert(0);
-				}
-			}
+		if (dirfd >= 0) {
+			int found;
+			struct ips *mx = smtproute_dir(dirfd, remhost, targetport, &found);
 
-			struct ips *mx = NULL;
-			fd = parse_route_params(&mx, remhost, targetport, array, hv, pv);
-			free(array);
-			if (fd != 0) {
-				free(clientcertbuf);
-				clientcertbuf = NULL;
-				return NULL;
-			}
-			return mx;
+			if (found)
+				return mx;
 		}
 	}
 
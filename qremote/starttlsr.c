@@ -9,6 +9,8 @@
 #include <netio.h>
 #include <qdns.h>
 #include <qdns_dane.h>
+#include <qremote/conn.h>
+#include <qremote/jobcache.h>
 #include <qremote/qremote.h>
 #include <ssl_timeoutio.h>
 #include <sstring.h>
@@ -17,6 +19,7 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <openssl/x509v3.h>
+#include <stdio.h>
 #include <string.h>
 #include <strings.h>
 #include <syslog.h>
@@ -25,6 +28,76 @@
 
 const char *clientcertname = "control/clientcert.pem";
 
+#define TLSCACHE_TTL_MAX 3600	/**< maximum number of seconds a TLS session is shared with other deliveries */
+
+static char tlscache_key[JOBCACHE_KEYLEN];	/**< the key of the sessions of the current connection in the job cache */
+
+/**
+ * @brief share a TLS session with the other deliveries
+ * @param sess the session
+ */
+static void
+tlscache_put(SSL_SESSION *sess)
+{
+	unsigned char buf[JOBCACHE_DATA];
+	unsigned char *p = buf;
+	const int len = i2d_SSL_SESSION(sess, NULL);
+
+	if ((*tlscache_key == '\0') || (len <= 0) || ((size_t)len > sizeof(buf)))
+		return;
+
+	(void) i2d_SSL_SESSION(sess, &p);
+
+	long ttl = SSL_SESSION_get_timeout(sess);
+	if ((ttl <= 0) || (ttl > TLSCACHE_TTL_MAX))
+		ttl = TLSCACHE_TTL_MAX;
+
+	jobcache_put(tlscache_key, buf, len, ttl);
+}
+
+/**
+ * @brief callback for OpenSSL when the server has sent a new session
+ * @return 0, the session is not kept
+ */
+static int
+tlscache_new_session(SSL *s __attribute__ ((unused)), SSL_SESSION *sess)
+{
+	tlscache_put(sess);
+
+	return 0;
+}
+
+/**
+ * @brief resume a session another delivery has set up with the same host
+ * @param myssl the connection
+ *
+ * The session is removed from the cache, TLS 1.3 sessions should only be
+ * used once (RfC 8446, appendix C.4). The server usually sends new sessions
+ * after the handshake, which are stored by tlscache_new_session().
+ */
+static void
+tlscache_resume(SSL *myssl)
+{
+	unsigned char buf[JOBCACHE_DATA];
+	const unsigned char *p = buf;
+
+	if (snprintf(tlscache_key, sizeof(tlscache_key), "tls:%s:%u", rhost, targetport) >= (int)sizeof(tlscache_key)) {
+		*tlscache_key = '\0';
+		return;
+	}
+
+	const ssize_t len = jobcache_get(tlscache_key, buf, sizeof(buf), 1);
+	if (len <= 0)
+		return;
+
+	SSL_SESSION *sess = d2i_SSL_SESSION(NULL, &p, len);
+	if (sess == NULL)
+		return;
+
+	(void) SSL_set_session(myssl, sess);
+	SSL_SESSION_free(sess);
+}
+
 /**
  * @brief send STARTTLS and handle the connection setup
  * @param d the dane information received for that domain
@@ -75,6 +148,10 @@ tls_init(const struct daneinfo *tlsa_info, int tlsa_cnt)
 	/* disable obsolete and insecure protocol versions */
 	SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
 
+	/* new sessions are only passed to the job cache */
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, tlscache_new_session);
+
 	if (*servercert && !SSL_CTX_load_verify_locations(ctx, servercert, NULL)) {
 		const char *msg[] = { "Z4.5.0 TLS unable to load ", servercert, ": ",
 				ssl_error(),  "; connecting to ", rhost };
@@ -228,6 +305,8 @@ tls_init(const struct daneinfo *tlsa_info, int tlsa_cnt)
 		err_conf("can't set ciphers\n");
 	}
 
+	tlscache_resume(myssl);
+
 	i = SSL_set_fd(myssl, socketd);
 	if (i != 1) {
 		const char *msg[] = { "Z4.5.0 TLS error setting fd: ", ssl_error(), "; connecting to ",
@@ -269,6 +348,14 @@ tls_init(const struct daneinfo *tlsa_info, int tlsa_cnt)
 		return -i;
 	}
 
+#ifdef TLS1_3_VERSION
+	/* a resumed TLS 1.2 session may be used again, the server will not send a new one */
+	if (SSL_session_reused(ssl) && (SSL_version(ssl) < TLS1_3_VERSION))
+#else
+	if (SSL_session_reused(ssl))
+#endif
+		tlscache_put(SSL_get_session(ssl));
+
 	if (*servercert || tlsa_usable > 0) {
 		long r = SSL_get_verify_result(ssl);
 
@@ -3,6 +3,7 @@
  */
 
 #include <qremote/qremote.h>
+#include <metrics.h>
 #include <netio.h>
 
 #include <string.h>
@@ -13,6 +14,15 @@
  * need to access this. */
 int statusfd = 1;
 
+void
+count_status(const char code)
+{
+	const char *pos = strchr(METRICS_QREMOTE_STATUS, code);
+
+	if ((code != '\0') && (pos != NULL))
+		metrics_inc(METRIC_QREMOTE_STATUS + (pos - METRICS_QREMOTE_STATUS));
+}
+
 static void
 write_status_vec(const struct iovec *data, int cnt)
 {
@@ -39,6 +49,8 @@ write_status_raw(const char *str, const size_t len)
 void
 write_status(const char *str)
 {
+	count_status(*str);
+
 	struct iovec data[] = {
 		{
 			.iov_base = (void*)str,
@@ -75,6 +87,8 @@ write_status_raw_m(const char **strs, const unsigned int count)
 void
 write_status_m(const char **strs, const unsigned int count)
 {
+	count_status(*strs[0]);
+
 	struct iovec *vectors = calloc(count + 1, sizeof(*vectors));
 
 	if (vectors == NULL) {
@@ -22,7 +22,9 @@
 #include <openssl/ssl.h>
 #include <poll.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
@@ -78,6 +80,189 @@ reverseip4(char *buf)
 	return strlen(buf);
 }
 
+static struct lookup_memo *memos;	/**< the remembered lookups */
+static unsigned int memocount;		/**< number of entries in memos */
+static unsigned int memosize;		/**< number of allocated entries in memos */
+static int memo_enabled;		/**< if lookups should be remembered at all */
+
+/**
+ * @brief start remembering the results of lookups
+ *
+ * This is only done when explicitely enabled, so callers that expect
+ * a new lookup on every call (e.g. the testcases) still get one.
+ */
+void
+lookup_memo_enable(void)
+{
+	memo_enabled = 1;
+}
+
+/**
+ * @brief forget all remembered lookups
+ */
+void
+lookup_memo_free(void)
+{
+	for (unsigned int i = 0; i < memocount; i++) {
+		free(memos[i].name);
+		free(memos[i].txt);
+	}
+	free(memos);
+	memos = NULL;
+	memocount = 0;
+	memosize = 0;
+}
+
+/**
+ * @brief forget all remembered lookups of one kind
+ * @param kind the kind of lookup
+ *
+ * This is used for results that depend on the transaction, e.g. the result
+ * of an SPF check may depend on the local part of the sender.
+ */
+void
+lookup_memo_forget(const enum lookup_memo_kind kind)
+{
+	unsigned int j = 0;
+
+	for (unsigned int i = 0; i < memocount; i++) {
+		if (memos[i].kind == kind) {
+			free(memos[i].name);
+			free(memos[i].txt);
+		} else {
+			memos[j++] = memos[i];
+		}
+	}
+	memocount = j;
+}
+
+/**
+ * @brief search a remembered lookup
+ * @param kind the kind of lookup
+ * @param name the name that is looked up
+ * @return the memo entry
+ * @retval NULL the lookup has not been done before or memoization is disabled
+ */
+struct lookup_memo *
+lookup_memo_find(const enum lookup_memo_kind kind, const char *name)
+{
+	for (unsigned int i = 0; i < memocount; i++) {
+		if ((memos[i].kind == kind) && (strcasecmp(memos[i].name, name) == 0))
+			return memos + i;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief remember the result of a lookup
+ * @param kind the kind of lookup
+ * @param name the name that was looked up
+ * @param result the result of the lookup
+ * @return the new memo entry
+ * @retval NULL memoization is disabled or there was not enough memory
+ *
+ * Not being able to remember a result is no error, the lookup will just
+ * be done again the next time. The returned pointer is only valid until
+ * the next call to this function.
+ */
+struct lookup_memo *
+lookup_memo_add(const enum lookup_memo_kind kind, const char *name, const int result)
+{
+	if (!memo_enabled)
+		return NULL;
+
+	if (memocount == memosize) {
+		const unsigned int nsize = memosize ? memosize * 2 : 8;
+		struct lookup_memo *n = realloc(memos, nsize * sizeof(*n));
+
+		if (n == NULL)
+			return NULL;
+		memos = n;
+		memosize = nsize;
+	}
+
+	struct lookup_memo *m = memos + memocount;
+
+	m->name = strdup(name);
+	if (m->name == NULL)
+		return NULL;
+	m->kind = kind;
+	m->result = result;
+	m->txt = NULL;
+	m->has_txt = 0;
+	memocount++;
+
+	return m;
+}
+
+/**
+ * @brief store the additional text for a memo entry
+ * @param memo the entry to update
+ * @param txt the text to store, may be NULL
+ * @retval 0 the text was stored
+ * @retval -ENOMEM out of memory, the entry was not changed
+ */
+int
+lookup_memo_set_txt(struct lookup_memo *memo, const char *txt)
+{
+	char *t = NULL;
+
+	if (txt != NULL) {
+		t = strdup(txt);
+		if (t == NULL)
+			return -ENOMEM;
+	}
+
+	free(memo->txt);
+	memo->txt = t;
+	memo->has_txt = 1;
+
+	return 0;
+}
+
+/**
+ * @brief look up an A record, using the remembered result if possible
+ * @param kind the kind of lookup
+ * @param name the name to look up
+ * @param memo the memo entry of the lookup is stored here, NULL if there is none
+ * @return the result of ask_dnsa()
+ *
+ * Temporary errors are not remembered, otherwise a single failure of the
+ * resolver would cause temporary rejections for the rest of the session.
+ */
+int
+lookup_memo_dnsa(const enum lookup_memo_kind kind, const char *name, struct lookup_memo **memo)
+{
+	*memo = lookup_memo_find(kind, name);
+	if (*memo != NULL)
+		return (*memo)->result;
+
+	const int r = ask_dnsa(name, NULL);
+	if ((r != DNS_ERROR_LOCAL) && (r != DNS_ERROR_TEMP))
+		*memo = lookup_memo_add(kind, name, r);
+
+	return r;
+}
+
+/**
+ * @brief get the TXT record of a blocklist listing
+ * @param txt the TXT record is stored here
+ * @param name the name to look up
+ * @param memo the memo entry of the A lookup of that name, may be NULL
+ */
+void
+lookup_memo_dnstxt(char **txt, const char *name, struct lookup_memo *memo)
+{
+	if ((memo != NULL) && memo->has_txt) {
+		*txt = (memo->txt == NULL) ? NULL : strdup(memo->txt);
+		return;
+	}
+
+	if ((dnstxt(txt, name) == 0) && (memo != NULL))
+		(void) lookup_memo_set_txt(memo, *txt);
+}
+
 /**
  * do a rbl lookup for remoteip
  *
@@ -114,8 +299,10 @@ check_rbl(char *const *rbls, char **txt)
 		} else {
 			int j;
 
+			struct lookup_memo *m;
+
 			strcpy(lookup + l, rbls[i]);
-			j = ask_dnsa(lookup, NULL);
+			j = lookup_memo_dnsa(MEMO_DNSBL, lookup, &m);
 			switch (j) {
 			case DNS_ERROR_LOCAL:
 				return j;
@@ -129,7 +316,7 @@ check_rbl(char *const *rbls, char **txt)
 				 * so that's no real problem for us */
 				if (j > 0) {
 					if (txt != NULL)
-						(void) dnstxt(txt, lookup);
+						lookup_memo_dnstxt(txt, lookup, m);
 					return i;
 				}
 			}
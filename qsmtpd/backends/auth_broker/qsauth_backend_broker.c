@@ -0,0 +1,142 @@
+/** \file qsauth_backend_broker.c
+ \brief AUTH backend using a local authentication broker
+
+ Instead of running the checkpassword program for every authentication attempt
+ the credentials are passed to a long running broker process (e.g. qsauthd)
+ over a UNIX domain socket. The request has the same format checkpassword
+ expects on file descriptor 3. The broker replies with a single character:
+ '0' if the user was authenticated, '1' if the credentials were rejected, and
+ anything else on internal errors.
+ */
+
+#include <qsmtpd/qsauth_backend.h>
+
+#include <log.h>
+#include <netio.h>
+#include <qsmtpd/qsmtpd.h>
+#include <sstring.h>
+
+#include <errno.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifndef SOCK_CLOEXEC
+#define SOCK_CLOEXEC 0
+#endif /* SOCK_CLOEXEC */
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif /* MSG_NOSIGNAL */
+
+static struct sockaddr_un broker_addr;	/**< address of the broker socket */
+
+#define AUTH_BROKER_TIMEOUT 30	/**< seconds to wait for the broker reply */
+
+static int
+err_broker(const char *msg)
+{
+	const char *logmsg[] = { msg, ": ", strerror(errno), NULL };
+	int err = errno;
+
+	log_writen(LOG_ERR, logmsg);
+	if (!netwrite(tempnoauth))
+		return -EDONE;
+	return -err;
+}
+
+int
+auth_backend_execute(const struct string *user, const struct string *pass, const struct string *resp)
+{
+	const struct timeval tv = {
+		.tv_sec = AUTH_BROKER_TIMEOUT
+	};
+	struct iovec iov[4] = {
+		{ .iov_base = user->s, .iov_len = user->len + 1 },
+		{ .iov_base = pass->s, .iov_len = pass->len + 1 },
+		{ .iov_base = (resp != NULL) ? resp->s : NULL, .iov_len = (resp != NULL) ? resp->len : 0 },
+		{ .iov_base = (void *)"", .iov_len = 1 }
+	};
+	struct msghdr mh = {
+		.msg_iov = iov,
+		.msg_iovlen = sizeof(iov) / sizeof(iov[0])
+	};
+	size_t total = 0;
+	char res;
+
+	for (unsigned int i = 0; i < sizeof(iov) / sizeof(iov[0]); i++)
+		total += iov[i].iov_len;
+
+	int sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sd < 0)
+		return err_broker("cannot create socket for auth broker");
+
+	if ((setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0) ||
+			(setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) != 0) ||
+			(connect(sd, (struct sockaddr *)&broker_addr, sizeof(broker_addr)) != 0)) {
+		int r = err_broker("cannot connect to auth broker");
+		close(sd);
+		return r;
+	}
+
+	/* the request is at most a few hundred bytes, so it is sent at once */
+	ssize_t w = sendmsg(sd, &mh, MSG_NOSIGNAL);
+	if ((w < 0) || ((size_t)w != total) || (shutdown(sd, SHUT_WR) != 0)) {
+		int r;
+
+		if (w >= 0)
+			errno = EIO;
+		r = err_broker("error sending request to auth broker");
+		close(sd);
+		return r;
+	}
+
+	ssize_t rlen = read(sd, &res, 1);
+	if (rlen != 1) {
+		int r;
+
+		if (rlen == 0)
+			errno = EPIPE;
+		r = err_broker("error reading reply from auth broker");
+		close(sd);
+		return r;
+	}
+	close(sd);
+
+	switch (res) {
+	case '0':
+		return 0; /* yes */
+	case '1':
+		return 1; /* no */
+	default:
+		errno = EIO;
+		return err_broker("auth broker reported an error");
+	}
+}
+
+int
+auth_backend_setup(int argc, const char **argv)
+{
+	if (argc != 3) {
+		log_write(LOG_ERR, "invalid number of parameters given");
+		return -EINVAL;
+	}
+
+	if (strlen(argv[2]) >= sizeof(broker_addr.sun_path)) {
+		const char *msg[] = { "path of auth broker socket '", argv[2], "' is too long", NULL };
+
+		log_writen(LOG_ERR, msg);
+
+		return -ENAMETOOLONG;
+	}
+
+	memset(&broker_addr, 0, sizeof(broker_addr));
+	broker_addr.sun_family = AF_UNIX;
+	strcpy(broker_addr.sun_path, argv[2]);
+
+	return 0;
+}
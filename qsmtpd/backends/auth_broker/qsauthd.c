@@ -0,0 +1,568 @@
+/** \file qsauthd.c
+ \brief reference authentication broker for Qsmtpd
+
+ qsauthd listens on a UNIX domain socket for requests of the broker AUTH
+ backend of Qsmtpd. Every request is checked by running a checkpassword
+ compatible program, just like the checkpassword backend does. Successful
+ results are cached for a short time so clients authenticating again and
+ again do not cause a new process to be spawned every time. The cache only
+ holds salted hashes of the credentials, the salt is random and only known
+ to the running process.
+
+ The socket is only accessible by its owner, which can be set with the -u
+ option to the user Qsmtpd runs as. Requests are read from all clients in
+ parallel, a client that does not send its request in time is dropped.
+
+ Usage: qsauthd [-t ttl] [-u user] socket checkprogram subprogram [args ...]
+ */
+
+#include <log.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_REQUEST 1024	/**< maximum size of a request */
+#define CACHE_SLOTS 1024	/**< number of cached positive results */
+#define MAX_PENDING 32		/**< maximum number of concurrently running check programs */
+#define KEYLEN 32		/**< length of the cache key (SHA-256) */
+#define MAX_READING 64		/**< maximum number of clients sending their request at the same time */
+#define REQUEST_TIMEOUT 5	/**< seconds a client may take to send the request */
+
+/** @struct cache_entry
+ @brief a cached positive authentication result
+ */
+struct cache_entry {
+	unsigned char key[KEYLEN];	/**< salted hash of the request */
+	time_t expires;			/**< time the entry becomes invalid */
+};
+
+/** @struct pending_check
+ @brief a running check program
+ */
+struct pending_check {
+	pid_t pid;			/**< process id of the check program */
+	int clientfd;			/**< connection to the client waiting for the result */
+	unsigned char key[KEYLEN];	/**< cache key of the request */
+};
+
+/** @struct reading_client
+ @brief a client that has not sent its complete request yet
+ */
+struct reading_client {
+	int fd;				/**< connection to the client */
+	size_t len;			/**< bytes of the request received so far */
+	time_t deadline;		/**< the client is dropped if the request is not complete by then */
+	char req[MAX_REQUEST];		/**< the request */
+};
+
+static struct cache_entry cache[CACHE_SLOTS];
+static struct reading_client reading[MAX_READING];
+static unsigned int nreading;
+static struct pending_check pending[MAX_PENDING];
+static unsigned int npending;
+static unsigned char salt[16];
+static unsigned long cachettl = 60;
+static char **checkargs;
+static int sigpipe[2];
+
+static void
+sigchld(int sig __attribute__ ((unused)))
+{
+	const int e = errno;
+	/* the pipe is non-blocking, a full pipe already wakes up the main loop */
+	ssize_t r = write(sigpipe[1], "", 1);
+
+	(void) r;
+	errno = e;
+}
+
+/**
+ * @brief calculate the cache key of a request
+ */
+static int
+request_key(const char *req, const size_t len, unsigned char *key)
+{
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	int ok;
+
+	if (ctx == NULL)
+		return -ENOMEM;
+
+	ok = EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) &&
+			EVP_DigestUpdate(ctx, salt, sizeof(salt)) &&
+			EVP_DigestUpdate(ctx, req, len) &&
+			EVP_DigestFinal_ex(ctx, key, NULL);
+
+	EVP_MD_CTX_free(ctx);
+
+	return ok ? 0 : -EINVAL;
+}
+
+static struct cache_entry *
+cache_slot(const unsigned char *key)
+{
+	uint32_t h;
+
+	memcpy(&h, key, sizeof(h));
+
+	return cache + (h % CACHE_SLOTS);
+}
+
+static int
+cache_lookup(const unsigned char *key)
+{
+	const struct cache_entry *e = cache_slot(key);
+
+	return (e->expires > time(NULL)) && (CRYPTO_memcmp(e->key, key, KEYLEN) == 0);
+}
+
+static void
+cache_store(const unsigned char *key)
+{
+	struct cache_entry *e = cache_slot(key);
+
+	if (cachettl == 0)
+		return;
+
+	memcpy(e->key, key, KEYLEN);
+	e->expires = time(NULL) + cachettl;
+}
+
+static void
+reply(const int fd, const char res)
+{
+	ssize_t r = write(fd, &res, 1);
+
+	(void) r;
+	close(fd);
+}
+
+/**
+ * @brief collect the results of all finished check programs
+ */
+static void
+reap_children(void)
+{
+	pid_t pid;
+	int wstat;
+
+	while ((pid = waitpid(-1, &wstat, WNOHANG)) > 0) {
+		unsigned int i;
+
+		for (i = 0; i < npending; i++)
+			if (pending[i].pid == pid)
+				break;
+
+		if (i == npending)
+			continue;
+
+		if (!WIFEXITED(wstat)) {
+			log_write(LOG_ERR, "auth child crashed");
+			reply(pending[i].clientfd, '2');
+		} else if (WEXITSTATUS(wstat) != 0) {
+			reply(pending[i].clientfd, '1');
+		} else {
+			cache_store(pending[i].key);
+			reply(pending[i].clientfd, '0');
+		}
+
+		OPENSSL_cleanse(pending + i, sizeof(pending[i]));
+		pending[i] = pending[--npending];
+	}
+}
+
+/**
+ * @brief start the check program for a request
+ * @return 0 on success, negative error code otherwise
+ */
+static int
+start_check(const int clientfd, const char *req, const size_t len, const unsigned char *key)
+{
+	int pi[2];
+	pid_t child;
+
+	if (pipe(pi) != 0)
+		return -errno;
+
+	child = fork();
+	if (child < 0) {
+		int e = errno;
+		close(pi[0]);
+		close(pi[1]);
+		return -e;
+	}
+
+	if (child == 0) {
+		sigset_t mask;
+
+		close(pi[1]);
+		if (pi[0] != 3) {
+			if (dup2(pi[0], 3) != 3)
+				_exit(1);
+			close(pi[0]);
+		}
+		signal(SIGCHLD, SIG_DFL);
+		signal(SIGPIPE, SIG_DFL);
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+
+		execvp(checkargs[0], checkargs);
+		_exit(1);
+	}
+
+	close(pi[0]);
+	/* the request is smaller than the pipe buffer, so this never blocks */
+	ssize_t w = write(pi[1], req, len);
+	close(pi[1]);
+	if ((w < 0) || ((size_t)w != len)) {
+		/* the child will fail reading the request and report an error */
+		log_write(LOG_ERR, "pipe error while authenticating");
+	}
+
+	pending[npending].pid = child;
+	pending[npending].clientfd = clientfd;
+	memcpy(pending[npending].key, key, KEYLEN);
+	npending++;
+
+	return 0;
+}
+
+/**
+ * @brief process a complete request
+ * @param fd the connection to the client
+ * @param req the request
+ * @param len length of req
+ */
+static void
+handle_request(const int fd, const char *req, const size_t len)
+{
+	unsigned char key[KEYLEN];
+	unsigned int nuls = 0;
+
+	for (size_t i = 0; i < len; i++)
+		if (req[i] == '\0')
+			nuls++;
+
+	/* user, password, and response, each terminated by a 0 byte */
+	if ((len == MAX_REQUEST) || (nuls < 3) || (req[len - 1] != '\0')) {
+		log_write(LOG_WARNING, "invalid request received");
+		reply(fd, '2');
+		return;
+	}
+
+	if (request_key(req, len, key) != 0) {
+		reply(fd, '2');
+		return;
+	}
+
+	if (cache_lookup(key)) {
+		reply(fd, '0');
+		return;
+	}
+
+	if (start_check(fd, req, len, key) != 0) {
+		log_write(LOG_ERR, "cannot fork auth");
+		reply(fd, '2');
+	}
+	OPENSSL_cleanse(key, sizeof(key));
+}
+
+static time_t
+now_monotonic(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+/**
+ * @brief remove a client from the list of clients sending their request
+ * @param idx index of the client in reading
+ *
+ * The connection is not closed.
+ */
+static void
+reading_remove(const unsigned int idx)
+{
+	OPENSSL_cleanse(reading[idx].req, reading[idx].len);
+	reading[idx] = reading[--nreading];
+	reading[nreading].len = 0;
+}
+
+/**
+ * @brief accept a new client connection
+ */
+static void
+accept_client(const int listenfd)
+{
+	int fd = accept(listenfd, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	if ((fcntl(fd, F_SETFD, FD_CLOEXEC) != 0) || (fcntl(fd, F_SETFL, O_NONBLOCK) != 0)) {
+		close(fd);
+		return;
+	}
+
+	reading[nreading].fd = fd;
+	reading[nreading].len = 0;
+	reading[nreading].deadline = now_monotonic() + REQUEST_TIMEOUT;
+	nreading++;
+}
+
+/**
+ * @brief read the data a client has sent
+ * @param idx index of the client in reading
+ *
+ * The client shuts down its sending side after the request, the request is
+ * processed once the end of input is reached.
+ */
+static void
+read_client(const unsigned int idx)
+{
+	struct reading_client *c = reading + idx;
+
+	while (c->len < sizeof(c->req)) {
+		ssize_t r = read(c->fd, c->req + c->len, sizeof(c->req) - c->len);
+
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				return;
+			close(c->fd);
+			reading_remove(idx);
+			return;
+		}
+		if (r == 0)
+			break;
+		c->len += r;
+	}
+
+	/* the checks and the reply are done by blocking I/O, the reply is only 1 byte */
+	if (fcntl(c->fd, F_SETFL, 0) != 0) {
+		close(c->fd);
+		reading_remove(idx);
+		return;
+	}
+
+	handle_request(c->fd, c->req, c->len);
+	reading_remove(idx);
+}
+
+/**
+ * @brief drop all clients that did not send their request in time
+ * @param now the current time
+ */
+static void
+expire_clients(const time_t now)
+{
+	for (unsigned int i = 0; i < nreading; ) {
+		if (reading[i].deadline <= now) {
+			log_write(LOG_WARNING, "timeout while reading request");
+			close(reading[i].fd);
+			reading_remove(i);
+		} else {
+			i++;
+		}
+	}
+}
+
+/**
+ * @brief create the listening socket
+ * @param path path of the socket
+ * @param owner the user the socket is given to, NULL to keep the current user
+ * @return the socket
+ * @retval -1 the socket could not be created
+ *
+ * The socket is only accessible by its owner, otherwise every local user
+ * could use it to check passwords.
+ */
+static int
+setup_socket(const char *path, const struct passwd *owner)
+{
+	struct sockaddr_un sa = {
+		.sun_family = AF_UNIX
+	};
+	struct stat st;
+
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		fprintf(stderr, "socket path %s is too long\n", path);
+		return -1;
+	}
+	strcpy(sa.sun_path, path);
+
+	/* remove a stale socket of a previous instance */
+	if ((lstat(path, &st) == 0) && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	/* never let the socket be accessible by others, not even for a moment */
+	const mode_t oldmask = umask(077);
+	const int b = bind(fd, (struct sockaddr *)&sa, sizeof(sa));
+	umask(oldmask);
+
+	if ((fcntl(fd, F_SETFD, FD_CLOEXEC) != 0) || (b != 0) ||
+			(chmod(path, 0600) != 0) ||
+			((owner != NULL) && (chown(path, owner->pw_uid, owner->pw_gid) != 0)) ||
+			(listen(fd, SOMAXCONN) != 0)) {
+		perror(path);
+		close(fd);
+		if (b == 0)
+			unlink(path);
+		return -1;
+	}
+
+	return fd;
+}
+
+int
+main(int argc, char **argv)
+{
+	int opt;
+	const struct passwd *owner = NULL;
+
+	while ((opt = getopt(argc, argv, "t:u:")) != -1) {
+		switch (opt) {
+		case 't':
+			{
+			char *end;
+
+			cachettl = strtoul(optarg, &end, 10);
+			if ((*end != '\0') || (*optarg == '\0')) {
+				fprintf(stderr, "invalid cache time: %s\n", optarg);
+				return 1;
+			}
+			break;
+			}
+		case 'u':
+			owner = getpwnam(optarg);
+			if (owner == NULL) {
+				fprintf(stderr, "unknown user: %s\n", optarg);
+				return 1;
+			}
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-t ttl] [-u user] socket checkprogram subprogram [args ...]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (argc - optind < 3) {
+		fprintf(stderr, "Usage: %s [-t ttl] [-u user] socket checkprogram subprogram [args ...]\n", argv[0]);
+		return 1;
+	}
+
+	checkargs = argv + optind + 1;
+
+	if (RAND_bytes(salt, sizeof(salt)) != 1) {
+		fputs("cannot initialize random salt\n", stderr);
+		return 1;
+	}
+
+	if (pipe(sigpipe) != 0) {
+		perror("pipe");
+		return 1;
+	}
+	for (unsigned int i = 0; i < 2; i++) {
+		fcntl(sigpipe[i], F_SETFD, FD_CLOEXEC);
+		fcntl(sigpipe[i], F_SETFL, O_NONBLOCK);
+	}
+
+	struct sigaction sa = {
+		.sa_handler = sigchld,
+		.sa_flags = SA_RESTART | SA_NOCLDSTOP
+	};
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGCHLD, &sa, NULL) != 0) {
+		perror("sigaction");
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	int listenfd = setup_socket(argv[optind], owner);
+	if (listenfd < 0)
+		return 1;
+
+#ifdef USESYSLOG
+	openlog("qsauthd", LOG_PID, LOG_MAIL);
+#endif
+
+	while (1) {
+		struct pollfd pfd[2 + MAX_READING] = {
+			{
+				.fd = sigpipe[0],
+				.events = POLLIN
+			},
+			{
+				.fd = listenfd,
+				/* do not accept new requests while all slots are busy */
+				.events = ((npending < MAX_PENDING) && (nreading < MAX_READING)) ? POLLIN : 0
+			}
+		};
+		int timeout = -1;
+		const time_t now = now_monotonic();
+
+		for (unsigned int i = 0; i < nreading; i++) {
+			const int left = (reading[i].deadline - now) * 1000;
+
+			pfd[2 + i].fd = reading[i].fd;
+			/* a complete request needs a free slot to start the check program */
+			pfd[2 + i].events = (npending < MAX_PENDING) ? POLLIN : 0;
+			if ((timeout < 0) || (left < timeout))
+				timeout = (left > 0) ? left : 0;
+		}
+		const unsigned int nfds = 2 + nreading;
+
+		if (poll(pfd, nfds, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			log_write(LOG_ERR, "poll() failed");
+			return 1;
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			char buf[32];
+
+			while (read(sigpipe[0], buf, sizeof(buf)) > 0)
+				;
+			reap_children();
+		}
+
+		/* walk backwards, reading_remove() moves the last entry into the freed slot */
+		for (unsigned int i = nfds - 2; i > 0; i--) {
+			if ((pfd[1 + i].revents != 0) && (npending < MAX_PENDING))
+				read_client(i - 1);
+		}
+
+		expire_clients(now_monotonic());
+
+		if (pfd[1].revents & POLLIN)
+			accept_client(listenfd);
+	}
+}
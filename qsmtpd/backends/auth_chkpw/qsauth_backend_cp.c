@@ -9,7 +9,6 @@
 #include <qsmtpd/qsmtpd.h>
 
 #include <errno.h>
-#include <signal.h>
 #include <syslog.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -51,7 +50,7 @@ static int err_write(void)
 
 #define WRITE(a,b) \
 	do { \
-		if (write(pi[1], (a), (b)) < 0) { \
+		if (write(pi[0][1], (a), (b)) < 0) { \
 			return err_write(); \
 		} \
 	} while (0)
@@ -61,34 +60,18 @@ auth_backend_execute(const struct string *user, const struct string *pass, const
 {
 	pid_t child;
 	int wstat;
-	int pi[2];
+	int pi[1][2];
+	const int target = 3;
+	char *argv[] = { (char *)auth_check, (char *)*auth_sub, NULL };
 
-	if (pipe(pi) == -1)
+	if (pipe(pi[0]) == -1)
 		return err_pipe();
 
-	switch (child = fork_clean()) {
-	case -1:
-		close(pi[0]);
-		close(pi[1]);
+	child = spawn_piped(auth_check, argv, pi, &target, 1);
+	if (child == -1) {
+		close(pi[0][1]);
 		return err_fork();
-	case 0:
-		{
-		sigset_t mask;
-
-		if (pipe_move(pi, 3) != 0)
-			_exit(1);
-
-		sigemptyset(&mask);
-		sigaddset(&mask, SIGPIPE);
-		if (sigprocmask(SIG_UNBLOCK, &mask, NULL) != 0)
-			_exit(1);
-
-		execlp(auth_check, auth_check, *auth_sub, NULL);
-		_exit(1);
-		}
 	}
-	if (close(pi[0]) != 0)
-		return err_write();
 
 	WRITE(user->s, user->len + 1);
 	WRITE(pass->s, pass->len + 1);
@@ -96,7 +79,7 @@ auth_backend_execute(const struct string *user, const struct string *pass, const
 		WRITE(resp->s, resp->len);
 	WRITE("", 1);
 
-	if (close(pi[1]) != 0)
+	if (close(pi[0][1]) != 0)
 		return err_write();
 
 	if (waitpid(child, &wstat, 0) == -1)
@@ -4,9 +4,15 @@
 
 #include <qsmtpd/qsmtpd.h>
 
+#include <tls.h>
+
 #include <errno.h>
+#include <signal.h>
+#include <spawn.h>
 #include <unistd.h>
 
+extern char **environ;
+
 /**
  * @brief move the read end of the pipe to the target descriptor
  * @param p both ends of the pipe
@@ -33,3 +39,87 @@ pipe_move(int p[2], int target)
 
 	return 0;
 }
+
+/**
+ * @brief start a helper program reading from pipes
+ * @param prog the program to run, searched in PATH
+ * @param argv the arguments of the program, NULL terminated
+ * @param pipes the pipes the program reads from
+ * @param targets the descriptors the read ends of pipes are moved to
+ * @param count number of entries in pipes and targets
+ * @return pid of the new process
+ * @retval -1 the process could not be started, errno is set
+ *
+ * This is what fork_clean() followed by pipe_move() for every pipe and
+ * execvp() would do, but uses posix_spawn(), which does not need to
+ * duplicate the address space of Qsmtpd. The read ends of the pipes are
+ * closed in the parent process in any case, the write ends are kept open.
+ * The descriptors of an active TLS connection are not passed to the child,
+ * and SIGPIPE is unblocked for it.
+ */
+pid_t
+spawn_piped(const char *prog, char *const argv[], int pipes[][2], const int *targets, const unsigned int count)
+{
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	sigset_t mask;
+	pid_t pid = -1;
+	int r;
+
+	r = posix_spawn_file_actions_init(&fa);
+	if (r != 0)
+		goto out;
+	r = posix_spawnattr_init(&attr);
+	if (r != 0)
+		goto out_fa;
+
+	if (ssl) {
+		int rfd = SSL_get_rfd(ssl);
+		int wfd = SSL_get_wfd(ssl);
+
+		r = posix_spawn_file_actions_addclose(&fa, wfd);
+		if ((r == 0) && (rfd != wfd))
+			r = posix_spawn_file_actions_addclose(&fa, rfd);
+		if (r != 0)
+			goto out_attr;
+	}
+
+	for (unsigned int i = 0; i < count; i++) {
+		r = posix_spawn_file_actions_addclose(&fa, pipes[i][1]);
+		if ((r == 0) && (pipes[i][0] != targets[i])) {
+			r = posix_spawn_file_actions_adddup2(&fa, pipes[i][0], targets[i]);
+			if (r == 0)
+				r = posix_spawn_file_actions_addclose(&fa, pipes[i][0]);
+		}
+		if (r != 0)
+			goto out_attr;
+	}
+
+	/* Qsmtpd blocks SIGPIPE for itself, the helpers should not inherit that */
+	if ((sigprocmask(SIG_BLOCK, NULL, &mask) != 0) || (sigdelset(&mask, SIGPIPE) != 0)) {
+		r = errno;
+		goto out_attr;
+	}
+	r = posix_spawnattr_setsigmask(&attr, &mask);
+	if (r == 0)
+		r = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+	if (r == 0)
+		r = posix_spawnp(&pid, prog, &fa, &attr, argv, environ);
+	if (r != 0)
+		pid = -1;
+
+out_attr:
+	posix_spawnattr_destroy(&attr);
+out_fa:
+	posix_spawn_file_actions_destroy(&fa);
+out:
+	for (unsigned int i = 0; i < count; i++)
+		close(pipes[i][0]);
+
+	if (pid < 0) {
+		errno = r;
+		return -1;
+	}
+
+	return pid;
+}
@@ -3,15 +3,19 @@
 #include <diropen.h>
 #include <fmt.h>
 #include <log.h>
+#include <metrics.h>
 #include <netio.h>
 #include <qsmtpd/addrparse.h>
 #include <qsmtpd/antispam.h>
 #include <qsmtpd/qsauth.h>
 #include <qsmtpd/queue.h>
 #include <qsmtpd/qsmtpd.h>
+#include <qsmtpd/rcptset.h>
 #include <qsmtpd/starttls.h>
 #include <qsmtpd/syntax.h>
+#include <qsmtpd/timing.h>
 #include <qsmtpd/userfilters.h>
+#include <qsmtpd/verdict.h>
 #include <qsmtpd/xtext.h>
 #include <qsmtpd/userconf.h>
 #include <tls.h>
@@ -28,11 +32,13 @@
 #include <sys/queue.h>
 #include <sys/socket.h>
 #include <sys/statvfs.h>
+#include <time.h>
 #include <unistd.h>
 
 char certfilename[24 + INET6_ADDRSTRLEN + 6] = "control/servercert.pem";		/**< path to SSL certificate filename */
 
 struct rcpt_list head;
+struct arena txarena;
 
 /**
  * check if the argument given to HELO/EHLO is syntactically correct
@@ -306,6 +312,100 @@ smtp_ehlo(void)
 	return rc;
 }
 
+#define FILTER_MIN_SAMPLES 100	/**< runs of a filter needed before its statistics are used */
+
+static unsigned int *rcpt_order;	/**< the order in which the entries of rcpt_cbs are run */
+static int verdict_counted;		/**< if a rejection of this connection was recorded in the verdict cache */
+
+/**
+ * @brief how many recipients a filter rejects per time spent in it
+ * @param f index of the filter in rcpt_cbs
+ * @return rejections per nanosecond
+ * @retval -1 not enough statistics available
+ */
+static double
+rcpt_filter_score(const unsigned int f)
+{
+	if (f >= METRICS_FILTERS)
+		return -1;
+
+	const enum metrics_counter first = METRIC_SMTPD_FILTERS + f * METRICS_VERDICTS;
+	uint64_t runs = 0;
+
+	for (unsigned int v = 0; v < METRICS_VERDICTS; v++)
+		runs += metrics_get(first + v);
+	if (runs < FILTER_MIN_SAMPLES)
+		return -1;
+
+	const uint64_t denied = metrics_get(first + (FILTER_DENIED_WITH_MESSAGE - FILTER_ERROR)) +
+			metrics_get(first + (FILTER_DENIED_UNSPECIFIC - FILTER_ERROR)) +
+			metrics_get(first + (FILTER_DENIED_NOUSER - FILTER_ERROR));
+
+	return (double)denied / (double)(metrics_get(METRIC_SMTPD_FILTER_TIME + f) + 1);
+}
+
+/**
+ * @brief compute the order in which the recipient filters are run
+ *
+ * The filters marked as fixed in rcpt_filter_info stay at their position
+ * and split rcpt_cbs into segments. Inside a segment the filters that only
+ * look at local data run before those that need DNS lookups, and filters
+ * of the same cost are sorted by how many recipients they rejected per time
+ * spent in them, summed up over all Qsmtpd processes. Filters without enough
+ * statistics keep their relative order inside their cost class.
+ *
+ * The order is only computed once per session. If there is not enough memory
+ * rcpt_order stays NULL and the filters are run in the order of rcpt_cbs.
+ */
+static void
+rcpt_order_init(void)
+{
+	unsigned int cnt = 0;
+
+	while (rcpt_cbs[cnt] != NULL)
+		cnt++;
+
+	double *score = malloc(cnt * sizeof(*score));
+	rcpt_order = malloc(cnt * sizeof(*rcpt_order));
+	if ((score == NULL) || (rcpt_order == NULL)) {
+		free(score);
+		free(rcpt_order);
+		rcpt_order = NULL;
+		return;
+	}
+
+	for (unsigned int f = 0; f < cnt; f++) {
+		rcpt_order[f] = f;
+		score[f] = rcpt_filter_score(f);
+	}
+
+	/* insertion sort inside each segment, it is stable and the list is short */
+	for (unsigned int f = 1; f < cnt; f++) {
+		const unsigned int cur = rcpt_order[f];
+		unsigned int p = f;
+
+		if (rcpt_filter_info[cur].fixed)
+			continue;
+
+		while (p > 0) {
+			const unsigned int prev = rcpt_order[p - 1];
+
+			if (rcpt_filter_info[prev].fixed)
+				break;
+			if (rcpt_filter_info[prev].cost < rcpt_filter_info[cur].cost)
+				break;
+			if ((rcpt_filter_info[prev].cost == rcpt_filter_info[cur].cost) &&
+					(score[prev] >= score[cur]))
+				break;
+			rcpt_order[p] = prev;
+			p--;
+		}
+		rcpt_order[p] = cur;
+	}
+
+	free(score);
+}
+
 int
 smtp_rcpt(void)
 {
@@ -330,7 +430,9 @@ smtp_rcpt(void)
 		return netwrite("452 4.5.3 Too many recipients\r\n") ? errno : 0;
 
 	userconf_init(&ds);
+	const uint64_t lookupstart = timing_now();
 	int i = addrparse(linein.s + 9 + bugoffset, 1, &tmp, &more, &ds, rcpthosts, rcpthsize);
+	timing_add(TIMING_RCPT_USER, lookupstart);
 	logmsg[2] = tmp.s;
 
 	if  (i > 0) {
@@ -408,15 +510,35 @@ smtp_rcpt(void)
 		return EINVAL;
 	}
 
-	struct recip *r = malloc(sizeof(*r));
+	/* the same recipient given twice would get the mail twice. Bounces
+	 * are not handled here, they may only have a single RCPT command. */
+	struct recip *dup = (xmitstat.mailfrom.len == 0) ? NULL : rcptset_find(tmp.s, tmp.len);
+	if ((dup != NULL) && dup->ok) {
+		userconf_free(&ds);
+		free(tmp.s);
+		okmsg[1] = dup->to.s;
+		return -net_writen(okmsg);
+	}
+
+	/* the address is stored directly behind the entry */
+	struct recip *r = arena_alloc(&txarena, sizeof(*r) + tmp.len + 1);
 	if (!r) {
 		userconf_free(&ds);
 		free(tmp.s);
 		return ENOMEM;
 	}
-	r->to.s = tmp.s;
+	r->to.s = (char *)(r + 1);
 	r->to.len = tmp.len;
+	memcpy(r->to.s, tmp.s, tmp.len + 1);
+	free(tmp.s);
+	/* the parsed address is still used for the log messages */
+	tmp.s = r->to.s;
+	logmsg[2] = tmp.s;
 	r->ok = 0;	/* user will be rejected until we change this explicitely */
+	if (rcptset_add(r) != 0) {
+		userconf_free(&ds);
+		return ENOMEM;
+	}
 	thisrecip = r;
 	TAILQ_INSERT_TAIL(&head, r, entries);
 
@@ -448,19 +570,36 @@ smtp_rcpt(void)
 		return err_control2("user/domain filterconf for ", r->to.s) ? errno : EDONE;
 	}
 
-	i = 0;
+	unsigned int n = 0;
 	int e = 0;
 	enum filter_result fr = FILTER_PASSED;	/* result of user filter */
 	const char *errmsg;
 	enum config_domain bt;			/* which policy matched */
 
+	if (rcpt_order == NULL)
+		rcpt_order_init();
+
 	/* Use all filters until there is a hard state: either rejection or whitelisting.
 	 * Continue on temporary errors to see if a later filter would introduce a hard
 	 * rejection to avoid that mail to come back to us just to fail. */
-	while ((rcpt_cbs[i] != NULL) && ((fr == FILTER_PASSED) || (fr == FILTER_DENIED_TEMPORARY))) {
+	while ((rcpt_cbs[n] != NULL) && ((fr == FILTER_PASSED) || (fr == FILTER_DENIED_TEMPORARY))) {
+		const uint64_t filterstart = timing_now();
+
+		/* i is the position in rcpt_cbs, used for logging and statistics */
+		i = (rcpt_order != NULL) ? rcpt_order[n] : n;
 		errmsg = NULL;
 		fr = rcpt_cbs[i](&ds, &errmsg, &bt);
 
+		const uint64_t filterns = timing_now() - filterstart;
+		if (i < TIMING_FILTERS) {
+			sesstiming.filter_ns[i] += filterns;
+			sesstiming.filter_count[i]++;
+		}
+		if (i < METRICS_FILTERS) {
+			metrics_inc(METRIC_SMTPD_FILTERS + i * METRICS_VERDICTS + (fr - FILTER_ERROR));
+			metrics_add(METRIC_SMTPD_FILTER_TIME + i, filterns);
+		}
+
 		switch (fr) {
 		case FILTER_WHITELISTED:
 			/* will terminate the loop */
@@ -490,8 +629,8 @@ smtp_rcpt(void)
 			/* will terminate the loop */
 			break;
 		}
-		
-		i++;
+
+		n++;
 	}
 	userconf_free(&ds);
 
@@ -507,12 +646,31 @@ smtp_rcpt(void)
 		goodrcpt++;
 		r->ok = 1;
 		okmsg[1] = r->to.s;
+		verdict_accept(&xmitstat.sremoteip);
+
+		/* get qmail-queue running while the client continues */
+		if (goodrcpt == 1)
+			queue_prespawn();
 
 		return -net_writen(okmsg);
 	}
 
 	/* handle rejection */
 	e = errno;
+
+	/* A hard rejection by a filter that only looks at the connection and the
+	 * HELO will happen again if the client reconnects, remember it. Only the
+	 * global configuration applies to every recipient, and a connection is
+	 * counted only once no matter how many recipients it tries. */
+	if (verdict_active() && !verdict_counted && (fr != FILTER_DENIED_TEMPORARY) &&
+			(bt == CONFIG_GLOBAL) &&
+			(rcpt_filter_info[i].deps & (FILTER_DEP_CONNECTION | FILTER_DEP_HELO)) &&
+			!(rcpt_filter_info[i].deps & ~(FILTER_DEP_CONNECTION | FILTER_DEP_HELO)) &&
+			(is_authenticated() == 0)) {
+		verdict_reject(&xmitstat.sremoteip, i, time(NULL));
+		verdict_counted = 1;
+	}
+
 	switch (fr) {
 	case FILTER_DENIED_TEMPORARY:
 		{
@@ -759,7 +917,9 @@ smtp_from_inner(void)
 	} else if (i > 0) {
 		xmitstat.spf = SPF_IGNORE;
 	} else {
+		const uint64_t spfstart = timing_now();
 		i = check_host(s);
+		timing_add(TIMING_SPF, spfstart);
 		if (i < 0)
 			return errno;
 		xmitstat.spf = (i & 0x0f);
@@ -9,6 +9,7 @@
 #include <log.h>
 #include <netio.h>
 #include <qsmtpd/antispam.h>
+#include <qsmtpd/headerscan.h>
 #include <qsmtpd/qsmtpd.h>
 #include <qsmtpd/queue.h>
 #include <qsmtpd/syntax.h>
@@ -25,12 +26,11 @@
 #include <time.h>
 #include <unistd.h>
 
-#define MAXHOPS		100		/* maximum number of "Received:" lines allowed in a mail (loop prevention) */
-
 size_t maxbytes;			/* the maximum allowed size of message data */
 static char datebuf[35] = ">; ";		/* the date for the From- and Received-lines */
 static const char *loop_logmsg = "mail loop}";
 static const char *loop_netmsg = "554 5.4.6 too many hops, this message is looping";
+static const char *loop_dtmsg = "554 5.4.6 message is looping, found a \"Delivered-To:\" line with one of the recipients";
 
 
 static inline void
@@ -211,41 +211,6 @@ write_received(const int chunked)
 			} \
 		} while (0)
 
-/**
- * @brief check if header lines violate RfC822
- * @param headerflags flags which headers were already found
- * @param hdrname the header found on error
- * @return if processing should continue
- * @retval 0 nothing special found
- * @retval 1 a known header was found
- * @retval -2 a duplicate header was found (hdrname is set)
- * @retval -8 unencoded 8 bit data was found
- */
-static int
-check_rfc822_headers(unsigned int *headerflags, const char **hdrname)
-{
-	const char *searchpattern[] = { "Date:", "From:", "Message-Id:", NULL };
-
-	for (int j = linein.len - 1; j >= 0; j--) {
-		if (((signed char)linein.s[j]) < 0)
-			return -8;
-	}
-
-	for (int j = 0; searchpattern[j] != NULL; j++) {
-		if (!strncasecmp(searchpattern[j], linein.s, strlen(searchpattern[j]))) {
-			if ((*headerflags) & (1 << j)) {
-				*hdrname = searchpattern[j];
-				return -2;
-			} else {
-				*headerflags |= (1 << j);
-				return 1;
-			}
-		}
-	}
-
-	return 0;
-}
-
 static unsigned long msgsize;
 
 static void log_recips(const char *reason1, const char *reason2, const char *reason3)
@@ -277,18 +242,12 @@ int
 smtp_data(void)
 {
 	const char *logreasons[] = { NULL, NULL, NULL };
-	unsigned int headerflags = 0;	/* Date: and From: are required in header,
+	struct header_scan hdrscan;	/* Date: and From: are required in header,
 					 * else message is bogus (RfC 2822, section 3.6).
 					 * We also scan for Message-Id here.
 					 * RfC 2821 says server SHOULD NOT check for this,
 					 * but we let the user decide.*/
-	enum header_flags {
-		HEADER_HAS_DATE = 0x1,	/**< "Date:" header found */
-		HEADER_HAS_FROM = 0x2,	/**< "From:" header found */
-		HEADER_HAS_MSGID = 0x4	/**< "Message-Id:" header found */
-	};
 	const char *errmsgs[] = { NULL, NULL, NULL, NULL };
-	unsigned int hops = 0;		/* number of "Received:"-lines */
 
 	msgsize = 0;
 
@@ -317,6 +276,8 @@ smtp_data(void)
 	if (rc)
 		goto err_write;
 
+	hdrscan_init(&hdrscan, (xmitstat.check2822 & 1) || submission_mode);
+
 	/* loop until:
 	 * -the message is bigger than allowed
 	 * -we reach the empty line between header and body
@@ -325,70 +286,38 @@ smtp_data(void)
 	if (net_read(1))
 		goto loop_data;
 	/* write the data to mail */
-	while (!((linein.len == 1) && (linein.s[0] == '.')) && (msgsize <= maxbytes) && (linein.len > 0) && (hops <= MAXHOPS)) {
-		unsigned int offset = 0;
-		if (linein.s[0] == '.') {
-			/* write buffer beginning at [1], we do not have to check if the second character
-			 * is also a '.', RfC 2821 says only we should discard the '.' beginning the line */
-			offset = 1;
-		} else {
-			int flagr = 1;	/* if the line may be a "Received:" or "Delivered-To:"-line */
-
-			if ((xmitstat.check2822 & 1) || submission_mode) {
-				const char *hdrname;
-				switch (check_rfc822_headers(&headerflags, &hdrname)) {
-				case 0:
-					break;
-				case 1:
-					flagr = 0;
-					break;
-				case -2:
-					logreasons[0] = "more than one '";
-					logreasons[1] = hdrname;
-					logreasons[2] = "' in header}";
-
-					errmsgs[0] = "550 5.6.0 message does not comply to RfC2822: "
-							"more than one '";
-					errmsgs[1] = hdrname;
-					errmsgs[2] = "'";
-					goto loop_data;
-				case -8:
-					logreasons[0] = "8bit-character in message header}";
-					errmsgs[0] = "550 5.6.0 message does not comply to RfC2822: "
-							"8bit character in message header";
-					goto loop_data;
-				}
-			}
-			if (flagr) {
-				if (!strncasecmp("Received:", linein.s, 9)) {
-					if (++hops > MAXHOPS) {
-						logreasons[0] = loop_logmsg;
-						errmsgs[0] = loop_netmsg;
-						goto loop_data;
-					}
-				} else if ((linein.len >= 20) && !strncmp("Delivered-To:", linein.s, 13)) {
-					/* we write it exactly this way, noone else is allowed to
-					 * change our header lines so we do not need to use strncasecmp
-					 *
-					 * The minimum length of 21 are a sum of:
-					 * 13: Delivered-To:
-					 * 1: ' '
-					 * 1: at least 1 character localpart
-					 * 1: @
-					 * 1: at least 1 character domain name
-					 * 1: '.'
-					 * 2: at least 2 characters top level domain */
-					struct recip *np;
-
-					TAILQ_FOREACH(np, &head, entries) {
-						if (np->ok && !strcmp(linein.s + 14, np->to.s)) {
-							logreasons[0] = loop_logmsg;
-							errmsgs[0] = "554 5.4.6 message is looping, found a \"Delivered-To:\" line with one of the recipients";
-							goto loop_data;
-						}
-					}
-				}
-			}
+	while (!((linein.len == 1) && (linein.s[0] == '.')) && (msgsize <= maxbytes) && (linein.len > 0)) {
+		const unsigned int offset = (linein.s[0] == '.') ? 1 : 0;
+
+		/* write buffer beginning at [1], we do not have to check if the second character
+		 * is also a '.', RfC 2821 says only we should discard the '.' beginning the line */
+		hdrscan_feed(&hdrscan, linein.s + offset, linein.len - offset);
+		switch (hdrscan_feed(&hdrscan, "\n", 1)) {
+		case HDRSCAN_OK:
+			break;
+		case HDRSCAN_HOPS:
+			logreasons[0] = loop_logmsg;
+			errmsgs[0] = loop_netmsg;
+			goto loop_data;
+		case HDRSCAN_LOOP:
+			logreasons[0] = loop_logmsg;
+			errmsgs[0] = loop_dtmsg;
+			goto loop_data;
+		case HDRSCAN_DUPLICATE:
+			logreasons[0] = "more than one '";
+			logreasons[1] = hdrscan.hdrname;
+			logreasons[2] = "' in header}";
+
+			errmsgs[0] = "550 5.6.0 message does not comply to RfC2822: "
+					"more than one '";
+			errmsgs[1] = hdrscan.hdrname;
+			errmsgs[2] = "'";
+			goto loop_data;
+		case HDRSCAN_8BIT:
+			logreasons[0] = "8bit-character in message header}";
+			errmsgs[0] = "550 5.6.0 message does not comply to RfC2822: "
+					"8bit character in message header";
+			goto loop_data;
 		}
 
 		struct iovec wdata[2] = {
@@ -413,7 +342,7 @@ smtp_data(void)
 		struct iovec wdata[10];
 		unsigned int wpos = 0;
 
-		if (!(headerflags & HEADER_HAS_DATE)) {
+		if (!(hdrscan.flags & HEADER_HAS_DATE)) {
 			wdata[wpos].iov_base = "Date: ";
 			wdata[wpos].iov_len = strlen("Date: ");
 			wpos++;
@@ -421,7 +350,7 @@ smtp_data(void)
 			wdata[wpos].iov_len = 32;
 			wpos++;
 		}
-		if (!(headerflags & HEADER_HAS_FROM)) {
+		if (!(hdrscan.flags & HEADER_HAS_FROM)) {
 			wdata[wpos].iov_base = "From: <";
 			wdata[wpos].iov_len = strlen("From: <");
 			wpos++;
@@ -432,7 +361,7 @@ smtp_data(void)
 			wdata[wpos].iov_len = strlen(">\n");
 			wpos++;
 		}
-		if (!(headerflags & HEADER_HAS_MSGID)) {
+		if (!(hdrscan.flags & HEADER_HAS_MSGID)) {
 			char timebuf[20];
 			struct timeval ti;
 			size_t l;
@@ -467,11 +396,11 @@ smtp_data(void)
 			wlen += wdata[k].iov_len;
 		WRITEVEC(wdata, wpos, wlen);
 	} else if (xmitstat.check2822 & 1) {
-		if (!(headerflags & HEADER_HAS_DATE)) {
+		if (!(hdrscan.flags & HEADER_HAS_DATE)) {
 			logreasons[0] = "no 'Date:' in header}";
 			errmsgs[0] = "550 5.6.0 message does not comply to RfC2822: 'Date:' missing";
 			goto loop_data;
-		} else if (!(headerflags & HEADER_HAS_FROM)) {
+		} else if (!(hdrscan.flags & HEADER_HAS_FROM)) {
 			logreasons[0] = "no 'From:' in header}";
 			errmsgs[0] = "550 5.6.0 message does not comply to RfC2822: 'From:' missing";
 			goto loop_data;
@@ -613,6 +542,7 @@ loop_data:
 #define CHUNK_READ_SIZE (INCOMING_CHUNK_SIZE * 1024)
 static int bdaterr;
 static int lastcr;
+static struct header_scan bdathdr;	/**< the header analysis of the current message */
 
 /**
  * handle BDAT command and store data into queue
@@ -622,8 +552,6 @@ static int lastcr;
 int
 smtp_bdat(void)
 {
-#warning FIXME: loop detection missing
-	unsigned int hops = 0;		/* number of "Received:"-lines */
 	char *more;
 
 	if (!goodrcpt) {
@@ -646,6 +574,7 @@ smtp_bdat(void)
 		lastcr = 0;
 
 		bdaterr = queue_init();
+		hdrscan_init(&bdathdr, 0);
 
 		if (!bdaterr)
 			bdaterr = write_received(1);
@@ -672,6 +601,8 @@ smtp_bdat(void)
 
 			chunksize -= chunk;
 			msgsize += chunk;
+			/* this stops costing anything once the end of the header was found */
+			hdrscan_feed(&bdathdr, inbuf, chunk);
 			/* if the last chunk ended in CR and there is no LF right here then keep the CR */
 			if (lastcr && (inbuf[0] != '\n'))
 				WRITEL("\r");
@@ -719,6 +650,14 @@ smtp_bdat(void)
 		bdaterr = EMSGSIZE;
 		freedata();
 	}
+	if ((bdathdr.result != HDRSCAN_OK) && !bdaterr) {
+		const char *errmsgs[] = { (bdathdr.result == HDRSCAN_LOOP) ? loop_dtmsg : loop_netmsg, NULL };
+
+		log_recips(loop_logmsg, NULL, NULL);
+		queue_reset();
+		freedata();
+		return net_writen(errmsgs) ? errno : EDONE;
+	}
 	/* send envelope data if this is last chunk */
 	if (*more && !bdaterr) {
 		if (queue_envelope(msgsize, 1))
@@ -731,14 +670,6 @@ smtp_bdat(void)
 		if (queuefd_hdr >= 0)
 			queue_reset();
 		freedata();
-	} else if (hops > MAXHOPS) {
-		const char *errmsgs[] = { loop_netmsg, NULL };
-		log_recips(loop_logmsg, NULL, NULL);
-		freedata();
-		if (net_writen(errmsgs))
-			bdaterr = -errno;
-		else
-			bdaterr = -EDONE;
 	} else {
 		/* This returns the size as given by the client. It has successfully been parsed as number.
 		 * and the contents of this message do not really matter, so we can just reuse that. This
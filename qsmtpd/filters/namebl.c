@@ -13,6 +13,68 @@
 #include <qsmtpd/qsmtpd.h>
 #include <qsmtpd/userconf.h>
 
+/**
+ * @brief build the name to look up in a blocklist
+ * @param blname the name is stored here, must have DOMAINNAME_MAX + 1 bytes
+ * @param d the (partial) sender domain
+ * @param bl the blocklist
+ * @retval 0 the name was built
+ * @retval -1 the name would be too long
+ */
+static int
+namebl_name(char *blname, const char *d, const char *bl)
+{
+	size_t dlen = strlen(d);
+	const size_t alen = strlen(bl) + 1;
+
+	if (dlen + alen >= DOMAINNAME_MAX + 1)
+		return -1;
+
+	memcpy(blname, d, dlen);
+	blname[dlen++] = '.';
+	/* This is no overrun as alen already includes the terminating
+	 * '\0', and the size was checked for being smaller than the
+	 * buffer length before. */
+	memcpy(blname + dlen, bl, alen);
+
+	return 0;
+}
+
+/**
+ * @brief send all lookups that are not yet known to the resolver at once
+ * @param a the blocklists
+ * @param fromdomain the sender domain
+ *
+ * The lists are checked one after another by cb_namebl(), all but the first
+ * lookup are then already answered by the resolver. Names that were looked
+ * up for a previous recipient are not sent again. Temporary errors are not
+ * remembered, so those names are asked again.
+ */
+static void
+namebl_prefetch(char **a, const char *fromdomain)
+{
+	int first = 1;
+
+	for (unsigned int i = 0; a[i] != NULL; i++) {
+		const char *d = fromdomain;
+
+		while (d != NULL) {
+			char blname[DOMAINNAME_MAX + 1];
+
+			if ((namebl_name(blname, d, a[i]) == 0) &&
+					(lookup_memo_find(MEMO_NAMEBL, blname) == NULL)) {
+				if (first)
+					first = 0;
+				else
+					dnsprefetch(blname, DNS_PREFETCH_A);
+			}
+			d = strchr(d, '.');
+			if (d != NULL)
+				d++;
+		}
+	}
+}
+
 enum filter_result
 cb_namebl(const struct userconf *ds, const char **logmsg, enum config_domain *t)
 {
@@ -40,26 +102,18 @@ cb_namebl(const struct userconf *ds, const char **logmsg, enum config_domain *t)
 	}
 
 	fromdomain = strchr(xmitstat.mailfrom.s, '@') + 1;
+	namebl_prefetch(a, fromdomain);
 
 	while (a[i] && (rc == FILTER_PASSED)) {
 		char *d = fromdomain;
-		size_t alen = strlen(a[i]) + 1;
 
 		while ((d != NULL) && (rc == FILTER_PASSED)) {
-			size_t dlen = strlen(d);
 			char blname[DOMAINNAME_MAX + 1];	/* maximum length of a valid DNS domain name + \0 */
 
-			if (dlen + alen < sizeof(blname)) {
-				int k;
-
-				memcpy(blname, d, dlen);
-				blname[dlen++] = '.';
-				/* This is no overrun as alen already includes the terminating
-				 * '\0', and the size was checked for being smaller than the
-				 * buffer length before. */
-				memcpy(blname + dlen, a[i], alen);
+			if (namebl_name(blname, d, a[i]) == 0) {
+				struct lookup_memo *m;
+				int k = lookup_memo_dnsa(MEMO_NAMEBL, blname, &m);
 
-				k = ask_dnsa(blname, NULL);
 				switch (k) {
 				case DNS_ERROR_LOCAL:
 					rc = FILTER_ERROR;
@@ -79,7 +133,7 @@ cb_namebl(const struct userconf *ds, const char **logmsg, enum config_domain *t)
 
 					/* if there is any error here we just write the generic
 					 * message to the client so that's no real problem for us */
-					(void) dnstxt(&txt, blname);
+					lookup_memo_dnstxt(&txt, blname, m);
 					rc = FILTER_DENIED_UNSPECIFIC;
 					break;
 				}
@@ -48,6 +48,36 @@ rcpt_cb rcpt_cbs[] = {
 			cb_check2822,
 			NULL};
 
+/** the properties of the filters in rcpt_cbs, must be in the same order
+ *
+ * Qsmtpd may run filters in a different order than given in rcpt_cbs to
+ * reject a recipient with less work. Filters marked as fixed always stay at
+ * their position: cb_boolean may whitelist and must be run before anything
+ * that could reject, cb_check2822 must run last.
+ */
+const struct rcpt_filter_info rcpt_filter_info[] = {
+	{ .name = "boolean", .deps = FILTER_DEP_CONNECTION | FILTER_DEP_SENDER | FILTER_DEP_RECIPIENT, .cost = FILTER_COST_LOCAL, .fixed = 1 },
+	{ .name = "nomail", .deps = 0, .cost = FILTER_COST_LOCAL },
+	{ .name = "smtpbugs", .deps = FILTER_DEP_CONNECTION | FILTER_DEP_SENDER, .cost = FILTER_COST_LOCAL },
+	{ .name = "usersize", .deps = FILTER_DEP_SENDER, .cost = FILTER_COST_LOCAL },
+	{ .name = "soberg", .deps = FILTER_DEP_HELO | FILTER_DEP_SENDER, .cost = FILTER_COST_LOCAL },
+	{ .name = "ipbl", .deps = FILTER_DEP_CONNECTION, .cost = FILTER_COST_LOCAL },
+	{ .name = "helo", .deps = FILTER_DEP_HELO, .cost = FILTER_COST_LOCAL },
+	{ .name = "badmailfrom", .deps = FILTER_DEP_SENDER, .cost = FILTER_COST_LOCAL },
+	{ .name = "badcc", .deps = FILTER_DEP_RECIPIENT, .cost = FILTER_COST_LOCAL },
+	{ .name = "fromdomain", .deps = FILTER_DEP_SENDER, .cost = FILTER_COST_LOCAL },
+	{ .name = "spf", .deps = FILTER_DEP_CONNECTION | FILTER_DEP_HELO | FILTER_DEP_SENDER, .cost = FILTER_COST_DNS },
+	{ .name = "dnsbl", .deps = FILTER_DEP_CONNECTION, .cost = FILTER_COST_DNS },
+	{ .name = "forceesmtp", .deps = FILTER_DEP_CONNECTION | FILTER_DEP_HELO, .cost = FILTER_COST_DNS },
+	{ .name = "namebl", .deps = FILTER_DEP_SENDER, .cost = FILTER_COST_DNS },
+	{ .name = "wildcardns", .deps = FILTER_DEP_SENDER, .cost = FILTER_COST_LOCAL },
+	{ .name = "check2822", .deps = FILTER_DEP_SENDER, .cost = FILTER_COST_LOCAL, .fixed = 1 }
+};
+
+/* fails to compile if rcpt_filter_info does not have one entry for every filter */
+typedef char rcpt_filter_info_check[(sizeof(rcpt_filter_info) / sizeof(rcpt_filter_info[0]) ==
+		sizeof(rcpt_cbs) / sizeof(rcpt_cbs[0]) - 1) ? 1 : -1];
+
 rcpt_cb late_cbs[] = {
 			cb_badcc
 };
@@ -5,6 +5,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #include "control.h"
@@ -105,11 +106,24 @@ cb_spf(const struct userconf *ds, const char **logmsg, enum config_domain *t)
 				/* In case you have an SPF_PERMERROR rSPF and afterwards a different
 				* error code the information how the record was malformed is lost. */
 				free(exps);
+				/* the same rSPF lists are usually configured for many
+				 * recipients, only ask once per transaction */
+				struct lookup_memo *m = lookup_memo_find(MEMO_SPF, spfname);
+				if (m != NULL) {
+					spfs = m->result;
+					exps = (m->txt == NULL) ? NULL : strdup(m->txt);
+					continue;
+				}
 				spfs = check_host(spfname);
 				/* check_host() will record the exp= modifier result in xmitstat,
 				* make sure it does not leak to another user */
 				exps = xmitstat.spfexp;
 				xmitstat.spfexp = NULL;
+				if ((spfs >= 0) && (spfs != SPF_TEMPERROR)) {
+					m = lookup_memo_add(MEMO_SPF, spfname, spfs);
+					if (m != NULL)
+						(void) lookup_memo_set_txt(m, exps);
+				}
 			}
 			free(a);
 
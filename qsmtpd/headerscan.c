@@ -0,0 +1,228 @@
+/** \file headerscan.c
+ \brief incremental analysis of the message header
+
+ The header is analyzed in a single pass over the data as it is received.
+ The few header names that are of interest are identified using a perfect
+ hash on the length and the second character of the name, so every line
+ costs at most one memcmp() in addition to scanning it once.
+ */
+
+#include <qsmtpd/headerscan.h>
+
+#include <qsmtpd/rcptset.h>
+
+#include <string.h>
+
+/** @brief the position in the current line */
+enum hdrscan_state {
+	HS_LINESTART = 0,		/**< at the beginning of a line */
+	HS_CR,				/**< a CR was found at the beginning of a line */
+	HS_NAME,			/**< in the name of a header */
+	HS_VALUE,			/**< behind the colon of a header or in a folded line */
+	HS_BODY				/**< the empty line ending the header was found */
+};
+
+/** @brief the header lines that are of interest */
+enum hdrscan_kind {
+	HDR_OTHER = 0,			/**< any other header */
+	HDR_DATE,			/**< "Date:" */
+	HDR_FROM,			/**< "From:" */
+	HDR_MSGID,			/**< "Message-Id:" */
+	HDR_RECEIVED,			/**< "Received:" */
+	HDR_DELIVEREDTO			/**< "Delivered-To:" */
+};
+
+/* the lengths of the names are 4, 4, 10, 8 and 12, this hash does not collide for them */
+#define HDRSCAN_HASH(len, c) (((len) + (unsigned char)(c)) & 15)
+
+static const struct {
+	const char *name;		/**< the name in lower case, without colon */
+	unsigned int len;		/**< length of name */
+	enum hdrscan_kind kind;		/**< the classification */
+	enum header_flags flag;		/**< the flag to set if this header is found, 0 if it may be repeated */
+	const char *display;		/**< the name as shown in error messages */
+} known_headers[16] = {
+	[HDRSCAN_HASH(4, 'a')] = { "date", 4, HDR_DATE, HEADER_HAS_DATE, "Date:" },
+	[HDRSCAN_HASH(4, 'r')] = { "from", 4, HDR_FROM, HEADER_HAS_FROM, "From:" },
+	[HDRSCAN_HASH(10, 'e')] = { "message-id", 10, HDR_MSGID, HEADER_HAS_MSGID, "Message-Id:" },
+	[HDRSCAN_HASH(8, 'e')] = { "received", 8, HDR_RECEIVED, 0, "Received:" },
+	[HDRSCAN_HASH(12, 'e')] = { "delivered-to", 12, HDR_DELIVEREDTO, 0, "Delivered-To:" }
+};
+
+/**
+ * @brief initialize the analysis of a new message
+ * @param hs the state to initialize
+ * @param check2822 if duplicate headers and 8 bit data should be detected
+ */
+void
+hdrscan_init(struct header_scan *hs, const int check2822)
+{
+	memset(hs, 0, sizeof(*hs));
+	hs->check2822 = !!check2822;
+}
+
+/**
+ * @brief check if the header has been completely analyzed
+ * @param hs the state of the analysis
+ * @return if the empty line ending the header was found
+ */
+int
+hdrscan_done(const struct header_scan *hs)
+{
+	return (hs->state == HS_BODY);
+}
+
+/**
+ * @brief handle a complete header name
+ * @param hs the state of the analysis
+ */
+static void
+hdrscan_classify(struct header_scan *hs)
+{
+	hs->kind = HDR_OTHER;
+
+	if ((hs->namelen < 2) || (hs->namelen > HDRSCAN_NAMELEN))
+		return;
+
+	const unsigned int h = HDRSCAN_HASH(hs->namelen, hs->name[1]);
+
+	if ((known_headers[h].len != hs->namelen) || (memcmp(known_headers[h].name, hs->name, hs->namelen) != 0))
+		return;
+
+	hs->kind = known_headers[h].kind;
+
+	if (hs->kind == HDR_RECEIVED) {
+		if (++hs->hops > MAXHOPS)
+			hs->result = HDRSCAN_HOPS;
+	} else if (known_headers[h].flag != 0) {
+		if (hs->check2822 && (hs->flags & known_headers[h].flag)) {
+			hs->hdrname = known_headers[h].display;
+			hs->result = HDRSCAN_DUPLICATE;
+		}
+		hs->flags |= known_headers[h].flag;
+	}
+}
+
+/**
+ * @brief handle the end of a "Delivered-To:" line
+ * @param hs the state of the analysis
+ */
+static void
+hdrscan_deliveredto(struct header_scan *hs)
+{
+	size_t len = hs->valuelen;
+
+	if (len > HDRSCAN_VALUELEN)
+		return;
+	if ((len > 0) && (hs->value[len - 1] == '\r'))
+		len--;
+	if (len == 0)
+		return;
+
+	const struct recip *np = rcptset_find(hs->value, len);
+
+	if ((np != NULL) && np->ok)
+		hs->result = HDRSCAN_LOOP;
+}
+
+/**
+ * @brief handle the next character of a header name
+ * @param hs the state of the analysis
+ * @param c the character
+ */
+static void
+hdrscan_name(struct header_scan *hs, const unsigned char c)
+{
+	if (c == ':') {
+		hdrscan_classify(hs);
+		hs->valuelen = 0;
+		hs->state = HS_VALUE;
+	} else if (c == '\n') {
+		/* not a header line at all */
+		hs->state = HS_LINESTART;
+	} else {
+		if (hs->namelen < HDRSCAN_NAMELEN)
+			hs->name[hs->namelen] = ((c >= 'A') && (c <= 'Z')) ? c + ('a' - 'A') : c;
+		hs->namelen++;
+	}
+}
+
+/**
+ * @brief analyze the next part of the message
+ * @param hs the state of the analysis
+ * @param buf the message data
+ * @param len length of buf
+ * @return the result of the analysis so far
+ */
+enum header_result
+hdrscan_feed(struct header_scan *hs, const char *buf, const size_t len)
+{
+	const char *end = buf + len;
+
+	for (const char *p = buf; (p < end) && (hs->state != HS_BODY) && (hs->result == HDRSCAN_OK); p++) {
+		const unsigned char c = *p;
+
+		if (hs->check2822 && (c & 0x80)) {
+			hs->result = HDRSCAN_8BIT;
+			break;
+		}
+
+		switch (hs->state) {
+		case HS_LINESTART:
+			if (c == '\n') {
+				hs->state = HS_BODY;
+				break;
+			} else if (c == '\r') {
+				hs->state = HS_CR;
+				break;
+			} else if ((c == ' ') || (c == '\t')) {
+				/* a folded line, the relevant headers were already handled */
+				hs->kind = HDR_OTHER;
+				hs->state = HS_VALUE;
+				break;
+			}
+			hs->namelen = 0;
+			hs->state = HS_NAME;
+			hdrscan_name(hs, c);
+			break;
+		case HS_NAME:
+			hdrscan_name(hs, c);
+			break;
+		case HS_CR:
+			if (c == '\n') {
+				hs->state = HS_BODY;
+				break;
+			}
+			/* a stray CR at the beginning of the line, this is no known header */
+			hs->name[0] = '\r';
+			hs->namelen = 1;
+			hs->state = HS_NAME;
+			hdrscan_name(hs, c);
+			break;
+		case HS_VALUE:
+			if (hs->kind == HDR_DELIVEREDTO) {
+				if (c == '\n') {
+					hdrscan_deliveredto(hs);
+					hs->state = HS_LINESTART;
+				} else if ((hs->valuelen > 0) || ((c != ' ') && (c != '\t'))) {
+					if (hs->valuelen < HDRSCAN_VALUELEN)
+						hs->value[hs->valuelen] = c;
+					hs->valuelen++;
+				}
+			} else if (c == '\n') {
+				hs->state = HS_LINESTART;
+			} else if (!hs->check2822) {
+				/* nothing in this line is of interest, skip to its end */
+				const char *nl = memchr(p, '\n', end - p);
+
+				if (nl == NULL)
+					return hs->result;
+				p = nl;
+				hs->state = HS_LINESTART;
+			}
+			break;
+		}
+	}
+
+	return hs->result;
+}
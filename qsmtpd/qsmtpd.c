@@ -9,7 +9,10 @@
 
 #include <control.h>
 #include <diropen.h>
+#include <fmt.h>
+#include <libowfatconn.h>
 #include <log.h>
+#include <metrics.h>
 #include <mmap.h>
 #include <netio.h>
 #include <qdns.h>
@@ -18,9 +21,15 @@
 #include <qsmtpd/commands.h>
 #include <qsmtpd/qsauth.h>
 #include <qsmtpd/qsdata.h>
+#include <qsmtpd/queue.h>
+#include <qsmtpd/rcptset.h>
 #include <qsmtpd/starttls.h>
 #include <qsmtpd/syntax.h>
+#include <qsmtpd/timing.h>
 #include <qsmtpd/userconf.h>
+#include <qsmtpd/userfilters.h>
+#include <qsmtpd/ratelimit.h>
+#include <qsmtpd/verdict.h>
 #include <sstring.h>
 #include <tls.h>
 #include <version.h>
@@ -41,28 +50,29 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
-#define _C(c, m, f, s, o) { .name = c, .len = sizeof(c) - 1, .mask = m, .func = f, .state = s, .flags = o }
+#define _C(c, m, f, s, o, n) { .name = c, .len = sizeof(c) - 1, .mask = m, .func = f, .state = s, .flags = o, .metric = METRICS_CMD_##n }
 
 struct smtpcomm *current_command;
 
 static struct smtpcomm commands[] = {
-	_C("NOOP",	0xffff, smtp_noop,      -1, 0), /* 0x0001 */
-	_C("QUIT",	0xfffd, smtp_quit,       0, 0), /* 0x0002 */
-	_C("RSET",	0xfffd, smtp_rset,     0x1, 0), /* 0x0004 */ /* the status to change to is set in smtp_rset */
-	_C("HELO",	0xfffd, smtp_helo,       0, 5), /* 0x0008 */
-	_C("EHLO",	0xfffd, smtp_ehlo,       0, 5), /* 0x0010 */
-	_C("MAIL FROM:",0x0018, smtp_from,       0, 3), /* 0x0020 */
-	_C("RCPT TO:",	0x0060, smtp_rcpt,       0, 1), /* 0x0040 */
-	_C("DATA",	0x0040, smtp_data,    0x10, 0), /* 0x0080 */ /* the status to change to is changed in smtp_data */
-	_C("STARTTLS",	0x0010, smtp_starttls, 0x1, 0), /* 0x0100 */
-	_C("AUTH",	0x0010, smtp_auth,      -1, 5), /* 0x0200 */
-	_C("VRFY",	0xffff, smtp_vrfy,      -1, 5), /* 0x0400 */
+	_C("NOOP",	0xffff, smtp_noop,      -1, 0, NOOP), /* 0x0001 */
+	_C("QUIT",	0xfffd, smtp_quit,       0, 0, QUIT), /* 0x0002 */
+	_C("RSET",	0xfffd, smtp_rset,     0x1, 0, RSET), /* 0x0004 */ /* the status to change to is set in smtp_rset */
+	_C("HELO",	0xfffd, smtp_helo,       0, 5, HELO), /* 0x0008 */
+	_C("EHLO",	0xfffd, smtp_ehlo,       0, 5, EHLO), /* 0x0010 */
+	_C("MAIL FROM:",0x0018, smtp_from,       0, 3, MAIL), /* 0x0020 */
+	_C("RCPT TO:",	0x0060, smtp_rcpt,       0, 1, RCPT), /* 0x0040 */
+	_C("DATA",	0x0040, smtp_data,    0x10, 0, DATA), /* 0x0080 */ /* the status to change to is changed in smtp_data */
+	_C("STARTTLS",	0x0010, smtp_starttls, 0x1, 0, STARTTLS), /* 0x0100 */
+	_C("AUTH",	0x0010, smtp_auth,      -1, 5, AUTH), /* 0x0200 */
+	_C("VRFY",	0xffff, smtp_vrfy,      -1, 5, VRFY), /* 0x0400 */
 #ifdef CHUNKING
-	_C("BDAT",	0x0840, smtp_bdat,      -1, 5), /* 0x0800 */ /* the status to change to is changed in smtp_bdat */
+	_C("BDAT",	0x0840, smtp_bdat,      -1, 5, BDAT), /* 0x0800 */ /* the status to change to is changed in smtp_bdat */
 #endif
-	_C("POST",	0xffff, http_post,      -1, 1)  /* 0x1000 */ /* this should stay last */
+	_C("POST",	0xffff, http_post,      -1, 1, POST)  /* 0x1000 */ /* this should stay last */
 };
 
 #undef _C
@@ -85,6 +95,7 @@ int authhide;				/**< hide source of authenticated mail */
 int submission_mode;			/**< if we should act as message submission agent */
 
 struct recip *thisrecip;
+struct session_timing sesstiming;	/**< accumulated timing values of this session */
 
 /**
  * \brief write and log error message if opening config file leads to an error
@@ -154,6 +165,7 @@ setup(void)
 #ifdef USESYSLOG
 	openlog("Qsmtpd", LOG_PID, LOG_MAIL);
 #endif
+	log_buffer_enable("Qsmtpd", LOG_MAIL);
 
 	/* make sure to have a reasonable default timeout if errors happen */
 	timeout = 320;
@@ -311,6 +323,39 @@ setup(void)
 		authhide = tl ? 1 : 0;
 	}
 
+	if ( (j = loadintfd(openat(controldir_fd, "queueprespawn", O_RDONLY | O_CLOEXEC), &tl, 0)) ) {
+		log_write(LOG_ERR, "parse error in control/queueprespawn");
+		queueprespawn = 0;
+	} else {
+		queueprespawn = tl ? 1 : 0;
+	}
+
+	char *verdictfile;
+	if (((ssize_t)loadoneliner(controldir_fd, "verdictcache", &verdictfile, 1)) >= 0) {
+		if (verdict_open(verdictfile) != 0) {
+			const char *logmsg[] = { "can not open verdict cache ", verdictfile, NULL };
+
+			log_writen(LOG_WARNING, logmsg);
+		}
+		free(verdictfile);
+	}
+
+	char **ratelines;
+	if (loadlistfd(openat(controldir_fd, "ratelimit", O_RDONLY | O_CLOEXEC), &ratelines, ratelimit_checkline) == 0) {
+		struct ratelimit_config ratecfg;
+
+		if (ratelimit_config(ratelines, &ratecfg) != 0) {
+			log_write(LOG_ERR, "no table file given in control/ratelimit");
+		} else if ((ratecfg.table != NULL) && (ratelimit_open(&ratecfg) != 0)) {
+			const char *logmsg[] = { "can not open rate limit table ", ratecfg.table, NULL };
+
+			log_writen(LOG_WARNING, logmsg);
+		}
+		free(ratelines);
+	} else {
+		log_write(LOG_ERR, "error opening control/ratelimit");
+	}
+
 	if ( (j = loadintfd(openat(controldir_fd, "forcesslauth", O_RDONLY | O_CLOEXEC), &sslauth, 0)) ) {
 		int e = errno;
 		log_write(LOG_ERR, "parse error in control/forcesslauth");
@@ -343,6 +388,10 @@ setup(void)
 	return j;
 }
 
+static enum ratelimit_result ratelimited;	/**< if the client exceeds the connection limits */
+static unsigned int knownbad;		/**< recent rejections of the client if it is refused */
+static unsigned int knownbad_filter;	/**< the filter that rejected the client last */
+
 /** initialize variables related to this connection */
 static int
 connsetup(void)
@@ -353,14 +402,25 @@ connsetup(void)
 	xmitstat.ipv4conn = IN6_IS_ADDR_V4MAPPED(&xmitstat.sremoteip) ? 1 : 0;
 #endif /* IPV4ONLY */
 
-	int j = ask_dnsname(&xmitstat.sremoteip, &xmitstat.remotehost.s);
-	if (j == DNS_ERROR_LOCAL) {
-		log_write(LOG_ERR, "can't look up remote host name");
-		return -1;
-	} else if (j <= 0) {
+	const time_t now = time(NULL);
+
+	/* the connection of a client that exceeds the limits or was rejected
+	 * repeatedly will be refused anyway, so don't bother to look up its name */
+	ratelimited = ratelimit_enter(&xmitstat.sremoteip, now);
+	if (ratelimited == RATELIMIT_OK)
+		knownbad = verdict_check(&xmitstat.sremoteip, now, &knownbad_filter);
+	if ((ratelimited != RATELIMIT_OK) || (knownbad > 0)) {
 		STREMPTY(xmitstat.remotehost);
 	} else {
-		xmitstat.remotehost.len = strlen(xmitstat.remotehost.s);
+		int j = ask_dnsname(&xmitstat.sremoteip, &xmitstat.remotehost.s);
+		if (j == DNS_ERROR_LOCAL) {
+			log_write(LOG_ERR, "can't look up remote host name");
+			return -1;
+		} else if (j <= 0) {
+			STREMPTY(xmitstat.remotehost);
+		} else {
+			xmitstat.remotehost.len = strlen(xmitstat.remotehost.s);
+		}
 	}
 	xmitstat.remoteinfo = getenv("TCPREMOTEINFO");
 	xmitstat.remoteport = getenv("TCPREMOTEPORT");
@@ -384,15 +444,14 @@ freedata(void)
 	xmitstat.frommx = NULL;
 	free(xmitstat.tlsclient);
 	xmitstat.tlsclient = NULL;
-	while (!TAILQ_EMPTY(&head)) {
-		struct recip *l = TAILQ_FIRST(&head);
-
-		TAILQ_REMOVE(&head, TAILQ_FIRST(&head), entries);
-		free(l->to.s);
-		free(l);
-	}
+	rcptset_clear();
+	TAILQ_INIT(&head);
+	arena_reset(&txarena);
 	rcptcount = 0;
 	goodrcpt = 0;
+	queue_discard();
+	/* the SPF result may depend on the sender */
+	lookup_memo_forget(MEMO_SPF);
 }
 
 /**
@@ -405,7 +464,11 @@ freedata(void)
 pid_t
 fork_clean()
 {
-	pid_t ret = fork();
+	pid_t ret;
+
+	/* otherwise the pending messages would be written by both processes */
+	log_flush();
+	ret = fork();
 
 	if (ret != 0)
 		return ret;
@@ -435,6 +498,83 @@ fork_clean()
 	return 0;
 }
 
+/**
+ * @brief append one value to the timing log line
+ * @param p where to write
+ * @param name the text to write before the value
+ * @param value the value to write
+ * @return pointer behind the written text
+ */
+static char *
+timing_put(char *p, const char *name, const unsigned long value)
+{
+	const size_t len = strlen(name);
+
+	memcpy(p, name, len);
+	p += len;
+	ultostr(value, p);
+	return p + strlen(p);
+}
+
+/**
+ * @brief log the timing values of this session
+ *
+ * All times are written in microseconds. Every phase that was entered is
+ * written as name=count/time, the time spent waiting for DNS replies in that
+ * phase is appended as name_dns=time if there was any. The recipient filters
+ * are written as f<index>=count/time.
+ */
+static void
+log_timing(void)
+{
+	static const char *phase_names[TIMING_PHASES] = {
+		[TIMING_CONNECT] = "connect",
+		[TIMING_BANNER] = "banner",
+		[TIMING_HELO] = "helo",
+		[TIMING_STARTTLS] = "starttls",
+		[TIMING_MAIL] = "mail",
+		[TIMING_SPF] = "spf",
+		[TIMING_RCPT] = "rcpt",
+		[TIMING_RCPT_USER] = "rcpt_user",
+		[TIMING_DATA] = "data",
+		[TIMING_QUEUE] = "queue"
+	};
+	/* every phase and filter needs less than 128 bytes */
+	char buf[(TIMING_PHASES + TIMING_FILTERS) * 128];
+	char *p = timing_put(buf, "total=", (timing_now() - sesstiming.start) / 1000);
+	const char *logmsg[] = { "session timing for [", xmitstat.remoteip, "]: ", buf, NULL };
+
+	for (unsigned int i = 0; i < TIMING_PHASES; i++) {
+		char name[24];
+
+		if (sesstiming.count[i] == 0)
+			continue;
+
+		name[0] = ' ';
+		strcpy(name + 1, phase_names[i]);
+		strcat(name, "=");
+		p = timing_put(p, name, sesstiming.count[i]);
+		p = timing_put(p, "/", sesstiming.ns[i] / 1000);
+
+		if (sesstiming.dns_ns[i] / 1000 != 0) {
+			name[strlen(name) - 1] = '\0';
+			strcat(name, "_dns=");
+			p = timing_put(p, name, sesstiming.dns_ns[i] / 1000);
+		}
+	}
+
+	for (unsigned int i = 0; i < TIMING_FILTERS; i++) {
+		if (sesstiming.filter_count[i] == 0)
+			continue;
+
+		p = timing_put(p, " f", i);
+		p = timing_put(p, "=", sesstiming.filter_count[i]);
+		p = timing_put(p, "/", sesstiming.filter_ns[i] / 1000);
+	}
+
+	log_writen(LOG_INFO, logmsg);
+}
+
 /**
  * \brief clean up the allocated data and exit the process
  * \param rc desired return code of the process
@@ -442,8 +582,13 @@ fork_clean()
 void
 conn_cleanup(const int rc)
 {
+	log_timing();
+	metrics_observe(METRIC_H_SMTPD_SESSION, timing_now() - sesstiming.start);
+
 	freedata();
 	userbackend_free();
+	lookup_memo_free();
+	arena_free(&txarena);
 	free(xmitstat.authname.s);
 
 	free(globalconf);
@@ -475,14 +620,97 @@ line_valid()
 
 static int flagbogus;
 
+/**
+ * @brief get the timing phase a command is accounted to
+ * @param cmd the command
+ * @return the phase of the command
+ * @retval TIMING_PHASES the command is not timed
+ */
+static enum session_phase
+command_phase(const struct smtpcomm *cmd)
+{
+	if ((cmd->func == smtp_helo) || (cmd->func == smtp_ehlo))
+		return TIMING_HELO;
+	else if (cmd->func == smtp_starttls)
+		return TIMING_STARTTLS;
+	else if (cmd->func == smtp_from)
+		return TIMING_MAIL;
+	else if (cmd->func == smtp_rcpt)
+		return TIMING_RCPT;
+	else if (cmd->func == smtp_data)
+		return TIMING_DATA;
+#ifdef CHUNKING
+	else if (cmd->func == smtp_bdat)
+		return TIMING_DATA;
+#endif
+	else
+		return TIMING_PHASES;
+}
+
+/**
+ * @brief refuse the connection of a client that was rejected repeatedly
+ *
+ * The client gets a 554 greeting, after that only QUIT is accepted.
+ */
+static void __attribute__ ((noreturn))
+refuse_knownbad(void)
+{
+	char cntbuf[ULSTRLEN];
+	const char *filter = "unknown";
+	const char *logmsg[] = { "refused connection from [", xmitstat.remoteip, "]: ", cntbuf,
+			" recent rejections {", NULL, "}", NULL };
+	const char *netmsg[] = { "554 5.7.1 ", heloname.s,
+			" too many rejected recipients from your address, try again later", NULL };
+
+	/* the index comes from a file shared with other processes */
+	for (unsigned int i = 0; rcpt_cbs[i] != NULL; i++) {
+		if (i == knownbad_filter)
+			filter = rcpt_filter_info[i].name;
+	}
+
+	ultostr(knownbad, cntbuf);
+	logmsg[5] = filter;
+	log_writen(LOG_INFO, logmsg);
+
+	if (net_writen(netmsg) != 0)
+		conn_cleanup(errno);
+
+	wait_for_quit();
+}
+
+/**
+ * @brief refuse the connection of a client that exceeds the connection limits
+ *
+ * The client gets a 421 greeting and the connection is closed.
+ */
+static void __attribute__ ((noreturn))
+refuse_ratelimited(void)
+{
+	const char *reason = (ratelimited == RATELIMIT_RATE) ?
+			"too many connections" : "too many concurrent sessions";
+	const char *logmsg[] = { "refused connection from [", xmitstat.remoteip, "]: ", reason, NULL };
+	const char *netmsg[] = { "421 4.7.0 ", heloname.s, " ", reason,
+			" from your address, try again later", NULL };
+
+	log_writen(LOG_INFO, logmsg);
+
+	conn_cleanup(net_writen(netmsg) ? errno : 0);
+}
+
 static void __attribute__ ((noreturn))
 smtploop(void)
 {
 	badcmds = 0;
 
+	if (ratelimited != RATELIMIT_OK)
+		refuse_ratelimited();
+	if (knownbad > 0)
+		refuse_knownbad();
+
 	assert(strcmp(commands[1].name, "QUIT") == 0);
 	if (!getenv("BANNER")) {
 		const char *msg[] = {"220 ", heloname.s, " " VERSIONSTRING " ESMTP", NULL};
+		const uint64_t bannerstart = timing_now();
 
 		flagbogus = hasinput(0);
 		switch (flagbogus) {
@@ -499,6 +727,7 @@ smtploop(void)
 			}
 		case 0:
 			flagbogus = -net_writen(msg);
+			timing_add(TIMING_BANNER, bannerstart);
 			if (flagbogus == 0)
 				break;
 			/* fallthrough */
@@ -619,9 +848,19 @@ smtploop(void)
 					} else if ((commands[i].flags & 4) && (linein.s[commands[i].len] != ' ')) {
 						flagbogus = EINVAL;
 					} else {
+						const enum session_phase phase = command_phase(commands + i);
+						const uint64_t cmdstart = timing_now();
+						const unsigned long long dnsstart = dns_wait_ns;
+
+						metrics_inc(METRIC_SMTPD_COMMANDS + commands[i].metric);
 						current_command = commands + i;
 						flagbogus = commands[i].func();
 						current_command = NULL;
+
+						if (phase != TIMING_PHASES) {
+							timing_add(phase, cmdstart);
+							sesstiming.dns_ns[phase] += dns_wait_ns - dnsstart;
+						}
 					}
 
 					/* command succeded */
@@ -646,6 +885,11 @@ main(int argc, char **argv)
 {
 	const char *localport = getenv("TCPLOCALPORT");
 
+	sesstiming.start = timing_now();
+	(void) metrics_attach();
+	metrics_inc(METRIC_SMTPD_SESSIONS);
+	lookup_memo_enable();
+
 	if (setup()) {
 		/* setup failed: make sure we wait until the "quit" of the other host but
 		 * do not process any mail. Commands RSET, QUIT and NOOP are still allowed.
@@ -667,7 +911,12 @@ main(int argc, char **argv)
 	/* Assume all given parameters are for auth checking */
 	auth_setup(argc, (const char **) argv);
 
+	const uint64_t connstart = timing_now();
+	const unsigned long long dnsstart = dns_wait_ns;
+
 	if (connsetup() < 0)
 		flagbogus = errno;
+	timing_add(TIMING_CONNECT, connstart);
+	sesstiming.dns_ns[TIMING_CONNECT] += dns_wait_ns - dnsstart;
 	smtploop();
 }
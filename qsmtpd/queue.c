@@ -6,13 +6,16 @@
 
 #include <fmt.h>
 #include <log.h>
+#include <metrics.h>
 #include <netio.h>
 #include <qsmtpd/antispam.h>
 #include <qsmtpd/qsmtpd.h>
+#include <qsmtpd/timing.h>
 #include <sstring.h>
 #include <tls.h>
 
 #include <errno.h>
+#include <string.h>
 #include <strings.h>
 #include <syslog.h>
 #include <sys/types.h>
@@ -23,6 +26,11 @@ static const char noqueue[] = "451 4.3.2 can not connect to queue\r\n";
 static pid_t qpid;			/* the pid of qmail-queue */
 int queuefd_data = -1;			/**< descriptor to send message data to qmail-queue */
 int queuefd_hdr = -1;			/**< descriptor to send header data to qmail-queue */
+unsigned long queueprespawn;		/**< start qmail-queue once the first recipient is accepted */
+
+static pid_t prepid;			/* the pid of a speculatively started qmail-queue */
+static int prefd_data = -1;		/* queuefd_data of the speculatively started qmail-queue */
+static int prefd_hdr = -1;		/* queuefd_hdr of the speculatively started qmail-queue */
 
 static int
 err_pipe(void)
@@ -54,30 +62,29 @@ queue_reset(void)
 }
 
 /**
- * @brief set up communication with queueing process
- * @return if queue was setup
+ * @brief start the queueing process
+ * @param pid the pid of the new process is stored here
+ * @param fd_data the descriptor for the message data is stored here
+ * @param fd_hdr the descriptor for the envelope is stored here
+ * @return if the process was started
  * @retval 0 queueing process is running and awaiting input
- * @retval >0 error code
+ * @retval -1 pipe creation failed
+ * @retval -2 the process could not be started or exited immediately
  */
-int
-queue_init(void)
+static int
+queue_spawn(pid_t *pid, int *fd_data, int *fd_hdr)
 {
-	int i;
 	const char *qqbin = NULL;
-	int fd0[2], fd1[2];		/* the fds to communicate with qmail-queue */
+	int fds[2][2];			/* the fds to communicate with qmail-queue */
+	const int targets[2] = { 0, 1 };
 
-	if (pipe(fd0)) {
-		if ( (i = err_pipe()) )
-			return i;
-		return EDONE;
-	}
-	if (pipe(fd1)) {
+	if (pipe(fds[0]))
+		return -1;
+	if (pipe(fds[1])) {
 		/* EIO on pipe operations? Shit just happens (although I don't know why this could ever happen) */
-		close(fd0[0]);
-		close(fd0[1]);
-		if ( (i = err_pipe()) )
-			return i;
-		return EDONE;
+		close(fds[0][0]);
+		close(fds[0][1]);
+		return -1;
 	}
 
 	if (is_authenticated_client())
@@ -89,49 +96,138 @@ queue_init(void)
 	if ((qqbin == NULL) || (strlen(qqbin) == 0))
 			qqbin = "bin/qmail-queue";
 
-	/* DJB uses vfork at this point (qmail.c::open_qmail) which looks broken
-	 * because he modifies data before calling execve */
-	switch (qpid = fork_clean()) {
-	case -1:
-		if ( (i = err_fork()) )
-			return i;
-		return EDONE;
-	case 0:
-		if (pipe_move(fd0, 0) != 0)
-			_exit(120);
-		if (pipe_move(fd1, 1) != 0)
-			_exit(120);
-
-		/* no chdir here, we already _are_ there (and qmail-queue does it again) */
-		execlp(qqbin, qqbin, NULL);
-		_exit(120);
-	default:
-		close(fd0[0]);
-		close(fd1[0]);
+	/* no chdir here, we already _are_ there (and qmail-queue does it again) */
+	char *argv[] = { (char *)qqbin, NULL };
+	*pid = spawn_piped(qqbin, argv, fds, targets, 2);
+	if (*pid == -1) {
+		close(fds[0][1]);
+		close(fds[1][1]);
+		return -2;
 	}
 
 	/* check if the child already returned, which means something went wrong */
-	if (waitpid(qpid, NULL, WNOHANG)) {
+	if (waitpid(*pid, NULL, WNOHANG)) {
 		/* error here may just happen, we are already in trouble */
-		close(fd0[1]);
-		close(fd1[1]);
+		close(fds[0][1]);
+		close(fds[1][1]);
+		return -2;
+	}
+
+	*fd_data = fds[0][1];
+	*fd_hdr = fds[1][1];
+
+	return 0;
+}
+
+/**
+ * @brief throw away a speculatively started queueing process
+ *
+ * qmail-queue will see end of file on both descriptors without getting an
+ * envelope, so it will exit without queueing anything.
+ */
+void
+queue_discard(void)
+{
+	if (prepid <= 0)
+		return;
+
+	close(prefd_data);
+	close(prefd_hdr);
+	prefd_data = -1;
+	prefd_hdr = -1;
+	waitpid(prepid, NULL, 0);
+	prepid = 0;
+}
+
+/**
+ * @brief start the queueing process in advance
+ *
+ * If enabled by control/queueprespawn this is called once the first
+ * recipient of a transaction was accepted, so starting qmail-queue overlaps
+ * with the remaining envelope and the client sending DATA or BDAT. Errors are
+ * ignored here, they will be reported when queue_init() tries again.
+ */
+void
+queue_prespawn(void)
+{
+	if (!queueprespawn || (prepid > 0))
+		return;
+
+	if (queue_spawn(&prepid, &prefd_data, &prefd_hdr) != 0)
+		prepid = 0;
+}
+
+/**
+ * @brief set up communication with queueing process
+ * @return if queue was setup
+ * @retval 0 queueing process is running and awaiting input
+ * @retval >0 error code
+ */
+int
+queue_init(void)
+{
+	int i;
+
+	if (prepid > 0) {
+		/* make sure the process is still waiting for input */
+		if (waitpid(prepid, NULL, WNOHANG) == 0) {
+			qpid = prepid;
+			queuefd_data = prefd_data;
+			queuefd_hdr = prefd_hdr;
+			prepid = 0;
+			prefd_data = -1;
+			prefd_hdr = -1;
+			return 0;
+		}
+		close(prefd_data);
+		close(prefd_hdr);
+		prefd_data = -1;
+		prefd_hdr = -1;
+		prepid = 0;
+	}
+
+	switch (queue_spawn(&qpid, &queuefd_data, &queuefd_hdr)) {
+	case 0:
+		return 0;
+	case -1:
+		if ( (i = err_pipe()) )
+			return i;
+		return EDONE;
+	default:
 		if ( (i = err_fork()) )
 			return i;
 		return EDONE;
 	}
+}
 
-	queuefd_data = fd0[1];
-	queuefd_hdr = fd1[1];
+#define LOG_RCPTS 16	/**< maximum number of recipients in one log line */
+#define LOG_RCPTLEN 640	/**< maximum length of the recipient addresses in one log line */
 
-	return 0;
-}
+/**
+ * @brief log the acceptance of a message for a batch of recipients
+ * @param logmail the log message, the recipient is inserted at index 4
+ * @param rcpts the addresses of the recipients
+ * @param cnt number of entries in rcpts
+ */
+static void
+log_recipients(const char **logmail, const char **rcpts, const unsigned int cnt)
+{
+	const char *msg[20 + 2 * LOG_RCPTS];
+	unsigned int i, j = 0;
+
+	for (i = 0; i < 4; i++)
+		msg[j++] = logmail[i];
+	for (i = 0; i < cnt; i++) {
+		if (i > 0)
+			msg[j++] = ">, <";
+		msg[j++] = rcpts[i];
+	}
+	for (i = 5; logmail[i] != NULL; i++)
+		msg[j++] = logmail[i];
+	msg[j] = NULL;
 
-#define WRITE(buf, len) \
-		do { \
-			if ( (rc = write(queuefd_hdr, buf, len)) < 0 ) { \
-				goto err_write; \
-			} \
-		} while (0)
+	log_writen(LOG_INFO, msg);
+}
 
 /**
  * @brief write the envelope data to qmail-queue and syslog
@@ -140,6 +236,9 @@ queue_init(void)
  * @returns if writing the envelope was successful
  * @retval 0 envelope was written to queue
  * @retval -1 an error occurred (errno is set)
+ *
+ * The envelope is collected in a single buffer and written at once, the
+ * accepted recipients are logged in batches of up to LOG_RCPTS per line.
  */
 int
 queue_envelope(const unsigned long msgsize, const int chunked)
@@ -150,7 +249,10 @@ queue_envelope(const unsigned long msgsize, const int chunked)
 	const char *logmail[] = {"received ", "", "message ", "to <", NULL, "> from <", MAILFROM,
 					">", "", "", " from IP [", xmitstat.remoteip, "] (", s, bytes,
 					NULL, " recipients)", NULL};
-	int rc, e;
+	const char *rcpts[LOG_RCPTS];	/* recipients not yet logged */
+	unsigned int rcptcnt = 0;	/* entries in rcpts */
+	size_t rcptlen = 0;		/* length of the addresses in rcpts */
+	int rc = 0, e;
 
 	/* the message body is sent to qmail-queue. Close the file descriptor and send the envelope information */
 	if (close(queuefd_data) != 0)
@@ -185,33 +287,72 @@ queue_envelope(const unsigned long msgsize, const int chunked)
 		}
 	}
 
-/* write the envelope information to qmail-queue */
+/* collect the envelope information for qmail-queue */
+
+	/* the return path, the terminating 0-byte of the envelope */
+	size_t envlen = 1 + xmitstat.mailfrom.len + 1 + 1;
+	struct recip *l;
 
-	/* write the return path to qmail-queue */
-	WRITE("F", 1);
-	WRITE(MAILFROM, xmitstat.mailfrom.len + 1);
+	TAILQ_FOREACH(l, &head, entries) {
+		if (l->ok)
+			envlen += 1 + l->to.len + liphost.len + 1;
+	}
+
+	char *env = arena_alloc(&txarena, envlen);
+	char *pos = env;
+
+	if (env == NULL) {
+		rc = -1;
+		goto err_write;
+	}
+
+	*pos++ = 'F';
+	memcpy(pos, MAILFROM, xmitstat.mailfrom.len + 1);
+	pos += xmitstat.mailfrom.len + 1;
 
 	while (!TAILQ_EMPTY(&head)) {
-		struct recip *l = TAILQ_FIRST(&head);
+		l = TAILQ_FIRST(&head);
 
 		if (l->ok) {
 			const char *at = strchr(l->to.s, '@');
 
-			logmail[4] = l->to.s;
-			log_writen(LOG_INFO, logmail);
-			WRITE("T", 1);
+			if ((rcptcnt == LOG_RCPTS) || ((rcptcnt > 0) && (rcptlen + l->to.len > LOG_RCPTLEN))) {
+				log_recipients(logmail, rcpts, rcptcnt);
+				rcptcnt = 0;
+				rcptlen = 0;
+			}
+			rcpts[rcptcnt++] = l->to.s;
+			rcptlen += l->to.len;
+
+			*pos++ = 'T';
 			if (at && (*(at + 1) == '[')) {
-				WRITE(l->to.s, at - l->to.s + 1);
-				WRITE(liphost.s, liphost.len + 1);
+				memcpy(pos, l->to.s, at - l->to.s + 1);
+				pos += at - l->to.s + 1;
+				memcpy(pos, liphost.s, liphost.len + 1);
+				pos += liphost.len + 1;
 			} else {
-				WRITE(l->to.s, l->to.len + 1);
+				memcpy(pos, l->to.s, l->to.len + 1);
+				pos += l->to.len + 1;
 			}
 		}
+		/* the memory is released by freedata() */
 		TAILQ_REMOVE(&head, TAILQ_FIRST(&head), entries);
-		free(l->to.s);
-		free(l);
 	}
-	WRITE("", 1);
+	*pos++ = '\0';
+
+	if (rcptcnt > 0)
+		log_recipients(logmail, rcpts, rcptcnt);
+
+/* write it to qmail-queue */
+	for (const char *w = env; w < pos; ) {
+		ssize_t r = write(queuefd_hdr, w, pos - w);
+
+		if (r < 0) {
+			rc = -1;
+			goto err_write;
+		}
+		w += r;
+	}
 	errno = 0;
 err_write:
 	e = errno;
@@ -239,8 +380,12 @@ int
 queue_result(void)
 {
 	int status;
+	const uint64_t start = timing_now();
+	const pid_t r = waitpid(qpid, &status, 0);
 
-	if (waitpid(qpid, &status, 0) == -1) {
+	timing_add(TIMING_QUEUE, start);
+	if (r == -1) {
+		metrics_inc(METRIC_SMTPD_QUEUE_ERRORS);
 		/* don't know why this could ever happen, but we want to be sure */
 		log_write(LOG_ERR, "waitpid(qmail-queue) went wrong");
 		return netwrite("451 4.3.2 error while writing mail to queue\r\n") ? errno : EDONE;
@@ -249,6 +394,7 @@ queue_result(void)
 		int exitcode = WEXITSTATUS(status);
 
 		if (!exitcode) {
+			metrics_inc(METRIC_SMTPD_QUEUED);
 			current_command->state = (0x008 << xmitstat.esmtp);
 			return netwrite("250 2.5.0 accepted message for delivery\r\n") ? errno : 0;
 		} else {
@@ -256,6 +402,7 @@ queue_result(void)
 			const char *logmess[] = {"qmail-queue failed with exitcode ", ec, NULL};
 			const char *netmsg;
 
+			metrics_inc(METRIC_SMTPD_QUEUE_ERRORS);
 			ultostr(exitcode, ec);
 			log_writen(LOG_ERR, logmess);
 
@@ -267,6 +414,7 @@ queue_result(void)
 			return netwrite(netmsg) ? errno : EDONE;
 		}
 	} else {
+		metrics_inc(METRIC_SMTPD_QUEUE_ERRORS);
 		log_write(LOG_ERR, "WIFEXITED(qmail-queue) went wrong");
 		return netwrite("451 4.3.2 error while writing mail to queue\r\n") ? errno : EDONE;
 	}
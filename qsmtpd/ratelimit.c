@@ -0,0 +1,505 @@
+/** \file ratelimit.c
+ \brief shared per client connection limits
+
+ Every Qsmtpd process only knows about its own connection, so a single
+ client may open hundreds of sessions at once and every one of them does the
+ reverse lookup and loads the configuration. This table is shared by all
+ Qsmtpd instances through a file mapped into memory and counts the running
+ sessions and the recent connections of every client, so a client above the
+ configured limits can be turned away before doing any work for it.
+
+ The table is updated with atomic operations only, so a flood of connections
+ does not serialize on a lock. If two new clients race for the same slot one
+ of them is simply not limited. Every running session is also listed with
+ its process id. When a client reaches its session limit the processes are
+ checked and the sessions of processes that were killed are removed. Should
+ the list be full, a session is only counted, and the count is reset once
+ the client did not connect for a while. IPv4 clients are tracked by their
+ address, IPv6 clients by their /64 network.
+ */
+
+#include <qsmtpd/ratelimit.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static struct ratelimit_table *table;	/**< the mapped table file */
+static unsigned long maxsessions;	/**< maximum concurrent sessions per client */
+static unsigned long maxrate;		/**< maximum connections per client and window */
+static struct ratelimit_slot *entered;	/**< the slot this process is counted in */
+static uint64_t enteredkey;		/**< the key entered belonged to */
+static pid_t enteredpid;		/**< the process that is counted in entered */
+static struct ratelimit_session *enteredsession;	/**< the entry of this process in the session list */
+
+/**
+ * @brief get the value of a setting
+ * @param line the line from control/ratelimit
+ * @param name the name of the setting
+ * @return the value
+ * @retval NULL the line does not contain this setting
+ */
+static const char *
+ratelimit_value(const char *line, const char *name)
+{
+	const size_t len = strlen(name);
+
+	if ((strncmp(line, name, len) != 0) || (line[len] != '='))
+		return NULL;
+
+	return line + len + 1;
+}
+
+/**
+ * @brief parse a numeric setting
+ * @param v the value
+ * @param res the number will be stored here
+ * @return if the value is a valid number
+ */
+static int
+ratelimit_number(const char *v, unsigned long *res)
+{
+	char *end;
+
+	if ((*v < '0') || (*v > '9'))
+		return 0;
+
+	errno = 0;
+	*res = strtoul(v, &end, 10);
+
+	return (*end == '\0') && (errno == 0);
+}
+
+/**
+ * @brief callback for loadlistfd() to check the lines of control/ratelimit
+ * @param line the line to check
+ * @return if the line is invalid
+ */
+int
+ratelimit_checkline(const char *line)
+{
+	const char *v;
+	unsigned long n;
+
+	if ((v = ratelimit_value(line, "table")) != NULL)
+		return (*v != '/');
+	if ((v = ratelimit_value(line, "sessions")) != NULL)
+		return !ratelimit_number(v, &n);
+	if ((v = ratelimit_value(line, "rate")) != NULL)
+		return !ratelimit_number(v, &n);
+
+	return 1;
+}
+
+/**
+ * @brief get the settings from the lines of control/ratelimit
+ * @param lines the lines as checked by ratelimit_checkline(), may be NULL
+ * @param cfg the settings will be stored here
+ * @retval 0 the settings are valid
+ * @retval -EINVAL limits are given, but no table file
+ *
+ * If no table file is given cfg->table is NULL and no limits apply. The
+ * pointers in cfg point into lines.
+ */
+int
+ratelimit_config(char **lines, struct ratelimit_config *cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+
+	for (unsigned int i = 0; (lines != NULL) && (lines[i] != NULL); i++) {
+		const char *v;
+
+		if ((v = ratelimit_value(lines[i], "table")) != NULL)
+			cfg->table = v;
+		else if ((v = ratelimit_value(lines[i], "sessions")) != NULL)
+			(void) ratelimit_number(v, &cfg->sessions);
+		else if ((v = ratelimit_value(lines[i], "rate")) != NULL)
+			(void) ratelimit_number(v, &cfg->rate);
+	}
+
+	if ((cfg->table == NULL) && ((cfg->sessions != 0) || (cfg->rate != 0)))
+		return -EINVAL;
+
+	return 0;
+}
+
+/**
+ * @brief open the shared table file
+ * @param cfg the settings
+ * @retval 0 the limits are active
+ * @retval <0 negative error code, no limits apply
+ *
+ * The file is created if it does not exist yet. If the contents of the file
+ * are not recognized it is reinitialized. The lock is only used for this,
+ * the table itself is updated without locking.
+ */
+int
+ratelimit_open(const struct ratelimit_config *cfg)
+{
+	struct stat st;
+	int err;
+
+	ratelimit_close();
+
+	const int fd = open(cfg->table, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -errno;
+
+	if (flock(fd, LOCK_EX) != 0)
+		goto err;
+
+	if (fstat(fd, &st) != 0)
+		goto err;
+
+	if ((st.st_size != sizeof(*table)) && (ftruncate(fd, sizeof(*table)) != 0))
+		goto err;
+
+	table = mmap(NULL, sizeof(*table), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (table == MAP_FAILED) {
+		table = NULL;
+		goto err;
+	}
+
+	if ((table->magic != RATELIMIT_MAGIC) || (table->slots != RATELIMIT_SLOTS)) {
+		memset(table, 0, sizeof(*table));
+		table->magic = RATELIMIT_MAGIC;
+		table->slots = RATELIMIT_SLOTS;
+	}
+
+	close(fd);
+
+	maxsessions = cfg->sessions;
+	maxrate = cfg->rate;
+
+	return 0;
+err:
+	err = errno;
+	close(fd);
+	return -err;
+}
+
+/**
+ * @brief release the shared table
+ *
+ * If this process is counted as a running session it is removed.
+ */
+void
+ratelimit_close(void)
+{
+	ratelimit_leave();
+
+	if (table != NULL) {
+		munmap(table, sizeof(*table));
+		table = NULL;
+	}
+}
+
+/**
+ * @brief get the key a client is tracked with
+ *
+ * IPv6 clients are tracked by the network part of their address, IPv4
+ * clients by their address in a range that is not used for IPv6 networks.
+ */
+static uint64_t
+ratelimit_key(const struct in6_addr *addr)
+{
+	uint64_t key = 0;
+
+	if (IN6_IS_ADDR_V4MAPPED(addr)) {
+		key = 0xffffffff;
+		for (unsigned int i = 12; i < 16; i++)
+			key = (key << 8) | addr->s6_addr[i];
+	} else {
+		for (unsigned int i = 0; i < 8; i++)
+			key = (key << 8) | addr->s6_addr[i];
+	}
+
+	/* 0 marks a free slot */
+	return (key == 0) ? 1 : key;
+}
+
+/**
+ * @brief calculate the first slot to look at for a key
+ */
+static unsigned int
+ratelimit_hash(const uint64_t key)
+{
+	uint32_t h = 2166136261u;
+
+	for (unsigned int i = 0; i < sizeof(key); i++) {
+		h ^= (key >> (8 * i)) & 0xff;
+		h *= 16777619u;
+	}
+
+	return h % RATELIMIT_SLOTS;
+}
+
+/**
+ * @brief find or allocate the slot of a client
+ * @param key the key of the client as returned by ratelimit_key()
+ * @param now the current time
+ * @return the slot of the client
+ * @retval NULL no slot could be allocated
+ *
+ * When a new slot is allocated a free one is preferred, otherwise the idle
+ * one that was used least recently is reused.
+ */
+static struct ratelimit_slot *
+ratelimit_find(const uint64_t key, const int64_t now)
+{
+	const unsigned int start = ratelimit_hash(key);
+	struct ratelimit_slot *victim = NULL;
+	uint64_t victimkey = 0;
+	int64_t victimlast = 0;
+
+	for (unsigned int i = 0; i < RATELIMIT_PROBE; i++) {
+		struct ratelimit_slot *s = table->slot + (start + i) % RATELIMIT_SLOTS;
+		const uint64_t k = __atomic_load_n(&s->key, __ATOMIC_ACQUIRE);
+
+		if (k == key)
+			return s;
+
+		if (k == 0) {
+			if ((victim == NULL) || (victimkey != 0)) {
+				victim = s;
+				victimkey = 0;
+			}
+			continue;
+		}
+
+		if ((victim != NULL) && (victimkey == 0))
+			continue;
+
+		const int64_t last = __atomic_load_n(&s->last, __ATOMIC_RELAXED);
+		const int idle = (last < now - RATELIMIT_STALE) ||
+				((__atomic_load_n(&s->sessions, __ATOMIC_RELAXED) == 0) &&
+				(last < now - 2 * RATELIMIT_WINDOW));
+
+		if (idle && ((victim == NULL) || (last < victimlast))) {
+			victim = s;
+			victimkey = k;
+			victimlast = last;
+		}
+	}
+
+	if (victim == NULL)
+		return NULL;
+
+	if (!__atomic_compare_exchange_n(&victim->key, &victimkey, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		/* another process was faster, maybe with the same client */
+		return (victimkey == key) ? victim : NULL;
+
+	__atomic_store_n(&victim->cur, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->prev, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->sessions, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->last, now, __ATOMIC_RELAXED);
+
+	return victim;
+}
+
+/**
+ * @brief find the slot of a client without allocating one
+ * @param key the key of the client as returned by ratelimit_key()
+ * @return the slot of the client
+ * @retval NULL the client has no slot
+ */
+static struct ratelimit_slot *
+ratelimit_lookup(const uint64_t key)
+{
+	const unsigned int start = ratelimit_hash(key);
+
+	for (unsigned int i = 0; i < RATELIMIT_PROBE; i++) {
+		struct ratelimit_slot *s = table->slot + (start + i) % RATELIMIT_SLOTS;
+
+		if (__atomic_load_n(&s->key, __ATOMIC_ACQUIRE) == key)
+			return s;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief count a connection in the rate window
+ * @param s the slot of the client
+ * @param now the current time
+ * @return the estimated number of connections in the last RATELIMIT_WINDOW seconds
+ *
+ * The previous window is weighted by the part of it that is still inside
+ * the sliding window.
+ */
+static unsigned long
+ratelimit_count(struct ratelimit_slot *s, const int64_t now)
+{
+	const uint64_t win = (uint64_t)(now / RATELIMIT_WINDOW) & 0xffffffff;
+	uint64_t old = __atomic_load_n(&s->cur, __ATOMIC_RELAXED);
+	uint64_t n;
+
+	do {
+		if ((old >> 32) == win)
+			n = old + 1;
+		else
+			n = (win << 32) | 1;
+	} while (!__atomic_compare_exchange_n(&s->cur, &old, n, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	if ((old >> 32) != win)
+		__atomic_store_n(&s->prev, old, __ATOMIC_RELAXED);
+
+	const uint64_t p = __atomic_load_n(&s->prev, __ATOMIC_RELAXED);
+	const unsigned long prevcnt = ((p >> 32) == ((win - 1) & 0xffffffff)) ? (uint32_t)p : 0;
+
+	return (uint32_t)n + prevcnt * (RATELIMIT_WINDOW - now % RATELIMIT_WINDOW) / RATELIMIT_WINDOW;
+}
+
+/**
+ * @brief remove a session from a slot
+ * @param s the slot
+ */
+static void
+ratelimit_release(struct ratelimit_slot *s)
+{
+	uint32_t old = __atomic_load_n(&s->sessions, __ATOMIC_RELAXED);
+
+	/* the count may have been reset in between */
+	while ((old > 0) && !__atomic_compare_exchange_n(&s->sessions, &old, old - 1, 1,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/**
+ * @brief add this process to the session list
+ * @param key the key of the client
+ * @param pid the process id of this process
+ * @return the entry of this process
+ * @retval NULL the list is full
+ */
+static struct ratelimit_session *
+ratelimit_track(const uint64_t key, const pid_t pid)
+{
+	const unsigned int start = (unsigned int)pid % RATELIMIT_TRACKED;
+
+	for (unsigned int i = 0; i < RATELIMIT_TRACKED; i++) {
+		struct ratelimit_session *e = table->session + (start + i) % RATELIMIT_TRACKED;
+		int32_t unused = 0;
+
+		if (__atomic_compare_exchange_n(&e->pid, &unused, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&e->key, key, __ATOMIC_RELEASE);
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief remove the sessions of processes that no longer exist
+ *
+ * The sessions are removed from the session list and from the count of
+ * their client.
+ */
+static void
+ratelimit_reap(void)
+{
+	for (unsigned int i = 0; i < RATELIMIT_TRACKED; i++) {
+		struct ratelimit_session *e = table->session + i;
+		int32_t pid = __atomic_load_n(&e->pid, __ATOMIC_ACQUIRE);
+		const uint64_t key = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+
+		/* free, or not completely set up yet */
+		if ((pid == 0) || (key == 0))
+			continue;
+
+		if ((kill(pid, 0) == 0) || (errno != ESRCH))
+			continue;
+
+		/* the process is gone, so only another reaper may change the entry */
+		if (!__atomic_compare_exchange_n(&e->pid, &pid, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			continue;
+		__atomic_store_n(&e->key, 0, __ATOMIC_RELEASE);
+
+		struct ratelimit_slot *s = ratelimit_lookup(key);
+		if (s != NULL)
+			ratelimit_release(s);
+	}
+}
+
+/**
+ * @brief check the limits for a new connection
+ * @param addr the address of the client
+ * @param now the current time
+ * @return if the connection is allowed
+ *
+ * Every connection counts for the rate limit. If the connection is allowed
+ * this process is counted as a running session of the client until
+ * ratelimit_leave() is called or the process exits.
+ */
+enum ratelimit_result
+ratelimit_enter(const struct in6_addr *addr, const int64_t now)
+{
+	static int registered;
+
+	if ((table == NULL) || (entered != NULL))
+		return RATELIMIT_OK;
+
+	const uint64_t key = ratelimit_key(addr);
+	struct ratelimit_slot *s = ratelimit_find(key, now);
+
+	if (s == NULL)
+		return RATELIMIT_OK;
+
+	/* sessions that are not in the session list are never removed if their
+	 * process was killed */
+	if (__atomic_exchange_n(&s->last, now, __ATOMIC_RELAXED) < now - RATELIMIT_STALE)
+		__atomic_store_n(&s->sessions, 0, __ATOMIC_RELAXED);
+
+	if ((ratelimit_count(s, now) > maxrate) && (maxrate != 0))
+		return RATELIMIT_RATE;
+
+	if ((__atomic_add_fetch(&s->sessions, 1, __ATOMIC_RELAXED) > maxsessions) && (maxsessions != 0)) {
+		/* some of them may belong to processes that were killed */
+		ratelimit_reap();
+		if (__atomic_load_n(&s->sessions, __ATOMIC_RELAXED) > maxsessions) {
+			ratelimit_release(s);
+			return RATELIMIT_SESSIONS;
+		}
+	}
+
+	entered = s;
+	enteredkey = key;
+	enteredpid = getpid();
+	enteredsession = ratelimit_track(key, enteredpid);
+
+	if (!registered && (atexit(ratelimit_leave) == 0))
+		registered = 1;
+
+	return RATELIMIT_OK;
+}
+
+/**
+ * @brief remove the session of this process from the table
+ *
+ * This is also called when the process exits. Child processes forked by the
+ * session do not remove it.
+ */
+void
+ratelimit_leave(void)
+{
+	if ((entered == NULL) || (enteredpid != getpid()))
+		return;
+
+	if (enteredsession != NULL) {
+		__atomic_store_n(&enteredsession->key, 0, __ATOMIC_RELEASE);
+		__atomic_store_n(&enteredsession->pid, 0, __ATOMIC_RELEASE);
+		enteredsession = NULL;
+	}
+
+	if (__atomic_load_n(&entered->key, __ATOMIC_RELAXED) == enteredkey)
+		ratelimit_release(entered);
+
+	entered = NULL;
+}
@@ -0,0 +1,173 @@
+/** \file rcptset.c
+ \brief hash set of the recipients of the current mail transaction
+ */
+
+#include <qsmtpd/rcptset.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define RCPTSET_MINSIZE 16	/**< number of slots allocated for the first entry */
+
+struct rcpt_set rcptset;
+
+/**
+ * @brief compute the hash of a mail address
+ * @param addr the address
+ * @param len length of addr
+ *
+ * The domain part is hashed in lower case so the hash matches
+ * addresses_equal().
+ */
+static uint32_t __attribute__ ((pure))
+address_hash(const char *addr, const size_t len)
+{
+	uint32_t h = 2166136261u;	/* FNV-1a */
+	int domain = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = addr[i];
+
+		if (domain && (c >= 'A') && (c <= 'Z'))
+			c += 'a' - 'A';
+		else if (c == '@')
+			domain = 1;
+		h = (h ^ c) * 16777619u;
+	}
+
+	return h;
+}
+
+/**
+ * @brief check if a recipient has the given address
+ * @param r the recipient
+ * @param addr the address
+ * @param len length of addr
+ */
+static int __attribute__ ((pure))
+addresses_equal(const struct recip *r, const char *addr, const size_t len)
+{
+	if (r->to.len != len)
+		return 0;
+
+	const char *at = memchr(addr, '@', len);
+
+	if (at == NULL)
+		return (memcmp(r->to.s, addr, len) == 0);
+
+	const size_t local = at - addr;
+
+	return (memcmp(r->to.s, addr, local + 1) == 0) &&
+			(strncasecmp(r->to.s + local + 1, at + 1, len - local - 1) == 0);
+}
+
+/**
+ * @brief find the slot for an address
+ * @param slots the slot array
+ * @param size number of slots
+ * @param addr the address
+ * @param len length of addr
+ * @return the slot holding an entry with the address, or the empty slot where it would be inserted
+ */
+static struct recip **
+rcptset_slot(struct recip **slots, const unsigned int size, const char *addr, const size_t len)
+{
+	unsigned int idx = address_hash(addr, len) & (size - 1);
+
+	while ((slots[idx] != NULL) && !addresses_equal(slots[idx], addr, len))
+		idx = (idx + 1) & (size - 1);
+
+	return slots + idx;
+}
+
+/**
+ * @brief grow the set so it can take at least one more entry
+ * @retval 0 the set has enough space
+ * @retval -ENOMEM out of memory
+ *
+ * The set is kept at most half full so probe sequences stay short.
+ */
+static int
+rcptset_grow(void)
+{
+	if ((rcptset.count + 1) * 2 <= rcptset.size)
+		return 0;
+
+	const unsigned int nsize = rcptset.size ? rcptset.size * 2 : RCPTSET_MINSIZE;
+	struct recip **n = calloc(nsize, sizeof(*n));
+
+	if (n == NULL)
+		return -ENOMEM;
+
+	for (unsigned int i = 0; i < rcptset.size; i++) {
+		struct recip *r = rcptset.slots[i];
+
+		if (r != NULL)
+			*rcptset_slot(n, nsize, r->to.s, r->to.len) = r;
+	}
+
+	free(rcptset.slots);
+	rcptset.slots = n;
+	rcptset.size = nsize;
+
+	return 0;
+}
+
+/**
+ * @brief add a recipient to the set
+ * @param r the recipient
+ * @retval 0 the recipient was added
+ * @retval -ENOMEM out of memory
+ *
+ * If there already is an entry with the same address it is replaced by r,
+ * so the set always references the latest recipient with that address.
+ */
+int
+rcptset_add(struct recip *r)
+{
+	int e = rcptset_grow();
+
+	if (e != 0)
+		return e;
+
+	struct recip **slot = rcptset_slot(rcptset.slots, rcptset.size, r->to.s, r->to.len);
+
+	if (*slot == NULL)
+		rcptset.count++;
+	*slot = r;
+
+	return 0;
+}
+
+/**
+ * @brief search a recipient in the set
+ * @param addr the address to search
+ * @param len length of addr
+ * @return the latest recipient with that address
+ * @retval NULL the address is not in the set
+ */
+struct recip *
+rcptset_find(const char *addr, const size_t len)
+{
+	if (rcptset.count == 0)
+		return NULL;
+
+	return *rcptset_slot(rcptset.slots, rcptset.size, addr, len);
+}
+
+/**
+ * @brief remove all entries from the set
+ *
+ * The recipients themselves are not freed.
+ */
+void
+rcptset_clear(void)
+{
+	free(rcptset.slots);
+	rcptset.slots = NULL;
+	rcptset.size = 0;
+	rcptset.count = 0;
+}
@@ -445,7 +445,17 @@ validate_domain(char ***domainlist)
 		return -1;
 	}
 
-	char *d = rnames;
+	const enum dns_prefetch_type addrtype = IN6_IS_ADDR_V4MAPPED(&xmitstat.sremoteip) ?
+			DNS_PREFETCH_A : DNS_PREFETCH_IP6;
+	char *d = rnames + strlen(rnames) + 1;
+	/* the names are checked one after another, let the resolver
+	 * work on all but the first one in the meantime */
+	for (int i = 1; i < r; i++) {
+		dnsprefetch(d, addrtype);
+		d += strlen(d) + 1;
+	}
+
+	d = rnames;
 	for (int i = 0; i < r; i++) {
 		struct in6_addr *ptrs;
 		int j, k;
@@ -1622,6 +1632,103 @@ find_modifier(const char *s, const char *mod)
 	return r;
 }
 
+/**
+ * @brief send one prefetch query for a domainspec
+ * @param name the start of the name
+ * @param type the records to prefetch
+ *
+ * Names that need macro expansion are skipped, expanding them may need DNS
+ * lookups on it's own.
+ */
+static void
+spf_prefetch_name(const char *name, const enum dns_prefetch_type type)
+{
+	char lookup[DOMAINNAME_MAX + 1];
+	size_t len = 0;
+
+	while ((name[len] != '\0') && (name[len] != '/') && !WSPACE(name[len]))
+		len++;
+
+	if ((len == 0) || (len > DOMAINNAME_MAX) || (memchr(name, '%', len) != NULL))
+		return;
+
+	memcpy(lookup, name, len);
+	lookup[len] = '\0';
+	dnsprefetch(lookup, type);
+}
+
+/**
+ * @brief let the resolver look up the DNS data of the upcoming mechanisms
+ * @param domain the current domain
+ * @param token the terms of the record
+ * @param redirect the domain of the redirect modifier or NULL
+ * @param queries number of DNS queries already done
+ *
+ * The terms are still evaluated one after another by spflookup() as RfC 7208
+ * requires, but the names that will be needed are sent to the resolver at
+ * once, so the lookups of the later terms are answered from its cache. Only
+ * as many DNS mechanisms are prefetched as the lookup limit still permits,
+ * and nothing after an "all" mechanism as that is never evaluated. The first
+ * DNS mechanism is skipped as it is looked up right away anyway. Records of
+ * included domains are handled when spflookup() recurses into them.
+ */
+static void
+spf_prefetch(const char *domain, const char *token, const char *redirect, const unsigned int queries)
+{
+	const enum dns_prefetch_type addrtype = IN6_IS_ADDR_V4MAPPED(&xmitstat.sremoteip) ?
+			DNS_PREFETCH_A : DNS_PREFETCH_IP6;
+	/* spflookup() evaluates DNS mechanisms as long as queries is not above 10 */
+	const unsigned int budget = (queries <= 10) ? 11 - queries : 0;
+	unsigned int cnt = 0;
+
+	while (cnt < budget) {
+		enum dns_prefetch_type type = DNS_PREFETCH_A;
+		int needname = 0;	/* the mechanism has no default domain */
+		size_t mechlen;
+
+		while (WSPACE(*token))
+			token++;
+		if (*token == '\0')
+			break;
+		if ((*token == '+') || (*token == '-') || (*token == '~') || (*token == '?'))
+			token++;
+
+		if ((mechlen = match_mechanism(token, "mx", ":/")) != 0) {
+			type = DNS_PREFETCH_MX;
+		} else if ((mechlen = match_mechanism(token, "ptr", ":/")) != 0) {
+			/* the PTR names are prefetched by validate_domain() */
+			cnt++;
+			token += mechlen;
+			mechlen = 0;
+		} else if ((mechlen = match_mechanism(token, "exists", ":")) != 0) {
+			needname = 1;
+		} else if (match_mechanism(token, "all", "") != 0) {
+			return;
+		} else if ((mechlen = match_mechanism(token, "a", ":/")) != 0) {
+			type = addrtype;
+		} else if ((mechlen = match_mechanism(token, "include", ":")) != 0) {
+			type = DNS_PREFETCH_TXT;
+			needname = 1;
+		}
+
+		if (mechlen != 0) {
+			token += mechlen;
+			if (cnt++ != 0) {
+				if (*token == ':')
+					spf_prefetch_name(token + 1, type);
+				else if (!needname)
+					dnsprefetch(domain, type);
+			}
+		}
+
+		while ((*token != '\0') && !WSPACE(*token))
+			token++;
+	}
+
+	if ((redirect != NULL) && (cnt < budget))
+		spf_prefetch_name(redirect, DNS_PREFETCH_TXT);
+}
+
 /**
  * look up SPF records for domain
  *
@@ -1728,6 +1835,8 @@ spflookup(const char *domain, unsigned int *queries)
 			expl = next;
 	}
 
+	spf_prefetch(domain, token, redirect, *queries);
+
 	while (*token && (result == SPF_NONE)) {
 		size_t mechlen;
 
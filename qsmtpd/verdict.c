@@ -0,0 +1,257 @@
+/** \file verdict.c
+ \brief shared cache of recent rejections per client address
+
+ Spam sources usually reconnect many times within a short time and get
+ rejected by the same checks every time, after doing the reverse lookup and
+ running all filters again. This cache records recipients rejected by a
+ filter that only depends on the connection and the HELO, and is shared by
+ all Qsmtpd instances through a file mapped into memory. A client that was
+ rejected often enough recently is refused right at connection time.
+
+ IPv4 clients are tracked by their address, IPv6 clients by their /64
+ network as they usually have a whole network to choose addresses from.
+ */
+
+#include <qsmtpd/verdict.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static struct verdict_table *table;	/**< the mapped cache file */
+static int tablefd = -1;		/**< descriptor of the cache file, used for locking */
+
+/**
+ * @brief open the shared cache file
+ * @param fname path of the cache file
+ * @return if the cache could be opened
+ * @retval 0 the cache is active
+ * @retval <0 negative error code, the cache remains inactive
+ *
+ * The file is created if it does not exist yet. If the contents of the file
+ * are not recognized it is reinitialized.
+ */
+int
+verdict_open(const char *fname)
+{
+	struct stat st;
+	int err;
+
+	verdict_close();
+
+	tablefd = open(fname, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (tablefd < 0)
+		return -errno;
+
+	if (flock(tablefd, LOCK_EX) != 0)
+		goto err;
+
+	if (fstat(tablefd, &st) != 0)
+		goto err;
+
+	if ((st.st_size != sizeof(*table)) && (ftruncate(tablefd, sizeof(*table)) != 0))
+		goto err;
+
+	table = mmap(NULL, sizeof(*table), PROT_READ | PROT_WRITE, MAP_SHARED, tablefd, 0);
+	if (table == MAP_FAILED) {
+		table = NULL;
+		goto err;
+	}
+
+	if ((table->magic != VERDICT_MAGIC) || (table->slots != VERDICT_SLOTS)) {
+		memset(table, 0, sizeof(*table));
+		table->magic = VERDICT_MAGIC;
+		table->slots = VERDICT_SLOTS;
+	}
+
+	flock(tablefd, LOCK_UN);
+
+	return 0;
+err:
+	err = errno;
+	close(tablefd);
+	tablefd = -1;
+	return -err;
+}
+
+/**
+ * @brief release the shared cache
+ */
+void
+verdict_close(void)
+{
+	if (table != NULL) {
+		munmap(table, sizeof(*table));
+		table = NULL;
+	}
+	if (tablefd >= 0) {
+		close(tablefd);
+		tablefd = -1;
+	}
+}
+
+/**
+ * @brief check if the shared cache is in use
+ * @return if verdict_open() was successful
+ */
+int
+verdict_active(void)
+{
+	return (table != NULL);
+}
+
+/**
+ * @brief get the key a client is tracked with
+ */
+static struct in6_addr
+verdict_key(const struct in6_addr *addr)
+{
+	struct in6_addr key = *addr;
+
+	if (!IN6_IS_ADDR_V4MAPPED(addr))
+		memset(key.s6_addr + 8, 0, 8);
+
+	return key;
+}
+
+/**
+ * @brief calculate the first slot to look at for a key
+ */
+static unsigned int
+verdict_hash(const struct in6_addr *key)
+{
+	uint32_t h = 2166136261u;
+
+	for (unsigned int i = 0; i < sizeof(key->s6_addr); i++) {
+		h ^= key->s6_addr[i];
+		h *= 16777619u;
+	}
+
+	return h % VERDICT_SLOTS;
+}
+
+/**
+ * @brief find the slot of a client
+ * @param key the key of the client as returned by verdict_key()
+ * @param now the current time
+ * @param create if a slot should be allocated when the client is not found
+ * @return the slot of the client
+ * @retval NULL the client is not in the cache
+ *
+ * Expired entries are never returned. When a new slot is allocated a free or
+ * expired one is preferred, otherwise the one expiring first is reused.
+ */
+static struct verdict_slot *
+verdict_find(const struct in6_addr *key, const int64_t now, const int create)
+{
+	const unsigned int start = verdict_hash(key);
+	struct verdict_slot *victim = NULL;
+
+	for (unsigned int i = 0; i < VERDICT_PROBE; i++) {
+		struct verdict_slot *s = table->slot + (start + i) % VERDICT_SLOTS;
+
+		if (IN6_ARE_ADDR_EQUAL(&s->addr, key) && (s->expires > now))
+			return s;
+
+		if (!create)
+			continue;
+
+		if ((victim == NULL) || (s->expires < victim->expires))
+			victim = s;
+	}
+
+	if (victim != NULL) {
+		memset(victim, 0, sizeof(*victim));
+		victim->addr = *key;
+	}
+
+	return victim;
+}
+
+/**
+ * @brief check if a client was rejected often enough to refuse the connection
+ * @param addr the address of the client
+ * @param now the current time
+ * @param filter the index of the filter that rejected the client last will be stored here
+ * @return the number of recent rejections if the connection should be refused, 0 otherwise
+ */
+unsigned int
+verdict_check(const struct in6_addr *addr, const int64_t now, unsigned int *filter)
+{
+	if (table == NULL)
+		return 0;
+
+	const struct in6_addr key = verdict_key(addr);
+	unsigned int rejects = 0;
+
+	flock(tablefd, LOCK_SH);
+
+	const struct verdict_slot *s = verdict_find(&key, now, 0);
+	if ((s != NULL) && (s->rejects >= VERDICT_THRESHOLD)) {
+		rejects = s->rejects;
+		*filter = s->filter;
+	}
+
+	flock(tablefd, LOCK_UN);
+
+	return rejects;
+}
+
+/**
+ * @brief record that a recipient of a client was rejected
+ * @param addr the address of the client
+ * @param filter the index of the filter that rejected the recipient
+ * @param now the current time
+ *
+ * Every rejection extends the time the entry is kept.
+ */
+void
+verdict_reject(const struct in6_addr *addr, const unsigned int filter, const int64_t now)
+{
+	if (table == NULL)
+		return;
+
+	const struct in6_addr key = verdict_key(addr);
+
+	flock(tablefd, LOCK_EX);
+
+	struct verdict_slot *s = verdict_find(&key, now, 1);
+
+	s->rejects++;
+	s->filter = filter;
+	s->expires = now + VERDICT_TTL;
+
+	flock(tablefd, LOCK_UN);
+}
+
+/**
+ * @brief record that a recipient of a client was accepted
+ * @param addr the address of the client
+ *
+ * The client is removed from the cache, it may be a gateway that also
+ * relays legitimate mail.
+ */
+void
+verdict_accept(const struct in6_addr *addr)
+{
+	if (table == NULL)
+		return;
+
+	const struct in6_addr key = verdict_key(addr);
+	const unsigned int start = verdict_hash(&key);
+
+	flock(tablefd, LOCK_EX);
+
+	for (unsigned int i = 0; i < VERDICT_PROBE; i++) {
+		struct verdict_slot *s = table->slot + (start + i) % VERDICT_SLOTS;
+
+		if (IN6_ARE_ADDR_EQUAL(&s->addr, &key))
+			memset(s, 0, sizeof(*s));
+	}
+
+	flock(tablefd, LOCK_UN);
+}
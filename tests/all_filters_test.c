@@ -6,6 +6,7 @@
 #include <qsmtpd/addrparse.h>
 #include <qsmtpd/antispam.h>
 #include <qsmtpd/qsmtpd.h>
+#include <qsmtpd/rcptset.h>
 #include <qsmtpd/userconf.h>
 #include "test_io/testcase_io.h"
 
@@ -28,6 +29,11 @@ struct rcpt_list head;
 
 static unsigned int testindex;
 static int err;
+static const char *nameblconf;		/**< overrides the namebl configuration of testdata if set */
+static unsigned int nameblerr_asked;	/**< lookups in nameblerror.example.net */
+static unsigned int nameblerr_prefetched;	/**< prefetches of names in nameblerror.example.net */
+
+extern enum filter_result cb_namebl(const struct userconf *, const char **, enum config_domain *);
 
 int
 check_host(const char *domain __attribute__ ((unused)))
@@ -48,6 +54,12 @@ test_ask_dnsa(const char *a, struct in6_addr **b)
 		return 1;
 	}
 
+	const char *e = strstr(a, ".nameblerror.example.net");
+	if ((e != NULL) && (e[strlen(".nameblerror.example.net")] == '\0')) {
+		nameblerr_asked++;
+		return DNS_ERROR_TEMP;
+	}
+
 	return 0;
 }
 
@@ -250,6 +262,19 @@ dnstxt(char **a, const char *b)
 	return 0;
 }
 
+void
+dnsprefetch(const char *host, const enum dns_prefetch_type type)
+{
+	/* only the namebl filter prefetches, and only the names it looks up later */
+	const char *bl = strstr(host, ".example.net");
+
+	assert(type == DNS_PREFETCH_A);
+	assert((bl != NULL) && (bl[strlen(".example.net")] == '\0'));
+
+	if (strstr(host, ".nameblerror.example.net") != NULL)
+		nameblerr_prefetched++;
+}
+
 static char **
 map_from_list(const char *values)
 {
@@ -289,7 +314,7 @@ userconf_get_buffer(const struct userconf *uc __attribute__ ((unused)), const ch
 		expected_cf = NULL;
 		expected_flags = userconf_global | userconf_inherit;
 	} else if (strcmp(key, "namebl") == 0) {
-		res = testdata[testindex].namebl;
+		res = (nameblconf != NULL) ? nameblconf : testdata[testindex].namebl;
 		expected_cf = domainvalid_or_inherit;
 		expected_flags = userconf_global | userconf_inherit;
 	} else if (strcmp(key, "dnsbl") == 0) {
@@ -363,6 +388,45 @@ default_session_config(void)
 	xmitstat.frommx = &frommx;
 
 	TAILQ_INIT(&head);
+	rcptset_clear();
+}
+
+/**
+ * @brief check that temporary errors of namebl lookups are not remembered
+ *
+ * Every recipient must ask again, including the prefetch.
+ */
+static void
+test_namebl_temperror(struct userconf *uc)
+{
+	const char *fmsg = NULL;
+
+	nameblconf = "nameblerror.example.net\0\0";
+	xmitstat.mailfrom.s = "foo@example.com";
+	xmitstat.mailfrom.len = strlen(xmitstat.mailfrom.s);
+	lookup_memo_enable();
+
+	for (unsigned int i = 1; i <= 2; i++) {
+		enum config_domain bt = CONFIG_NONE;
+		int r = cb_namebl(uc, &fmsg, &bt);
+
+		if (r != FILTER_DENIED_TEMPORARY) {
+			fprintf(stderr, "namebl temporary error: recipient %u returned %i instead of %i\n",
+					i, r, FILTER_DENIED_TEMPORARY);
+			err++;
+		}
+
+		/* example.com.nameblerror.example.net and com.nameblerror.example.net,
+		 * the first one is not prefetched */
+		if ((nameblerr_asked != 2 * i) || (nameblerr_prefetched != i)) {
+			fprintf(stderr, "namebl temporary error: recipient %u asked %u times and prefetched %u times\n",
+					i, nameblerr_asked, nameblerr_prefetched);
+			err++;
+		}
+	}
+
+	lookup_memo_free();
+	nameblconf = NULL;
 }
 
 int
@@ -383,12 +447,15 @@ main(void)
 	controldir_fd = AT_FDCWD;
 
 	TAILQ_INIT(&head);
+	rcptset_clear();
 
 	thisrecip = &dummyrecip;
 	dummyrecip.to.s = "postmaster";
 	dummyrecip.to.len = strlen(dummyrecip.to.s);
 	dummyrecip.ok = 0;
 	TAILQ_INSERT_TAIL(&head, &dummyrecip, entries);
+	if (rcptset_add(&dummyrecip) != 0)
+		abort();
 
 	xmitstat.spf = SPF_IGNORE;
 
@@ -413,7 +480,11 @@ main(void)
 	firstrecip.to.len = strlen(firstrecip.to.s);
 	firstrecip.ok = 0;
 	TAILQ_INSERT_TAIL(&head, &firstrecip, entries);
+	if (rcptset_add(&firstrecip) != 0)
+		abort();
 	TAILQ_INSERT_TAIL(&head, &dummyrecip, entries);
+	if (rcptset_add(&dummyrecip) != 0)
+		abort();
 
 	for (int i = 0; rcpt_cbs[i] != NULL; i++) {
 		const char *errmsg;
@@ -449,7 +520,11 @@ main(void)
 		firstrecip.to.len = strlen(firstrecip.to.s);
 		firstrecip.ok = 0;
 		TAILQ_INSERT_TAIL(&head, &firstrecip, entries);
+		if (rcptset_add(&firstrecip) != 0)
+			abort();
 		TAILQ_INSERT_TAIL(&head, &dummyrecip, entries);
+		if (rcptset_add(&dummyrecip) != 0)
+			abort();
 
 		xmitstat.mailfrom.s = (char *)testdata[testindex].mailfrom;
 		xmitstat.mailfrom.len = (xmitstat.mailfrom.s == NULL) ? 0 : strlen(xmitstat.mailfrom.s);
@@ -548,5 +623,13 @@ main(void)
 			close(uc.domaindirfd);
 	}
 
+	/* this enables the lookup memo, so it must run last */
+	testindex = 0;
+	uc.userconf = NULL;
+	uc.userdirfd = -1;
+	uc.domaindirfd = -1;
+	default_session_config();
+	test_namebl_temperror(&uc);
+
 	return err;
 }
@@ -163,6 +163,108 @@ test_rbl()
 	return err;
 }
 
+static int
+test_rbl_memo(void)
+{
+	int err = 0;
+	char * const rbls[] = {
+		"foo.bar.example.com",
+		"bar.bar.example.com",
+		NULL
+	};
+	const char *entries[] = {
+		"42.42.18.172.bar.bar.example.com",
+		NULL
+	};
+	char *txt = NULL;
+
+	if (inet_pton(AF_INET6, "::ffff:172.18.42.42", &xmitstat.sremoteip) != 1) {
+		fprintf(stderr, "can not parse IPv6 address\n");
+		exit(EINVAL);
+	}
+	xmitstat.ipv4conn = 1;
+
+	lookup_memo_enable();
+
+	dnsentries = entries;
+	int r = check_rbl(rbls, &txt);
+	free(txt);
+	txt = NULL;
+	if (r != 1) {
+		fprintf(stderr, "check_rbl() with memo should have returned 1 but returned %i\n", r);
+		err++;
+	}
+
+	/* the DNS entries are gone, but the result is remembered */
+	dnsentries = NULL;
+	r = check_rbl(rbls, &txt);
+	free(txt);
+	txt = NULL;
+	if (r != 1) {
+		fprintf(stderr, "check_rbl() did not use the remembered result, returned %i\n", r);
+		err++;
+	}
+
+	if (lookup_memo_find(MEMO_DNSBL, "42.42.18.172.foo.bar.example.com") == NULL) {
+		fprintf(stderr, "negative lookup result was not remembered\n");
+		err++;
+	}
+	if (lookup_memo_find(MEMO_SPF, "42.42.18.172.foo.bar.example.com") != NULL) {
+		fprintf(stderr, "lookup_memo_find() did not check the kind of the entry\n");
+		err++;
+	}
+
+	lookup_memo_forget(MEMO_DNSBL);
+	if (lookup_memo_find(MEMO_DNSBL, "42.42.18.172.foo.bar.example.com") != NULL) {
+		fprintf(stderr, "lookup_memo_forget() did not remove the entry\n");
+		err++;
+	}
+
+	lookup_memo_free();
+	r = check_rbl(rbls, NULL);
+	lookup_memo_free();
+	err += check_nomatch(r, "check_rbl() after lookup_memo_free()");
+
+	return err;
+}
+
+static int
+test_rbl_memo_temperror(void)
+{
+	int err = 0;
+	char * const rbls[] = {
+		"foo.timeout.example.com",
+		NULL
+	};
+	const char *entries[] = {
+		"42.42.18.172.foo.timeout.example.com",
+		NULL
+	};
+
+	lookup_memo_enable();
+
+	dnsentries = entries;
+	int r = check_rbl(rbls, NULL);
+	if ((r != -1) || (errno != EAGAIN)) {
+		fprintf(stderr, "check_rbl() with temporary error returned %i, errno %i\n", r, errno);
+		err++;
+	}
+
+	if (lookup_memo_find(MEMO_DNSBL, "42.42.18.172.foo.timeout.example.com") != NULL) {
+		fprintf(stderr, "temporary error was remembered\n");
+		err++;
+	}
+
+	/* the resolver works again */
+	dnsentries = NULL;
+	r = check_rbl(rbls, NULL);
+	err += check_nomatch(r, "check_rbl() after temporary error");
+
+	lookup_memo_free();
+
+	return err;
+}
+
 void test_log_writen(int priority __attribute__ ((unused)), const char **msg)
 {
 	static int firstseen;
@@ -218,6 +320,8 @@ main(void)
 	testcase_setup_ask_dnsa(test_ask_dnsa);
 
 	err += test_rbl();
+	err += test_rbl_memo();
+	err += test_rbl_memo_temperror();
 
 	return err;
 }
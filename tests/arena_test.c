@@ -0,0 +1,88 @@
+#include <arena.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+static int
+check_aligned(const void *p, const char *msg)
+{
+	if (((uintptr_t)p % sizeof(long double)) != 0) {
+		fprintf(stderr, "%s: %p is not aligned\n", msg, p);
+		return 1;
+	}
+	return 0;
+}
+
+int
+main(void)
+{
+	struct arena a = { 0 };
+	int err = 0;
+	char *prev = NULL;
+
+	/* many small allocations spanning several blocks */
+	for (unsigned int i = 0; i < 1000; i++) {
+		char *p = arena_alloc(&a, 1 + (i % 37));
+
+		if (p == NULL) {
+			fputs("arena_alloc() failed\n", stderr);
+			return 1;
+		}
+		err += check_aligned(p, "small allocation");
+		memset(p, 'x', 1 + (i % 37));
+		if (p == prev) {
+			fputs("arena_alloc() returned the same pointer twice\n", stderr);
+			err++;
+		}
+		prev = p;
+	}
+
+	/* a large allocation does not discard the current block */
+	char *small1 = arena_alloc(&a, 8);
+	char *big = arena_alloc(&a, 3 * ARENA_BLOCKSIZE);
+	char *small2 = arena_alloc(&a, 8);
+
+	if ((small1 == NULL) || (big == NULL) || (small2 == NULL)) {
+		fputs("arena_alloc() failed\n", stderr);
+		return 1;
+	}
+	err += check_aligned(big, "large allocation");
+	memset(big, 'y', 3 * ARENA_BLOCKSIZE);
+	if (small2 - small1 > 64) {
+		fputs("large allocation moved the small ones to a new block\n", stderr);
+		err++;
+	}
+
+	const char src[] = "foo@example.com and more";
+	char *s = arena_strndup(&a, src, 15);
+	if ((s == NULL) || (strcmp(s, "foo@example.com") != 0)) {
+		fputs("arena_strndup() did not copy the string correctly\n", stderr);
+		err++;
+	}
+
+	/* after reset the kept block is reused */
+	arena_reset(&a);
+	if ((a.used != 0) || (a.blocks == NULL)) {
+		fputs("arena_reset() did not keep a block\n", stderr);
+		err++;
+	}
+	char *first = arena_alloc(&a, 16);
+	char *second = arena_alloc(&a, 16);
+	if ((first == NULL) || (second != first + 16)) {
+		fputs("allocations after arena_reset() are not contiguous\n", stderr);
+		err++;
+	}
+
+	arena_free(&a);
+	if (a.blocks != NULL) {
+		fputs("arena_free() did not release the blocks\n", stderr);
+		err++;
+	}
+
+	/* an empty arena can be reset and freed */
+	arena_reset(&a);
+	arena_free(&a);
+
+	return err;
+}
@@ -0,0 +1,198 @@
+/** \file auth_be_broker_test.c
+ * \brief Testcases for the auth broker authentication backend.
+ */
+
+#include <qsmtpd/qsauth_backend.h>
+
+#include "auth_users.h"
+#include <qsmtpd/qsmtpd.h>
+#include <sstring.h>
+#include "test_io/testcase_io.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+const char *tempnoauth = "[MSG:tempnoauth]";
+
+static const char sockname[] = "auth_be_broker_test.sock";
+
+static int err;	/* global error counter */
+
+static void
+check_all_msgs(const char *caller)
+{
+	if (log_write_msg != NULL) {
+		fprintf(stderr, "%s: expected log message '%s' was not received\n",
+				caller, log_write_msg);
+		err++;
+	}
+
+	err += testcase_netnwrite_check(caller);
+}
+
+/**
+ * @brief test auth_backend_setup() with invalid arguments
+ */
+static void
+test_setup_errors(void)
+{
+	char longpath[sizeof(((struct sockaddr_un *)NULL)->sun_path) + 10];
+	const char *args_invalid_count[] = { "Qsmtpd", "foo.example.com" };
+	const char *args_long[] = { "Qsmtpd", "foo.example.com", longpath };
+	char logbuf[sizeof(longpath) + 100];
+
+	memset(longpath, 'a', sizeof(longpath) - 1);
+	longpath[sizeof(longpath) - 1] = '\0';
+	snprintf(logbuf, sizeof(logbuf), "path of auth broker socket '%s' is too long", longpath);
+
+	log_write_msg = "invalid number of parameters given";
+	log_write_priority = LOG_ERR;
+	if (auth_backend_setup(2, args_invalid_count) != -EINVAL) {
+		fprintf(stderr, "auth_backend_setup(2, ...) returned wrong error code\n");
+		err++;
+	}
+
+	log_write_msg = logbuf;
+	log_write_priority = LOG_ERR;
+	if (auth_backend_setup(3, args_long) != -ENAMETOOLONG) {
+		fprintf(stderr, "auth_backend_setup() with long path returned wrong error code\n");
+		err++;
+	}
+
+	check_all_msgs(__func__);
+}
+
+static void
+test_user(const unsigned int idx, const int wrongpass, const int expect)
+{
+	struct string user = { .s = (char *)users[idx].username, .len = strlen(users[idx].username) };
+	struct string pass = { .s = (char *)users[idx].password, .len = strlen(users[idx].password) };
+
+	if (wrongpass)
+		pass = user;
+
+	int r = auth_backend_execute(&user, &pass, NULL);
+	if (r != expect) {
+		fprintf(stderr, "auth_backend_execute() for user %s returned %i, expected %i\n",
+				users[idx].username, r, expect);
+		err++;
+	}
+
+	check_all_msgs(__func__);
+}
+
+/**
+ * @brief a client that does not send its request must not block others
+ */
+static void
+test_stalled_client(void)
+{
+	struct sockaddr_un sa = {
+		.sun_family = AF_UNIX
+	};
+	struct timespec start, end;
+
+	strcpy(sa.sun_path, sockname);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ((fd < 0) || (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0)) {
+		fprintf(stderr, "%s: cannot connect to broker\n", __func__);
+		err++;
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	test_user(2, 0, 0);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	/* the broker waits up to 5 seconds for a request */
+	if (end.tv_sec - start.tv_sec >= 2) {
+		fprintf(stderr, "%s: request was delayed by a stalled client\n", __func__);
+		err++;
+	}
+
+	close(fd);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *args[] = { "Qsmtpd", "foo.example.com", sockname };
+	char connlogbuf[256];
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s qsauthd auth_dummy\n", argv[0]);
+		return 1;
+	}
+
+	testcase_setup_log_write(testcase_log_write_compare);
+	testcase_setup_log_writen(testcase_log_writen_combine);
+	testcase_setup_netnwrite(testcase_netnwrite_compare);
+
+	test_setup_errors();
+
+	if (auth_backend_setup(3, args) != 0) {
+		fprintf(stderr, "correct call to auth_backend_setup() failed\n");
+		return ++err;
+	}
+
+	unlink(sockname);
+
+	pid_t broker = fork();
+	if (broker < 0) {
+		fprintf(stderr, "fork() failed\n");
+		return ++err;
+	}
+	if (broker == 0) {
+		execl(argv[1], argv[1], sockname, argv[2], autharg, NULL);
+		_exit(1);
+	}
+
+	/* wait for the broker to set up the socket */
+	for (unsigned int i = 0; (i < 50) && (access(sockname, F_OK) != 0); i++)
+		usleep(100000);
+
+	struct stat st;
+	if ((stat(sockname, &st) != 0) || ((st.st_mode & 0777) != 0600)) {
+		fprintf(stderr, "broker socket is not only accessible by its owner\n");
+		err++;
+	}
+
+	test_user(1, 0, 0);
+	test_user(2, 0, 0);
+	test_user(1, 1, 1);
+	test_stalled_client();
+	/* now served from the cache */
+	test_user(1, 0, 0);
+	test_user(3, 1, 1);
+
+	/* the dummy program crashes for this user */
+	log_write_msg = "auth broker reported an error: Input/output error";
+	log_write_priority = LOG_ERR;
+	netnwrite_msg = tempnoauth;
+	test_user(0, 0, -EDONE);
+
+	kill(broker, SIGTERM);
+	waitpid(broker, NULL, 0);
+	unlink(sockname);
+
+	snprintf(connlogbuf, sizeof(connlogbuf), "cannot connect to auth broker: %s", strerror(ENOENT));
+	log_write_msg = connlogbuf;
+	log_write_priority = LOG_ERR;
+	netnwrite_msg = tempnoauth;
+	test_user(1, 0, -EDONE);
+
+	return err;
+}
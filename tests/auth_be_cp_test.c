@@ -5,6 +5,7 @@
 #include <qsmtpd/qsauth_backend.h>
 
 #include "auth_users.h"
+#include <qsmtpd/qsauth.h>
 #include <qsmtpd/qsmtpd.h>
 #include <sstring.h>
 #include "test_io/testcase_io.h"
@@ -34,34 +35,28 @@ check_all_msgs(const char *caller)
 	err += testcase_netnwrite_check(caller);
 }
 
-static int fork_success;
-
-pid_t fork_clean(void)
-{
-	if (!fork_success)
-		return -1;
-
-	return fork();
-}
-
 /**
- * @brief test when fork fails
+ * @brief test when the checkpassword program can not be started
  */
 static void
 test_fork_fail(void)
 {
 	struct string sdummy;
 
+	const char *nosub[] = { "", NULL };
+
 	sdummy.s = "abc";
 	sdummy.len = strlen(sdummy.s);
 
-	fork_success = 0;
+	/* a program that does not exist can not be started */
+	auth_check = "/nonexistent/checkpassword";
+	auth_sub = nosub;
 	log_write_msg = "cannot fork auth";
 	log_write_priority = LOG_ERR;
 	netnwrite_msg = tempnoauth;
 
 	if (auth_backend_execute(&sdummy, &sdummy, &sdummy) != -EDONE) {
-		fprintf(stderr, "auth_backend_execute() did not return -EDONE after failed fork\n");
+		fprintf(stderr, "auth_backend_execute() did not return -EDONE after failed spawn\n");
 		err++;
 	}
 
@@ -77,7 +72,6 @@ test_chkpw_abort(void)
 	struct string user = { .s = (char *)users[0].username, .len = strlen(users[0].username) };
 	struct string pass = { .s = (char *)users[0].password, .len = strlen(users[0].password) };
 
-	fork_success = 1;
 	log_write_msg = "auth child crashed";
 	log_write_priority = LOG_ERR;
 	netnwrite_msg = tempnoauth;
@@ -99,7 +93,6 @@ test_chkpw_wrong(void)
 	struct string user = { .s = (char *)users[1].username, .len = strlen(users[1].username) };
 	struct string resp = STREMPTY_INIT;
 
-	fork_success = 1;
 
 	if (auth_backend_execute(&user, &user, &resp) != 1) {
 		fprintf(stderr, "auth_backend_execute() did not return 1 for wrong password\n");
@@ -118,7 +111,6 @@ test_chkpw_correct(void)
 	struct string user = { .s = (char *)users[1].username, .len = strlen(users[1].username) };
 	struct string pass = { .s = (char *)users[1].password, .len = strlen(users[1].password) };
 
-	fork_success = 1;
 
 	if (auth_backend_execute(&user, &pass, NULL) != 0) {
 		fprintf(stderr, "auth_backend_execute() did not return 0 for correct password\n");
@@ -105,12 +105,87 @@ test_cdb(void)
 	return errcnt;
 }
 
+static int
+test_make(void)
+{
+	int errcnt = 0;
+	char keys[300][8];
+	struct cdb_record records[300];
+	struct stat st;
+
+	for (unsigned int i = 0; i < 300; i++) {
+		records[i].keylen = snprintf(keys[i], sizeof(keys[i]), "k%u", i);
+		records[i].key = keys[i];
+		/* the value is the key without the leading k, the last one is empty */
+		records[i].data = keys[i] + 1;
+		records[i].datalen = (i == 299) ? 0 : records[i].keylen - 1;
+	}
+
+	FILE *f = tmpfile();
+	if (f == NULL) {
+		puts("ERROR: can not create temporary file");
+		return 1;
+	}
+
+	int r = cdb_make(fileno(f), records, 300);
+	if (r != 0) {
+		printf("ERROR: cdb_make() returned %i\n", r);
+		fclose(f);
+		return 1;
+	}
+
+	if (fstat(fileno(f), &st) != 0) {
+		fclose(f);
+		return 1;
+	}
+
+	const char *mm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(f), 0);
+	fclose(f);
+	if (mm == MAP_FAILED) {
+		puts("ERROR: can not map temporary file");
+		return 1;
+	}
+
+	for (unsigned int i = 0; i < 300; i++) {
+		unsigned int len;
+		const char *v = cdb_find(mm, st.st_size, records[i].key, records[i].keylen, &len);
+
+		if ((v == NULL) || (len != records[i].datalen) || (memcmp(v, records[i].data, len) != 0)) {
+			printf("ERROR: entry %s not found in created database\n", records[i].key);
+			errcnt++;
+		}
+	}
+
+	unsigned int len;
+	errno = 42;
+	if ((cdb_find(mm, st.st_size, "k300", 4, &len) != NULL) || (errno != 0)) {
+		puts("ERROR: entry found that was not in the created database");
+		errcnt++;
+	}
+
+	/* a truncated database must not be read beyond its end, cut off the hash tables */
+	if ((cdb_find(mm, st.st_size - 16 * 300, "k3", 2, &len) != NULL) || (errno != EINVAL)) {
+		puts("ERROR: truncated database not detected");
+		errcnt++;
+	}
+
+	if ((cdb_find(mm, 1024, "k3", 2, &len) != NULL) || (errno != EINVAL)) {
+		puts("ERROR: database without complete header not detected");
+		errcnt++;
+	}
+
+	munmap((void *)mm, st.st_size);
+
+	return errcnt;
+}
+
 int
 main(void)
 {
 	int err = 0;
 
 	err = test_cdb();
+	err += test_make();
 
 	return err;
 }
@@ -8,6 +8,7 @@
 #include <qsmtpd/qsauth.h>
 #include <qsmtpd/qsmtpd.h>
 #include <qsmtpd/syntax.h>
+#include <qsmtpd/timing.h>
 #include <qsmtpd/userconf.h>
 #include <qsmtpd/userfilters.h>
 #include <qsmtpd/xtext.h>
@@ -24,6 +25,7 @@
 #include <syslog.h>
 
 struct xmitstat xmitstat;
+struct session_timing sesstiming;
 int relayclient;
 char *rcpthosts;
 off_t rcpthsize;
@@ -43,6 +45,10 @@ rcpt_cb rcpt_cbs[] = {
 	NULL
 };
 
+const struct rcpt_filter_info rcpt_filter_info[] = {
+	{ .name = NULL }
+};
+
 const char *blocktype[] = { (const char *)(uintptr_t)(-1) };
 
 /* make sure they will never be accessed */
@@ -118,6 +124,12 @@ queue_reset(void)
 	abort();
 }
 
+void
+queue_prespawn(void)
+{
+	abort();
+}
+
 /* may in theory be used, but since the files opened before are
  * not there the flow should never reach this. */
 int
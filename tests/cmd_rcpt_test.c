@@ -5,21 +5,28 @@
 #include <qsmtpd/queue.h>
 #include <qsmtpd/qsauth.h>
 #include <qsmtpd/qsmtpd.h>
+#include <qsmtpd/rcptset.h>
 #include <qsmtpd/syntax.h>
+#include <qsmtpd/timing.h>
 #include <qsmtpd/userconf.h>
 #include <qsmtpd/userfilters.h>
+#include <qsmtpd/verdict.h>
 #include <qsmtpd/xtext.h>
 #include <sstring.h>
 #include "test_io/testcase_io.h"
 
+#include <arpa/inet.h>
 #include <assert.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
+#include <unistd.h>
 
 struct xmitstat xmitstat;
+struct session_timing sesstiming;
 int relayclient;
 char *rcpthosts;
 off_t rcpthsize;
@@ -85,6 +92,8 @@ cb_third(const struct userconf *ds __attribute__ ((unused)), const char **logmsg
 	*logmsg = "third filter";
 	*t = CONFIG_GLOBAL;
 
+	if (xmitstat.check2822 == 2)
+		return FILTER_DENIED_UNSPECIFIC;
 	if (xmitstat.check2822 != 0)
 		return FILTER_DENIED_TEMPORARY;
 
@@ -98,6 +107,12 @@ rcpt_cb rcpt_cbs[] = {
 	NULL
 };
 
+const struct rcpt_filter_info rcpt_filter_info[] = {
+	{ .name = "first", .deps = 0, .cost = FILTER_COST_LOCAL, .fixed = 1 },
+	{ .name = "second", .deps = FILTER_DEP_CONNECTION, .cost = FILTER_COST_LOCAL },
+	{ .name = "third", .deps = FILTER_DEP_CONNECTION | FILTER_DEP_HELO, .cost = FILTER_COST_LOCAL }
+};
+
 const char *blocktype[] = { (char *)((uintptr_t)-1), "user", "domain", (char *)((uintptr_t)-1), "global", (char *)((uintptr_t)-1), (char *)((uintptr_t)-1) };
 
 /* make sure they will never be accessed */
@@ -174,6 +189,11 @@ queue_reset(void)
 	abort();
 }
 
+void
+queue_prespawn(void)
+{
+}
+
 /* may in theory be used, but since the files opened before are
  * not there the flow should never reach this. */
 int
@@ -333,6 +353,104 @@ test_log_write(int priority, const char *msg)
 	second_log_write_msg = NULL;
 }
 
+/**
+ * @brief reject a recipient while the verdict cache is active
+ * @param spf value for the first filter
+ * @param helostatus value for the second filter
+ * @param check2822 value for the third filter
+ * @param logmsg the expected log message
+ */
+static void
+verdict_rcpt(const unsigned int spf, const unsigned int helostatus, const unsigned int check2822, const char *logmsg)
+{
+	memset(&xmitstat, 0, sizeof(xmitstat));
+	xmitstat.mailfrom.s = "baz@example.org";
+	xmitstat.mailfrom.len = strlen(xmitstat.mailfrom.s);
+	if (inet_pton(AF_INET6, "::ffff:192.0.2.7", &xmitstat.sremoteip) != 1)
+		abort();
+	xmitstat.spf = spf;
+	xmitstat.helostatus = helostatus;
+	xmitstat.check2822 = check2822;
+
+	strcpy(linein.s, "RCPT TO:<bar@example.org>");
+	linein.len = strlen(linein.s);
+	expected_uc_load = 0;
+	expected_tarpit = 1;
+	/* the client is not allowed to relay */
+	relayclient = 2;
+	expected_tls_verify = 1;
+	tls_verify_result = 0;
+	netnwrite_msg = "550 5.7.1 mail denied for policy reasons\r\n";
+	log_write_msg = logmsg;
+	log_write_priority = LOG_INFO;
+
+	int r = smtp_rcpt();
+	if (r != 0) {
+		fprintf(stderr, "verdict: smtp_rcpt() returned %i\n", r);
+		errcnt++;
+	}
+	errcnt += testcase_netnwrite_check("verdict");
+	if (log_write_msg != NULL) {
+		fprintf(stderr, "verdict: smtp_rcpt() did not write the expected log string '%s'\n",
+				log_write_msg);
+		errcnt++;
+	}
+}
+
+/**
+ * @brief check which rejections are recorded in the verdict cache
+ */
+static void
+test_verdict(void)
+{
+	const char *fname = "cmd_rcpt_test.verdict";
+	struct in6_addr addr;
+	unsigned int filter;
+
+	unlink(fname);
+	if (verdict_open(fname) != 0) {
+		fputs("verdict: can not open cache\n", stderr);
+		errcnt++;
+		return;
+	}
+
+	/* one more rejection will reach VERDICT_THRESHOLD */
+	if (inet_pton(AF_INET6, "::ffff:192.0.2.7", &addr) != 1)
+		abort();
+	for (unsigned int i = 0; i < VERDICT_THRESHOLD - 1; i++)
+		verdict_reject(&addr, 7, time(NULL));
+
+	/* a filter that does not depend on the connection at all */
+	verdict_rcpt(1, 0, 0, "rejected message to <bar@example.org> from <baz@example.org> from IP [] {first filter, user policy}");
+	/* the domain configuration does not apply to all recipients */
+	verdict_rcpt(0, 2, 0, "rejected message to <bar@example.org> from <baz@example.org> from IP [] {second filter, domain policy}");
+
+	if (verdict_check(&addr, time(NULL), &filter) != 0) {
+		fputs("verdict: rejection by user or domain configuration was counted\n", stderr);
+		errcnt++;
+	}
+
+	/* global configuration, counted only once per connection */
+	verdict_rcpt(0, 0, 2, "rejected message to <bar@example.org> from <baz@example.org> from IP [] {third filter, global policy}");
+	verdict_rcpt(0, 0, 2, "rejected message to <bar@example.org> from <baz@example.org> from IP [] {third filter, global policy}");
+
+	const unsigned int rejects = verdict_check(&addr, time(NULL), &filter);
+	if ((rejects != VERDICT_THRESHOLD) || (filter != 2)) {
+		fprintf(stderr, "verdict: %u rejections by filter %u recorded instead of %u by filter 2\n",
+				rejects, filter, VERDICT_THRESHOLD);
+		errcnt++;
+	}
+
+	verdict_close();
+	unlink(fname);
+
+	rcptset_clear();
+	TAILQ_INIT(&head);
+	arena_reset(&txarena);
+	goodrcpt = 0;
+	rcptcount = 0;
+}
+
 int
 main(void)
 {
@@ -343,6 +461,7 @@ main(void)
 		unsigned int tls_verify:1;	/* call to tls_verify() is permitted */
 		unsigned int badbounce:1;	/* if this is a bad bounce */
 		unsigned int maxrcpt:1;		/* maximum number of rcpts should have been reached before */
+		unsigned int duplicate:1;	/* the recipient has already been accepted */
 		int tls_verify_result;
 		int tarpit;
 		int flush_rcpt;	/* clear the recipient list after this test */
@@ -365,6 +484,18 @@ main(void)
 			.input = "RCPT TO:<foo@example.org>",
 			.netmsg = "250 2.1.0 recipient <foo@example.org> OK\r\n",
 		},
+		/* the same recipient again is accepted, but not added twice */
+		{
+			.xmitstat = {
+				.mailfrom = {
+					.s = "baz@example.org",
+					.len = strlen("baz@example.org")
+				},
+			},
+			.input = "RCPT TO:<foo@example.org>",
+			.netmsg = "250 2.1.0 recipient <foo@example.org> OK\r\n",
+			.duplicate = 1
+		},
 		/* all filters return temporary error */
 		{
 			.xmitstat = {
@@ -644,7 +775,13 @@ main(void)
 			errcnt++;
 		}
 
-		if ((testdata[i].netmsg != NULL) && (testdata[i].netmsg[0] == '2')) {
+		if (testdata[i].duplicate) {
+			if ((goodrcpt != oldgood) || (rcptcount != oldcnt)) {
+				fprintf(stderr, "%u: duplicate recipient changed goodrcpt to %u and rcptcount to %u\n",
+						i, goodrcpt, rcptcount);
+				errcnt++;
+			}
+		} else if ((testdata[i].netmsg != NULL) && (testdata[i].netmsg[0] == '2')) {
 			if (goodrcpt != oldgood + 1) {
 				fprintf(stderr, "%u: smtp_rcpt() returned 0, but goodrcpt was %u instead of %u\n",
 						i, goodrcpt, oldgood + 1);
@@ -686,17 +823,17 @@ main(void)
 
 		/* flush on request and on last test */
 		if (testdata[i].flush_rcpt || (testdata[i + 1].input == NULL)) {
-			while (!TAILQ_EMPTY(&head)) {
-				struct recip *l = TAILQ_FIRST(&head);
-
-				TAILQ_REMOVE(&head, TAILQ_FIRST(&head), entries);
-				free(l->to.s);
-				free(l);
-			}
+			rcptset_clear();
+			TAILQ_INIT(&head);
+			arena_reset(&txarena);
 			goodrcpt = 0;
 			rcptcount = 0;
 		}
 	}
 
+	test_verdict();
+
+	arena_free(&txarena);
+
 	return errcnt;
 }
@@ -126,6 +126,7 @@ checkreply(const char *status, const char **pre, const int mask)
 //       different and the last one is new
 // LF in the last argument is expanded to CRLF, | is used to delimit the
 // different network messagess
+// If PIPELINING is set the envelope is flushed together with a DATA command.
 
 int
 main(int argc, char *argv[])
@@ -201,6 +202,16 @@ main(int argc, char *argv[])
 
 	r = send_envelope(recodeflag, argv[2], argc - 4, argv + 3);
 
+	if (smtpext & esmtp_pipelining) {
+		if (r != 0) {
+			fprintf(stderr, "send_envelope() returned %i in pipelining mode\n", r);
+			return EFAULT;
+		}
+		// the whole envelope must be sent together with the DATA command
+		envelope_flush("DATA\r\n", strlen("DATA\r\n"));
+		r = envelope_replies();
+	}
+
 	if (!(smtpext & esmtp_pipelining) && *netbuffer_next) {
 		fprintf(stderr, "too few network messages were sent\n");
 		return EFAULT;
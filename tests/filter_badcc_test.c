@@ -2,6 +2,7 @@
 
 #include <qsmtpd/addrparse.h>
 #include <qsmtpd/qsmtpd.h>
+#include <qsmtpd/rcptset.h>
 #include <qsmtpd/userconf.h>
 #include "test_io/testcase_io.h"
 
@@ -49,7 +50,7 @@ static struct recip recips[] = {
 };
 
 static const char badcc_foo[] = "nonexistent@invalid.example.net\0@example.com\0sub.example.net\0\0";
-static const char badcc_domain[] = "foo@example.com\0\0";
+static const char badcc_domain[] = "foo@example.com\0bar@example.net\0\0";
 
 #define RCPT_PATTERNS 5
 #define VALID_USERDIRFD (420 + 42)
@@ -94,12 +95,15 @@ setup_recip_order(unsigned int valid, int r0, int r1, int r2, int r3, int r4)
 
 	goodrcpt = 0;
 	TAILQ_INIT(&head);
+	rcptset_clear();
 
 	for (int i = 0; (i < RCPT_PATTERNS) && (rflags[i] >= 0); i++) {
 		thisrecip = &recips[rflags[i]];
 		thisrecip->ok = (valid & (1 << rflags[i]));
 		memset(&thisrecip->entries, 0, sizeof(thisrecip->entries));
 		TAILQ_INSERT_TAIL(&head, thisrecip, entries);
+		if (rcptset_add(thisrecip) != 0)
+			exit(ENOMEM);
 		if (thisrecip->ok)
 			goodrcpt++;
 	}
@@ -158,6 +162,78 @@ userconf_get_buffer(const struct userconf *uc, const char *key, char ***values,
 	return type;
 }
 
+/**
+ * @brief set up a list of recipients that are not in the recips array
+ * @param list the recipients, terminated by NULL, the last one is the current one
+ */
+static void
+setup_recip_list(struct recip **list)
+{
+	goodrcpt = 0;
+	TAILQ_INIT(&head);
+	rcptset_clear();
+
+	for (int i = 0; list[i] != NULL; i++) {
+		thisrecip = list[i];
+		thisrecip->to.len = strlen(thisrecip->to.s);
+		thisrecip->ok = 1;
+		memset(&thisrecip->entries, 0, sizeof(thisrecip->entries));
+		TAILQ_INSERT_TAIL(&head, thisrecip, entries);
+		if (rcptset_add(thisrecip) != 0)
+			exit(ENOMEM);
+		goodrcpt++;
+	}
+
+	setup_userconf();
+}
+
+/**
+ * @brief check how complete addresses in badcc are matched
+ */
+static int
+test_complete_addresses(void)
+{
+	int err = 0;
+	const char *logmsg;
+	enum config_domain t;
+	struct recip upper = { .to = { .s = "FOO@Example.COM" } };
+	struct recip bar = { .to = { .s = "bar@example.net" } };
+	struct recip bar2 = { .to = { .s = "bar@example.net" } };
+	struct recip baz = { .to = { .s = "baz@example.org" } };
+
+	/* the whole address is compared case insensitive */
+	struct recip *caselist[] = { &upper, &bar, NULL };
+	setup_recip_list(caselist);
+	int r = cb_badcc(&ds, &logmsg, &t);
+	if (r != 2) {
+		fprintf(stderr, "bar@example.net should reject FOO@Example.COM,"
+				" but result is %i\n", r);
+		err++;
+	}
+
+	/* an earlier recipient with the same address as the current one */
+	struct recip *duplist[] = { &bar, &baz, &bar2, NULL };
+	setup_recip_list(duplist);
+	r = cb_badcc(&ds, &logmsg, &t);
+	if (r != 2) {
+		fprintf(stderr, "bar@example.net should reject an earlier bar@example.net,"
+				" but result is %i\n", r);
+		err++;
+	}
+
+	/* but not only itself */
+	struct recip *selflist[] = { &baz, &bar, NULL };
+	setup_recip_list(selflist);
+	r = cb_badcc(&ds, &logmsg, &t);
+	if (r != 0) {
+		fprintf(stderr, "bar@example.net should not reject itself,"
+				" but result is %i\n", r);
+		err++;
+	}
+
+	return err;
+}
+
 int
 main(void)
 {
@@ -237,5 +313,9 @@ main(void)
 		err++;
 	}
 
+	err += test_complete_addresses();
+
+	rcptset_clear();
+
 	return err;
 }
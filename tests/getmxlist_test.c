@@ -1,9 +1,12 @@
 #include <qremote/conn.h>
+#include <qremote/jobcache.h>
 #include <qremote/qremote.h>
+#include "test_io/testcase_io.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -50,6 +53,86 @@ getrhost(const struct ips *m __attribute__ ((unused)), const unsigned short idx
 	abort();
 }
 
+static unsigned int mxqueries;
+
+static int
+test_ask_dnsmx(const char *host, struct ips **result)
+{
+	mxqueries++;
+
+	if (strcmp(host, "example.net") != 0)
+		exit(EFAULT);
+
+	struct ips *first = calloc(1, sizeof(*first));
+	struct ips *second = calloc(1, sizeof(*second));
+
+	if ((first == NULL) || (second == NULL))
+		exit(ENOMEM);
+
+	first->name = strdup("mx.example.net");
+	first->priority = 10;
+	first->count = 2;
+	first->addr = calloc(2, sizeof(*first->addr));
+	first->next = second;
+	second->priority = MX_PRIORITY_IMPLICIT;
+	second->count = 1;
+	second->addr = calloc(1, sizeof(*second->addr));
+	if ((first->name == NULL) || (first->addr == NULL) || (second->addr == NULL))
+		exit(ENOMEM);
+	first->addr[1].s6_addr[15] = 1;
+	second->addr[0].s6_addr[15] = 2;
+
+	*result = first;
+
+	return 0;
+}
+
+/**
+ * @brief check that a MX list is shared through the job cache
+ */
+static int
+test_mxcache(void)
+{
+	char host[] = "example.net";
+	struct ips *mx[2];
+
+	if (jobcache_init() != 0)
+		exit(EFAULT);
+
+	testcase_setup_ask_dnsmx(test_ask_dnsmx);
+
+	for (unsigned int i = 0; i < 2; i++)
+		getmxlist(host, mx + i);
+
+	if (mxqueries != 1) {
+		fprintf(stderr, "MX list looked up %u times\n", mxqueries);
+		return 1;
+	}
+
+	int ret = 0;
+	const struct ips *a = mx[0];
+	const struct ips *b = mx[1];
+
+	for (; (a != NULL) && (b != NULL); a = a->next, b = b->next) {
+		if ((a->priority != b->priority) || (a->count != b->count) ||
+				(memcmp(a->addr, b->addr, a->count * sizeof(*a->addr)) != 0) ||
+				((a->name == NULL) != (b->name == NULL)) ||
+				((a->name != NULL) && (strcmp(a->name, b->name) != 0))) {
+			fputs("cached MX entry differs\n", stderr);
+			ret++;
+		}
+	}
+	if ((a != NULL) || (b != NULL)) {
+		fputs("cached MX list has different length\n", stderr);
+		ret++;
+	}
+
+	freeips(mx[0]);
+	freeips(mx[1]);
+
+	return ret;
+}
+
 int
 main(void)
 {
@@ -129,5 +212,7 @@ main(void)
 		freeips(mx);
 	}
 
+	ret += test_mxcache();
+
 	return ret;
 }
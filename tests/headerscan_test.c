@@ -0,0 +1,179 @@
+#include <qsmtpd/headerscan.h>
+#include <qsmtpd/rcptset.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct recip rcpts[] = {
+	{ .to = { .s = "foo@example.com", .len = 15 }, .ok = 1 },
+	{ .to = { .s = "bar@example.com", .len = 15 }, .ok = 0 }
+};
+
+static const struct {
+	const char *msg;
+	const int check2822;
+	const enum header_result result;
+	const unsigned int flags;
+	const unsigned int hops;
+	const int done;			/* if the end of the header is reached */
+	const char *hdrname;
+} testdata[] = {
+	{
+		.msg = "Date: today\nFrom: <baz@example.org>\nMessage-Id: <1@example.org>\n\nbody\n",
+		.check2822 = 1,
+		.flags = HEADER_HAS_DATE | HEADER_HAS_FROM | HEADER_HAS_MSGID,
+		.done = 1
+	},
+	{
+		.msg = "DATE: today\r\nfrom: <baz@example.org>\r\n\r\nDate: in body\r\n",
+		.check2822 = 1,
+		.flags = HEADER_HAS_DATE | HEADER_HAS_FROM,
+		.done = 1
+	},
+	{
+		.msg = "Date: today\nSubject: x\nDate: tomorrow\n\n",
+		.check2822 = 1,
+		.result = HDRSCAN_DUPLICATE,
+		.flags = HEADER_HAS_DATE,
+		.hdrname = "Date:"
+	},
+	{
+		/* duplicates are only reported if requested */
+		.msg = "Date: today\nDate: tomorrow\n\n",
+		.flags = HEADER_HAS_DATE,
+		.done = 1
+	},
+	{
+		.msg = "Subject: \xe4\n\n",
+		.check2822 = 1,
+		.result = HDRSCAN_8BIT
+	},
+	{
+		.msg = "Subject: \xe4\n\n\xe4\n",
+		.done = 1
+	},
+	{
+		.msg = "Received: from a\n by b\nReceived: from c\nX-Received: no\n\n",
+		.hops = 2,
+		.done = 1
+	},
+	{
+		.msg = "Delivered-To: foo@example.com\nDate: today\n\n",
+		.result = HDRSCAN_LOOP
+	},
+	{
+		.msg = "Delivered-To:\tfoo@example.com\r\n\r\n",
+		.result = HDRSCAN_LOOP
+	},
+	{
+		/* the domain is case insensitive */
+		.msg = "delivered-to: foo@EXAMPLE.com\n\n",
+		.result = HDRSCAN_LOOP
+	},
+	{
+		/* rejected recipients do not count */
+		.msg = "Delivered-To: bar@example.com\nDelivered-To: foo@example.com.invalid\n"
+				"Delivered-To: foo@example.co\nX-Delivered-To: foo@example.com\n\n"
+				"Delivered-To: foo@example.com\n",
+		.done = 1
+	},
+	{
+		/* folded lines and lines that are no headers */
+		.msg = "Subject: foo\n Delivered-To: foo@example.com\nno header line\n\tReceived: x\n\n",
+		.done = 1
+	},
+	{
+		.msg = "Subject: no end of header\n",
+	},
+	{ .msg = NULL }
+};
+
+static int
+check(const unsigned int idx, const unsigned int split, const struct header_scan *hs, const enum header_result r)
+{
+	int err = 0;
+
+	if (r != testdata[idx].result) {
+		fprintf(stderr, "%u/%u: result %i, expected %i\n", idx, split, r, testdata[idx].result);
+		err++;
+	}
+	if (hs->flags != testdata[idx].flags) {
+		fprintf(stderr, "%u/%u: flags 0x%x, expected 0x%x\n", idx, split, hs->flags, testdata[idx].flags);
+		err++;
+	}
+	if (hs->hops != testdata[idx].hops) {
+		fprintf(stderr, "%u/%u: hops %u, expected %u\n", idx, split, hs->hops, testdata[idx].hops);
+		err++;
+	}
+	if (hdrscan_done(hs) != testdata[idx].done) {
+		fprintf(stderr, "%u/%u: end of header %sfound\n", idx, split, hdrscan_done(hs) ? "" : "not ");
+		err++;
+	}
+	if ((testdata[idx].hdrname != NULL) &&
+			((hs->hdrname == NULL) || (strcmp(hs->hdrname, testdata[idx].hdrname) != 0))) {
+		fprintf(stderr, "%u/%u: wrong header name for duplicate\n", idx, split);
+		err++;
+	}
+
+	return err;
+}
+
+static int
+test_hops(void)
+{
+	struct header_scan hs;
+	int err = 0;
+
+	hdrscan_init(&hs, 0);
+	for (unsigned int i = 0; i < MAXHOPS; i++) {
+		if (hdrscan_feed(&hs, "Received: from x\n", 17) != HDRSCAN_OK) {
+			fprintf(stderr, "hop %u was already detected as loop\n", i + 1);
+			return 1;
+		}
+	}
+	if (hdrscan_feed(&hs, "Received: from x\n", 17) != HDRSCAN_HOPS) {
+		fputs("too many hops were not detected\n", stderr);
+		err++;
+	}
+
+	return err;
+}
+
+int
+main(void)
+{
+	int err = 0;
+
+	for (unsigned int i = 0; i < sizeof(rcpts) / sizeof(rcpts[0]); i++) {
+		if (rcptset_add(rcpts + i) != 0) {
+			fputs("rcptset_add() failed\n", stderr);
+			return 1;
+		}
+	}
+
+	for (unsigned int i = 0; testdata[i].msg != NULL; i++) {
+		const size_t len = strlen(testdata[i].msg);
+
+		/* the result must not depend on how the data is split */
+		for (size_t split = 1; split <= len; split++) {
+			struct header_scan hs;
+			enum header_result r = HDRSCAN_OK;
+
+			hdrscan_init(&hs, testdata[i].check2822);
+			for (size_t off = 0; off < len; off += split) {
+				const size_t l = (len - off < split) ? len - off : split;
+
+				r = hdrscan_feed(&hs, testdata[i].msg + off, l);
+			}
+
+			err += check(i, split, &hs, r);
+		}
+	}
+
+	err += test_hops();
+
+	rcptset_clear();
+
+	return err;
+}
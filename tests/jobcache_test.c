@@ -0,0 +1,120 @@
+/** \file jobcache_test.c
+ * \brief Testcases for the results shared between scheduled deliveries
+ */
+
+#include <qremote/jobcache.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static int
+test_inactive(void)
+{
+	char buf[16];
+
+	/* the cache is not set up: nothing is stored */
+	jobcache_put("inactive", "data", 4, 60);
+	if (jobcache_get("inactive", buf, sizeof(buf), 0) != 0) {
+		fprintf(stderr, "%s: inactive cache returned data\n", __func__);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int
+test_basic(void)
+{
+	int ret = 0;
+	char buf[JOBCACHE_DATA + 1];
+	char longkey[JOBCACHE_KEYLEN + 1];
+
+	jobcache_put("a", "first", 5, 60);
+	jobcache_put("b", "second", 6, 60);
+
+	if ((jobcache_get("a", buf, sizeof(buf), 0) != 5) || (memcmp(buf, "first", 5) != 0)) {
+		fprintf(stderr, "%s: entry a not found\n", __func__);
+		ret++;
+	}
+	if ((jobcache_get("b", buf, sizeof(buf), 0) != 6) || (memcmp(buf, "second", 6) != 0)) {
+		fprintf(stderr, "%s: entry b not found\n", __func__);
+		ret++;
+	}
+
+	/* a buffer too small for the data */
+	if (jobcache_get("b", buf, 5, 0) != 0) {
+		fprintf(stderr, "%s: data copied into too small buffer\n", __func__);
+		ret++;
+	}
+
+	jobcache_put("a", "replaced", 8, 60);
+	if ((jobcache_get("a", buf, sizeof(buf), 1) != 8) || (memcmp(buf, "replaced", 8) != 0)) {
+		fprintf(stderr, "%s: entry a not replaced\n", __func__);
+		ret++;
+	}
+	if (jobcache_get("a", buf, sizeof(buf), 0) != 0) {
+		fprintf(stderr, "%s: entry a not removed\n", __func__);
+		ret++;
+	}
+
+	memset(buf, 'x', sizeof(buf));
+	jobcache_put("big", buf, JOBCACHE_DATA + 1, 60);
+	if (jobcache_get("big", buf, sizeof(buf), 0) != 0) {
+		fprintf(stderr, "%s: too big entry was stored\n", __func__);
+		ret++;
+	}
+
+	memset(longkey, 'k', sizeof(longkey) - 1);
+	longkey[sizeof(longkey) - 1] = '\0';
+	jobcache_put(longkey, "data", 4, 60);
+	if (jobcache_get(longkey, buf, sizeof(buf), 0) != 0) {
+		fprintf(stderr, "%s: entry with too long key was stored\n", __func__);
+		ret++;
+	}
+
+	return ret;
+}
+
+static int
+test_shared(void)
+{
+	char buf[16];
+
+	/* what a forked delivery stores is seen by the others */
+	const pid_t child = fork();
+	if (child < 0)
+		exit(2);
+	if (child == 0) {
+		jobcache_put("shared", "child", 5, 60);
+		_exit(0);
+	}
+	waitpid(child, NULL, 0);
+
+	if ((jobcache_get("shared", buf, sizeof(buf), 0) != 5) || (memcmp(buf, "child", 5) != 0)) {
+		fprintf(stderr, "%s: entry of child not found\n", __func__);
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+main(void)
+{
+	int ret = 0;
+
+	ret += test_inactive();
+
+	if (jobcache_init() != 0) {
+		fputs("can not set up the cache\n", stderr);
+		return 1;
+	}
+
+	ret += test_basic();
+	ret += test_shared();
+
+	return ret;
+}
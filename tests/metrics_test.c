@@ -0,0 +1,131 @@
+#include <metrics.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char testfname[] = "metrics_testfile";
+
+static uint64_t counters[METRIC_COUNTERS];
+static uint64_t hists[METRIC_HISTOGRAMS][METRICS_BUCKETS + 2];
+
+int
+main(void)
+{
+	int err = 0;
+
+	unlink(testfname);
+	setenv("QSMTP_METRICS", testfname, 1);
+
+	if (metrics_attach() != -ENOENT) {
+		fputs("attaching to a nonexistent file did not fail\n", stderr);
+		return 1;
+	}
+	/* must not crash */
+	metrics_inc(METRIC_SMTPD_SESSIONS);
+	metrics_observe(METRIC_H_SMTPD_SESSION, 1);
+	if (metrics_get(METRIC_SMTPD_SESSIONS) != 0) {
+		fputs("metrics_get() without metrics file did not return 0\n", stderr);
+		err++;
+	}
+
+	/* a file with the wrong size must be replaced */
+	FILE *f = fopen(testfname, "w");
+	if (f == NULL) {
+		fprintf(stderr, "can not create %s\n", testfname);
+		return 2;
+	}
+	fputs("garbage", f);
+	fclose(f);
+
+	if (metrics_read(testfname, counters, hists) != -EINVAL) {
+		fputs("reading a file with invalid format did not fail\n", stderr);
+		err++;
+	}
+
+	int r = metrics_create(testfname);
+	if (r != 0) {
+		fprintf(stderr, "metrics_create() failed: %s\n", strerror(-r));
+		unlink(testfname);
+		return 3;
+	}
+
+	r = metrics_attach();
+	if (r != 0) {
+		fprintf(stderr, "metrics_attach() failed: %s\n", strerror(-r));
+		unlink(testfname);
+		return 4;
+	}
+
+	metrics_inc(METRIC_SMTPD_SESSIONS);
+	metrics_inc(METRIC_SMTPD_SESSIONS);
+	metrics_add(METRIC_NET_BYTES_IN, 1000);
+	metrics_inc(METRIC_COUNTERS - 1);
+	/* 0.5ms, exactly 1ms, 1.5ms, 2 minutes */
+	metrics_observe(METRIC_H_DNS + METRICS_DNS_MX, 500000);
+	metrics_observe(METRIC_H_DNS + METRICS_DNS_MX, 1000000);
+	metrics_observe(METRIC_H_DNS + METRICS_DNS_MX, 1500000);
+	metrics_observe(METRIC_H_DNS + METRICS_DNS_MX, 120000000000ULL);
+
+	if (metrics_get(METRIC_SMTPD_SESSIONS) != 2) {
+		fprintf(stderr, "metrics_get() returned %llu instead of 2\n",
+				(unsigned long long)metrics_get(METRIC_SMTPD_SESSIONS));
+		err++;
+	}
+
+	/* creating it again must keep the values */
+	r = metrics_create(testfname);
+	if (r != 0) {
+		fprintf(stderr, "metrics_create() on existing file failed: %s\n", strerror(-r));
+		err++;
+	}
+
+	r = metrics_read(testfname, counters, hists);
+	unlink(testfname);
+	if (r != 0) {
+		fprintf(stderr, "metrics_read() failed: %s\n", strerror(-r));
+		return 5;
+	}
+
+	for (unsigned int i = 0; i < METRIC_COUNTERS; i++) {
+		uint64_t expect = 0;
+
+		if (i == METRIC_SMTPD_SESSIONS)
+			expect = 2;
+		else if (i == METRIC_NET_BYTES_IN)
+			expect = 1000;
+		else if (i == METRIC_COUNTERS - 1)
+			expect = 1;
+
+		if (counters[i] != expect) {
+			fprintf(stderr, "counter %u is %llu, expected %llu\n", i,
+					(unsigned long long)counters[i], (unsigned long long)expect);
+			err++;
+		}
+	}
+
+	for (unsigned int i = 0; i < METRIC_HISTOGRAMS; i++) {
+		for (unsigned int b = 0; b < METRICS_BUCKETS + 2; b++) {
+			uint64_t expect = 0;
+
+			if (i == METRIC_H_DNS + METRICS_DNS_MX) {
+				if (b == 0)
+					expect = 2;
+				else if ((b == 1) || (b == METRICS_BUCKETS))
+					expect = 1;
+				else if (b == METRICS_BUCKETS + 1)
+					expect = 500 + 1000 + 1500 + 120000000;
+			}
+
+			if (hists[i][b] != expect) {
+				fprintf(stderr, "histogram %u bucket %u is %llu, expected %llu\n", i, b,
+						(unsigned long long)hists[i][b], (unsigned long long)expect);
+				err++;
+			}
+		}
+	}
+
+	return err;
+}
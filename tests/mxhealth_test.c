@@ -0,0 +1,176 @@
+#include <qremote/mxhealth.h>
+
+#include <qdns.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char cachename[] = "mxhealth_test.cache";
+
+static struct in6_addr
+mkaddr(const unsigned char last)
+{
+	struct in6_addr r = in6addr_loopback;
+
+	r.s6_addr[15] = last;
+
+	return r;
+}
+
+static int
+test_inactive(void)
+{
+	struct in6_addr a = mkaddr(2);
+	struct in6_addr addrs[1] = { mkaddr(3) };
+	struct ips mx = {
+		.addr = addrs,
+		.count = 1
+	};
+	struct ips *mxp = &mx;
+
+	/* all of these must be no-ops if the cache is not open */
+	mxhealth_attempt(&a);
+	mxhealth_result(1);
+	mxhealth_sort(&mxp);
+
+	if ((mxp != &mx) || mxhealth_dead(&a, time(NULL))) {
+		fprintf(stderr, "%s: inactive cache changed state\n", __func__);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int
+test_backoff(void)
+{
+	int ret = 0;
+	struct in6_addr a = mkaddr(4);
+	const int64_t now = time(NULL);
+
+	mxhealth_attempt(&a);
+	mxhealth_result(1);
+
+	if (!mxhealth_dead(&a, now)) {
+		fprintf(stderr, "%s: address not dead after failure\n", __func__);
+		ret++;
+	}
+	if (mxhealth_dead(&a, now + MXHEALTH_BACKOFF_BASE + 1)) {
+		fprintf(stderr, "%s: address still dead after first backoff interval\n", __func__);
+		ret++;
+	}
+
+	/* the second failure doubles the backoff */
+	mxhealth_attempt(&a);
+	mxhealth_result(1);
+	if (!mxhealth_dead(&a, now + MXHEALTH_BACKOFF_BASE + 1)) {
+		fprintf(stderr, "%s: backoff not increased after second failure\n", __func__);
+		ret++;
+	}
+
+	/* a result without attempt must not change anything */
+	mxhealth_result(0);
+	if (!mxhealth_dead(&a, now)) {
+		fprintf(stderr, "%s: result without attempt was recorded\n", __func__);
+		ret++;
+	}
+
+	/* the cache is shared: reopening must keep the information */
+	mxhealth_close();
+	if (mxhealth_open(cachename) != 0) {
+		fprintf(stderr, "%s: can not reopen cache\n", __func__);
+		return ++ret;
+	}
+	if (!mxhealth_dead(&a, now)) {
+		fprintf(stderr, "%s: information lost on reopen\n", __func__);
+		ret++;
+	}
+
+	mxhealth_attempt(&a);
+	mxhealth_result(0);
+	if (mxhealth_dead(&a, now)) {
+		fprintf(stderr, "%s: address still dead after success\n", __func__);
+		ret++;
+	}
+
+	return ret;
+}
+
+static int
+test_sort(void)
+{
+	int ret = 0;
+	struct in6_addr addr1[3] = { mkaddr(10), mkaddr(11), mkaddr(12) };
+	struct in6_addr addr2[1] = { mkaddr(20) };
+	struct in6_addr addr3[1] = { mkaddr(30) };
+	struct ips mx[3] = {
+		{
+			.addr = addr2,
+			.count = 1,
+			.priority = 10,
+			.next = mx + 1
+		},
+		{
+			.addr = addr1,
+			.count = 3,
+			.priority = 20,
+			.next = mx + 2
+		},
+		{
+			.addr = addr3,
+			.count = 1,
+			.priority = 30
+		}
+	};
+	struct ips *mxp = mx;
+
+	mxhealth_attempt(addr2);
+	mxhealth_result(1);
+	mxhealth_attempt(addr1);
+	mxhealth_result(1);
+	mxhealth_attempt(addr1 + 2);
+	mxhealth_result(1);
+
+	mxhealth_sort(&mxp);
+
+	if ((mxp != mx + 1) || (mxp->next != mx + 2) || (mx[2].next != mx) || (mx[0].next != NULL)) {
+		fprintf(stderr, "%s: dead MX entry not moved to the end\n", __func__);
+		ret++;
+	}
+
+	const struct in6_addr expect[3] = { mkaddr(11), mkaddr(10), mkaddr(12) };
+	if (memcmp(addr1, expect, sizeof(expect)) != 0) {
+		fprintf(stderr, "%s: addresses inside MX entry not reordered\n", __func__);
+		ret++;
+	}
+
+	return ret;
+}
+
+int
+main(void)
+{
+	int ret = 0;
+
+	unlink(cachename);
+
+	ret += test_inactive();
+
+	int r = mxhealth_open(cachename);
+	if (r != 0) {
+		fprintf(stderr, "can not open cache: %i\n", r);
+		return 1;
+	}
+
+	ret += test_backoff();
+	ret += test_sort();
+
+	mxhealth_close();
+	unlink(cachename);
+
+	return ret;
+}
@@ -25,6 +25,11 @@ log_write(int priority __attribute__ ((unused)), const char *s __attribute__ ((u
 {
 	dieerror(EFAULT);
 }
+
+void
+log_flush(void)
+{
+}
 #endif
 
 int socketd;
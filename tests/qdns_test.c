@@ -345,6 +345,19 @@ int dnsmx(char **out, size_t *len, const char *host)
 	}
 }
 
+static unsigned int prefetched;	/**< number of calls to dnsprefetch() */
+
+void
+dnsprefetch(const char *host, const enum dns_prefetch_type type)
+{
+	if (type != DNS_PREFETCH_IP6) {
+		fprintf(stderr, "prefetch of %s with unexpected type %i\n", host, type);
+		exit(1);
+	}
+
+	prefetched++;
+}
+
 int dnsname(char **out, const struct in6_addr *ip)
 {
 	char ipstr[INET6_ADDRSTRLEN];
@@ -501,12 +514,23 @@ test_mx(void)
 	for (unsigned int mxidx = 0; mxentries[mxidx].name != NULL; mxidx++) {
 		struct ips *res = (void *)((uintptr_t)-1);
 		unsigned int idx = 0;
+		unsigned int mxcnt = 0;
 
+		prefetched = 0;
 		if (ask_dnsmx(mxentries[mxidx].name, &res) != 0) {
 			fprintf(stderr, "lookup of %s did not return MX entries\n", mxentries[mxidx].name);
 			return ++err;
 		}
 
+		while ((mxcnt < MAX_MX_PER_DOMAIN) && (mxentries[mxidx].entries[mxcnt].priority != 0))
+			mxcnt++;
+		/* all but the first MX name are prefetched */
+		if (prefetched != mxcnt - 1) {
+			fprintf(stderr, "lookup of %s prefetched %u names, expected %u\n",
+					mxentries[mxidx].name, prefetched, mxcnt - 1);
+			err++;
+		}
+
 		struct ips *cur = res;
 		while (cur != NULL) {
 			char *nname = NULL;
@@ -4,6 +4,7 @@
 #endif /* CHUNKING */
 
 #include <netio.h>
+#include <qremote/greeting.h>
 #include <qremote/qrdata.h>
 #include <qremote/qremote.h>
 #include "test_io/testcase_io.h"
@@ -35,28 +36,37 @@ static unsigned int write_msg_index;
 static struct checkreply_data {
 	const char *status;
 	int result;
+	unsigned int writes;	/* if not 0: number of netnwrite() calls expected before this reply */
 } const *checkreply_msgs;
 static unsigned int checkreply_index;
 
-void
-quit(void)
+/**
+ * @brief check that all expected network traffic happened
+ */
+static void
+check_complete(void)
 {
-	if (expect_quit) {
-		if (may_log_count != 0) {
-			fprintf(stderr, "%u expected log messages were not sent\n", may_log_count);
-			exit(EINVAL);
-		}
+	if (may_log_count != 0) {
+		fprintf(stderr, "%u expected log messages were not sent\n", may_log_count);
+		exit(EINVAL);
+	}
 
-		if ((checkreply_msgs != NULL) && (checkreply_msgs[checkreply_index].status != NULL)) {
-			fprintf(stderr, "not all calls to checkreply() were done\n");
-			exit(EINVAL);
-		}
+	if ((checkreply_msgs != NULL) && (checkreply_msgs[checkreply_index].status != NULL)) {
+		fprintf(stderr, "not all calls to checkreply() were done\n");
+		exit(EINVAL);
+	}
 
-		if ((write_msgs != NULL) && (write_msgs[write_msg_index] != NULL)) {
-			fprintf(stderr, "not all calls to netnwrite() were done\n");
-			exit(EINVAL);
-		}
+	if ((write_msgs != NULL) && (write_msgs[write_msg_index] != NULL)) {
+		fprintf(stderr, "not all calls to netnwrite() were done\n");
+		exit(EINVAL);
+	}
+}
 
+void
+quit(void)
+{
+	if (expect_quit) {
+		check_complete();
 		exit(0);
 	}
 
@@ -72,15 +82,37 @@ checkreply(const char *status, const char **pre __attribute__ ((unused)), const
 		exit(EFAULT);
 	}
 
-	if (strcmp(status, checkreply_msgs[checkreply_index].status) != 0) {
+	/* NULL status is expected as "" */
+	if (strcmp(status ? status : "", checkreply_msgs[checkreply_index].status) != 0) {
 		fprintf(stderr, "expected message at index %u not received, got '%s', expected '%s'\n",
 			checkreply_index, status, checkreply_msgs[checkreply_index].status);
 		exit(EINVAL);
 	}
 
+	if ((checkreply_msgs[checkreply_index].writes != 0) &&
+			(checkreply_msgs[checkreply_index].writes != write_msg_index)) {
+		fprintf(stderr, "reply at index %u read after %u messages, expected after %u\n",
+			checkreply_index, write_msg_index, checkreply_msgs[checkreply_index].writes);
+		exit(EINVAL);
+	}
+
 	return checkreply_msgs[checkreply_index++].result;
 }
 
+int
+envelope_flush(const char *tail, const size_t taillen)
+{
+	return (tail != NULL) ? netnwrite(tail, taillen) : 0;
+}
+
+static int envelope_rejected;	/* if envelope_replies() reports all recipients as rejected */
+
+int
+envelope_replies(void)
+{
+	return envelope_rejected;
+}
+
 static unsigned int was_send_data_called;
 
 void
@@ -94,6 +126,11 @@ send_data(unsigned int recodeflag)
 	was_send_data_called = 1;
 }
 
+void
+free_msgindex(void)
+{
+}
+
 void
 test_log_write(int priority, const char *s)
 {
@@ -108,6 +145,8 @@ test_log_write(int priority, const char *s)
 void
 test_net_conn_shutdown(const enum conn_shutdown_type sdtype __attribute__((unused)))
 {
+	if (expect_quit)
+		check_complete();
 	free(outbuf);
 	outbuf = NULL;
 }
@@ -214,8 +253,8 @@ test_single_byte(void)
 		NULL
 	};
 	const struct checkreply_data chrmsgs[] = {
-		{ "KZD", 250 },
-		{ NULL, 0 }
+		{ "KZD", 250, 0 },
+		{ NULL, 0, 0 }
 	};
 
 	msgdata = "a";
@@ -250,10 +289,10 @@ test_wrap_single_line(void)
 		NULL
 	};
 	const struct checkreply_data chrmsgs[] = {
-		{ " ZD", 250 },
-		{ " ZD", 250 },
-		{ "KZD", 250 },
-		{ NULL, 0 }
+		{ " ZD", 250, 0 },
+		{ " ZD", 250, 0 },
+		{ "KZD", 250, 0 },
+		{ NULL, 0, 0 }
 	};
 
 	msgdata = "abcdefgh";
@@ -287,9 +326,9 @@ test_wrap_multi_lines(void)
 		NULL
 	};
 	const struct checkreply_data chrmsgs[] = {
-		{ " ZD", 250 },
-		{ "KZD", 250 },
-		{ NULL, 0 }
+		{ " ZD", 250, 0 },
+		{ "KZD", 250, 0 },
+		{ NULL, 0, 0 }
 	};
 
 	msgdata = "ab\r\ncde\r\nfgh\r\n";
@@ -324,10 +363,10 @@ test_newline_crlf_errors(void)
 		NULL
 	};
 	const struct checkreply_data chrmsgs[] = {
-		{ " ZD", 250 },
-		{ " ZD", 250 },
-		{ "KZD", 250 },
-		{ NULL, 0 }
+		{ " ZD", 250, 0 },
+		{ " ZD", 250, 0 },
+		{ "KZD", 250, 0 },
+		{ NULL, 0, 0 }
 	};
 
 	msgdata = "\r\n\n\n\r\n\r";
@@ -357,6 +396,92 @@ test_newline_crlf_errors(void)
 	return 0;
 }
 
+static int
+test_pipeline_window(void)
+{
+	const char *netmsgs[] = {
+		"BDAT 3\r\nabc",
+		"BDAT 3\r\ndef",
+		"BDAT 3\r\nghi",
+		"BDAT 3\r\njkl",
+		"BDAT 2 LAST\r\nmn",
+		NULL
+	};
+	/* 2 chunks are kept in flight */
+	const struct checkreply_data chrmsgs[] = {
+		{ " ZD", 250, 2 },
+		{ " ZD", 250, 3 },
+		{ " ZD", 250, 4 },
+		{ " ZD", 250, 5 },
+		{ "KZD", 250, 5 },
+		{ NULL, 0, 0 }
+	};
+
+	msgdata = "abcdefghijklmn";
+	msgsize = strlen(msgdata);
+	may_log_count = 0;
+	chunksize = 18;
+	chunkwindow = 2;
+	smtpext = esmtp_pipelining;
+	write_msg_index = 0;
+	write_msgs = netmsgs;
+	checkreply_index = 0;
+	checkreply_msgs = chrmsgs;
+	successmsg[2] = "3";
+
+	testcase_setup_netnwrite(test_netnwrite);
+
+	send_bdat(0);
+
+	smtpext = 0;
+	chunkwindow = 0;
+
+	if (checkreply_msgs[checkreply_index].status != NULL) {
+		fprintf(stderr, "not all replies were read\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+static int
+test_pipeline_fail(void)
+{
+	const char *netmsgs[] = {
+		"BDAT 3\r\nabc",
+		"BDAT 3\r\ndef",
+		"BDAT 3\r\nghi",
+		NULL
+	};
+	/* the reply to the first chunk is an error, the others are ignored */
+	const struct checkreply_data chrmsgs[] = {
+		{ " ZD", 550, 3 },
+		{ "", 503, 3 },
+		{ "", 503, 3 },
+		{ NULL, 0, 0 }
+	};
+
+	msgdata = "abcdefghijklmn";
+	msgsize = strlen(msgdata);
+	may_log_count = 0;
+	chunksize = 18;
+	chunkwindow = 3;
+	smtpext = esmtp_pipelining;
+	write_msg_index = 0;
+	write_msgs = netmsgs;
+	checkreply_index = 0;
+	checkreply_msgs = chrmsgs;
+	successmsg[2] = "3";
+	expect_quit = 1;
+
+	testcase_setup_netnwrite(test_netnwrite);
+
+	send_bdat(0);
+
+	fprintf(stderr, "end of %s reached, send_bdat() should not have returned\n", __FUNCTION__);
+	return 1;
+}
+
 static int
 test_wrap_fail(void)
 {
@@ -366,9 +491,9 @@ test_wrap_fail(void)
 		NULL
 	};
 	const struct checkreply_data chrmsgs[] = {
-		{ " ZD", 250 },
-		{ " ZD", 550 },
-		{ NULL, 0 }
+		{ " ZD", 250, 0 },
+		{ " ZD", 550, 0 },
+		{ NULL, 0, 0 }
 	};
 
 	msgdata = "abcdefgh";
@@ -390,16 +515,107 @@ test_wrap_fail(void)
 	return 1;
 }
 
+/**
+ * @brief all recipients are rejected while chunks are in flight
+ *
+ * The replies to all chunks sent so far have to be read before the
+ * connection is closed, no further chunk may be sent.
+ */
+static int
+test_all_rejected(void)
+{
+	const char *netmsgs[] = {
+		"BDAT 3\r\nabc",
+		"BDAT 3\r\ndef",
+		"BDAT 3\r\nghi",
+		NULL
+	};
+	const struct checkreply_data chrmsgs[] = {
+		{ "", 554, 3 },
+		{ "", 503, 3 },
+		{ "", 503, 3 },
+		{ NULL, 0, 0 }
+	};
+
+	msgdata = "abcdefghijklmn";
+	msgsize = strlen(msgdata);
+	may_log_count = 0;
+	chunksize = 18;
+	chunkwindow = 3;
+	smtpext = esmtp_pipelining;
+	envelope_rejected = 1;
+	write_msg_index = 0;
+	write_msgs = netmsgs;
+	checkreply_index = 0;
+	checkreply_msgs = chrmsgs;
+	successmsg[2] = "3";
+	expect_quit = 1;
+
+	testcase_setup_netnwrite(test_netnwrite);
+
+	send_bdat(0);
+
+	fprintf(stderr, "end of %s reached, send_bdat() should not have returned\n", __FUNCTION__);
+	return 1;
+}
+
+/**
+ * @brief all recipients are rejected and the whole message fits in one chunk
+ */
+static int
+test_all_rejected_last(void)
+{
+	const char *netmsgs[] = {
+		"BDAT 2 LAST\r\nab",
+		NULL
+	};
+	const struct checkreply_data chrmsgs[] = {
+		{ "", 554, 1 },
+		{ NULL, 0, 0 }
+	};
+
+	msgdata = "ab";
+	msgsize = strlen(msgdata);
+	may_log_count = 0;
+	chunksize = 1024;
+	chunkwindow = 3;
+	smtpext = esmtp_pipelining;
+	envelope_rejected = 1;
+	write_msg_index = 0;
+	write_msgs = netmsgs;
+	checkreply_index = 0;
+	checkreply_msgs = chrmsgs;
+	successmsg[2] = "3";
+	expect_quit = 1;
+
+	testcase_setup_netnwrite(test_netnwrite);
+
+	send_bdat(0);
+
+	fprintf(stderr, "end of %s reached, send_bdat() should not have returned\n", __FUNCTION__);
+	return 1;
+}
+
 int
-main(void)
+main(int argc, char **argv)
 {
 	int ret = 0;
 
+	testcase_setup_net_conn_shutdown(test_net_conn_shutdown);
+
+	if ((argc == 2) && (strcmp(argv[1], "pipeline_fail") == 0))
+		return test_pipeline_fail();
+	if ((argc == 2) && (strcmp(argv[1], "all_rejected") == 0))
+		return test_all_rejected();
+	if ((argc == 2) && (strcmp(argv[1], "all_rejected_last") == 0))
+		return test_all_rejected_last();
+
 	ret += test_bad_malloc();
 	ret += test_single_byte();
 	ret += test_wrap_single_line();
 	ret += test_wrap_multi_lines();
 	ret += test_newline_crlf_errors();
+	ret += test_pipeline_window();
 
 	if (ret != 0) {
 		fprintf(stderr, "%i errors before calling final test\n", ret);
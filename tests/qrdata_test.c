@@ -1,6 +1,7 @@
 #define _ISOC99_SOURCE
 #include <netio.h>
 #include <qutf8.h>
+#include <qremote/lineindex.h>
 #include <qremote/qrdata.h>
 #include <qremote/qremote.h>
 #include "test_io/testcase_io.h"
@@ -29,6 +30,8 @@ enum datastate {
 
 static enum datastate state = ST_START;
 static unsigned int datareply;
+static unsigned int rejectreply;	/**< reply to DATA if all recipients were rejected */
+static unsigned int rejectreplies;	/**< number of replies read after all recipients were rejected */
 
 unsigned int may_log_count;
 
@@ -209,6 +212,27 @@ static struct {
 		.recodeflag = 0,
 		.log_count = 0
 	},
+	{
+		.name = "8bitDots",
+		.msg = "Subject: dot-test\r\nContent-Transfer-Encoding: 8bit\r\n\r\n\303\244\r\n.\r\n..\r\n...x\r\n.",
+		.filters = 0,
+		.recodeflag = recode_8bit,
+		.log_count = 0
+	},
+	{
+		.name = "8bitTrailingSpace",
+		.msg = "Subject: trailing whitespace\r\nContent-Transfer-Encoding: 8bit\r\n\r\n\303\244 ",
+		.filters = 0,
+		.recodeflag = recode_8bit,
+		.log_count = 0
+	},
+	{
+		.name = "8bitTrailingTab",
+		.msg = "Subject: trailing whitespace\r\nContent-Transfer-Encoding: 8bit\r\n\r\n\303\244 and a tab\t",
+		.filters = 0,
+		.recodeflag = recode_8bit,
+		.log_count = 0
+	},
 	{
 		.name = "8bitHeader",
 		.msg = "Subject: garbage \244\r\n\r\n",
@@ -460,6 +484,63 @@ static struct {
 };
 static unsigned int usepattern;
 
+/**
+ * @brief check that the line index gives the same results as need_recode()
+ * @param msg the message
+ * @param len length of msg
+ * @return number of mismatches
+ *
+ * All parts starting at a line start are checked that end at a line start,
+ * one character before or after it, around the line length limit after it,
+ * or at the end of the message.
+ */
+static int
+check_line_index(const char *msg, const off_t len)
+{
+	struct line_index idx;
+	int err = 0;
+	/* offsets of the part ends relative to the line starts, the large ones
+	 * catch the limit for long lines */
+	const off_t ends[] = { -1, 0, 1, 998, 999, 1000 };
+
+	if (line_index_build(&idx, msg, len) != 0) {
+		fputs("line_index_build() failed\n", stderr);
+		return 1;
+	}
+
+	for (unsigned int i = 0; i < idx.lines; i++) {
+		const off_t start = idx.entries[i].start;
+
+		for (unsigned int j = i; j <= idx.lines; j++) {
+			for (unsigned int k = 0; k < sizeof(ends) / sizeof(ends[0]); k++) {
+				const off_t end = idx.entries[j].start + ends[k];
+
+				if ((end < start) || (end > len))
+					continue;
+
+				const int r = line_index_recode(&idx, msg + start, end - start);
+				const unsigned int expect = need_recode(msg + start, end - start);
+
+				if (r != (int)expect) {
+					fprintf(stderr, "line_index_recode(%lld, %lld) returned 0x%x, need_recode() 0x%x\n",
+							(long long)start, (long long)(end - start), r, expect);
+					err++;
+				}
+			}
+		}
+	}
+
+	if ((len > 1) && (msg[0] != '\r') && (msg[0] != '\n') && (msg[1] != '\r') && (msg[1] != '\n') &&
+			(line_index_recode(&idx, msg + 1, len - 1) != -1)) {
+		fputs("line_index_recode() did not reject a part not starting at a line start\n", stderr);
+		err++;
+	}
+
+	line_index_free(&idx);
+
+	return err;
+}
+
 static void
 dots_detector(const char *msg, const size_t len)
 {
@@ -693,6 +774,31 @@ checkreply(const char *status, const char **pre __attribute__ ((unused)), const
 {
 	int ret = 0;
 
+	if (rejectreply != 0) {
+		/* only the reply to DATA and the one to the empty message are read */
+		if ((status != NULL) || (mask != 0) || (state != ST_DATA + rejectreplies)) {
+			fprintf(stderr, "unexpected call %u to %s()\n", rejectreplies, __func__);
+			exit(EFAULT);
+		}
+
+		if (rejectreplies++ == 0) {
+			if (rejectreply == 354) {
+				state = ST_354;
+				return 354;
+			}
+			state = ST_DATAEND;
+			return rejectreply;
+		}
+
+		if (rejectreply != 354) {
+			fprintf(stderr, "reply read after DATA was rejected\n");
+			exit(EFAULT);
+		}
+
+		state = ST_DATAEND;
+		return 554;
+	}
+
 	if (strcmp("KZD", status) != 0)
 		exit(EINVAL);
 
@@ -764,6 +870,18 @@ checkreply(const char *status, const char **pre __attribute__ ((unused)), const
 	exit(ret);
 }
 
+int
+envelope_flush(const char *tail, const size_t taillen)
+{
+	return (tail != NULL) ? netnwrite(tail, taillen) : 0;
+}
+
+int
+envelope_replies(void)
+{
+	return (rejectreply != 0);
+}
+
 int
 test_netnwrite(const char *s, const size_t l)
 {
@@ -838,6 +956,24 @@ write_status_m(const char **strs, const unsigned int count)
 void
 test_net_conn_shutdown(const enum conn_shutdown_type sdtype __attribute__((unused)))
 {
+	if (rejectreply != 0) {
+		/* a 354 has to be answered with an empty message */
+		const char *expect = (rejectreply == 354) ? ".\r\n" : "";
+		const unsigned int replies = (rejectreply == 354) ? 2 : 1;
+
+		if ((outpos != strlen(expect)) || (memcmp(outbuf, expect, outpos) != 0)) {
+			fprintf(stderr, "unexpected data sent after all recipients were rejected: '%.*s'\n",
+					(int)outpos, outbuf);
+			exit(EINVAL);
+		}
+
+		if (rejectreplies != replies) {
+			fprintf(stderr, "%u replies read after all recipients were rejected, expected %u\n",
+					rejectreplies, replies);
+			exit(EINVAL);
+		}
+	}
+
 	free(outbuf);
 	outbuf = NULL;
 }
@@ -860,7 +996,16 @@ int main(int argc, char **argv)
 	heloname.s = "foo.bar.example.com";
 	heloname.len = strlen(heloname.s);
 
-	if ((strcmp(argv[1], "data_reply_400") == 0) || (strcmp(argv[1], "data_reply_500") == 0)) {
+	if ((strcmp(argv[1], "all_rejected_354") == 0) || (strcmp(argv[1], "all_rejected_554") == 0)) {
+		rejectreply = (strcmp(argv[1], "all_rejected_354") == 0) ? 354 : 554;
+		msgdata = testpatterns[0].msg;
+		msgsize = strlen(msgdata);
+		outlen = 16;
+		outbuf = calloc(outlen, 1);
+		if (outbuf == NULL)
+			return ENOMEM;
+		ascii = 0;
+	} else if ((strcmp(argv[1], "data_reply_400") == 0) || (strcmp(argv[1], "data_reply_500") == 0)) {
 		if (strcmp(argv[1], "data_reply_400") == 0)
 			datareply = 400;
 		else
@@ -957,6 +1102,9 @@ int main(int argc, char **argv)
 			return EFAULT;
 		}
 
+		if (check_line_index(msgdata, msgsize) != 0)
+			return EFAULT;
+
 		if (fd >= 0) {
 			cstring cs = {
 				.s = msgdata,
@@ -0,0 +1,507 @@
+/** \file qremote_scheduler_test.c
+ * \brief Testcases for the delivery scheduler of Qremote and qremotec
+ */
+
+#include <qremote/scheduler.h>
+
+#include <qremote/mxhealth.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char sockname[] = "qremote_scheduler_test.sock";
+static const char msgname[] = "qremote_scheduler_test.msg";
+static const char msgtext[] = "Subject: test\r\n\r\nhello\r\n";
+static const char healthname[] = "qremote_scheduler_test.health";
+static const char heldname[] = "qremote_scheduler_test.held";
+static const char healthaddr[] = "2001:db8::25";
+
+static int err;	/* global error counter */
+static int hold_lock;	/* if this delivery keeps the lock of the MX health cache for a while */
+static int lock_shared;	/* if this delivery got the lock while another one held it */
+
+/**
+ * @brief flock() as used by the MX health cache
+ *
+ * A delivery with hold_lock set keeps the exclusive lock for a while and
+ * marks this with a file. Any other delivery must not get the lock while
+ * that file exists.
+ */
+int
+flock(int fd, int operation)
+{
+	const int r = syscall(SYS_flock, fd, operation);
+
+	if ((r != 0) || (operation != LOCK_EX))
+		return r;
+
+	if (hold_lock) {
+		const struct timespec ts = {
+			.tv_nsec = 300000000
+		};
+		int hfd = open(heldname, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+
+		if (hfd >= 0)
+			close(hfd);
+		nanosleep(&ts, NULL);
+		unlink(heldname);
+	} else if (access(heldname, F_OK) == 0) {
+		lock_shared = 1;
+	}
+
+	return r;
+}
+
+void
+log_writen(int priority __attribute__ ((unused)), const char **s __attribute__ ((unused)))
+{
+}
+
+void
+log_write(int priority __attribute__ ((unused)), const char *s __attribute__ ((unused)))
+{
+}
+
+static void
+test_job_args(void)
+{
+	const struct {
+		const char *buf;
+		size_t len;
+		int argc;
+	} patterns[] = {
+		{ .buf = "host\0sender\0rcpt", .len = 17, .argc = 4 },
+		{ .buf = "host\0\0rcpt1\0rcpt2", .len = 18, .argc = 5 },
+		{ .buf = "host\0sender", .len = 12, .argc = -EINVAL },
+		{ .buf = "\0sender\0rcpt", .len = 13, .argc = -EINVAL },
+		{ .buf = "host\0sender\0rcpt", .len = 16, .argc = -EINVAL },
+		{ .buf = "", .len = 0, .argc = -EINVAL },
+		{ .buf = NULL }
+	};
+
+	for (unsigned int i = 0; patterns[i].buf != NULL; i++) {
+		char buf[32];
+		char **argv = NULL;
+
+		memcpy(buf, patterns[i].buf, patterns[i].len);
+		const int r = scheduler_job_args(buf, patterns[i].len, &argv);
+
+		if (r != patterns[i].argc) {
+			fprintf(stderr, "pattern %u: scheduler_job_args() returned %i instead of %i\n",
+					i, r, patterns[i].argc);
+			err++;
+		} else if (r > 0) {
+			if ((strcmp(argv[0], "Qremote") != 0) || (strcmp(argv[1], "host") != 0) ||
+					(argv[r] != NULL) || (strncmp(argv[r - 1], "rcpt", 4) != 0)) {
+				fprintf(stderr, "pattern %u: wrong arguments returned\n", i);
+				err++;
+			}
+		}
+		free(argv);
+	}
+}
+
+/**
+ * @brief the delivery in the child process
+ *
+ * Only one delivery per host may run at a time, which is checked with a
+ * lock file. The status contains the host and the message.
+ */
+static void __attribute__ ((noreturn))
+run_job(int argc, char **argv)
+{
+	char lockname[64];
+	char msg[128];
+	ssize_t len = read(0, msg, sizeof(msg) - 1);
+
+	if ((argc < 4) || (strcmp(argv[0], "Qremote") != 0) || (len < 0))
+		_exit(1);
+	msg[len] = '\0';
+
+	/* crash after the status of the first recipient */
+	if (strcmp(argv[1], "crash.example") == 0) {
+		ssize_t r = write(1, "r", 2);
+
+		(void) r;
+		abort();
+	}
+
+	/* both deliveries record a failure, the second one waits until the
+	 * first one holds the lock */
+	if (strncmp(argv[1], "health-", strlen("health-")) == 0) {
+		const struct timespec ts = {
+			.tv_nsec = 100000000
+		};
+		struct in6_addr addr;
+
+		hold_lock = (strcmp(argv[1], "health-a.example") == 0);
+		if (!hold_lock)
+			nanosleep(&ts, NULL);
+		if (inet_pton(AF_INET6, healthaddr, &addr) != 1)
+			_exit(1);
+		mxhealth_attempt(&addr);
+		mxhealth_result(1);
+		if (lock_shared) {
+			const char status[] = "Dlock of the MX health cache is shared\n";
+			ssize_t r = write(1, status, sizeof(status));
+
+			(void) r;
+			_exit(0);
+		}
+	}
+
+	snprintf(lockname, sizeof(lockname), "qremote_scheduler_test.%s", argv[1]);
+	int fd = open(lockname, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		const char status[] = "Dconcurrency limit for host exceeded\n";
+		ssize_t r = write(1, status, sizeof(status));
+
+		(void) r;
+		_exit(0);
+	}
+	close(fd);
+
+	const struct timespec ts = {
+		.tv_nsec = 200000000
+	};
+	nanosleep(&ts, NULL);
+	unlink(lockname);
+
+	ssize_t r = 0;
+
+	for (int i = 3; (i < argc) && (r >= 0); i++)
+		r = write(1, "r", 2);
+
+	char status[256];
+	snprintf(status, sizeof(status), "K%s %s", argv[1], msg);
+	r = write(1, status, strlen(status) + 1);
+	(void) r;
+
+	_exit(0);
+}
+
+/**
+ * @brief start qremotec
+ * @param qremotec path to the program
+ * @param host the target host
+ * @return the pipe the status of qremotec can be read from
+ */
+static int
+start_client(const char *qremotec, const char *host, pid_t *pid)
+{
+	int pi[2];
+
+	if (pipe(pi) != 0)
+		exit(2);
+
+	*pid = fork();
+	if (*pid < 0)
+		exit(2);
+
+	if (*pid == 0) {
+		int fd = open(msgname, O_RDONLY);
+
+		if ((fd < 0) || (dup2(fd, 0) != 0) || (dup2(pi[1], 1) != 1))
+			_exit(1);
+		close(pi[0]);
+		execl(qremotec, "qremotec", host, "sender@example.net", "rcpt@example.com", NULL);
+		_exit(1);
+	}
+
+	close(pi[1]);
+	return pi[0];
+}
+
+static size_t
+read_all(const int fd, char *buf, const size_t len)
+{
+	size_t pos = 0;
+
+	while (pos < len) {
+		ssize_t r = read(fd, buf + pos, len - pos);
+
+		if (r <= 0)
+			break;
+		pos += r;
+	}
+	close(fd);
+
+	return pos;
+}
+
+static void
+check_client(const int fd, const pid_t pid, const char *host)
+{
+	char buf[256];
+	char expect[256];
+	int wstat;
+	const size_t len = read_all(fd, buf, sizeof(buf));
+	const size_t elen = 2 + snprintf(expect + 2, sizeof(expect) - 2, "K%s %s", host, msgtext) + 1;
+
+	memcpy(expect, "r", 2);
+
+	if ((len != elen) || (memcmp(buf, expect, len) != 0)) {
+		fprintf(stderr, "unexpected status for delivery to %s: %.*s\n", host, (int)len, buf);
+		err++;
+	}
+
+	if ((waitpid(pid, &wstat, 0) != pid) || !WIFEXITED(wstat) || (WEXITSTATUS(wstat) != 0)) {
+		fprintf(stderr, "qremotec for %s did not exit successfully\n", host);
+		err++;
+	}
+}
+
+/**
+ * @brief check that concurrent deliveries do not share the lock of the MX health cache
+ * @param qremotec path to the program
+ */
+static void
+test_health_lock(const char *qremotec)
+{
+	const char *hosts[] = { "health-a.example", "health-b.example" };
+	int fds[2];
+	pid_t pids[2];
+
+	for (unsigned int i = 0; i < 2; i++)
+		fds[i] = start_client(qremotec, hosts[i], pids + i);
+	for (unsigned int i = 0; i < 2; i++)
+		check_client(fds[i], pids[i], hosts[i]);
+
+	/* both failures must be recorded */
+	struct mxhealth_table *table = malloc(sizeof(*table));
+	struct in6_addr addr;
+	int fd = open(healthname, O_RDONLY | O_CLOEXEC);
+
+	if ((table == NULL) || (fd < 0) || (inet_pton(AF_INET6, healthaddr, &addr) != 1))
+		exit(2);
+	if (read_all(fd, (char *)table, sizeof(*table)) != sizeof(*table)) {
+		fputs("MX health cache has wrong size\n", stderr);
+		err++;
+		free(table);
+		return;
+	}
+
+	unsigned int failures = 0;
+	for (unsigned int i = 0; i < MXHEALTH_SLOTS; i++)
+		if (IN6_ARE_ADDR_EQUAL(&table->slot[i].addr, &addr))
+			failures = table->slot[i].failures;
+	free(table);
+
+	if (failures != 2) {
+		fprintf(stderr, "MX health cache recorded %u failures instead of 2\n", failures);
+		err++;
+	}
+}
+
+static int
+connect_scheduler(void)
+{
+	struct sockaddr_un sa = {
+		.sun_family = AF_UNIX
+	};
+
+	strcpy(sa.sun_path, sockname);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ((fd >= 0) && (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0)) {
+		close(fd);
+		fd = -1;
+	}
+	if (fd < 0) {
+		fputs("cannot connect to scheduler\n", stderr);
+		err++;
+	}
+
+	return fd;
+}
+
+static void
+test_invalid_job(void)
+{
+	char buf[256];
+
+	int fd = connect_scheduler();
+	if (fd < 0)
+		return;
+
+	/* no message file descriptor */
+	ssize_t r = write(fd, "host\0sender\0rcpt", 17);
+
+	(void) r;
+	shutdown(fd, SHUT_WR);
+
+	const size_t len = read_all(fd, buf, sizeof(buf) - 1);
+	buf[len] = '\0';
+	if (strncmp(buf, "Z4.3.0 ", 7) != 0) {
+		fprintf(stderr, "invalid job was not rejected: %s\n", buf);
+		err++;
+	}
+}
+
+/**
+ * @brief check that a client that does not send its job does not delay others
+ * @param qremotec path to the program
+ */
+static void
+test_stalled_client(const char *qremotec)
+{
+	char buf[256];
+	pid_t pid;
+	const time_t start = time(NULL);
+
+	const int stalled = connect_scheduler();
+	if (stalled < 0)
+		return;
+
+	const int fd = start_client(qremotec, "c.example", &pid);
+	check_client(fd, pid, "c.example");
+
+	if (time(NULL) - start >= 3) {
+		fputs("delivery was delayed by a stalled client\n", stderr);
+		err++;
+	}
+
+	/* the stalled client is dropped after the timeout */
+	const size_t len = read_all(stalled, buf, sizeof(buf) - 1);
+	buf[len] = '\0';
+	if (strncmp(buf, "Z4.3.0 ", 7) != 0) {
+		fprintf(stderr, "stalled client was not rejected: %s\n", buf);
+		err++;
+	}
+}
+
+/**
+ * @brief check that a delivery that crashed is not reported as done
+ * @param qremotec path to the program
+ */
+static void
+test_crashed_job(const char *qremotec)
+{
+	char buf[256];
+	pid_t pid;
+	int wstat;
+
+	const int fd = start_client(qremotec, "crash.example", &pid);
+	const size_t len = read_all(fd, buf, sizeof(buf));
+
+	if ((len != 2) || (memcmp(buf, "r", 2) != 0)) {
+		fprintf(stderr, "unexpected status of crashed delivery: %.*s\n", (int)len, buf);
+		err++;
+	}
+
+	if ((waitpid(pid, &wstat, 0) != pid) || !WIFEXITED(wstat) || (WEXITSTATUS(wstat) != 111)) {
+		fputs("qremotec did not report the crashed delivery\n", stderr);
+		err++;
+	}
+}
+
+static void
+test_no_scheduler(const char *qremotec)
+{
+	char buf[256];
+	pid_t pid;
+
+	setenv("QREMOTE_SOCKET", "qremote_scheduler_test.nonexistent", 1);
+	const int fd = start_client(qremotec, "a.example", &pid);
+	const size_t len = read_all(fd, buf, sizeof(buf) - 1);
+
+	buf[len] = '\0';
+	waitpid(pid, NULL, 0);
+	setenv("QREMOTE_SOCKET", sockname, 1);
+
+	if (strncmp(buf, "Z4.3.0 ", 7) != 0) {
+		fprintf(stderr, "no temporary error without scheduler: %s\n", buf);
+		err++;
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc != 2) {
+		fputs("Usage: testcase_qremote_scheduler qremotec\n", stderr);
+		return 1;
+	}
+
+	test_job_args();
+
+	FILE *f = fopen(msgname, "w");
+	if (f == NULL) {
+		fprintf(stderr, "can not create %s\n", msgname);
+		return 2;
+	}
+	fputs(msgtext, f);
+	fclose(f);
+
+	unlink(sockname);
+	unlink(healthname);
+	unlink(heldname);
+	const pid_t scheduler = fork();
+	if (scheduler < 0)
+		return 2;
+
+	if (scheduler == 0) {
+		char *args[] = { "-d", "-m", "1", (char *)sockname, NULL };
+		int jobargc;
+		char **jobargv;
+
+		/* opened before the scheduler starts, like Qremote does */
+		if (mxhealth_open(healthname) != 0)
+			_exit(1);
+		if (scheduler_run(4, args, &jobargc, &jobargv) != 0)
+			_exit(1);
+		run_job(jobargc, jobargv);
+	}
+
+	const struct timespec ts = {
+		.tv_nsec = 20000000
+	};
+	struct stat st;
+
+	for (unsigned int i = 0; (i < 100) && (stat(sockname, &st) != 0); i++)
+		nanosleep(&ts, NULL);
+
+	setenv("QREMOTE_SOCKET", sockname, 1);
+
+	if ((lstat(sockname, &st) != 0) || ((st.st_mode & 0777) != 0600)) {
+		fprintf(stderr, "socket has mode %o instead of 600\n", st.st_mode & 0777);
+		err++;
+	}
+
+	/* the deliveries to a.example must not run in parallel */
+	const char *hosts[] = { "a.example", "a.example", "b.example", "a.example" };
+	int fds[4];
+	pid_t pids[4];
+
+	for (unsigned int i = 0; i < 4; i++)
+		fds[i] = start_client(argv[1], hosts[i], pids + i);
+	for (unsigned int i = 0; i < 4; i++)
+		check_client(fds[i], pids[i], hosts[i]);
+
+	test_health_lock(argv[1]);
+	test_invalid_job();
+	test_stalled_client(argv[1]);
+	test_crashed_job(argv[1]);
+	test_no_scheduler(argv[1]);
+
+	kill(scheduler, SIGTERM);
+	waitpid(scheduler, NULL, 0);
+	unlink(sockname);
+	unlink(msgname);
+	unlink(healthname);
+
+	return err;
+}
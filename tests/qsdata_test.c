@@ -5,6 +5,7 @@
 #include "../qsmtpd/data.c"
 
 #include <qsmtpd/antispam.h>
+#include <qsmtpd/rcptset.h>
 #include "test_io/testcase_io.h"
 #include <version.h>
 
@@ -98,6 +99,7 @@ fork_clean()
 void
 freedata(void)
 {
+	rcptset_clear();
 	while (!TAILQ_EMPTY(&head)) {
 		struct recip *l = TAILQ_FIRST(&head);
 
@@ -189,6 +191,7 @@ queue_envelope(const unsigned long sz, const int chunked)
 	// clean up the envelope, the real function does this, too
 	// if it would be kept here the testcase could cause strange crashes if a different
 	// code path is accidentially run which would free that data elsewhere
+	rcptset_clear();
 	while (!TAILQ_EMPTY(&head)) {
 		struct recip *l = TAILQ_FIRST(&head);
 
@@ -361,6 +364,13 @@ setup_recip(void)
 	}
 	thisrecip->to.len = strlen(thisrecip->to.s);
 
+	if (rcptset_add(thisrecip) != 0) {
+		free(thisrecip->to.s);
+		free(thisrecip);
+		thisrecip = NULL;
+		return 3;
+	}
+
 	TAILQ_INIT(&head);
 	TAILQ_INSERT_TAIL(&head, thisrecip, entries);
 
@@ -683,127 +693,6 @@ check_queueheader(void)
 	return err;
 }
 
-static int
-check_check_rfc822_headers(void)
-{
-	const char tohdr[] = "To: <foo@example.com>";
-	const char fromhdr[] = "From: <foo@example.com>";
-	const char datehdr[] = "Date: Sun, 15 Jun 2014 18:26:30 +0200";
-	const char msgidhdr[] = "message-id: <12345@example.com>"; /* intentionally lowercase */
-	struct tc {
-		const char *hdrname;		/* expected hdrname */
-		const unsigned int flagsb;	/* flags before test */
-		const unsigned int flagsa;	/* flags after test */
-		const int rc;			/* expected return code */
-		const char *pattern;		/* input line */
-	} testdata[] = {
-		{
-			.pattern = ""
-		},
-		{
-			.pattern = tohdr
-		},
-		{
-			.pattern = datehdr,
-			.flagsa = 1,
-			.rc = 1
-		},
-		{
-			.pattern = fromhdr,
-			.flagsa = 2,
-			.rc = 1
-		},
-		{
-			.pattern = msgidhdr,
-			.flagsa = 4,
-			.rc = 1
-		},
-		{
-			.pattern = datehdr,
-			.flagsb = 2,
-			.flagsa = 3,
-			.rc = 1
-		},
-		{
-			.pattern = fromhdr,
-			.flagsb = 1,
-			.flagsa = 3,
-			.rc = 1
-		},
-		{
-			.pattern = msgidhdr,
-			.flagsb = 2,
-			.flagsa = 6,
-			.rc = 1
-		},
-		{
-			.hdrname = "Date:",
-			.pattern = datehdr,
-			.flagsb = 1,
-			.flagsa = 1,
-			.rc = -2
-		},
-		{
-			.hdrname = "From:",
-			.pattern = fromhdr,
-			.flagsb = 2,
-			.flagsa = 2,
-			.rc = -2
-		},
-		{
-			.hdrname = "Message-Id:",
-			.pattern = msgidhdr,
-			.flagsb = 4,
-			.flagsa = 4,
-			.rc = -2
-		},
-		{
-			.rc = -8,
-			.pattern = "X-\222"
-		},
-		{
-			.rc = 0,
-			.pattern = "D"
-		},
-		{ }
-	};
-	int ret = 0;
-
-	for (unsigned int i = 0; testdata[i].pattern != NULL; i++) {
-		const char *hdrname = NULL;
-		unsigned int hdrflags = testdata[i].flagsb;
-
-		printf("%s: Running test: '%s'\n", __func__, testdata[i].pattern);
-		linein.len = strlen(testdata[i].pattern);
-		memcpy(linein.s, testdata[i].pattern, linein.len);
-		linein.s[linein.len] = '\0';
-
-		int r = check_rfc822_headers(&hdrflags, &hdrname);
-
-		if (r != testdata[i].rc) {
-			fprintf(stderr, "%s[%u]: return code mismatch, got %i, expected %i\n",
-					__func__, i, r, testdata[i].rc);
-			ret++;
-		} else if ((hdrname != NULL) && (testdata[i].hdrname != NULL)) {
-			if (strcmp(hdrname, testdata[i].hdrname) != 0) {
-				fprintf(stderr, "%s[%u]: header name mismatch, got '%s', expected '%s'\n",
-					__func__, i, hdrname, testdata[i].hdrname);
-				ret++;
-			}
-		} else if ((hdrname != NULL) ^ (testdata[i].hdrname != NULL)) {
-			fprintf(stderr, "%s[%u]: header name mismatch, got '%s', expected '%s'\n",
-				__func__, i, hdrname, testdata[i].hdrname);
-			ret++;
-		} else if (hdrflags != testdata[i].flagsa) {
-			fprintf(stderr, "%s[%u]: flags mismatch, got %u, expected %u\n",
-				__func__, i, hdrflags, testdata[i].flagsa);
-			ret++;
-		}
-	}
-
-	return ret;
-}
-
 static int
 check_data_no_rcpt(void)
 {
@@ -1702,6 +1591,55 @@ check_bdat_msgsize(void)
 	return ret;
 }
 
+static int
+check_bdat_loop(void)
+{
+	int ret = 0;
+	struct cstring d = {
+		.s = "Subject: loop\r\nDelivered-To: test@example.com\r\n\r\nbody\r\n",
+		.len = strlen("Subject: loop\r\nDelivered-To: test@example.com\r\n\r\nbody\r\n")
+	};
+	char logbuf[256];
+
+	printf("%s\n", __func__);
+
+	goodrcpt = 1;
+	queue_init_result = 0;
+	comstate = 0x0040;
+	xmitstat.esmtp = 1;
+	readbin_expected = 1;
+	queue_reset_expected = 1;
+	queuefd_hdr = open("/dev/null", O_WRONLY);
+	maxbytes = 16 * 1024;
+	readbin_data = &d;
+	snprintf(logbuf, sizeof(logbuf),
+			"rejected message to <test@example.com> from <foo@example.com> from IP [::ffff:192.0.2.24] (%zu bytes) {mail loop}",
+			d.len);
+	log_write_msg = logbuf;
+	log_write_priority = LOG_INFO;
+	netnwrite_msg = "554 5.4.6 message is looping, found a \"Delivered-To:\" line with one of the recipients\r\n";
+	if (queuefd_hdr < 0)
+		abort();
+
+	setup_datafd();
+
+	sprintf(linein.s, "BDAT %zu LAST", d.len);
+	linein.len = strlen(linein.s);
+
+	int r = smtp_bdat();
+
+	if (r != EDONE)
+		ret++;
+
+	if (testcase_netnwrite_check(__func__))
+		ret++;
+
+	close(queuefd_data_recv);
+	queuefd_data_recv = -1;
+
+	return ret;
+}
+
 // use the same pattern, split at every possible position, the output should be constant
 static int
 check_bdat_multiple_chunks(void)
@@ -2069,7 +2007,6 @@ main()
 	ret += check_twodigit();
 	ret += check_date822();
 	ret += check_queueheader();
-	ret += check_check_rfc822_headers();
 	ret += check_data_no_rcpt();
 	ret += check_data_qinit_fail();
 
@@ -2102,6 +2039,7 @@ main()
 	testcase_setup_net_readbin(test_net_readbin);
 
 	ret += check_bdat_msgsize();
+	ret += check_bdat_loop();
 	ret += check_bdat_single_chunk();
 	ret += check_bdat_multiple_chunks();
 	ret += check_bdat_multiple_buffers();
@@ -1,5 +1,6 @@
 #include <qsmtpd/queue.h>
 #include <qsmtpd/qsmtpd.h>
+#include <qsmtpd/timing.h>
 #include <tls.h>
 #include "test_io/testcase_io.h"
 
@@ -15,21 +16,19 @@
 #include <unistd.h>
 
 struct xmitstat xmitstat;
+struct session_timing sesstiming;
 unsigned int goodrcpt;
 string liphost;
 static struct smtpcomm command;
 struct smtpcomm *current_command = &command;
 static char logbuffer[2048];
 struct rcpt_list head;
+struct arena txarena;
 
 pid_t
-fork_clean()
-{
-	exit(EFAULT);
-}
-
-int
-pipe_move(int p[2] __attribute__((unused)), int target __attribute__((unused)))
+spawn_piped(const char *prog __attribute__((unused)), char *const argv[] __attribute__((unused)),
+		int pipes[][2] __attribute__((unused)), const int *targets __attribute__((unused)),
+		const unsigned int count __attribute__((unused)))
 {
 	exit(EFAULT);
 }
@@ -37,6 +36,7 @@ pipe_move(int p[2] __attribute__((unused)), int target __attribute__((unused)))
 void
 freedata(void)
 {
+	arena_reset(&txarena);
 }
 
 void
@@ -164,17 +164,19 @@ create_rcpt(const char *addr)
 	if (addr == NULL)
 		return;
 
-	r = malloc(sizeof(*r));
+	r = arena_alloc(&txarena, sizeof(*r));
 	if (r == NULL)
 		exit(ENOMEM);
 
 	r->ok = (addr[0] != '!');	/* user will be rejected until we change this explicitely */
-	if (r->ok) {
-		dupstr(&(r->to), addr);
+	if (r->ok)
 		goodrcpt++;
-	} else {
-		dupstr(&(r->to), addr + 1);
-	}
+	else
+		addr++;
+	r->to.len = strlen(addr);
+	r->to.s = arena_strndup(&txarena, addr, r->to.len);
+	if (r->to.s == NULL)
+		exit(ENOMEM);
 	TAILQ_INSERT_TAIL(&head, r, entries);
 }
 
@@ -218,8 +220,7 @@ test_log_messages(void)
 			.rcpt2 = "bar@example.com",
 			.msgsize = 19,
 			.from = "baz@example.org",
-			.logmsg = "received message to <foo@example.com> from <baz@example.org> from IP [::ffff:172.28.19.44] (19 bytes, 2 recipients)\n"
-				"received message to <bar@example.com> from <baz@example.org> from IP [::ffff:172.28.19.44] (19 bytes, 2 recipients)\n",
+			.logmsg = "received message to <foo@example.com>, <bar@example.com> from <baz@example.org> from IP [::ffff:172.28.19.44] (19 bytes, 2 recipients)\n",
 			.envelope = envelope2a,
 			.envsize = sizeof(envelope2a)
 		},
@@ -237,8 +238,7 @@ test_log_messages(void)
 			.rcpt2 = "bar@example.com",
 			.chunked = 1,
 			.msgsize = 29,
-			.logmsg = "received chunked message to <foo@example.com> from <> from IP [::ffff:172.28.19.44] (29 bytes, 2 recipients)\n"
-				"received chunked message to <bar@example.com> from <> from IP [::ffff:172.28.19.44] (29 bytes, 2 recipients)\n",
+			.logmsg = "received chunked message to <foo@example.com>, <bar@example.com> from <> from IP [::ffff:172.28.19.44] (29 bytes, 2 recipients)\n",
 			.envelope = envelope2,
 			.envsize = sizeof(envelope2)
 		},
@@ -270,8 +270,7 @@ test_log_messages(void)
 			.encrypted = 1,
 			.spacebug = 1,
 			.msgsize = 41,
-			.logmsg = "received (NONE) encrypted message with SMTP space bug to <foo@example.com> from <> from IP [::ffff:172.28.19.44] (41 bytes, 2 recipients)\n"
-				"received (NONE) encrypted message with SMTP space bug to <bar@example.com> from <> from IP [::ffff:172.28.19.44] (41 bytes, 2 recipients)\n",
+			.logmsg = "received (NONE) encrypted message with SMTP space bug to <foo@example.com>, <bar@example.com> from <> from IP [::ffff:172.28.19.44] (41 bytes, 2 recipients)\n",
 			.envelope = envelope2,
 			.envsize = sizeof(envelope2)
 		},
@@ -282,8 +281,7 @@ test_log_messages(void)
 			.spacebug = 1,
 			.msgsize = 43,
 			.authname = "baz",
-			.logmsg = "received (NONE) encrypted message with SMTP space bug to <foo@example.com> from <> (authenticated as baz) from IP [::ffff:172.28.19.44] (43 bytes, 2 recipients)\n"
-				"received (NONE) encrypted message with SMTP space bug to <bar@example.com> from <> (authenticated as baz) from IP [::ffff:172.28.19.44] (43 bytes, 2 recipients)\n",
+			.logmsg = "received (NONE) encrypted message with SMTP space bug to <foo@example.com>, <bar@example.com> from <> (authenticated as baz) from IP [::ffff:172.28.19.44] (43 bytes, 2 recipients)\n",
 			.envelope = envelope2,
 			.envsize = sizeof(envelope2)
 		},
@@ -381,6 +379,69 @@ test_log_messages(void)
 	return ret;
 }
 
+static int
+test_log_batches(void)
+{
+	int ret = 0;
+	char expect[sizeof(logbuffer)] = "received message to <";
+	char envelope[512] = "Fbaz@example.org";
+	size_t envsize = strlen(envelope) + 1;
+	char rpipe[sizeof(envelope)];
+	int fd[2];
+	const unsigned int count = 20;
+
+	TAILQ_INIT(&head);
+	goodrcpt = 0;
+	ssl = NULL;
+	xmitstat.spacebug = 0;
+	xmitstat.authname.len = 0;
+	xmitstat.mailfrom.s = "baz@example.org";
+	xmitstat.mailfrom.len = strlen(xmitstat.mailfrom.s);
+
+	/* 16 recipients are logged in one line, the remaining 4 in a second one */
+	for (unsigned int i = 0; i < count; i++) {
+		char addr[32];
+
+		snprintf(addr, sizeof(addr), "r%u@example.com", i);
+		create_rcpt(addr);
+		envsize += snprintf(envelope + envsize, sizeof(envelope) - envsize, "T%s", addr) + 1;
+
+		if ((i == 0) || (i == 16))
+			strcat(expect, addr);
+		else
+			strcat(strcat(expect, ">, <"), addr);
+		if ((i == 15) || (i == count - 1))
+			strcat(expect, "> from <baz@example.org> from IP [::ffff:172.28.19.44] (19 bytes, 20 recipients)\n");
+		if (i == 15)
+			strcat(expect, "received message to <");
+	}
+	envelope[envsize++] = '\0';
+
+	if (pipe(fd) != 0) {
+		fprintf(stderr, "cannot create pipe\n");
+		exit(ENOMEM);
+	}
+
+	queuefd_data = open(".", O_RDONLY | O_CLOEXEC);
+	queuefd_hdr = fd[1];
+
+	if (queue_envelope(19, 0) != 0) {
+		fprintf(stderr, "%s: queue_envelope() failed, errno %i\n", __func__, errno);
+		ret++;
+	}
+
+	ssize_t r = read(fd[0], rpipe, sizeof(rpipe));
+	if ((r != (ssize_t)envsize) || (memcmp(rpipe, envelope, envsize) != 0)) {
+		fprintf(stderr, "%s: envelope did not match expected one\n", __func__);
+		ret++;
+	}
+	close(fd[0]);
+
+	ret += check_logmsg(expect);
+
+	return ret;
+}
+
 void
 test_ssl_free(SSL *myssl)
 {
@@ -416,6 +477,9 @@ main(void)
 	ret += test_invalid_write();
 	ret += test_invalid_write2();
 	ret += test_log_messages();
+	ret += test_log_batches();
+
+	arena_free(&txarena);
 
 	return ret;
 }
@@ -0,0 +1,299 @@
+/** \file ratelimit_test.c
+ * \brief Testcases for the shared connection limits of Qsmtpd
+ */
+
+#include <qsmtpd/ratelimit.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char tablename[] = "ratelimit_test.table";
+
+static struct in6_addr
+mkaddr(const char *str)
+{
+	struct in6_addr r;
+
+	if (inet_pton(AF_INET6, str, &r) != 1) {
+		fprintf(stderr, "can not parse address %s\n", str);
+		exit(1);
+	}
+
+	return r;
+}
+
+static int
+test_config(void)
+{
+	int ret = 0;
+	const char *valid[] = { "table=/var/run/qsmtpd.rate", "sessions=10", "rate=0", NULL };
+	const char *invalid[] = { "table=relative", "table=", "sessions=", "sessions=-1", "sessions=1x",
+			"rate=a", "rate", "unknown=1", "", NULL };
+
+	for (unsigned int i = 0; valid[i] != NULL; i++) {
+		if (ratelimit_checkline(valid[i]) != 0) {
+			fprintf(stderr, "%s: valid line '%s' rejected\n", __func__, valid[i]);
+			ret++;
+		}
+	}
+
+	for (unsigned int i = 0; invalid[i] != NULL; i++) {
+		if (ratelimit_checkline(invalid[i]) == 0) {
+			fprintf(stderr, "%s: invalid line '%s' accepted\n", __func__, invalid[i]);
+			ret++;
+		}
+	}
+
+	struct ratelimit_config cfg;
+	char *lines[] = { "sessions=10", "rate=20", "table=/var/run/qsmtpd.rate", NULL };
+
+	if ((ratelimit_config(lines, &cfg) != 0) || (cfg.sessions != 10) || (cfg.rate != 20) ||
+			(cfg.table == NULL) || (strcmp(cfg.table, "/var/run/qsmtpd.rate") != 0)) {
+		fprintf(stderr, "%s: settings not parsed correctly\n", __func__);
+		ret++;
+	}
+
+	if ((ratelimit_config(NULL, &cfg) != 0) || (cfg.table != NULL)) {
+		fprintf(stderr, "%s: empty settings not handled\n", __func__);
+		ret++;
+	}
+
+	lines[2] = NULL;
+	if (ratelimit_config(lines, &cfg) != -EINVAL) {
+		fprintf(stderr, "%s: limits without table not rejected\n", __func__);
+		ret++;
+	}
+
+	return ret;
+}
+
+static int
+test_inactive(void)
+{
+	struct in6_addr a = mkaddr("::ffff:192.0.2.1");
+	const int64_t now = time(NULL);
+
+	for (unsigned int i = 0; i < 100; i++) {
+		if (ratelimit_enter(&a, now) != RATELIMIT_OK) {
+			fprintf(stderr, "%s: inactive table refused connection\n", __func__);
+			return 1;
+		}
+		ratelimit_leave();
+	}
+
+	return 0;
+}
+
+/**
+ * @brief start a session in a child process
+ * @param addr the address of the client
+ * @param now the current time
+ * @param release the child exits when the write end of this pipe is closed
+ * @param pid the process id of the child is stored here
+ * @return the result of ratelimit_enter() in the child
+ */
+static int
+start_session(const struct in6_addr *addr, const int64_t now, const int release[2], pid_t *pid)
+{
+	int res[2];
+	char r = -1;
+
+	if (pipe(res) != 0)
+		exit(2);
+
+	*pid = fork();
+	if (*pid < 0)
+		exit(2);
+
+	if (*pid == 0) {
+		close(release[1]);
+		close(res[0]);
+		r = ratelimit_enter(addr, now);
+		ssize_t w = write(res[1], &r, 1);
+		(void) w;
+
+		/* wait until the parent closes the pipe, then exit normally */
+		w = read(release[0], &r, 1);
+		exit(0);
+	}
+
+	close(res[1]);
+	if (read(res[0], &r, 1) != 1)
+		r = -1;
+	close(res[0]);
+
+	return r;
+}
+
+static int
+test_sessions(void)
+{
+	int ret = 0;
+	struct in6_addr a = mkaddr("2001:db8:1:2::1");
+	struct in6_addr b = mkaddr("2001:db8:1:2::2");
+	struct in6_addr c = mkaddr("2001:db8:1:3::1");
+	const int64_t now = time(NULL);
+	const struct ratelimit_config cfg = {
+		.table = tablename,
+		.sessions = 2
+	};
+	int release[2];
+	pid_t pids[2];
+
+	if (ratelimit_open(&cfg) != 0) {
+		fprintf(stderr, "%s: can not open table\n", __func__);
+		return 1;
+	}
+
+	if (pipe(release) != 0)
+		exit(2);
+
+	for (unsigned int i = 0; i < 2; i++) {
+		if (start_session(&a, now, release, pids + i) != RATELIMIT_OK) {
+			fprintf(stderr, "%s: session %u refused\n", __func__, i);
+			ret++;
+		}
+	}
+
+	/* same /64 network */
+	if (ratelimit_enter(&b, now) != RATELIMIT_SESSIONS) {
+		fprintf(stderr, "%s: session above limit not refused\n", __func__);
+		ret++;
+	}
+
+	if (ratelimit_enter(&c, now) != RATELIMIT_OK) {
+		fprintf(stderr, "%s: session from other network refused\n", __func__);
+		ret++;
+	}
+	ratelimit_leave();
+
+	/* the sessions are removed when the processes exit */
+	close(release[1]);
+	close(release[0]);
+	for (unsigned int i = 0; i < 2; i++)
+		waitpid(pids[i], NULL, 0);
+
+	if (ratelimit_enter(&a, now) != RATELIMIT_OK) {
+		fprintf(stderr, "%s: session refused after others ended\n", __func__);
+		ret++;
+	}
+	ratelimit_leave();
+
+	/* a killed process never removes its session itself, it is found
+	 * once the limit is reached */
+	if (pipe(release) != 0)
+		exit(2);
+	for (unsigned int i = 0; i < 2; i++)
+		start_session(&a, now, release, pids + i);
+	kill(pids[0], SIGKILL);
+	waitpid(pids[0], NULL, 0);
+
+	if (ratelimit_enter(&a, now + 1) != RATELIMIT_OK) {
+		fprintf(stderr, "%s: session of killed process not removed\n", __func__);
+		ret++;
+	}
+	ratelimit_leave();
+
+	/* the remaining session still counts: one more is fine, but not two */
+	if (start_session(&b, now + 1, release, pids) != RATELIMIT_OK) {
+		fprintf(stderr, "%s: session refused after killed session was removed\n", __func__);
+		ret++;
+	}
+	if (ratelimit_enter(&a, now + 1) != RATELIMIT_SESSIONS) {
+		fprintf(stderr, "%s: session of running process removed\n", __func__);
+		ret++;
+	}
+
+	close(release[1]);
+	close(release[0]);
+	for (unsigned int i = 0; i < 2; i++)
+		waitpid(pids[i], NULL, 0);
+
+	ratelimit_close();
+
+	return ret;
+}
+
+static int
+test_rate(void)
+{
+	int ret = 0;
+	struct in6_addr a = mkaddr("::ffff:192.0.2.2");
+	struct in6_addr b = mkaddr("::ffff:192.0.2.3");
+	/* start of a window */
+	const int64_t now = (time(NULL) / RATELIMIT_WINDOW + 1) * RATELIMIT_WINDOW;
+	const struct ratelimit_config cfg = {
+		.table = tablename,
+		.rate = 5
+	};
+
+	if (ratelimit_open(&cfg) != 0) {
+		fprintf(stderr, "%s: can not open table\n", __func__);
+		return 1;
+	}
+
+	for (unsigned int i = 0; i < cfg.rate; i++) {
+		if (ratelimit_enter(&a, now) != RATELIMIT_OK) {
+			fprintf(stderr, "%s: connection %u refused\n", __func__, i);
+			ret++;
+		}
+		ratelimit_leave();
+	}
+
+	if (ratelimit_enter(&a, now) != RATELIMIT_RATE) {
+		fprintf(stderr, "%s: connection above rate not refused\n", __func__);
+		ret++;
+	}
+
+	if (ratelimit_enter(&b, now) != RATELIMIT_OK) {
+		fprintf(stderr, "%s: connection from neighbor address refused\n", __func__);
+		ret++;
+	}
+	ratelimit_leave();
+
+	/* the information is shared: reopening must keep it */
+	if (ratelimit_open(&cfg) != 0) {
+		fprintf(stderr, "%s: can not reopen table\n", __func__);
+		return ++ret;
+	}
+
+	/* 6 connections in the previous window, 5 of them still count */
+	if (ratelimit_enter(&a, now + RATELIMIT_WINDOW + RATELIMIT_WINDOW / 10) != RATELIMIT_RATE) {
+		fprintf(stderr, "%s: connections in previous window not counted\n", __func__);
+		ret++;
+	}
+
+	if (ratelimit_enter(&a, now + 3 * RATELIMIT_WINDOW) != RATELIMIT_OK) {
+		fprintf(stderr, "%s: connection refused after the window\n", __func__);
+		ret++;
+	}
+	ratelimit_leave();
+
+	ratelimit_close();
+
+	return ret;
+}
+
+int
+main(void)
+{
+	int ret = 0;
+
+	unlink(tablename);
+
+	ret += test_config();
+	ret += test_inactive();
+	ret += test_sessions();
+	ret += test_rate();
+
+	unlink(tablename);
+
+	return ret;
+}
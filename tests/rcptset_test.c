@@ -0,0 +1,94 @@
+#include <qsmtpd/rcptset.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RCPTS 100
+
+static struct recip recips[RCPTS];
+static char addrs[RCPTS][32];
+
+static struct recip *
+find(const char *addr)
+{
+	return rcptset_find(addr, strlen(addr));
+}
+
+int
+main(void)
+{
+	int err = 0;
+
+	if (find("foo@example.com") != NULL) {
+		fputs("empty set returned an entry\n", stderr);
+		err++;
+	}
+
+	/* more entries than fit into the initial table */
+	for (unsigned int i = 0; i < RCPTS; i++) {
+		snprintf(addrs[i], sizeof(addrs[i]), "user%u@Example%u.com", i, i % 7);
+		recips[i].to.s = addrs[i];
+		recips[i].to.len = strlen(addrs[i]);
+		if (rcptset_add(recips + i) != 0) {
+			fprintf(stderr, "rcptset_add() failed for entry %u\n", i);
+			return 1;
+		}
+	}
+
+	for (unsigned int i = 0; i < RCPTS; i++) {
+		char buf[32];
+
+		if (find(addrs[i]) != recips + i) {
+			fprintf(stderr, "%s was not found\n", addrs[i]);
+			err++;
+		}
+
+		/* the domain is not case sensitive */
+		snprintf(buf, sizeof(buf), "user%u@EXAMPLE%u.COM", i, i % 7);
+		if (find(buf) != recips + i) {
+			fprintf(stderr, "%s was not found\n", buf);
+			err++;
+		}
+
+		/* the local part is */
+		snprintf(buf, sizeof(buf), "User%u@example%u.com", i, i % 7);
+		if (find(buf) != NULL) {
+			fprintf(stderr, "%s was found\n", buf);
+			err++;
+		}
+	}
+
+	if (find("user1@example1.co") != NULL) {
+		fputs("prefix of an address was found\n", stderr);
+		err++;
+	}
+
+	/* adding the same address again replaces the entry */
+	struct recip again = {
+		.to = {
+			.s = "user3@example3.com",
+			.len = strlen("user3@example3.com")
+		}
+	};
+	if (rcptset_add(&again) != 0) {
+		fputs("rcptset_add() failed for duplicate\n", stderr);
+		return 1;
+	}
+	if (find(addrs[3]) != &again) {
+		fputs("duplicate did not replace the old entry\n", stderr);
+		err++;
+	}
+	if (rcptset.count != RCPTS) {
+		fprintf(stderr, "set has %u entries instead of %u\n", rcptset.count, RCPTS);
+		err++;
+	}
+
+	rcptset_clear();
+	if (find(addrs[0]) != NULL) {
+		fputs("cleared set returned an entry\n", stderr);
+		err++;
+	}
+
+	return err;
+}
@@ -0,0 +1,41 @@
+# Run a smtproutes.d test case with the directory compiled by qsroutes.
+#
+# Variables:
+#  SOURCE_DIR   the test case directory
+#  WORK_DIR     where the test case is copied to
+#  QSROUTES     path to qsroutes
+#  TESTCASE     path to testcase_smtproutes
+#  EXPECT_FAIL  qsroutes has to reject the directory, the test case is not run
+
+cmake_minimum_required(VERSION 3.0)
+
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(COPY "${SOURCE_DIR}/" DESTINATION "${WORK_DIR}")
+
+execute_process(COMMAND "${QSROUTES}" "${WORK_DIR}/control"
+		RESULT_VARIABLE QSROUTES_RESULT)
+
+if (EXPECT_FAIL)
+	if (QSROUTES_RESULT EQUAL 0)
+		message(FATAL_ERROR "qsroutes accepted invalid entries")
+	endif ()
+	if (EXISTS "${WORK_DIR}/control/smtproutes.cdb")
+		message(FATAL_ERROR "qsroutes wrote smtproutes.cdb from invalid entries")
+	endif ()
+	return()
+endif ()
+
+if (NOT QSROUTES_RESULT EQUAL 0)
+	message(FATAL_ERROR "qsroutes failed with ${QSROUTES_RESULT}")
+endif ()
+
+# the directory must not be needed anymore
+file(REMOVE_RECURSE "${WORK_DIR}/control/smtproutes.d")
+
+execute_process(COMMAND "${TESTCASE}"
+		WORKING_DIRECTORY "${WORK_DIR}"
+		RESULT_VARIABLE TESTCASE_RESULT)
+
+if (NOT TESTCASE_RESULT EQUAL 0)
+	message(FATAL_ERROR "testcase_smtproutes failed with ${TESTCASE_RESULT}")
+endif ()
@@ -2,6 +2,7 @@
  \brief SPF testcases
  */
 
+#include <libowfatconn.h>
 #include <mime_chars.h>
 #include <qremote/mime.h> /* for skipwhitespace() */
 #include <qremote/qremote.h> /* for write_status(), required by mime */
@@ -327,6 +328,17 @@ dnstxt(char **out __attribute__ ((unused)), const char *host __attribute__ ((unu
 	abort();
 }
 
+static char prefetched[1024];	/**< the queries passed to dnsprefetch() */
+
+void
+dnsprefetch(const char *host, const enum dns_prefetch_type type)
+{
+	static const char *typenames[] = { "A", "IP6", "MX", "TXT" };
+	const size_t len = strlen(prefetched);
+
+	snprintf(prefetched + len, sizeof(prefetched) - len, "%s %s;", typenames[type], host);
+}
+
 struct spftestcase {
 	const char *helo;
 	const char *from;
@@ -3860,6 +3872,120 @@ test_behavior()
 	return run_suite_test(ptrtestcases);
 }
 
+static int
+test_prefetch()
+{
+	const struct dnsentry prefetchentries[] = {
+		{
+			.type = DNSTYPE_TXT,
+			.key = "pf.example.com",
+			.value = "v=spf1 ip4:10.0.0.1 a mx:mx.example.com include:inc.example.com "
+					"exists:%{i}.ex.example.com ptr a:b.example.com/24 -all a:never.example.com"
+		},
+		{
+			.type = DNSTYPE_TXT,
+			.key = "inc.example.com",
+			.value = "v=spf1 a:x.example.com a:y.example.com -all"
+		},
+		{
+			.type = DNSTYPE_A,
+			.key = "x.example.com",
+			.value = "::ffff:1.2.3.4"
+		},
+		{
+			.type = DNSTYPE_TXT,
+			.key = "limit.example.com",
+			.value = "v=spf1 a:n1.example.com a:n2.example.com a:n3.example.com a:n4.example.com "
+					"a:n5.example.com a:n6.example.com a:n7.example.com a:n8.example.com "
+					"a:n9.example.com a:n10.example.com a:n11.example.com a:n12.example.com -all"
+		},
+		{
+			.type = DNSTYPE_TXT,
+			.key = "redir.example.com",
+			.value = "v=spf1 a:r1.example.com a:r2.example.com redirect=target.example.com"
+		},
+		{
+			.type = DNSTYPE_TXT,
+			.key = "target.example.com",
+			.value = "v=spf1 -all"
+		},
+		{
+			.type = DNSTYPE_NONE
+		},
+	};
+	const struct {
+		struct suite_testcase tc[2];
+		const char *prefetched;
+	} prefetchtestcases[] = {
+		{
+			.tc = {
+				{
+					.name = "prefetch-include",
+					.helo = "mail.example.com",
+					.remoteip = "::ffff:1.2.3.4",
+					.mailfrom = "foo@pf.example.com",
+					.result = SPF_PASS
+				}
+			},
+			.prefetched = "MX mx.example.com;TXT inc.example.com;A b.example.com;A y.example.com;"
+		},
+		{
+			.tc = {
+				{
+					.name = "prefetch-limit",
+					.helo = "mail.example.com",
+					.remoteip = "::ffff:1.2.3.4",
+					.mailfrom = "foo@limit.example.com",
+					.result = SPF_FAIL
+				}
+			},
+			.prefetched = "A n2.example.com;A n3.example.com;A n4.example.com;A n5.example.com;"
+					"A n6.example.com;A n7.example.com;A n8.example.com;A n9.example.com;"
+					"A n10.example.com;A n11.example.com;"
+		},
+		{
+			.tc = {
+				{
+					.name = "prefetch-redirect",
+					.helo = "mail.example.com",
+					.remoteip = "::ffff:1.2.3.4",
+					.mailfrom = "foo@redir.example.com",
+					.result = SPF_FAIL
+				}
+			},
+			.prefetched = "A r2.example.com;TXT target.example.com;"
+		},
+		{
+			.tc = {
+				{
+					.name = "prefetch-ip6",
+					.helo = "mail.example.com",
+					.remoteip = "::1",
+					.mailfrom = "foo@redir.example.com",
+					.result = SPF_FAIL
+				}
+			},
+			.prefetched = "IP6 r2.example.com;TXT target.example.com;"
+		}
+	};
+	int err = 0;
+
+	dnsdata = prefetchentries;
+
+	for (unsigned int i = 0; i < sizeof(prefetchtestcases) / sizeof(prefetchtestcases[0]); i++) {
+		prefetched[0] = '\0';
+		err += run_suite_test(prefetchtestcases[i].tc);
+
+		if (strcmp(prefetched, prefetchtestcases[i].prefetched) != 0) {
+			fprintf(stderr, "Test %s prefetched '%s', but '%s' was expected\n",
+					prefetchtestcases[i].tc[0].name, prefetched, prefetchtestcases[i].prefetched);
+			err++;
+		}
+	}
+
+	return err;
+}
+
 static int
 test_received()
 {
@@ -3952,6 +4078,8 @@ int main(int argc, char **argv)
 		return test_parse();
 	else if (strcmp(argv[1], "_behavior_") == 0)
 		return test_behavior();
+	else if (strcmp(argv[1], "_prefetch_") == 0)
+		return test_prefetch();
 	else if (strcmp(argv[1], "_received_") == 0)
 		return test_received();
 	else if (strcmp(argv[1], "_suite_") == 0)
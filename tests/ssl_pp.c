@@ -23,6 +23,7 @@ struct xmitstat xmitstat;
 char *partner_fqdn = "testcert.example.org";
 char certfilename[] = "control/servercert.pem";
 char *rhost;
+unsigned int targetport = 25;
 int socketd;
 static const char *logmsg;
 static const char *client_log;
@@ -88,6 +89,11 @@ log_write(int priority, const char *s)
 	log_writen(priority, msg);
 }
 
+void
+log_flush(void)
+{
+}
+
 void
 net_conn_shutdown(const enum conn_shutdown_type sd_type __attribute__ ((unused)))
 {
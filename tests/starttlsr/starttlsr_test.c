@@ -20,6 +20,7 @@
 #include <unistd.h>
 
 char *rhost;
+unsigned int targetport = 25;
 size_t rhostlen;
 char *partner_fqdn;
 unsigned int smtpext;
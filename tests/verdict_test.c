@@ -0,0 +1,161 @@
+/** \file verdict_test.c
+ * \brief Testcases for the shared rejection cache of Qsmtpd
+ */
+
+#include <qsmtpd/verdict.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char cachename[] = "verdict_test.cache";
+
+static struct in6_addr
+mkaddr(const char *str)
+{
+	struct in6_addr r;
+
+	if (inet_pton(AF_INET6, str, &r) != 1) {
+		fprintf(stderr, "can not parse address %s\n", str);
+		exit(1);
+	}
+
+	return r;
+}
+
+static int
+test_inactive(void)
+{
+	struct in6_addr a = mkaddr("::ffff:192.0.2.1");
+	const int64_t now = time(NULL);
+	unsigned int filter = 42;
+
+	/* all of these must be no-ops if the cache is not open */
+	for (unsigned int i = 0; i < VERDICT_THRESHOLD; i++)
+		verdict_reject(&a, 1, now);
+	verdict_accept(&a);
+
+	if ((verdict_check(&a, now, &filter) != 0) || (filter != 42)) {
+		fprintf(stderr, "%s: inactive cache changed state\n", __func__);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int
+test_threshold(void)
+{
+	int ret = 0;
+	struct in6_addr a = mkaddr("::ffff:192.0.2.2");
+	struct in6_addr b = mkaddr("::ffff:192.0.2.3");
+	const int64_t now = time(NULL);
+	unsigned int filter = 0;
+
+	for (unsigned int i = 1; i < VERDICT_THRESHOLD; i++)
+		verdict_reject(&a, 5, now);
+
+	if (verdict_check(&a, now, &filter) != 0) {
+		fprintf(stderr, "%s: client refused before reaching the threshold\n", __func__);
+		ret++;
+	}
+
+	verdict_reject(&a, 7, now);
+	if ((verdict_check(&a, now, &filter) != VERDICT_THRESHOLD) || (filter != 7)) {
+		fprintf(stderr, "%s: client not refused after reaching the threshold\n", __func__);
+		ret++;
+	}
+
+	if (verdict_check(&b, now, &filter) != 0) {
+		fprintf(stderr, "%s: neighbor IPv4 address refused\n", __func__);
+		ret++;
+	}
+
+	if (verdict_check(&a, now + VERDICT_TTL, &filter) != 0) {
+		fprintf(stderr, "%s: entry did not expire\n", __func__);
+		ret++;
+	}
+
+	/* the cache is shared: reopening must keep the information */
+	verdict_close();
+	if (verdict_open(cachename) != 0) {
+		fprintf(stderr, "%s: can not reopen cache\n", __func__);
+		return ++ret;
+	}
+	if (verdict_check(&a, now, &filter) == 0) {
+		fprintf(stderr, "%s: information lost on reopen\n", __func__);
+		ret++;
+	}
+
+	verdict_accept(&a);
+	if (verdict_check(&a, now, &filter) != 0) {
+		fprintf(stderr, "%s: client still refused after accepted recipient\n", __func__);
+		ret++;
+	}
+
+	/* an expired entry starts counting again */
+	for (unsigned int i = 1; i < VERDICT_THRESHOLD; i++)
+		verdict_reject(&a, 5, now);
+	for (unsigned int i = 1; i < VERDICT_THRESHOLD; i++)
+		verdict_reject(&a, 5, now + VERDICT_TTL);
+	if (verdict_check(&a, now + VERDICT_TTL, &filter) != 0) {
+		fprintf(stderr, "%s: expired rejections were counted\n", __func__);
+		ret++;
+	}
+
+	return ret;
+}
+
+static int
+test_ipv6(void)
+{
+	int ret = 0;
+	struct in6_addr a = mkaddr("2001:db8:1:2::1");
+	struct in6_addr b = mkaddr("2001:db8:1:2:dead:beef:0:1");
+	struct in6_addr c = mkaddr("2001:db8:1:3::1");
+	const int64_t now = time(NULL);
+	unsigned int filter;
+
+	for (unsigned int i = 0; i < VERDICT_THRESHOLD; i++)
+		verdict_reject((i & 1) ? &a : &b, 3, now);
+
+	if ((verdict_check(&a, now, &filter) == 0) || (verdict_check(&b, now, &filter) == 0)) {
+		fprintf(stderr, "%s: rejections in the same /64 not combined\n", __func__);
+		ret++;
+	}
+
+	if (verdict_check(&c, now, &filter) != 0) {
+		fprintf(stderr, "%s: other /64 refused\n", __func__);
+		ret++;
+	}
+
+	return ret;
+}
+
+int
+main(void)
+{
+	int ret = 0;
+
+	unlink(cachename);
+
+	ret += test_inactive();
+
+	int r = verdict_open(cachename);
+	if (r != 0) {
+		fprintf(stderr, "can not open cache: %i\n", r);
+		return 1;
+	}
+
+	ret += test_threshold();
+	ret += test_ipv6();
+
+	verdict_close();
+	unlink(cachename);
+
+	return ret;
+}
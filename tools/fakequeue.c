@@ -0,0 +1,37 @@
+/** \file fakequeue.c
+ \brief qmail-queue replacement for load tests
+
+ This reads the message from descriptor 0 and the envelope from descriptor 1
+ like qmail-queue does, but throws everything away. Use it by pointing
+ QMAILQUEUE to it, qsload does this automatically.
+ */
+
+#include <errno.h>
+#include <unistd.h>
+
+static int
+drain(const int fd)
+{
+	char buf[65536];
+
+	for (;;) {
+		ssize_t r = read(fd, buf, sizeof(buf));
+
+		if (r == 0)
+			return 0;
+		if ((r < 0) && (errno != EINTR))
+			return -1;
+	}
+}
+
+int
+main(void)
+{
+	/* exit codes as documented in qmail-queue(8) */
+	if (drain(0) != 0)
+		return 54;
+	if (drain(1) != 0)
+		return 54;
+
+	return 0;
+}
@@ -3,6 +3,9 @@
 
  qp converts the contents of the given filename to quoted-printable,
  using Qremotes recoding engine. The result will be written to stdout.
+
+ With -b the file is recoded the given number of times without writing
+ the result, and the throughput of the recoding engine is printed.
  */
 
 #include <fmt.h>
@@ -13,16 +16,20 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 extern void send_qp(const char *, const off_t);
 unsigned int smtpext;
 struct string heloname;
 int in_data;
+static unsigned long long outbytes;	/* bytes generated in benchmark mode */
+static int benchmark;
 
 void quit(void)
 {
@@ -30,11 +37,14 @@ void quit(void)
 
 void write_status(const char *str)
 {
-	puts(str);
+	if (!benchmark)
+		puts(str);
 }
 
 void write_status_m(const char **strs, const unsigned int count)
 {
+	if (benchmark)
+		return;
 	for (unsigned int i = 0; i < count - 1; i++)
 		fputs(strs[i], stdout);
 	puts(strs[count - 1]);
@@ -49,6 +59,9 @@ int net_writen(const char *const *s)
 {
 	int i = 0, rc = 0;
 
+	if (benchmark)
+		return 0;
+
 	while (s[i] && (rc >= 0)) {
 		rc = write(1, s[i], strlen(s[i]));
 		i++;
@@ -85,20 +98,62 @@ struct string linein = {
 
 int netnwrite(const char *s, size_t l)
 {
+	if (benchmark) {
+		outbytes += l;
+		return 0;
+	}
 	return write(1, s, l);
 }
 
+int envelope_flush(const char *tail, const size_t taillen)
+{
+	return (tail != NULL) ? netnwrite(tail, taillen) : 0;
+}
+
+int envelope_replies(void)
+{
+	return 0;
+}
+
+static void
+usage(void)
+{
+	fputs("Usage: qp [-b runs] filename\n", stderr);
+}
+
 int main(int argc, char *argv[])
 {
-	if (argc != 2) {
-		fputs("Usage: qp filename\n", stderr);
+	unsigned long runs = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:")) != -1) {
+		switch (opt) {
+		case 'b': {
+			char *end;
+
+			runs = strtoul(optarg, &end, 10);
+			if ((*end != '\0') || (runs == 0)) {
+				usage();
+				return 1;
+			}
+			benchmark = 1;
+			break;
+		}
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (argc != optind + 1) {
+		usage();
 		return 1;
 	}
 
 	heloname.s = "caliban.sf-tec.de";
 	heloname.len = strlen(heloname.s);
 
-	int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+	int fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
 
 	if (fd < 0)
 		return errno;
@@ -116,7 +171,20 @@ int main(int argc, char *argv[])
 	if (msgdata == MAP_FAILED)
 		return errno;
 
-	send_data(need_recode(msgdata, msgsize));
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned long r = 0; r < runs; r++)
+		send_data(need_recode(msgdata, msgsize));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (benchmark) {
+		const double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		const double inbytes = (double)msgsize * runs;
+
+		printf("%lu runs, %.0f bytes in, %llu bytes out, %.3f s, %.1f MiB/s\n",
+				runs, inbytes, outbytes, secs, (secs > 0) ? inbytes / secs / (1024 * 1024) : 0);
+	}
 
 	munmap((void *)msgdata, msgsize);
 
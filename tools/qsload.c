@@ -0,0 +1,1294 @@
+/** \file qsload.c
+ \brief load generator for Qsmtpd and Qremote
+
+ In "smtpd" mode every session starts a new Qsmtpd connected to a socketpair,
+ just like tcpserver would do, and delivers the messages to it. The messages
+ are passed to fakequeue instead of qmail-queue.
+
+ In "remote" mode Qremote is started once per message and delivers to a
+ simple SMTP sink listening on the loopback interface. The sink accepts
+ everything and throws it away.
+
+ Timing samples from all sessions are collected by the main process, which
+ prints the throughput and the latency percentiles for every protocol phase.
+ */
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/** @enum phase
+ @brief the measured parts of an SMTP session
+ */
+enum phase {
+	PHASE_BANNER,		/**< connect until the greeting is received (sink: until EHLO is received) */
+	PHASE_EHLO,		/**< EHLO command */
+	PHASE_STARTTLS,		/**< STARTTLS, the TLS handshake, and the second EHLO */
+	PHASE_ENVELOPE,		/**< MAIL FROM until all RCPT replies (and the DATA reply) are received */
+	PHASE_BODY,		/**< sending the message data until the final reply */
+	PHASE_QUIT,		/**< QUIT command */
+	PHASE_DELIVERY,		/**< start of Qremote until it exits */
+	PHASE_SESSION,		/**< the whole session */
+	PHASE_COUNT		/**< number of phases */
+};
+
+static const char *phase_names[PHASE_COUNT] = {
+	"banner",
+	"ehlo",
+	"starttls",
+	"envelope",
+	"body",
+	"quit",
+	"delivery",
+	"session"
+};
+
+#define SAMPLE_OK	0x1	/**< the message was accepted */
+#define SAMPLE_MSG	0x2	/**< the sample describes one message */
+#define SAMPLE_SINK	0x4	/**< the sample was recorded by the sink */
+
+/** @struct sample
+ @brief timing information of one message or one session
+
+ The samples are written to a pipe shared by all processes. They are smaller
+ than PIPE_BUF so every write is atomic.
+ */
+struct sample {
+	uint32_t flags;			/**< SAMPLE_* flags */
+	uint32_t pad;			/**< unused */
+	uint64_t bytes;			/**< message size */
+	uint64_t ns[PHASE_COUNT];	/**< duration of the phases, 0 if the phase was not run */
+};
+
+/** @struct dist
+ @brief distribution of random values given on the command line
+ */
+struct dist {
+	unsigned long min;		/**< minimum value for ranges */
+	unsigned long max;		/**< maximum value for ranges */
+	unsigned long values[16];	/**< possible values for lists */
+	unsigned int count;		/**< number of entries in values, 0 for ranges */
+};
+
+static unsigned int concurrency = 4;
+static unsigned long messages = 100;
+static unsigned int per_session = 1;
+static struct dist sizes = { .min = 4096, .max = 4096 };
+static struct dist rcpts = { .min = 1, .max = 1 };
+static uint64_t seed = 0x716c6f6164ULL;
+static int use_pipelining = 1;
+static int use_tls;
+static int use_chunking;
+static size_t chunk;
+static int eightbit;
+static const char *sender = "loadtest@example.net";
+static const char *domain;
+static unsigned int port = 2525;
+static const char *sinkaddr = "127.0.0.1";
+static const char *certfile;
+
+static int resultfd = -1;		/**< write end of the sample pipe */
+static SSL_CTX *ctx;
+static volatile sig_atomic_t stop_sink;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief duration since a given start time
+ *
+ * This never returns 0 as that is used to mark phases that were not run.
+ */
+static uint64_t
+since(const uint64_t start)
+{
+	const uint64_t d = now_ns() - start;
+
+	return d ? d : 1;
+}
+
+static uint64_t
+rnd(uint64_t *state)
+{
+	/* xorshift64* */
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static unsigned long
+dist_pick(const struct dist *d, uint64_t *state)
+{
+	if (d->count > 0)
+		return d->values[rnd(state) % d->count];
+	if (d->min == d->max)
+		return d->min;
+	return d->min + rnd(state) % (d->max - d->min + 1);
+}
+
+static void
+submit(const struct sample *s)
+{
+	if (write(resultfd, s, sizeof(*s)) != sizeof(*s))
+		_exit(1);
+}
+
+static int
+parse_number(const char *s, char **end, unsigned long *value)
+{
+	errno = 0;
+	*value = strtoul(s, end, 10);
+	if ((errno != 0) || (*end == s))
+		return -1;
+
+	switch (**end) {
+	case 'k':
+	case 'K':
+		*value *= 1024;
+		(*end)++;
+		break;
+	case 'm':
+	case 'M':
+		*value *= 1024 * 1024;
+		(*end)++;
+		break;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief parse a distribution
+ * @param s the argument, either "n", "n-m", or "n,m,..."
+ * @param d the result
+ * @return if the argument is valid
+ * @retval 0 the argument was parsed
+ * @retval -1 syntax error
+ */
+static int
+parse_dist(const char *s, struct dist *d)
+{
+	char *end;
+	unsigned long v;
+
+	memset(d, 0, sizeof(*d));
+	if (parse_number(s, &end, &v) != 0)
+		return -1;
+
+	if (*end == '\0') {
+		d->min = d->max = v;
+	} else if (*end == '-') {
+		d->min = v;
+		if ((parse_number(end + 1, &end, &d->max) != 0) || (*end != '\0') || (d->max < d->min))
+			return -1;
+	} else if (*end == ',') {
+		d->values[d->count++] = v;
+		while (*end == ',') {
+			if (d->count == sizeof(d->values) / sizeof(d->values[0]))
+				return -1;
+			if (parse_number(end + 1, &end, &d->values[d->count++]) != 0)
+				return -1;
+		}
+		if (*end != '\0')
+			return -1;
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief create a message
+ * @param buf the buffer to use, will be reallocated as needed
+ * @param size requested size of the message
+ * @param id number of the message
+ * @param state random state
+ * @return length of the message
+ *
+ * The message ends in CRLF and no line begins with a dot, so it can be sent
+ * unmodified in DATA and BDAT.
+ */
+static size_t
+make_message(char **buf, const size_t size, const unsigned long id, uint64_t *state)
+{
+	static const char *words[] = { "lorem", "ipsum", "dolor", "sit", "amet", "consectetur",
+			"adipiscing", "elit", "sed", "do", "eiusmod", "tempor", "incididunt", "ut",
+			"labore", "et", "dolore", "magna", "aliqua", "\xc3\xa4rger", "gr\xc3\xbc\xc3\x9f" };
+	const unsigned int wordcount = sizeof(words) / sizeof(words[0]) - (eightbit ? 0 : 2);
+	char *m = realloc(*buf, size + 1024);
+	size_t len;
+
+	if (m == NULL) {
+		fputs("out of memory\n", stderr);
+		_exit(1);
+	}
+	*buf = m;
+
+	len = snprintf(m, 1024, "From: <%s>\r\n"
+			"To: <load@%s>\r\n"
+			"Subject: load test message %lu\r\n"
+			"Message-Id: <%lu.%lu@qsload.invalid>\r\n"
+			"Date: Thu, 1 Jan 2015 00:00:00 +0000\r\n"
+			"MIME-Version: 1.0\r\n"
+			"Content-Type: text/plain; charset=%s\r\n"
+			"Content-Transfer-Encoding: %s\r\n"
+			"\r\n",
+			sender, domain, id, id, (unsigned long)getpid(),
+			eightbit ? "utf-8" : "us-ascii", eightbit ? "8bit" : "7bit");
+
+	while (len < size) {
+		size_t linelen = 0;
+
+		while (linelen < 60) {
+			const char *w = words[rnd(state) % wordcount];
+			const size_t wl = strlen(w);
+
+			if (linelen > 0)
+				m[len + linelen++] = ' ';
+			memcpy(m + len + linelen, w, wl);
+			linelen += wl;
+		}
+		len += linelen;
+		m[len++] = '\r';
+		m[len++] = '\n';
+	}
+
+	return len;
+}
+
+/** @struct conn
+ @brief a buffered connection, optionally using TLS
+ */
+struct conn {
+	int fd;			/**< the socket */
+	SSL *ssl;		/**< the TLS state once STARTTLS was done */
+	char buf[8192];		/**< read buffer */
+	size_t pos;		/**< first unused byte in buf */
+	size_t len;		/**< number of valid bytes in buf */
+};
+
+static ssize_t
+conn_recv(struct conn *c, void *buf, const size_t len)
+{
+	if (c->ssl != NULL) {
+		int r = SSL_read(c->ssl, buf, len);
+
+		return (r > 0) ? r : -1;
+	}
+
+	for (;;) {
+		ssize_t r = read(c->fd, buf, len);
+
+		if ((r >= 0) || (errno != EINTR))
+			return r;
+	}
+}
+
+static int
+conn_write(struct conn *c, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t w;
+
+		if (c->ssl != NULL) {
+			int r = SSL_write(c->ssl, buf, len);
+
+			w = (r > 0) ? r : -1;
+		} else {
+			w = write(c->fd, buf, len);
+			if ((w < 0) && (errno == EINTR))
+				continue;
+		}
+
+		if (w <= 0)
+			return -1;
+		buf += w;
+		len -= w;
+	}
+
+	return 0;
+}
+
+static int
+conn_fill(struct conn *c)
+{
+	if (c->pos > 0) {
+		memmove(c->buf, c->buf + c->pos, c->len - c->pos);
+		c->len -= c->pos;
+		c->pos = 0;
+	}
+
+	ssize_t r = conn_recv(c, c->buf + c->len, sizeof(c->buf) - c->len);
+	if (r <= 0)
+		return -1;
+	c->len += r;
+
+	return 0;
+}
+
+/**
+ * @brief read one line
+ * @param c the connection
+ * @param line buffer for the line, will be 0-terminated
+ * @param max size of line
+ * @return length of the line without the line end
+ * @retval -1 connection closed or error
+ */
+static ssize_t
+conn_getline(struct conn *c, char *line, const size_t max)
+{
+	for (;;) {
+		char *lf = memchr(c->buf + c->pos, '\n', c->len - c->pos);
+
+		if (lf != NULL) {
+			size_t l = lf - (c->buf + c->pos);
+			const size_t next = c->pos + l + 1;
+
+			if ((l > 0) && (lf[-1] == '\r'))
+				l--;
+			if (l >= max)
+				l = max - 1;
+			memcpy(line, c->buf + c->pos, l);
+			line[l] = '\0';
+			c->pos = next;
+			return l;
+		}
+
+		if ((c->pos == 0) && (c->len == sizeof(c->buf)))
+			return -1;
+		if (conn_fill(c) != 0)
+			return -1;
+	}
+}
+
+/**
+ * @brief read exactly the given amount of data and throw it away
+ */
+static int
+conn_skip(struct conn *c, size_t len)
+{
+	while (len > 0) {
+		if (c->pos == c->len) {
+			c->pos = c->len = 0;
+			if (conn_fill(c) != 0)
+				return -1;
+		}
+
+		const size_t l = (c->len - c->pos < len) ? c->len - c->pos : len;
+		c->pos += l;
+		len -= l;
+	}
+
+	return 0;
+}
+
+#define EXT_PIPELINING	0x1
+#define EXT_CHUNKING	0x2
+#define EXT_STARTTLS	0x4
+
+/**
+ * @brief read an SMTP reply
+ * @param c the connection
+ * @param ext if not NULL the announced ESMTP extensions are stored here
+ * @return the reply code
+ * @retval -1 connection error or invalid reply
+ */
+static int
+read_reply(struct conn *c, unsigned int *ext)
+{
+	char line[1024];
+
+	for (;;) {
+		ssize_t l = conn_getline(c, line, sizeof(line));
+
+		if ((l < 3) || (line[0] < '2') || (line[0] > '5'))
+			return -1;
+
+		if ((ext != NULL) && (l > 4)) {
+			if (strcasecmp(line + 4, "PIPELINING") == 0)
+				*ext |= EXT_PIPELINING;
+			else if (strcasecmp(line + 4, "CHUNKING") == 0)
+				*ext |= EXT_CHUNKING;
+			else if (strcasecmp(line + 4, "STARTTLS") == 0)
+				*ext |= EXT_STARTTLS;
+		}
+
+		if ((l == 3) || (line[3] == ' '))
+			return (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+		if (line[3] != '-')
+			return -1;
+	}
+}
+
+static int
+command(struct conn *c, const char *cmd, unsigned int *ext)
+{
+	if (conn_write(c, cmd, strlen(cmd)) != 0)
+		return -1;
+	return read_reply(c, ext);
+}
+
+/**
+ * @brief send the messages of one session to Qsmtpd
+ * @param c the connection
+ * @param first number of the first message
+ * @param count number of messages to send
+ * @param state random state
+ * @param session the session sample to fill
+ * @return number of messages not sent because of errors
+ */
+static unsigned long
+smtpd_conversation(struct conn *c, const unsigned long first, const unsigned long count,
+		uint64_t *state, struct sample *session)
+{
+	static char *msg;
+	static char *cmds;
+	unsigned int ext = 0;
+	uint64_t t = now_ns();
+
+	if (read_reply(c, NULL) != 220)
+		return count;
+	session->ns[PHASE_BANNER] = since(t);
+
+	t = now_ns();
+	if (command(c, "EHLO qsload.example.net\r\n", &ext) != 250)
+		return count;
+	session->ns[PHASE_EHLO] = since(t);
+
+	if (use_tls) {
+		if (!(ext & EXT_STARTTLS)) {
+			fputs("server does not announce STARTTLS\n", stderr);
+			return count;
+		}
+
+		t = now_ns();
+		if (command(c, "STARTTLS\r\n", NULL) != 220)
+			return count;
+		c->ssl = SSL_new(ctx);
+		if ((c->ssl == NULL) || (SSL_set_fd(c->ssl, c->fd) != 1) || (SSL_connect(c->ssl) != 1)) {
+			ERR_print_errors_fp(stderr);
+			return count;
+		}
+		ext = 0;
+		if (command(c, "EHLO qsload.example.net\r\n", &ext) != 250)
+			return count;
+		session->ns[PHASE_STARTTLS] = since(t);
+	}
+
+	for (unsigned long i = 0; i < count; i++) {
+		struct sample s = { .flags = SAMPLE_MSG };
+		const unsigned long id = first + i;
+		const unsigned long rc = dist_pick(&rcpts, state);
+		const size_t len = make_message(&msg, dist_pick(&sizes, state), id, state);
+		const int pipelined = use_pipelining && (ext & EXT_PIPELINING);
+		const int chunked = use_chunking && (ext & EXT_CHUNKING);
+		size_t clen = 0;
+		unsigned int good = 0;
+
+		s.bytes = len;
+
+		/* the whole envelope, including DATA if it is used */
+		cmds = realloc(cmds, 128 + (rc + 2) * (strlen(domain) + 48));
+		if (cmds == NULL) {
+			fputs("out of memory\n", stderr);
+			_exit(1);
+		}
+
+		t = now_ns();
+		if (pipelined) {
+			clen += sprintf(cmds, "MAIL FROM:<%s>\r\n", sender);
+			for (unsigned long r = 0; r < rc; r++)
+				clen += sprintf(cmds + clen, "RCPT TO:<load%lu@%s>\r\n", r, domain);
+			if (!chunked)
+				clen += sprintf(cmds + clen, "DATA\r\n");
+
+			if ((conn_write(c, cmds, clen) != 0) || (read_reply(c, NULL) != 250))
+				return count - i;
+			for (unsigned long r = 0; r < rc; r++) {
+				int code = read_reply(c, NULL);
+
+				if (code < 0)
+					return count - i;
+				if (code == 250)
+					good++;
+			}
+			if (!chunked && (read_reply(c, NULL) != 354))
+				return count - i;
+		} else {
+			sprintf(cmds, "MAIL FROM:<%s>\r\n", sender);
+			if (command(c, cmds, NULL) != 250)
+				return count - i;
+			for (unsigned long r = 0; r < rc; r++) {
+				sprintf(cmds, "RCPT TO:<load%lu@%s>\r\n", r, domain);
+				int code = command(c, cmds, NULL);
+
+				if (code < 0)
+					return count - i;
+				if (code == 250)
+					good++;
+			}
+			if (!chunked && (good > 0) && (command(c, "DATA\r\n", NULL) != 354))
+				return count - i;
+		}
+		s.ns[PHASE_ENVELOPE] = since(t);
+
+		if (good == 0) {
+			/* all recipients rejected, the DATA command was rejected too */
+			submit(&s);
+			if (command(c, "RSET\r\n", NULL) != 250)
+				return count - i - 1;
+			continue;
+		}
+
+		t = now_ns();
+		if (chunked) {
+			size_t off = 0;
+
+			do {
+				const size_t l = ((chunk == 0) || (len - off <= chunk)) ? len - off : chunk;
+				char bdat[64];
+				const int last = (off + l == len);
+
+				snprintf(bdat, sizeof(bdat), "BDAT %zu%s\r\n", l, last ? " LAST" : "");
+				if ((conn_write(c, bdat, strlen(bdat)) != 0) ||
+						(conn_write(c, msg + off, l) != 0))
+					return count - i;
+				off += l;
+				/* the reply of the last chunk is checked below */
+				if (!last && (read_reply(c, NULL) != 250))
+					return count - i;
+			} while (off < len);
+		} else {
+			if ((conn_write(c, msg, len) != 0) || (conn_write(c, ".\r\n", 3) != 0))
+				return count - i;
+		}
+
+		if (read_reply(c, NULL) == 250)
+			s.flags |= SAMPLE_OK;
+		s.ns[PHASE_BODY] = since(t);
+		submit(&s);
+	}
+
+	t = now_ns();
+	if (command(c, "QUIT\r\n", NULL) == 221)
+		session->ns[PHASE_QUIT] = since(t);
+
+	return 0;
+}
+
+/**
+ * @brief run one Qsmtpd session
+ * @param prog the command line of Qsmtpd
+ * @param first number of the first message
+ * @param count number of messages to send in this session
+ * @param state random state
+ */
+static void
+smtpd_session(char **prog, const unsigned long first, const unsigned long count, uint64_t *state)
+{
+	struct conn c = { .fd = -1 };
+	struct sample session = { .flags = 0 };
+	int sv[2];
+	const uint64_t start = now_ns();
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+		perror("socketpair");
+		_exit(1);
+	}
+
+	pid_t child = fork();
+	if (child < 0) {
+		perror("fork");
+		_exit(1);
+	} else if (child == 0) {
+		if ((dup2(sv[1], 0) != 0) || (dup2(sv[1], 1) != 1))
+			_exit(1);
+		execv(prog[0], prog);
+		_exit(1);
+	}
+
+	close(sv[1]);
+	c.fd = sv[0];
+
+	unsigned long failed = smtpd_conversation(&c, first, count, state, &session);
+
+	if (c.ssl != NULL) {
+		SSL_shutdown(c.ssl);
+		SSL_free(c.ssl);
+	}
+	close(c.fd);
+	waitpid(child, NULL, 0);
+
+	session.ns[PHASE_SESSION] = since(start);
+	submit(&session);
+
+	/* report the messages that were not sent at all as failed */
+	while (failed-- > 0) {
+		struct sample s = { .flags = SAMPLE_MSG };
+
+		submit(&s);
+	}
+}
+
+/**
+ * @brief deliver one message with Qremote
+ * @param prog the path to Qremote
+ * @param id number of the message
+ * @param state random state
+ */
+static void
+remote_delivery(const char *prog, const unsigned long id, uint64_t *state)
+{
+	static char *msg;
+	struct sample s = { .flags = SAMPLE_MSG };
+	const unsigned long rc = dist_pick(&rcpts, state);
+	const size_t len = make_message(&msg, dist_pick(&sizes, state), id, state);
+	const char *tmpdir = getenv("TMPDIR");
+	char fname[PATH_MAX];
+	char **argv = calloc(rc + 4, sizeof(*argv));
+	int status[2];
+
+	if (argv == NULL) {
+		fputs("out of memory\n", stderr);
+		_exit(1);
+	}
+
+	/* Qremote needs a file it can mmap() */
+	snprintf(fname, sizeof(fname), "%s/qsload.XXXXXX", (tmpdir != NULL) ? tmpdir : "/tmp");
+	int fd = mkstemp(fname);
+	if (fd < 0) {
+		perror(fname);
+		_exit(1);
+	}
+	unlink(fname);
+	if (write(fd, msg, len) != (ssize_t)len) {
+		perror("write");
+		_exit(1);
+	}
+	lseek(fd, 0, SEEK_SET);
+
+	argv[0] = (char *)prog;
+	argv[1] = (char *)domain;
+	argv[2] = (char *)sender;
+	for (unsigned long r = 0; r < rc; r++) {
+		argv[3 + r] = malloc(strlen(domain) + 32);
+		if (argv[3 + r] == NULL) {
+			fputs("out of memory\n", stderr);
+			_exit(1);
+		}
+		sprintf(argv[3 + r], "load%lu@%s", r, domain);
+	}
+
+	if (pipe(status) != 0) {
+		perror("pipe");
+		_exit(1);
+	}
+
+	const uint64_t start = now_ns();
+	pid_t child = fork();
+	if (child < 0) {
+		perror("fork");
+		_exit(1);
+	} else if (child == 0) {
+		close(status[0]);
+		if ((dup2(fd, 0) != 0) || (dup2(status[1], 1) != 1))
+			_exit(1);
+		execv(prog, argv);
+		_exit(1);
+	}
+
+	close(status[1]);
+	close(fd);
+
+	/* the status records are separated by 0 bytes, the final one starts with 'K' on success */
+	char buf[4096];
+	size_t blen = 0;
+	ssize_t r;
+	while ((r = read(status[0], buf + blen, sizeof(buf) - 1 - blen)) > 0) {
+		blen += r;
+		if (blen == sizeof(buf) - 1)
+			blen = 0;
+	}
+	buf[blen] = '\0';
+	close(status[0]);
+	waitpid(child, NULL, 0);
+
+	s.ns[PHASE_DELIVERY] = since(start);
+	s.bytes = len;
+	for (size_t i = 0; i < blen; i += strlen(buf + i) + 1) {
+		if (buf[i] == 'K')
+			s.flags |= SAMPLE_OK;
+	}
+	submit(&s);
+
+	for (unsigned long i = 0; i < rc; i++)
+		free(argv[3 + i]);
+	free(argv);
+}
+
+/**
+ * @brief handle one connection to the sink
+ */
+static void
+sink_session(const int fd)
+{
+	struct conn c = { .fd = fd };
+	struct sample session = { .flags = SAMPLE_SINK };
+	struct sample s = { .flags = SAMPLE_SINK | SAMPLE_MSG };
+	const uint64_t start = now_ns();
+	uint64_t t = start;
+	uint64_t tls_start = 0;
+	char line[1024];
+	int ehlo_seen = 0;
+
+	if (conn_write(&c, "220 qsload.invalid ESMTP sink\r\n", 31) != 0)
+		return;
+
+	for (;;) {
+		ssize_t l = conn_getline(&c, line, sizeof(line));
+
+		if (l < 0)
+			break;
+
+		if ((strncasecmp(line, "EHLO ", 5) == 0) || (strncasecmp(line, "HELO ", 5) == 0)) {
+			char reply[256];
+
+			if (!ehlo_seen) {
+				session.ns[PHASE_BANNER] = since(start);
+				ehlo_seen = 1;
+			} else if (tls_start != 0) {
+				session.ns[PHASE_STARTTLS] = since(tls_start);
+			}
+			t = now_ns();
+			snprintf(reply, sizeof(reply), "250-qsload.invalid\r\n250-PIPELINING\r\n250-8BITMIME\r\n%s%s"
+					"250 ENHANCEDSTATUSCODES\r\n",
+					use_chunking ? "250-CHUNKING\r\n" : "",
+					((ctx != NULL) && (c.ssl == NULL)) ? "250-STARTTLS\r\n" : "");
+			if (conn_write(&c, reply, strlen(reply)) != 0)
+				break;
+			session.ns[PHASE_EHLO] = since(t);
+		} else if ((strcasecmp(line, "STARTTLS") == 0) && (ctx != NULL) && (c.ssl == NULL)) {
+			tls_start = now_ns();
+			if (conn_write(&c, "220 2.0.0 go ahead\r\n", 20) != 0)
+				break;
+			c.ssl = SSL_new(ctx);
+			if ((c.ssl == NULL) || (SSL_set_fd(c.ssl, fd) != 1) || (SSL_accept(c.ssl) != 1))
+				break;
+		} else if (strncasecmp(line, "MAIL FROM:", 10) == 0) {
+			t = now_ns();
+			s.bytes = 0;
+			s.ns[PHASE_BODY] = 0;
+			if (conn_write(&c, "250 2.1.0 ok\r\n", 14) != 0)
+				break;
+		} else if (strncasecmp(line, "RCPT TO:", 8) == 0) {
+			if (conn_write(&c, "250 2.1.5 ok\r\n", 14) != 0)
+				break;
+		} else if (strcasecmp(line, "DATA") == 0) {
+			s.ns[PHASE_ENVELOPE] = since(t);
+			t = now_ns();
+			if (conn_write(&c, "354 go ahead\r\n", 14) != 0)
+				break;
+			while ((l = conn_getline(&c, line, sizeof(line))) >= 0) {
+				if ((l == 1) && (line[0] == '.'))
+					break;
+				s.bytes += l + 2;
+			}
+			if (l < 0)
+				break;
+			s.ns[PHASE_BODY] = since(t);
+			s.flags |= SAMPLE_OK;
+			submit(&s);
+			if (conn_write(&c, "250 2.0.0 ok\r\n", 14) != 0)
+				break;
+		} else if (strncasecmp(line, "BDAT ", 5) == 0) {
+			char *end;
+			const unsigned long len = strtoul(line + 5, &end, 10);
+			const int last = (strcasecmp(end, " LAST") == 0);
+
+			if (s.bytes == 0) {
+				s.ns[PHASE_ENVELOPE] = since(t);
+				t = now_ns();
+			}
+			if (conn_skip(&c, len) != 0)
+				break;
+			s.bytes += len;
+			if (last) {
+				s.ns[PHASE_BODY] = since(t);
+				s.flags |= SAMPLE_OK;
+				submit(&s);
+			}
+			if (conn_write(&c, "250 2.0.0 ok\r\n", 14) != 0)
+				break;
+		} else if ((strcasecmp(line, "RSET") == 0) || (strcasecmp(line, "NOOP") == 0)) {
+			if (conn_write(&c, "250 2.0.0 ok\r\n", 14) != 0)
+				break;
+		} else if (strcasecmp(line, "QUIT") == 0) {
+			char buf[64];
+
+			/* let the client close the connection first, Qremote treats a
+			 * hangup as read error even if the reply is already there */
+			if (conn_write(&c, "221 2.0.0 bye\r\n", 15) == 0)
+				while (conn_recv(&c, buf, sizeof(buf)) > 0)
+					;
+			break;
+		} else {
+			if (conn_write(&c, "502 5.5.2 unknown command\r\n", 27) != 0)
+				break;
+		}
+	}
+
+	if (c.ssl != NULL) {
+		SSL_shutdown(c.ssl);
+		SSL_free(c.ssl);
+	}
+	close(fd);
+
+	session.ns[PHASE_SESSION] = since(start);
+	submit(&session);
+}
+
+static void
+sink_stop(int sig __attribute__ ((unused)))
+{
+	stop_sink = 1;
+}
+
+/**
+ * @brief accept connections until SIGTERM is received
+ */
+static void __attribute__ ((noreturn))
+sink(const int lfd)
+{
+	struct sigaction sa = { .sa_handler = sink_stop };
+
+	/* no SA_RESTART, accept() must be interrupted */
+	sigaction(SIGTERM, &sa, NULL);
+
+	while (!stop_sink) {
+		int fd = accept(lfd, NULL, NULL);
+
+		if (fd < 0)
+			continue;
+
+		pid_t child = fork();
+		if (child == 0) {
+			close(lfd);
+			sink_session(fd);
+			_exit(0);
+		}
+		close(fd);
+
+		/* collect the children that have already finished */
+		while (waitpid(-1, NULL, WNOHANG) > 0)
+			;
+	}
+
+	close(lfd);
+	while (wait(NULL) > 0)
+		;
+	_exit(0);
+}
+
+static int
+sink_listen(void)
+{
+	struct sockaddr_in sa = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port)
+	};
+	const int one = 1;
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (inet_pton(AF_INET, sinkaddr, &sa.sin_addr) != 1) {
+		fprintf(stderr, "invalid IPv4 address for the sink: %s\n", sinkaddr);
+		exit(EINVAL);
+	}
+
+	if ((fd < 0) || (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0) ||
+			(bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) || (listen(fd, 128) != 0)) {
+		fprintf(stderr, "cannot listen on %s:%u: %s\n", sinkaddr, port, strerror(errno));
+		exit(1);
+	}
+
+	return fd;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *)a;
+	const uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * @brief collect the samples and print the results
+ * @param workers the pids of the load generating processes
+ * @param sinkpid pid of the sink or 0
+ * @param rfd read end of the sample pipe
+ * @param start start time of the test
+ */
+static void
+collect(pid_t *workers, const pid_t sinkpid, const int rfd, const uint64_t start)
+{
+	uint64_t *values[PHASE_COUNT][2] = { { NULL } };
+	size_t counts[PHASE_COUNT][2] = { { 0 } };
+	unsigned long ok = 0;
+	unsigned long failed = 0;
+	unsigned long long bytes = 0;
+	unsigned int running = concurrency;
+	uint64_t end = 0;
+	struct sample s;
+	size_t have = 0;
+
+	for (;;) {
+		struct pollfd pfd = { .fd = rfd, .events = POLLIN };
+
+		if (poll(&pfd, 1, 100) > 0) {
+			ssize_t r = read(rfd, (char *)&s + have, sizeof(s) - have);
+
+			if (r == 0)
+				break;
+			if (r < 0)
+				continue;
+			have += r;
+			if (have < sizeof(s))
+				continue;
+			have = 0;
+
+			if ((s.flags & (SAMPLE_MSG | SAMPLE_SINK)) == SAMPLE_MSG) {
+				if (s.flags & SAMPLE_OK) {
+					ok++;
+					bytes += s.bytes;
+				} else {
+					failed++;
+				}
+			}
+
+			const int src = (s.flags & SAMPLE_SINK) ? 1 : 0;
+			for (unsigned int p = 0; p < PHASE_COUNT; p++) {
+				if (s.ns[p] == 0)
+					continue;
+				if ((counts[p][src] & (counts[p][src] - 1)) == 0) {
+					uint64_t *n = realloc(values[p][src], (counts[p][src] ? counts[p][src] * 2 : 64) * sizeof(*n));
+
+					if (n == NULL) {
+						fputs("out of memory\n", stderr);
+						exit(1);
+					}
+					values[p][src] = n;
+				}
+				values[p][src][counts[p][src]++] = s.ns[p];
+			}
+		}
+
+		pid_t pid;
+		while ((running > 0) && ((pid = waitpid(-1, NULL, WNOHANG)) > 0)) {
+			for (unsigned int i = 0; i < concurrency; i++) {
+				if (workers[i] == pid) {
+					workers[i] = 0;
+					running--;
+				}
+			}
+			if ((running == 0) && (end == 0)) {
+				end = now_ns();
+				if (sinkpid != 0)
+					kill(sinkpid, SIGTERM);
+			}
+		}
+	}
+
+	if (sinkpid != 0)
+		waitpid(sinkpid, NULL, 0);
+	if (end == 0)
+		end = now_ns();
+
+	const double secs = (end - start) / 1e9;
+	printf("messages:   %lu accepted, %lu failed in %.3f s\n", ok, failed, secs);
+	printf("throughput: %.1f msgs/s, %.2f MiB/s\n", ok / secs, bytes / secs / (1024.0 * 1024.0));
+	printf("%-10s %-6s %8s %10s %10s %10s\n", "phase", "side", "count", "p50 ms", "p99 ms", "max ms");
+	for (unsigned int p = 0; p < PHASE_COUNT; p++) {
+		for (int src = 0; src < 2; src++) {
+			const size_t n = counts[p][src];
+
+			if (n == 0)
+				continue;
+			qsort(values[p][src], n, sizeof(uint64_t), cmp_u64);
+			printf("%-10s %-6s %8zu %10.3f %10.3f %10.3f\n", phase_names[p], src ? "sink" : "client", n,
+					values[p][src][(n - 1) * 50 / 100] / 1e6,
+					values[p][src][(n - 1) * 99 / 100] / 1e6,
+					values[p][src][n - 1] / 1e6);
+			free(values[p][src]);
+		}
+	}
+}
+
+static void __attribute__ ((noreturn))
+usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [options] smtpd /path/to/Qsmtpd [args...]\n"
+			"       %s [options] remote /path/to/Qremote\n"
+			"\n"
+			"  -c num     number of concurrent sessions (default: 4)\n"
+			"  -n num     total number of messages (default: 100)\n"
+			"  -m num     messages per Qsmtpd session (default: 1)\n"
+			"  -s sizes   message sizes: n, min-max, or n,m,... (k and m suffixes allowed, default: 4k)\n"
+			"  -r rcpts   recipients per message, same syntax as -s (default: 1)\n"
+			"  -S seed    seed for the random values\n"
+			"  -P         do not use PIPELINING\n"
+			"  -t         use STARTTLS when talking to Qsmtpd\n"
+			"  -B         use CHUNKING (smtpd: if announced, remote: announce it in the sink)\n"
+			"  -C size    BDAT chunk size, default is the whole message in one chunk\n"
+			"  -8         send 8bit messages\n"
+			"  -f addr    envelope sender (default: loadtest@example.net)\n"
+			"  -d domain  recipient domain (default: example.com for smtpd, loadtest.invalid for remote)\n"
+			"  -q path    qmail-queue replacement for Qsmtpd (default: fakequeue next to this program)\n"
+			"  -a addr    IPv4 address of the sink (default: 127.0.0.1)\n"
+			"  -p port    port of the sink (default: 2525)\n"
+			"  -T file    PEM file with certificate and key to offer STARTTLS in the sink\n"
+			"\n"
+			"In remote mode the domain must be routed to the sink in control/smtproutes, or\n"
+			"be given as address literal like \"[127.0.0.2]\" when the sink listens on port 25\n"
+			"of an address that is not configured on any interface.\n",
+			argv0, argv0);
+	exit(EINVAL);
+}
+
+static const char *
+find_fakequeue(const char *argv0)
+{
+	static char path[PATH_MAX];
+	char buf[PATH_MAX];
+	const char *slash = strrchr(argv0, '/');
+
+	if (slash == NULL)
+		return NULL;
+
+	snprintf(buf, sizeof(buf), "%.*s/fakequeue", (int)(slash - argv0), argv0);
+	/* Qsmtpd changes the directory, so the path must be absolute */
+	if (realpath(buf, path) == NULL)
+		return NULL;
+
+	return path;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *queue = NULL;
+	char *end;
+	unsigned long v;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "+c:n:m:s:r:S:PtBC:8f:d:q:a:p:T:")) != -1) {
+		switch (opt) {
+		case 'c':
+			v = strtoul(optarg, &end, 10);
+			if ((*end != '\0') || (v == 0) || (v > 4096))
+				usage(argv[0]);
+			concurrency = v;
+			break;
+		case 'n':
+			messages = strtoul(optarg, &end, 10);
+			if ((*end != '\0') || (messages == 0))
+				usage(argv[0]);
+			break;
+		case 'm':
+			v = strtoul(optarg, &end, 10);
+			if ((*end != '\0') || (v == 0) || (v > UINT_MAX))
+				usage(argv[0]);
+			per_session = v;
+			break;
+		case 's':
+			if (parse_dist(optarg, &sizes) != 0)
+				usage(argv[0]);
+			break;
+		case 'r':
+			if ((parse_dist(optarg, &rcpts) != 0) || ((rcpts.count == 0) && (rcpts.min == 0)))
+				usage(argv[0]);
+			break;
+		case 'S':
+			seed = strtoull(optarg, &end, 0);
+			if ((*end != '\0') || (seed == 0))
+				usage(argv[0]);
+			break;
+		case 'P':
+			use_pipelining = 0;
+			break;
+		case 't':
+			use_tls = 1;
+			break;
+		case 'B':
+			use_chunking = 1;
+			break;
+		case 'C':
+			if ((parse_number(optarg, &end, &v) != 0) || (*end != '\0') || (v == 0))
+				usage(argv[0]);
+			chunk = v;
+			break;
+		case '8':
+			eightbit = 1;
+			break;
+		case 'f':
+			sender = optarg;
+			break;
+		case 'd':
+			domain = optarg;
+			break;
+		case 'q':
+			queue = optarg;
+			break;
+		case 'a':
+			sinkaddr = optarg;
+			break;
+		case 'p':
+			v = strtoul(optarg, &end, 10);
+			if ((*end != '\0') || (v == 0) || (v > 65535))
+				usage(argv[0]);
+			port = v;
+			break;
+		case 'T':
+			certfile = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (argc - optind < 2)
+		usage(argv[0]);
+
+	const int remote = (strcmp(argv[optind], "remote") == 0);
+	if (!remote && (strcmp(argv[optind], "smtpd") != 0))
+		usage(argv[0]);
+	char **prog = argv + optind + 1;
+
+	if (domain == NULL)
+		domain = remote ? "loadtest.invalid" : "example.com";
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (use_tls && !remote) {
+		ctx = SSL_CTX_new(TLS_client_method());
+		if (ctx == NULL) {
+			ERR_print_errors_fp(stderr);
+			return 1;
+		}
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+	} else if ((certfile != NULL) && remote) {
+		ctx = SSL_CTX_new(TLS_server_method());
+		if ((ctx == NULL) || (SSL_CTX_use_certificate_chain_file(ctx, certfile) != 1) ||
+				(SSL_CTX_use_PrivateKey_file(ctx, certfile, SSL_FILETYPE_PEM) != 1)) {
+			ERR_print_errors_fp(stderr);
+			return 1;
+		}
+	}
+
+	if (!remote) {
+		/* the environment tcpserver would set up */
+		setenv("TCPREMOTEIP", "127.0.0.1", 0);
+		setenv("TCPREMOTEPORT", "42424", 0);
+		setenv("TCPLOCALIP", "127.0.0.1", 0);
+		setenv("TCPLOCALPORT", "25", 0);
+		setenv("TCP6REMOTEIP", "::ffff:127.0.0.1", 0);
+		setenv("TCP6LOCALIP", "::ffff:127.0.0.1", 0);
+
+		if (queue == NULL)
+			queue = find_fakequeue(argv[0]);
+		if (queue != NULL) {
+			setenv("QMAILQUEUE", queue, 1);
+		} else if (getenv("QMAILQUEUE") == NULL) {
+			fputs("cannot find fakequeue, use -q or set QMAILQUEUE\n", stderr);
+			return 1;
+		}
+	}
+
+	int pfd[2];
+	if ((pipe(pfd) != 0) || (fcntl(pfd[0], F_SETFD, FD_CLOEXEC) != 0) ||
+			(fcntl(pfd[1], F_SETFD, FD_CLOEXEC) != 0)) {
+		perror("pipe");
+		return 1;
+	}
+	resultfd = pfd[1];
+
+	pid_t sinkpid = 0;
+	if (remote) {
+		const int lfd = sink_listen();
+
+		sinkpid = fork();
+		if (sinkpid < 0) {
+			perror("fork");
+			return 1;
+		} else if (sinkpid == 0) {
+			close(pfd[0]);
+			sink(lfd);
+		}
+		close(lfd);
+	}
+
+	pid_t *workers = calloc(concurrency, sizeof(*workers));
+	if (workers == NULL) {
+		fputs("out of memory\n", stderr);
+		return 1;
+	}
+
+	const uint64_t start = now_ns();
+	for (unsigned int w = 0; w < concurrency; w++) {
+		workers[w] = fork();
+		if (workers[w] < 0) {
+			perror("fork");
+			return 1;
+		} else if (workers[w] > 0) {
+			continue;
+		}
+
+		close(pfd[0]);
+		uint64_t state = seed + w * 0x9E3779B97F4A7C15ULL;
+		if (state == 0)
+			state = 1;
+
+		/* the messages are distributed round robin over the workers */
+		if (remote) {
+			for (unsigned long id = w; id < messages; id += concurrency)
+				remote_delivery(prog[0], id, &state);
+		} else {
+			for (unsigned long id = w * per_session; id < messages; id += (unsigned long)concurrency * per_session) {
+				const unsigned long cnt = (messages - id < per_session) ? messages - id : per_session;
+
+				smtpd_session(prog, id, cnt, &state);
+			}
+		}
+		_exit(0);
+	}
+	close(pfd[1]);
+
+	collect(workers, sinkpid, pfd[0], start);
+	free(workers);
+
+	return 0;
+}
@@ -0,0 +1,220 @@
+/** \file qsmetrics.c
+ \brief create and export the runtime metrics of Qsmtpd and Qremote
+
+ Without options the current values are written to stdout in the Prometheus
+ text exposition format, so this can be run from e.g. the textfile collector
+ of the node exporter or from inetd. With -c the metrics file is created, it
+ needs to be writable by the users Qsmtpd and Qremote run as.
+ */
+
+#include <metrics.h>
+#include <qmaildir.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *command_names[METRICS_COMMANDS] = {
+	[METRICS_CMD_NOOP] = "NOOP",
+	[METRICS_CMD_QUIT] = "QUIT",
+	[METRICS_CMD_RSET] = "RSET",
+	[METRICS_CMD_HELO] = "HELO",
+	[METRICS_CMD_EHLO] = "EHLO",
+	[METRICS_CMD_MAIL] = "MAIL",
+	[METRICS_CMD_RCPT] = "RCPT",
+	[METRICS_CMD_DATA] = "DATA",
+	[METRICS_CMD_STARTTLS] = "STARTTLS",
+	[METRICS_CMD_AUTH] = "AUTH",
+	[METRICS_CMD_VRFY] = "VRFY",
+	[METRICS_CMD_BDAT] = "BDAT",
+	[METRICS_CMD_POST] = "POST"
+};
+
+/* in the order of enum filter_result, starting at FILTER_ERROR */
+static const char *verdict_names[METRICS_VERDICTS] = {
+	"error", "passed", "denied_with_message", "denied_unspecific", "denied_nouser",
+	"denied_temporary", "whitelisted"
+};
+
+static const char *dns_names[METRICS_DNS_TYPES] = {
+	[METRICS_DNS_A] = "A",
+	[METRICS_DNS_AAAA] = "AAAA",
+	[METRICS_DNS_MX] = "MX",
+	[METRICS_DNS_TXT] = "TXT",
+	[METRICS_DNS_PTR] = "PTR"
+};
+
+/* in the order of METRICS_QREMOTE_STATUS */
+static const char *status_names[] = {
+	"recipient_accepted", "recipient_failed", "recipient_deferred",
+	"delivered", "deferred", "failed"
+};
+
+static uint64_t counters[METRIC_COUNTERS];
+static uint64_t hists[METRIC_HISTOGRAMS][METRICS_BUCKETS + 2];
+
+static void
+header(const char *name, const char *type, const char *help)
+{
+	printf("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void
+counter(const char *name, const char *help, const enum metrics_counter c)
+{
+	header(name, "counter", help);
+	printf("%s %llu\n", name, (unsigned long long)counters[c]);
+}
+
+static void
+labeled(const char *name, const char *label, const char **values, const unsigned int count,
+		const enum metrics_counter first)
+{
+	for (unsigned int i = 0; i < count; i++)
+		printf("%s{%s=\"%s\"} %llu\n", name, label, values[i], (unsigned long long)counters[first + i]);
+}
+
+static void
+histogram(const char *name, const char *label, const char *value, const enum metrics_histogram h)
+{
+	unsigned long long count = 0;
+	char bucketlabel[64] = "";	/* the label as prefix for le */
+	char sumlabel[64] = "";		/* the label for _sum and _count */
+
+	if (label != NULL) {
+		snprintf(bucketlabel, sizeof(bucketlabel), "%s=\"%s\",", label, value);
+		snprintf(sumlabel, sizeof(sumlabel), "{%s=\"%s\"}", label, value);
+	}
+
+	for (unsigned int b = 0; b < METRICS_BUCKETS; b++) {
+		count += hists[h][b];
+		printf("%s_bucket{%sle=\"%g\"} %llu\n", name, bucketlabel, metrics_bucket_bounds[b] / 1e6, count);
+	}
+	count += hists[h][METRICS_BUCKETS];
+	printf("%s_bucket{%sle=\"+Inf\"} %llu\n", name, bucketlabel, count);
+	printf("%s_sum%s %g\n", name, sumlabel, hists[h][METRICS_BUCKETS + 1] / 1e6);
+	printf("%s_count%s %llu\n", name, sumlabel, count);
+}
+
+static void
+export(void)
+{
+	counter("qsmtp_smtpd_sessions_total", "Sessions accepted by Qsmtpd.", METRIC_SMTPD_SESSIONS);
+
+	header("qsmtp_smtpd_commands_total", "counter", "SMTP commands run by Qsmtpd.");
+	labeled("qsmtp_smtpd_commands_total", "command", command_names, METRICS_COMMANDS, METRIC_SMTPD_COMMANDS);
+
+	header("qsmtp_smtpd_filter_verdicts_total", "counter", "Results of the recipient filters by position in the filter list.");
+	for (unsigned int f = 0; f < METRICS_FILTERS; f++) {
+		const enum metrics_counter first = METRIC_SMTPD_FILTERS + f * METRICS_VERDICTS;
+		uint64_t total = 0;
+
+		for (unsigned int v = 0; v < METRICS_VERDICTS; v++)
+			total += counters[first + v];
+		/* filters that were never run do not exist in this build */
+		if (total == 0)
+			continue;
+
+		for (unsigned int v = 0; v < METRICS_VERDICTS; v++)
+			printf("qsmtp_smtpd_filter_verdicts_total{filter=\"%u\",verdict=\"%s\"} %llu\n",
+					f, verdict_names[v], (unsigned long long)counters[first + v]);
+	}
+
+	header("qsmtp_smtpd_filter_seconds_total", "counter", "Time spent in the recipient filters by position in the filter list.");
+	for (unsigned int f = 0; f < METRICS_FILTERS; f++) {
+		if (counters[METRIC_SMTPD_FILTER_TIME + f] == 0)
+			continue;
+		printf("qsmtp_smtpd_filter_seconds_total{filter=\"%u\"} %g\n",
+				f, counters[METRIC_SMTPD_FILTER_TIME + f] / 1e9);
+	}
+
+	counter("qsmtp_smtpd_queued_total", "Messages accepted by qmail-queue.", METRIC_SMTPD_QUEUED);
+	counter("qsmtp_smtpd_queue_errors_total", "Messages not accepted by qmail-queue.", METRIC_SMTPD_QUEUE_ERRORS);
+
+	header("qsmtp_smtpd_session_duration_seconds", "histogram", "Duration of Qsmtpd sessions.");
+	histogram("qsmtp_smtpd_session_duration_seconds", NULL, NULL, METRIC_H_SMTPD_SESSION);
+
+	header("qsmtp_qremote_status_total", "counter", "Status codes reported by Qremote to qmail-rspawn.");
+	labeled("qsmtp_qremote_status_total", "status", status_names, sizeof(status_names) / sizeof(status_names[0]),
+			METRIC_QREMOTE_STATUS);
+
+	header("qsmtp_qremote_delivery_duration_seconds", "histogram", "Duration of Qremote deliveries.");
+	histogram("qsmtp_qremote_delivery_duration_seconds", NULL, NULL, METRIC_H_QREMOTE_DELIVERY);
+
+	header("qsmtp_dns_queries_total", "counter", "DNS queries by type.");
+	labeled("qsmtp_dns_queries_total", "type", dns_names, METRICS_DNS_TYPES, METRIC_DNS_QUERIES);
+
+	header("qsmtp_dns_errors_total", "counter", "Failed DNS queries by type.");
+	labeled("qsmtp_dns_errors_total", "type", dns_names, METRICS_DNS_TYPES, METRIC_DNS_ERRORS);
+
+	header("qsmtp_dns_query_duration_seconds", "histogram", "Duration of DNS queries by type.");
+	for (unsigned int t = 0; t < METRICS_DNS_TYPES; t++)
+		histogram("qsmtp_dns_query_duration_seconds", "type", dns_names[t], METRIC_H_DNS + t);
+
+	counter("qsmtp_net_received_bytes_total", "Bytes read from the network.", METRIC_NET_BYTES_IN);
+	counter("qsmtp_net_sent_bytes_total", "Bytes written to the network.", METRIC_NET_BYTES_OUT);
+
+	header("qsmtp_tls_handshakes_total", "counter", "TLS handshakes by role and result.");
+	printf("qsmtp_tls_handshakes_total{role=\"server\",result=\"success\"} %llu\n",
+			(unsigned long long)counters[METRIC_TLS_ACCEPT]);
+	printf("qsmtp_tls_handshakes_total{role=\"server\",result=\"failure\"} %llu\n",
+			(unsigned long long)counters[METRIC_TLS_ACCEPT_FAILED]);
+	printf("qsmtp_tls_handshakes_total{role=\"client\",result=\"success\"} %llu\n",
+			(unsigned long long)counters[METRIC_TLS_CONNECT]);
+	printf("qsmtp_tls_handshakes_total{role=\"client\",result=\"failure\"} %llu\n",
+			(unsigned long long)counters[METRIC_TLS_CONNECT_FAILED]);
+}
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-c] [file]\n\n"
+			"  -c   create the metrics file\n\n"
+			"The default file is " METRICS_FILE ".\n", argv0);
+}
+
+int
+main(int argc, char **argv)
+{
+	int create = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c")) != -1) {
+		switch (opt) {
+		case 'c':
+			create = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (argc > optind + 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	const char *path = (argc > optind) ? argv[optind] : METRICS_FILE;
+	int r;
+
+	if (create) {
+		r = metrics_create(path);
+		if (r != 0) {
+			fprintf(stderr, "can not create %s: %s\n", path, strerror(-r));
+			return 1;
+		}
+		return 0;
+	}
+
+	r = metrics_read(path, counters, hists);
+	if (r != 0) {
+		fprintf(stderr, "can not read %s: %s\n", path, strerror(-r));
+		return 1;
+	}
+
+	export();
+
+	return (fflush(stdout) == 0) ? 0 : 1;
+}
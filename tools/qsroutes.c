@@ -0,0 +1,278 @@
+/** \file qsroutes.c
+ \brief compile control/smtproutes.d into a CDB database
+
+ Qremote looks up the static route for every delivery. With many files in
+ control/smtproutes.d this costs several failed open() calls and parsing a
+ file for every message. qsroutes checks all files in the directory and
+ stores their valid settings in control/smtproutes.cdb, which Qremote uses
+ instead of the directory as long as it exists. It has to be run again
+ whenever the directory is changed.
+
+ Usage: qsroutes [controldir]
+ */
+
+#include <cdb.h>
+#include <control.h>
+#include <qmaildir.h>
+#include <qremote/routetags.h>
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char *curfile;	/**< the file currently read, for error messages */
+static unsigned int tagmask;	/**< the settings already found in curfile */
+static int haserr;		/**< if any invalid setting was found */
+
+void
+log_writen(int priority __attribute__ ((unused)), const char **s)
+{
+	fprintf(stderr, "%s: ", curfile);
+	for (unsigned int i = 0; s[i] != NULL; i++)
+		fputs(s[i], stderr);
+	fputc('\n', stderr);
+}
+
+void
+log_write(int priority, const char *s)
+{
+	const char *msg[] = { s, NULL };
+
+	log_writen(priority, msg);
+}
+
+/**
+ * @brief check the value of a setting
+ * @param tag the setting
+ * @param v the value
+ * @return if the value is invalid
+ *
+ * The relay host and the client certificate are checked by Qremote when the
+ * route is used, the resolved host or the permissions of the user Qremote
+ * runs as may change later.
+ */
+static int
+invalid_value(const int tag, const char *v)
+{
+	switch (tag) {
+	case ROUTE_PORT: {
+		char *end;
+		const unsigned long port = strtoul(v, &end, 10);
+
+		return (*v < '0') || (*v > '9') || (*end != '\0') || (port == 0) || (port >= 65536);
+	}
+	case ROUTE_OUTGOINGIP: {
+		struct in_addr a;
+
+		return (inet_pton(AF_INET, v, &a) <= 0);
+	}
+	case ROUTE_OUTGOINGIP6: {
+		struct in6_addr a;
+
+		return (inet_pton(AF_INET6, v, &a) <= 0) || IN6_IS_ADDR_V4MAPPED(&a);
+	}
+	default:
+		return (*v == '\0');
+	}
+}
+
+/**
+ * @brief callback for loadlistfd() to check the lines of a smtproutes.d file
+ * @param s the line to check
+ */
+static int
+validroute(const char *s)
+{
+	const int i = route_tag(s);
+
+	if ((i < 0) || (tagmask & (1 << i)) || invalid_value(i, s + strlen(route_tags[i]) + 1)) {
+		haserr = 1;
+		return 1;
+	}
+
+	tagmask |= 1 << i;
+	return 0;
+}
+
+/**
+ * @brief read one file of smtproutes.d
+ * @param dirfd the smtproutes.d directory
+ * @param name name of the file
+ * @param rec the database entry will be stored here
+ * @retval 0 the file was read
+ * @retval <0 negative error code
+ *
+ * The value of the entry contains all settings of the file, each terminated
+ * by a 0 byte.
+ */
+static int
+read_route(const int dirfd, const char *name, struct cdb_record *rec)
+{
+	struct stat st;
+	char **array;
+	const int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) != 0) {
+		const int err = -errno;
+		close(fd);
+		return err;
+	}
+
+	if (!S_ISREG(st.st_mode)) {
+		close(fd);
+		return -EISDIR;
+	}
+
+	curfile = name;
+	tagmask = 0;
+	if (loadlistfd(fd, &array, validroute) != 0)
+		return -errno;
+
+	size_t len = 0;
+	for (unsigned int i = 0; (array != NULL) && (array[i] != NULL); i++)
+		len += strlen(array[i]) + 1;
+
+	char *buf = malloc(strlen(name) + len + 1);
+	if (buf == NULL) {
+		free(array);
+		return -ENOMEM;
+	}
+
+	rec->keylen = strlen(name);
+	memcpy(buf, name, rec->keylen);
+	rec->key = buf;
+	rec->data = buf + rec->keylen;
+	rec->datalen = len;
+
+	len = 0;
+	for (unsigned int i = 0; (array != NULL) && (array[i] != NULL); i++) {
+		const size_t l = strlen(array[i]) + 1;
+
+		memcpy(buf + rec->keylen + len, array[i], l);
+		len += l;
+	}
+
+	free(array);
+
+	return 0;
+}
+
+static int
+cmp_records(const void *a, const void *b)
+{
+	return strcmp(((const struct cdb_record *)a)->key, ((const struct cdb_record *)b)->key);
+}
+
+/**
+ * @brief write the database
+ * @param dirfd the control directory
+ * @param records the entries
+ * @param count number of entries
+ * @retval 0 the database was written
+ * @retval <0 negative error code
+ */
+static int
+write_routes(const int dirfd, const struct cdb_record *records, const unsigned int count)
+{
+	const int fd = openat(dirfd, "smtproutes.cdb.tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+	if (fd < 0)
+		return -errno;
+
+	int r = cdb_make(fd, records, count);
+	if ((r == 0) && (fsync(fd) != 0))
+		r = -errno;
+	if ((close(fd) != 0) && (r == 0))
+		r = -errno;
+	if ((r == 0) && (renameat(dirfd, "smtproutes.cdb.tmp", dirfd, "smtproutes.cdb") != 0))
+		r = -errno;
+
+	if (r != 0)
+		unlinkat(dirfd, "smtproutes.cdb.tmp", 0);
+
+	return r;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc > 2) {
+		fprintf(stderr, "usage: %s [controldir]\n\n"
+				"The default directory is " AUTOQMAIL "/control.\n", argv[0]);
+		return 1;
+	}
+
+	const char *path = (argc == 2) ? argv[1] : AUTOQMAIL "/control";
+	const int controlfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (controlfd < 0) {
+		fprintf(stderr, "can not open %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	const int routesfd = openat(controlfd, "smtproutes.d", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR *d = (routesfd >= 0) ? fdopendir(routesfd) : NULL;
+	if (d == NULL) {
+		fprintf(stderr, "can not open %s/smtproutes.d: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	struct cdb_record *records = NULL;
+	unsigned int count = 0;
+	unsigned int size = 0;
+	struct dirent *de;
+	int r = 0;
+
+	while ((r == 0) && ((de = readdir(d)) != NULL)) {
+		if (de->d_name[0] == '.')
+			continue;
+
+		if (count == size) {
+			struct cdb_record *n = realloc(records, (size + 64) * sizeof(*n));
+
+			if (n == NULL) {
+				r = -ENOMEM;
+				break;
+			}
+			records = n;
+			size += 64;
+		}
+
+		r = read_route(routesfd, de->d_name, records + count);
+		if (r == 0)
+			count++;
+		else
+			fprintf(stderr, "can not read %s/smtproutes.d/%s: %s\n", path, de->d_name, strerror(-r));
+	}
+
+	closedir(d);
+
+	if ((r == 0) && haserr) {
+		fputs("smtproutes.cdb not written because of invalid entries\n", stderr);
+		r = -EINVAL;
+	} else if (r == 0) {
+		/* the order does not matter for lookups, but makes the output reproducible */
+		if (count > 1)
+			qsort(records, count, sizeof(*records), cmp_records);
+
+		r = write_routes(controlfd, records, count);
+		if (r != 0)
+			fprintf(stderr, "can not write %s/smtproutes.cdb: %s\n", path, strerror(-r));
+	}
+
+	for (unsigned int i = 0; i < count; i++)
+		free((char *)records[i].key);
+	free(records);
+	close(controlfd);
+
+	return (r == 0) ? 0 : 1;
+}